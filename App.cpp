@@ -194,6 +194,7 @@ void App::showPrefs()
     Prefs prefs(settings);
     prefs.exec();
     settings.save();
+    emit settingsChanged();
 }
 
 void App::about()
@@ -29,6 +29,9 @@ public:
     bool isConsoleHidden() const { return false; }
     bool isVerboseDebugMode() const { return settings.other.verbosity > 0; }
 
+signals:
+    void settingsChanged(); ///< emitted when the Prefs dialog closes
+
 public slots:
     void setVerboseDebugMode(bool b) { settings.other.verbosity = b ? 2 : 0;  settings.save(); }
     void showRaiseDebugWin();
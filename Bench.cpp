@@ -0,0 +1,517 @@
+// FG_Bench -- headless recording throughput benchmark.
+//
+// Runs a matrix of formats x resolutions x fps x thread counts through Recorder (and thus FFmpegEncoder or the
+// image/zip writers), feeding it frames as fast as it will take them, and reports sustained fps, dropped frames,
+// MB/s written, CPU time and peak RSS for each as CSV and/or JSON.
+//
+// Each matrix entry runs in its own child process (this same executable, invoked with --run) so that peak RSS and
+// CPU time are per-entry, and so that one entry crashing doesn't take out the whole run.
+//
+// Example: FG_Bench --formats MJPEG,FFV1,RAW --sizes 1920x1080,5056x2968 --fps 10,30 --threads 0,4 --json out.json
+#include "Recorder.h"
+#include "Settings.h"
+#include "Frame.h"
+#include "Util.h"
+#include "LatencyStats.h"
+#include "FakeFrameGenerator.h"
+#include "RecordingReader.h"
+#include "StripeSet.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QTextStream>
+#include <QThread>
+#include <QVector>
+#include <cstdio>
+#if defined(Q_OS_WIN)
+#  include <Windows.h>
+#  include <Psapi.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+namespace {
+
+    struct Case {
+        Settings::Fmt fmt = Settings::Fmt_N;
+        int w = 0, h = 0;
+        double fps = 0.0;
+        int threads = 0; ///< 0 = Recorder picks
+    };
+
+    struct Opts {
+        double seconds = 5.0;
+        QString dir;
+        bool zip = false, keep = false, readback = false;
+        int readahead = 4;
+        int zipLevel = 0;
+        bool rawContainer = false;
+        Settings::RawIO rawIO = Settings::RawIO_Direct;
+        int rawCompressLevel = 0;
+        bool rawPredictor = true;
+        int jpgQuality = 90, pngLevel = 1;
+        int convSlices = 0; ///< 0 = automatic
+        int bufHighPct = 80, bufLowPct = 50;
+        QString spillDir;
+        QStringList stripeDirs;
+        double preTriggerSecs = 0.0;
+        int preTriggerMemMB = 2048;
+        bool preTriggerCompress = false;
+        Settings::JpgSubsampling jpgSubsampling = Settings::Jpg_420;
+        Settings::QueuePolicy policy = Settings::Queue_DropNewest;
+        FakeFrameGenerator::Pattern pattern = FakeFrameGenerator::Noise;
+    };
+
+    double cpuSeconds()
+    {
+#if defined(Q_OS_WIN)
+        FILETIME c, e, k, u;
+        if (!GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u)) return 0.0;
+        auto ft2s = [](const FILETIME &ft) { return double((quint64(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) / 1e7; };
+        return ft2s(k) + ft2s(u);
+#else
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru)) return 0.0;
+        return double(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + double(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+#endif
+    }
+
+    qint64 peakRSSBytes()
+    {
+#if defined(Q_OS_WIN)
+        PROCESS_MEMORY_COUNTERS pmc;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+        return qint64(pmc.PeakWorkingSetSize);
+#else
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru)) return 0;
+#  if defined(Q_OS_DARWIN)
+        return qint64(ru.ru_maxrss); // bytes on macOS
+#  else
+        return qint64(ru.ru_maxrss) * 1024LL; // KB elsewhere
+#  endif
+#endif
+    }
+
+    qint64 diskUsage(const QString &path)
+    {
+        QFileInfo fi(path);
+        if (fi.isFile()) return fi.size();
+        qint64 ret = 0;
+        for (QDirIterator it(path, QDir::Files, QDirIterator::Subdirectories); it.hasNext(); ) {
+            it.next();
+            ret += it.fileInfo().size();
+        }
+        return ret;
+    }
+
+    /// Everything a recording consists of: just location, unless it's a stripe manifest, then also every stripe.
+    QStringList recordingPaths(const QString &location)
+    {
+        QStringList ret(location);
+        if (StripeSet::Manifest m; location.endsWith(StripeSet::ManifestSuffix) && StripeSet::readManifest(location, m))
+            ret += m.stripes;
+        return ret;
+    }
+
+    /// Pre-renders n frames of pattern, which are then cycled through, so that generation costs nothing during the run.
+    QVector<QImage> makeFrames(int w, int h, int n, FakeFrameGenerator::Pattern pattern)
+    {
+        QVector<QImage> ret;
+        QThreadPool pool;
+        for (int i = 0; i < n; ++i) {
+            QImage img = Util::alignedImage(w, h, QImage::Format_ARGB32); // like FakeFrameGenerator's
+            FakeFrameGenerator::render(img, pattern, quint64(i+1), 1, n, &pool);
+            ret.push_back(img);
+        }
+        return ret;
+    }
+
+    QJsonObject caseToJson(const Case &c)
+    {
+        return QJsonObject{
+            {"format", Settings::fmt2String(c.fmt)}, {"width", c.w}, {"height", c.h}, {"fps", c.fps}, {"threads", c.threads}
+        };
+    }
+
+    /// Runs 1 case in this process and returns the results. Called in the child process.
+    QJsonObject runCase(const Case &c, const Opts &o)
+    {
+        QJsonObject ret = caseToJson(c);
+        Settings settings;
+        settings.format = c.fmt;
+        settings.fps = c.fps;
+        settings.saveDir = o.dir;
+        settings.savePrefix = "FG_Bench";
+        settings.zipEmbed = o.zip && Settings::ZipableFormats.count(c.fmt);
+        settings.zipLevel = o.zipLevel;
+        settings.rawContainer = o.rawContainer;
+        settings.rawIO = o.rawIO;
+        settings.rawCompressLevel = o.rawCompressLevel;
+        settings.rawPredictor = o.rawPredictor;
+        settings.jpgQuality = o.jpgQuality;
+        settings.jpgSubsampling = o.jpgSubsampling;
+        settings.pngLevel = o.pngLevel;
+        settings.bufHighPct = o.bufHighPct;
+        settings.bufLowPct = o.bufLowPct;
+        settings.spillEnabled = !o.spillDir.isEmpty();
+        settings.spillDir = o.spillDir;
+        settings.stripeDirs = o.stripeDirs;
+        settings.preTriggerSecs = o.preTriggerSecs;
+        settings.preTriggerMemMB = o.preTriggerMemMB;
+        settings.preTriggerCompress = o.preTriggerCompress;
+        settings.queuePolicy = o.policy;
+        settings.transient.nThreads = c.threads;
+        settings.transient.convSlices = o.convSlices;
+
+        const QVector<QImage> imgs = makeFrames(c.w, c.h, 8, o.pattern);
+        quint64 generated = 0, dropped = 0, written = 0;
+        QString error;
+        Recorder rec;
+        QObject::connect(&rec, &Recorder::frameDropped, [&dropped](quint64){ ++dropped; });
+        QObject::connect(&rec, &Recorder::error, [&error](QString e){ if (error.isEmpty()) error = e; });
+        QObject::connect(&rec, &Recorder::finalized, [&written](QString, quint64 n){ written = n; });
+        qint64 bufPeak = 0, spillPeak = 0;
+        QObject::connect(&rec, &Recorder::bufferFill, [&](qint64, qint64 recentMax, qint64, qint64 spilled){
+            bufPeak = qMax(bufPeak, recentMax); spillPeak = qMax(spillPeak, spilled);
+        });
+
+        int preFrames = 0; // from the last preTriggerFill before recording, which start() emits
+        QObject::connect(&rec, &Recorder::preTriggerFill, [&](int frames, double, qint64, qint64){
+            if (!rec.isRecording()) preFrames = frames;
+        });
+
+        quint64 nPre = 0;
+        if (o.preTriggerSecs > 0.) {
+            // fill the pre-trigger buffer at the case's fps, as a camera would, then start recording with it full
+            rec.setPreTrigger(settings);
+            QElapsedTimer pt;
+            pt.start();
+            while (pt.nsecsElapsed() < qint64(o.preTriggerSecs * 1e9)) {
+                rec.saveFrame(Frame(imgs[int(nPre % quint64(imgs.size()))], nPre+1));
+                ++nPre;
+                QCoreApplication::processEvents();
+                while (pt.nsecsElapsed() < qint64(double(nPre) * 1e9 / c.fps)) QThread::usleep(100);
+            }
+        }
+
+        QString location;
+        if (QString err = rec.start(settings, QSize(c.w, c.h), &location); !err.isEmpty()) {
+            ret["error"] = err;
+            return ret;
+        }
+        const double cpu0 = cpuSeconds();
+        QElapsedTimer et;
+        et.start();
+        // no throttling: hand frames to the Recorder as fast as it'll take them. Its queues decide what gets dropped.
+        while (et.elapsed() < qint64(o.seconds * 1e3) && rec.isRecording()) {
+            rec.saveFrame(Frame(imgs[int((nPre + generated) % quint64(imgs.size()))], nPre + generated + 1));
+            ++generated;
+            QCoreApplication::processEvents();
+        }
+        const double tGen = double(et.nsecsElapsed()) / 1e9;
+        rec.stop();
+        rec.waitForFinalized(); // everything written, closed and synced. Emits finalized(), with the count of frames written.
+        QCoreApplication::processEvents(); // deliver any stragglers
+        const double tTotal = double(et.nsecsElapsed()) / 1e9, cpu = cpuSeconds() - cpu0;
+        const QStringList paths = recordingPaths(location);
+        qint64 bytes = 0;
+        for (const auto & path : paths) bytes += diskUsage(path);
+
+        ret["seconds"] = tTotal;
+        ret["generated"] = double(generated);
+        ret["written"] = double(written);
+        ret["dropped"] = double(dropped);
+        ret["gen_fps"] = double(generated) / tGen;
+        ret["sustained_fps"] = double(written) / tTotal;
+        ret["mb_per_sec"] = double(bytes) / 1e6 / tTotal;
+        ret["bytes"] = double(bytes);
+        if (c.fmt == Settings::Fmt_RAW && bytes > 0) // what the frames would take uncompressed, over what they did
+            ret["compress_ratio"] = double(written) * double(imgs[0].sizeInBytes()) / double(bytes);
+        ret["cpu_seconds"] = cpu;
+        ret["cpu_pct"] = 100.0 * cpu / tTotal;
+        ret["peak_rss_mb"] = double(peakRSSBytes()) / 1e6;
+        ret["buffer_peak_mb"] = double(bufPeak) / 1e6;
+        ret["spill_peak_mb"] = double(spillPeak) / 1e6;
+        ret["stripes"] = qMax(paths.size() - 1, 1);
+        ret["pretrigger_frames"] = preFrames;
+        if (!error.isEmpty()) ret["error"] = error;
+
+        QJsonObject lat;
+        for (int i = 0; i < LatencyStats::NStages; ++i) {
+            const auto snap = LatencyStats::histogram(LatencyStats::Stage(i)).snapshot();
+            if (!snap.count) continue;
+            lat[LatencyStats::stageName(LatencyStats::Stage(i))] = QJsonObject{
+                {"p50_ms", double(snap.percentile(50.0))/1e6}, {"p99_ms", double(snap.percentile(99.0))/1e6},
+                {"max_ms", double(snap.maxNS)/1e6}
+            };
+        }
+        ret["latency"] = lat;
+
+        if (o.readback && (QFileInfo(location).isDir() || location.endsWith(".zip") || location.endsWith(".fgraw")
+                           || location.endsWith(StripeSet::ManifestSuffix))) {
+            // read the whole recording back in order, touching every page, as a player/analysis tool would.
+            // (Video files are FFmpeg's business, not RecordingReader's.)
+            RecordingReader rr(location, QSize(c.w, c.h));
+            QString rerr;
+            if (!rr.open(&rerr)) {
+                ret["error"] = "readback: " + rerr;
+            } else {
+                rr.setSequential(true);
+                rr.setReadahead(o.readahead);
+                quint64 sum = 0, nRead = 0, nBytes = 0, nZeroCopy = 0;
+                et.restart();
+                for (qint64 i = 0; i < rr.frameCount(); ++i) {
+                    const Frame f = rr.frameAt(i, &rerr);
+                    if (f.isNull()) { if (!ret.contains("error")) ret["error"] = "readback: " + rerr; break; }
+                    const uchar *bits = f.img.constBits();
+                    const qint64 n = f.img.sizeInBytes();
+                    for (qint64 off = 0; off < n; off += 4096) sum += bits[off];
+                    nZeroCopy += rr.isZeroCopy(i) ? 1 : 0;
+                    nBytes += quint64(n);
+                    ++nRead;
+                }
+                const double tRead = qMax(double(et.nsecsElapsed()) / 1e9, 1e-9);
+                ret["read_frames"] = double(nRead);
+                ret["read_fps"] = double(nRead) / tRead;
+                ret["read_mb_per_sec"] = double(nBytes) / 1e6 / tRead;
+                ret["read_zero_copy"] = nRead && nZeroCopy == nRead;
+                ret["read_checksum"] = double(sum & 0xffffffffULL); // keeps the page touches from being optimized out
+            }
+        }
+
+        if (!o.keep) {
+            for (const auto & path : paths) {
+                if (QFileInfo(path).isDir()) QDir(path).removeRecursively();
+                else QFile::remove(path);
+            }
+        }
+        return ret;
+    }
+
+    const QStringList csvColumns = {
+        "format", "width", "height", "fps", "threads", "seconds", "generated", "written", "dropped", "gen_fps",
+        "sustained_fps", "mb_per_sec", "compress_ratio", "cpu_seconds", "cpu_pct", "peak_rss_mb", "buffer_peak_mb", "spill_peak_mb", "stripes", "pretrigger_frames", "read_fps",
+        "read_mb_per_sec", "error"
+    };
+
+    QString toCsvLine(const QJsonObject &r)
+    {
+        QStringList cols;
+        for (const auto & k : csvColumns) {
+            const QJsonValue v = r.value(k);
+            if (v.isDouble()) cols.push_back(QString::number(v.toDouble(), 'g', 10));
+            else cols.push_back(QString("\"%1\"").arg(v.toString().replace('"', "'")));
+        }
+        return cols.join(',');
+    }
+
+    template <typename T, typename F>
+    QVector<T> parseList(const QString &s, F && parseOne, QString &err)
+    {
+        QVector<T> ret;
+        for (const auto & tok : s.split(',', QString::SkipEmptyParts)) {
+            bool ok = false;
+            T v = parseOne(tok.trimmed(), ok);
+            if (!ok) { err = QString("Cannot parse '%1'").arg(tok); return {}; }
+            ret.push_back(v);
+        }
+        return ret;
+    }
+
+} // end anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("FG_Bench");
+
+    QString allFmts;
+    for (const auto fmt : Settings::EnabledFormats)
+        allFmts += (allFmts.isEmpty() ? "" : ",") + Settings::fmt2String(fmt);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless recording throughput benchmark. Runs every combination of the given formats, "
+                                     "sizes, fps and thread counts through the Recorder, unthrottled.");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"formats", "Comma-separated formats.", "list", allFmts},
+        {"sizes", "Comma-separated WxH frame sizes.", "list", QString("1920x1080,%1x%2").arg(Frame::DefaultWidth()).arg(Frame::DefaultHeight())},
+        {"fps", "Comma-separated recording fps values.", "list", "10,30"},
+        {"threads", "Comma-separated thread counts (0 = automatic).", "list", "0"},
+        {"seconds", "How long to feed frames for, per case.", "secs", "5"},
+        {"dir", "Directory to record to.", "dir", QDir::tempPath()},
+        {"zip", "Embed RAW/PNG/JPG frames in a .zip."},
+        {"zip-level", "Deflate level (0-9) for RAW frames embedded in a .zip. 0 = store.", "level", "0"},
+        {"raw-container", "Write RAW recordings to a single preallocated .fgraw file."},
+        {"raw-io", "I/O mode for --raw-container: direct, dropcache or buffered.", "mode", "direct"},
+        {"raw-compress", "Lossless compression level (0-9) for --raw-container frames. 0 = off.", "level", "0"},
+        {"raw-no-predictor", "With --raw-compress, don't filter rows before compressing them."},
+        {"jpg-quality", "JPG quality (1-100).", "quality", "90"},
+        {"subsampling", "JPG chroma subsampling: 420, 422 or 444.", "mode", "420"},
+        {"png-level", "PNG zlib level (0-9).", "level", "1"},
+        {"conv-slices", "Bands to split each frame's BGRA -> YUV 4:2:0 conversion into, for FFmpeg formats. 0 = automatic,"
+                        " 1 = off.", "n", "0"},
+        {"policy", "Encoder queue-full policy: newest, oldest or block.", "policy", "newest"},
+        {"watermarks", "Write-behind buffer HIGH,LOW watermarks, in % of the memory budget.", "pcts", "80,50"},
+        {"spill-dir", "Spill RAW/PNG/JPG frames above the high watermark to a file in this directory.", "dir"},
+        {"stripe-dirs", "Comma-separated extra directories (ideally each on its own drive) to stripe RAW/PNG/JPG recordings"
+                        " over, together with --dir.", "list"},
+        {"pre-trigger", "Seconds of frames to feed (at the case's fps) into the pre-trigger buffer before recording starts."
+                        " 0 = off.", "secs", "0"},
+        {"pre-trigger-mem", "Memory for the pre-trigger buffer, in MB.", "mb", "2048"},
+        {"pre-trigger-compress", "Keep pre-trigger frames deflated."},
+        {"pattern", "Test pattern: noise, gradient or bars.", "pattern", "noise"},
+        {"readback", "After recording, read each recording back (memory-mapped, in order) and report read fps and MB/s."},
+        {"readahead", "Frames to hint ahead of the reader for --readback.", "frames", "4"},
+        {"keep", "Keep the recordings (they are deleted after each case by default)."},
+        {"csv", "Write CSV results to file ('-' = stdout, the default if --json isn't given).", "file"},
+        {"json", "Write JSON results to file ('-' = stdout).", "file"},
+        {"run", "Internal: run a single FMT,WxH,FPS,THREADS case in this process."
+                " Prints 1 line: RESULT followed by the result JSON.", "case"},
+    });
+    parser.process(app);
+
+    Opts opts;
+    opts.seconds = qMax(parser.value("seconds").toDouble(), 0.1);
+    opts.dir = parser.value("dir");
+    opts.zip = parser.isSet("zip");
+    opts.zipLevel = qBound(0, parser.value("zip-level").toInt(), 9);
+    opts.rawContainer = parser.isSet("raw-container");
+    if (const QString io = parser.value("raw-io"); io == "dropcache") opts.rawIO = Settings::RawIO_DropCache;
+    else if (io == "buffered") opts.rawIO = Settings::RawIO_Buffered;
+    opts.rawCompressLevel = qBound(0, parser.value("raw-compress").toInt(), 9);
+    opts.rawPredictor = !parser.isSet("raw-no-predictor");
+    opts.jpgQuality = qBound(1, parser.value("jpg-quality").toInt(), 100);
+    if (const QString ss = parser.value("subsampling"); ss == "422") opts.jpgSubsampling = Settings::Jpg_422;
+    else if (ss == "444") opts.jpgSubsampling = Settings::Jpg_444;
+    opts.pngLevel = qBound(0, parser.value("png-level").toInt(), 9);
+    opts.convSlices = qMax(parser.value("conv-slices").toInt(), 0);
+    if (const QStringList wm = parser.value("watermarks").split(','); wm.size() == 2) {
+        opts.bufHighPct = qBound(1, wm[0].toInt(), 100);
+        opts.bufLowPct = qBound(0, wm[1].toInt(), opts.bufHighPct);
+    }
+    opts.spillDir = parser.value("spill-dir");
+    opts.stripeDirs = parser.value("stripe-dirs").split(',', QString::SkipEmptyParts);
+    opts.preTriggerSecs = qMax(parser.value("pre-trigger").toDouble(), 0.0);
+    opts.preTriggerMemMB = qMax(parser.value("pre-trigger-mem").toInt(), 1);
+    opts.preTriggerCompress = parser.isSet("pre-trigger-compress");
+    opts.keep = parser.isSet("keep");
+    opts.readback = parser.isSet("readback");
+    opts.readahead = qMax(parser.value("readahead").toInt(), 0);
+    if (const QString pol = parser.value("policy"); pol == "oldest") opts.policy = Settings::Queue_DropOldest;
+    else if (pol == "block") opts.policy = Settings::Queue_Block;
+    if (const QString pat = parser.value("pattern"); pat == "gradient") opts.pattern = FakeFrameGenerator::Gradient;
+    else if (pat == "bars") opts.pattern = FakeFrameGenerator::MovingBars;
+
+    auto parseFmt = [](const QString &s, bool &ok) { auto f = Settings::string2Fmt(s); ok = Settings::EnabledFormats.count(f) != 0; return f; };
+    auto parseSize = [](const QString &s, bool &ok) {
+        const auto wh = s.split('x');
+        bool ok2 = false;
+        QSize ret(wh.value(0).toInt(&ok), wh.value(1).toInt(&ok2));
+        ok = ok && ok2 && wh.size() == 2 && !ret.isEmpty();
+        return ret;
+    };
+    auto parseDouble = [](const QString &s, bool &ok) { return s.toDouble(&ok); };
+    auto parseInt = [](const QString &s, bool &ok) { return s.toInt(&ok); };
+
+    if (parser.isSet("run")) {
+        // child process mode
+        const QStringList f = parser.value("run").split(',');
+        bool ok[4] = {};
+        Case c;
+        c.fmt = parseFmt(f.value(0), ok[0]);
+        const QSize sz = parseSize(f.value(1), ok[1]);
+        c.w = sz.width(); c.h = sz.height();
+        c.fps = parseDouble(f.value(2), ok[2]);
+        c.threads = parseInt(f.value(3), ok[3]);
+        if (f.size() != 4 || !ok[0] || !ok[1] || !ok[2] || !ok[3]) {
+            std::fprintf(stderr, "Bad --run spec: %s\n", parser.value("run").toUtf8().constData());
+            return 1;
+        }
+        const QJsonObject r = runCase(c, opts);
+        std::printf("RESULT %s\n", QJsonDocument(r).toJson(QJsonDocument::Compact).constData());
+        std::fflush(stdout);
+        return 0;
+    }
+
+    QString err;
+    const auto fmts = parseList<Settings::Fmt>(parser.value("formats"), parseFmt, err);
+    const auto sizes = parseList<QSize>(parser.value("sizes"), parseSize, err);
+    const auto fpses = parseList<double>(parser.value("fps"), parseDouble, err);
+    const auto threads = parseList<int>(parser.value("threads"), parseInt, err);
+    if (!err.isEmpty() || fmts.isEmpty() || sizes.isEmpty() || fpses.isEmpty() || threads.isEmpty()) {
+        std::fprintf(stderr, "%s\n", (err.isEmpty() ? QString("Empty matrix") : err).toUtf8().constData());
+        return 1;
+    }
+    if (!QFileInfo(opts.dir).isDir()) {
+        std::fprintf(stderr, "Directory does not exist: %s\n", opts.dir.toUtf8().constData());
+        return 1;
+    }
+
+    QJsonArray results;
+    const int nCases = fmts.size() * sizes.size() * fpses.size() * threads.size();
+    int caseNum = 0;
+    for (const auto fmt : fmts) for (const auto & sz : sizes) for (const auto fps : fpses) for (const auto nthr : threads) {
+        const Case c{fmt, sz.width(), sz.height(), fps, nthr};
+        const QString spec = QString("%1,%2x%3,%4,%5").arg(Settings::fmt2String(fmt)).arg(c.w).arg(c.h).arg(fps).arg(nthr);
+        std::fprintf(stderr, "[%d/%d] %s ...\n", ++caseNum, nCases, spec.toUtf8().constData());
+
+        QStringList args = {"--run", spec, "--seconds", QString::number(opts.seconds), "--dir", opts.dir,
+                            "--policy", parser.value("policy"), "--pattern", parser.value("pattern"),
+                            "--jpg-quality", QString::number(opts.jpgQuality), "--subsampling", parser.value("subsampling"),
+                            "--png-level", QString::number(opts.pngLevel), "--watermarks", parser.value("watermarks"),
+                            "--conv-slices", QString::number(opts.convSlices)};
+        if (!opts.spillDir.isEmpty()) args << "--spill-dir" << opts.spillDir;
+        if (!opts.stripeDirs.isEmpty()) args << "--stripe-dirs" << opts.stripeDirs.join(',');
+        if (opts.zip) args << "--zip" << "--zip-level" << QString::number(opts.zipLevel);
+        if (opts.rawContainer) args << "--raw-container" << "--raw-io" << parser.value("raw-io")
+                                    << "--raw-compress" << QString::number(opts.rawCompressLevel);
+        if (!opts.rawPredictor) args << "--raw-no-predictor";
+        if (opts.readback) args << "--readback" << "--readahead" << QString::number(opts.readahead);
+        if (opts.preTriggerSecs > 0.) args << "--pre-trigger" << QString::number(opts.preTriggerSecs)
+                                            << "--pre-trigger-mem" << QString::number(opts.preTriggerMemMB);
+        if (opts.preTriggerCompress) args << "--pre-trigger-compress";
+        if (opts.keep) args << "--keep";
+        QProcess proc;
+        proc.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        proc.start(QCoreApplication::applicationFilePath(), args);
+        proc.waitForFinished(-1);
+        QJsonObject r;
+        for (const auto & line : QString::fromUtf8(proc.readAllStandardOutput()).split('\n'))
+            if (line.startsWith("RESULT "))
+                r = QJsonDocument::fromJson(line.mid(7).toUtf8()).object();
+        if (r.isEmpty()) {
+            r = caseToJson(c);
+            r["error"] = QString("child process failed (exit code %1)").arg(proc.exitCode());
+        }
+        results.push_back(r);
+    }
+
+    auto writeOut = [](const QString &fn, const QByteArray &data) {
+        if (fn == "-") { std::fwrite(data.constData(), 1, size_t(data.size()), stdout); std::fflush(stdout); return true; }
+        QFile f(fn);
+        if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate) || f.write(data) != data.size()) {
+            std::fprintf(stderr, "Error writing %s: %s\n", fn.toUtf8().constData(), f.errorString().toUtf8().constData());
+            return false;
+        }
+        return true;
+    };
+    bool ok = true;
+    if (parser.isSet("csv") || !parser.isSet("json")) {
+        QString csv = csvColumns.join(',') + "\n";
+        for (const auto & r : results) csv += toCsvLine(r.toObject()) + "\n";
+        ok = writeOut(parser.isSet("csv") ? parser.value("csv") : QString("-"), csv.toUtf8()) && ok;
+    }
+    if (parser.isSet("json"))
+        ok = writeOut(parser.value("json"), QJsonDocument(results).toJson(QJsonDocument::Indented)) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include "BoxFilter.h"
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#  define BOXFILTER_SSE2 1
+#  include <emmintrin.h>
+#else
+#  define BOXFILTER_SSE2 0
+#endif
+
+namespace BoxFilter {
+
+namespace {
+
+    /// acc[i] = r0[i] + r1[i] for i in [0, n). r1 may be null.
+    void sumRows(uint16_t *acc, const uint8_t *r0, const uint8_t *r1, int n)
+    {
+        int i = 0;
+#if BOXFILTER_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + i)),
+                          p1 = r1 ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + i)) : zero;
+            __m128i *a = reinterpret_cast<__m128i *>(acc + i);
+            _mm_storeu_si128(a, _mm_add_epi16(_mm_unpacklo_epi8(p0, zero), _mm_unpacklo_epi8(p1, zero)));
+            _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_unpackhi_epi8(p0, zero), _mm_unpackhi_epi8(p1, zero)));
+        }
+#endif
+        for (; i < n; ++i) acc[i] = uint16_t(r0[i] + (r1 ? r1[i] : 0));
+    }
+
+    /// acc[i] += r0[i] + r1[i] for i in [0, n). r1 may be null.
+    void addRows(uint16_t *acc, const uint8_t *r0, const uint8_t *r1, int n)
+    {
+        int i = 0;
+#if BOXFILTER_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + i)),
+                          p1 = r1 ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + i)) : zero;
+            __m128i *a = reinterpret_cast<__m128i *>(acc + i);
+            const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(p0, zero), _mm_unpacklo_epi8(p1, zero)),
+                          hi = _mm_add_epi16(_mm_unpackhi_epi8(p0, zero), _mm_unpackhi_epi8(p1, zero));
+            _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), lo));
+            _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), hi));
+        }
+#endif
+        for (; i < n; ++i) acc[i] = uint16_t(acc[i] + r0[i] + (r1 ? r1[i] : 0));
+    }
+
+    /// (sum + half) * recip >> 16 ~= sum / area, rounded. sum + half always fits in 16 bits (see MaxFactor).
+    inline uint8_t average(unsigned sum, unsigned half, unsigned recip) { return uint8_t(((sum + half) * recip) >> 16); }
+
+    /// Sums each run of factor pixels of the column sums in acc and writes their averages to out
+    void sumColumns(const uint16_t *acc, int ow, int channels, int factor, unsigned half, unsigned recip, uint8_t *out)
+    {
+        int ox = 0;
+#if BOXFILTER_SSE2
+        if (channels == 4) {
+            // 1 pixel = 4 16-bit sums = half a register. 2 pixels at a time, then the halves are added up.
+            const __m128i h = _mm_set1_epi16(short(half)), m = _mm_set1_epi16(short(recip));
+            for (; ox < ow; ++ox) {
+                const uint16_t *a = acc + ox * factor * 4;
+                __m128i s = _mm_setzero_si128();
+                int i = 0;
+                for (; i + 2 <= factor; i += 2)
+                    s = _mm_add_epi16(s, _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i * 4)));
+                s = _mm_add_epi16(s, _mm_srli_si128(s, 8));
+                if (i < factor)
+                    s = _mm_add_epi16(s, _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + i * 4)));
+                const __m128i avg = _mm_mulhi_epu16(_mm_add_epi16(s, h), m);
+                const int px = _mm_cvtsi128_si32(_mm_packus_epi16(avg, avg));
+                std::memcpy(out + ox * 4, &px, 4);
+            }
+        }
+#endif
+        for (; ox < ow; ++ox) {
+            const uint16_t *a = acc + ox * factor * channels;
+            for (int c = 0; c < channels; ++c) {
+                unsigned s = 0;
+                for (int i = 0; i < factor; ++i) s += a[i * channels + c];
+                out[ox * channels + c] = average(s, half, recip);
+            }
+        }
+    }
+
+} // end anonymous namespace
+
+void downscale(const uint8_t *src, int srcStride, int w, int h, int channels, int factor, uint8_t *dst, int dstStride)
+{
+    const int ow = w / factor, oh = h / factor, rowBytes = ow * channels;
+    if (factor <= 1) {
+        for (int y = 0; y < oh; ++y) std::memcpy(dst + y * int64_t(dstStride), src + y * int64_t(srcStride), size_t(rowBytes));
+        return;
+    }
+    const unsigned area = unsigned(factor * factor), half = area / 2, recip = (65536U + half) / area;
+    const int inBytes = rowBytes * factor;
+    std::vector<uint16_t> acc(size_t(inBytes), 0);
+    for (int oy = 0; oy < oh; ++oy) {
+        // rows go in 2 at a time, which halves the passes over acc
+        const uint8_t *row = src + int64_t(oy) * factor * srcStride;
+        sumRows(acc.data(), row, row + srcStride, inBytes);
+        for (int r = 2; r < factor; r += 2) {
+            row += 2 * srcStride;
+            addRows(acc.data(), row, r + 1 < factor ? row + srcStride : nullptr, inBytes);
+        }
+        sumColumns(acc.data(), ow, channels, factor, half, recip, dst + int64_t(oy) * dstStride);
+    }
+}
+
+} // end namespace BoxFilter
@@ -0,0 +1,24 @@
+#ifndef BOXFILTER_H
+#define BOXFILTER_H
+
+#include <cstdint>
+
+/// Integer-factor box-filter downscaling of 8-bit-per-channel images (BGRA, or single planes: Y, U, V, interleaved UV).
+/// Used for the display preview, where a frame several times the size of the widget would otherwise be uploaded at
+/// full resolution and then aliased by the GPU's bilinear sampling.
+///
+/// Each output pixel is the rounded average of a factor x factor block. The last w % factor columns and h % factor
+/// rows are dropped. Rows are summed with SSE2 (baseline on x86-64, so no runtime dispatch), then blocks are summed
+/// and divided by a fixed-point reciprocal. The scalar version does the exact same integer math.
+namespace BoxFilter {
+
+    constexpr int MaxFactor = 16; ///< so that a whole block's sum fits in 16 bits
+
+    /// Box-filters the w x h image at src (channels bytes per pixel) into dst, which must have room for
+    /// (h / factor) rows of (w / factor) * channels bytes. factor must be in [1, MaxFactor].
+    void downscale(const uint8_t *src, int srcStride, int w, int h, int channels, int factor,
+                   uint8_t *dst, int dstStride);
+
+} // end namespace BoxFilter
+
+#endif // BOXFILTER_H
@@ -11,8 +11,10 @@
 #include <QFileDialog>
 #include <QSettings>
 #include <QTextBrowser>
+#include <QMessageBox>
 #include "Settings.h"
 #include "App.h"
+#include "LatencyStats.h"
 
 DebugWindow::DebugWindow(QWidget *parent) :
     QMainWindow(parent, Qt::Dialog/*|Qt::MSWindowsFixedSizeDialogHint*/),
@@ -33,6 +35,22 @@ DebugWindow::DebugWindow(QWidget *parent) :
 #endif
     setWindowIcon(QIcon(":/Img/app_icon.png"));
     ui->tb->setFontPointSize(8.0);
+
+    connect(ui->latencyResetBut, &QToolButton::clicked, this, [this]{
+        LatencyStats::resetAll();
+        updateLatencyStats();
+    });
+    connect(ui->latencyDumpBut, &QToolButton::clicked, this, [this]{
+        const QString fn = QFileDialog::getSaveFileName(this, "Save Latency Histograms",
+                                                        QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation) + "/latency.csv",
+                                                        "CSV Files (*.csv)");
+        if (fn.isEmpty()) return;
+        if (QString err; !LatencyStats::dumpToFile(fn, &err))
+            QMessageBox::critical(this, "Error Saving Latency Histograms", err);
+    });
+    QTimer *t = new QTimer(this);
+    connect(t, &QTimer::timeout, this, [this]{ if (isVisible()) updateLatencyStats(); });
+    t->start(1000);
 }
 
 
@@ -56,3 +74,8 @@ void DebugWindow::clearLog()
 {
     ui->tb->clear();
 }
+
+void DebugWindow::updateLatencyStats()
+{
+    ui->latencyTB->setPlainText(LatencyStats::report());
+}
@@ -24,6 +24,7 @@ public:
 public slots:
     void printSettings(const Settings &);
     void clearLog(); ///< clears the debug/console log
+    void updateLatencyStats(); ///< refreshes the pipeline latency table. Called periodically while visible.
 
 private:
     Ui::DebugWindow *ui;
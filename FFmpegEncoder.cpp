@@ -2,6 +2,8 @@
 #include "Settings.h"
 #include "Util.h"
 #include "Frame.h"
+#include "RGB2YUV.h"
+#include "LatencyStats.h"
 
 
 // AVCODEC STUFF
@@ -11,6 +13,7 @@ extern "C" {
 #include "libavcodec/avcodec.h"
 #include "libavutil/channel_layout.h"
 #include "libavutil/common.h"
+#include "libavutil/cpu.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/samplefmt.h"
@@ -28,8 +31,12 @@ extern "C" {
 #include <QReadLocker>
 #include <QWriteLocker>
 #include <atomic>
-#include <deque>
+#include <algorithm>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <vector>
+#include <QThread>
 #include <QThreadPool>
 
 #ifdef __GNUC__
@@ -47,82 +54,267 @@ namespace {
     AVPixelFormat qimgfmt2avcodecfmt(QImage::Format fmt);
     AVCodecID fmt2CodecId(int fmtFromSettingsClass);
 
-    struct Q
+    /// Fixed-capacity ring of Frame slots shared by the producer (enqueue), the Converter threads and the single
+    /// Encoder thread. Each slot carries its own atomic state, so none of these parties ever take a lock to touch
+    /// the frame data. Slot lifecycle: Empty -> Pending (producer) -> Converting (a converter) -> Ready (that same
+    /// converter) -> Empty (encoder).
+    ///
+    /// There must only ever be 1 producer (FFmpegEncoder::enqueue is called from the Recorder's thread) and 1 consumer
+    /// (the Encoder thread). Any number of Converter threads may race each other to claim Pending slots.
+    ///
+    /// What happens when the ring is full is up to the FFmpegEncoder::QueuePolicy passed to enqueue(). For
+    /// DropOldest, the producer may also take the front slot away from the converters/encoder (see dropFront()).
+    class Q
     {
+    public:
         QString name = "Q";
 
-        std::deque<Frame> frames; ///< buffered video frames.  this list never exceeds maxImgs in size. guarded by mut below.
+        struct alignas(64) Slot { ///< padded to a cache line so neighbouring slots' state flags don't false-share
+            enum State : int { Empty = 0, Pending, Converting, Ready };
+            enum Fate : int { Live = 0, Encoding, Dropped }; ///< decides the producer/encoder race for a Ready front slot
+            std::atomic<int> state = Empty;
+            /// Fate in the low 2 bits, and the ring index of the frame it applies to in the rest (see fateOf()), so a
+            /// CAS on it can't succeed against a frame that was dropped and replaced while the CAS-er wasn't looking.
+            std::atomic<quint64> fate = 0ULL;
+            std::atomic<quint64> num = 0ULL; ///< copy of frame.num that the producer may read regardless of who owns the slot
+            Frame frame; ///< only touched by whichever thread currently "owns" the slot as per state above
+            qint64 tEnqueuedNS = 0; ///< Util::getTimeNS() when the frame was enqueued. Owned like frame is.
+        };
 
-        static const int maxFrames = qMax(3,int(Frame::DefaultFPS())); ///< max number of video frames to buffer: 1 second worth of frames or 3 minimum.
+        static constexpr int minFrames = 3;
 
-        mutable QMutex mut; ///< to synchronize access to frames member above
-        QSemaphore semReadyForEncode; ///< signal video frames are proccessed by converters and ready for encode. typically sem.available() should be 1 or 0, but may reach maxFrames.
+        QSemaphore semPending; ///< 1 resource per Pending frame. Converter threads block on this; used purely as a wake-up.
+        QSemaphore semReadyForEncode; ///< signal video frames are proccessed by converters and ready for encode. Used purely as a wake-up for the Encoder thread.
+        QSemaphore semFree; ///< released every time a slot is emptied. Used purely as a wake-up for a blocked producer.
 
-        Q() {}
+        explicit Q(int capacity) : slots(size_t(qMax(capacity, 1))) {}
 
         ~Q() {
-            if (const auto ctv = frames.size()) {
-                Warning("%s: ~Q still had %d frames in Q (all were safely released)", name.toUtf8().constData(), int(ctv));
+            int ctv = 0;
+            for (auto & s : slots)
+                if (s.state.load(std::memory_order_acquire) != Slot::Empty) ++ctv;
+            if (ctv) {
+                Warning("%s: ~Q still had %d frames in Q (all were safely released)", name.toUtf8().constData(), ctv);
             } else {
-                Debug("%s: ~Q deleted (and was empty).", name.toUtf8().constData());
+                Debug("%s: ~Q deleted (and was empty). High-water mark: %d/%d frames", name.toUtf8().constData(),
+                      int(highWater), capacity());
             }
         }
 
-        // returns false if queue was full, in which case the frame wasn't added
-        bool enqueue(const Frame & frame, QString *err = nullptr) {
+        int capacity() const { return int(slots.size()); }
+
+        /// Producer thread only. If the queue is full, policy decides what happens: DropNewest returns false
+        /// without adding frame, DropOldest drops the front frame instead (if nobody is busy with it -- otherwise
+        /// falls back to DropNewest), and BlockProducer waits for the encoder to make room.
+        /// Frames dropped to make room are appended to *droppedOut (if not null).
+        /// On success releases 1 semPending resource, waking exactly one Converter thread.
+        bool enqueue(const Frame & frame, QString *err = nullptr, FFmpegEncoder::QueuePolicy policy = FFmpegEncoder::DropNewest,
+                     std::vector<quint64> *droppedOut = nullptr) {
             if (err) *err = "";
-            QMutexLocker l(&mut);
-            if (frames.size() >= maxFrames) {
+            const quint64 t = tail.load(std::memory_order_relaxed);
+            Slot & s = slot(t);
+            while (s.state.load(std::memory_order_acquire) != Slot::Empty) {
+                if (policy == FFmpegEncoder::DropOldest) {
+                    if (quint64 dnum; dropFront(t, dnum)) {
+                        if (droppedOut) droppedOut->push_back(dnum);
+                        continue; // its slot was the one at the tail: this time round the push goes through
+                    }
+                    // the encoder popped the front meanwhile (head moves just before its slot empties): retry the
+                    // push rather than drop anything, now that there's room
+                    if (size() < capacity()) continue;
+                } else if (policy == FFmpegEncoder::BlockProducer) {
+                    semFree.acquire(1); // stale resources from earlier pops just cost us an extra trip around the loop
+                    continue;
+                }
                 if (err) *err = QString("FFmpegEncoder::enqueue -- queue full, dropping frame %1").arg(frame.num);
                 return false;
             }
-            frames.push_back(frame);
+            s.frame = frame;
+            s.tEnqueuedNS = Util::getTimeNS();
+            s.num.store(frame.num, std::memory_order_relaxed);
+            s.fate.store(fateOf(t, Slot::Live), std::memory_order_relaxed);
+            s.state.store(Slot::Pending, std::memory_order_release);
+            tail.store(t+1, std::memory_order_release);
+            semPending.release(1);
+            if (const int depth = size(); depth > highWater.load(std::memory_order_relaxed)) highWater = depth;
+            for (int depth = size(), hw = recentHighWater.load(std::memory_order_relaxed);
+                 depth > hw && !recentHighWater.compare_exchange_weak(hw, depth, std::memory_order_relaxed); ) {}
             return true;
         }
 
-        int size() const { QMutexLocker l(&mut); return int(frames.size()); }
-
-        // unconditionally put back a frame because FFmpeg gave us EGAIN when we tried to process it.
-        // Called from FFmpegEncoder::doEncode() (Encoder thread). Will release 1 semaphore resource.
-        void putBackFrame(Frame &&frame) {
-            QMutexLocker l(&mut);
-            frames.emplace_front(std::move(frame));
-            semReadyForEncode.release(1);
-        }
-
-        // Called from Conversion thread(s)
-        Frame *findFirstNeedsAVFrame() {
-            QMutexLocker l(&mut);
-            for (auto it = frames.begin(); it != frames.end(); ++it) {
-                if (!it->avframe && it->flag == 0) {
-                    it->flag = 1; // mark it as "being processed"
-                    return &*it;
-                }
+        int size() const { return int(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire)); }
+
+        /// Returns the deepest the queue has been since it was created.
+        int highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+        /// Returns the deepest the queue has been since the last call to this function.
+        int takeRecentHighWaterMark() { return recentHighWater.exchange(size(), std::memory_order_relaxed); }
+
+        // Called from Conversion thread(s). Claims the oldest Pending slot, or returns nullptr if there are none.
+        // Any Pending slot is fair game, so a stale head/tail snapshot here is harmless.
+        Slot *claimForConversion() {
+            const quint64 h = head.load(std::memory_order_acquire), t = tail.load(std::memory_order_acquire);
+            for (quint64 i = h; i < t; ++i) {
+                Slot & s = slot(i);
+                int expected = Slot::Pending;
+                if (s.state.compare_exchange_strong(expected, Slot::Converting, std::memory_order_acq_rel))
+                    return &s;
             }
             return nullptr;
         }
 
-        // Called from Conversion thread(s) when a frame's conversion is complete. Will release 1 semaphore resource.
-        void markFrameReadyForEncode(Frame *f) {
-            if (f && f->avframe && f->flag == 1) {
-                f->flag = 2;
+        // Called from Conversion thread(s) when a frame's conversion is complete (or failed, in which case
+        // frame.avframe is null and the encoder will skip it). Will release 1 semaphore resource.
+        void markFrameReadyForEncode(Slot *s) {
+            if (s && s->state.load(std::memory_order_relaxed) == Slot::Converting) {
+                s->state.store(Slot::Ready, std::memory_order_release);
                 semReadyForEncode.release(1);
             }
         }
 
-        // Called from Encoder thread to query for any frames available to encode. Will return a null frame if none available.
-        Frame getFirstIfReadyForEncode() {
-            Frame ret;
-            QMutexLocker l(&mut);
-            if (!frames.empty() && frames.front().avframe && frames.front().flag == 2) {
-                ret = std::move(frames.front());
-                frames.pop_front();
+        // Called from Encoder thread to query for the next frame to encode, in order. Returns nullptr if the frame
+        // at the head of the queue isn't converted yet. The frame stays in the queue until popFront() is called,
+        // so an EAGAIN from avcodec simply means "try this same frame again".
+        Frame *peekReadyForEncode() {
+            const quint64 h = head.load(std::memory_order_acquire);
+            if (h == tail.load(std::memory_order_acquire)) return nullptr;
+            Slot & s = slot(h);
+            if (s.state.load(std::memory_order_acquire) != Slot::Ready) return nullptr;
+            // claim it so the producer can no longer drop it out from under us (already ours if this is an EAGAIN retry).
+            // The claim is for frame h specifically: if the producer dropped h and already reused the slot for a newer
+            // frame since we looked at head and state above, the CAS fails instead of grabbing that unconverted frame.
+            if (quint64 fate = fateOf(h, Slot::Live); s.fate.compare_exchange_strong(fate, fateOf(h, Slot::Encoding), std::memory_order_acq_rel))
+                LatencyStats::record(LatencyStats::QueueResidency, Util::getTimeNS() - s.tEnqueuedNS);
+            else if (fate != fateOf(h, Slot::Encoding))
+                return nullptr; // producer dropped it (and popped it itself)
+            return &s.frame;
+        }
+
+        // Called from Encoder thread to release the frame returned by peekReadyForEncode() back to the producer.
+        void popFront() { release(head.load(std::memory_order_acquire)); }
+
+    private:
+        std::vector<Slot> slots;
+        alignas(64) std::atomic<quint64> head = 0ULL; ///< next slot to encode. written by whoever owns the front slot
+        alignas(64) std::atomic<quint64> tail = 0ULL; ///< next slot to fill. written only by the producer thread
+        std::atomic_int highWater = 0, recentHighWater = 0;
+
+        Slot & slot(quint64 i) { return slots[size_t(i % slots.size())]; }
+        static quint64 fateOf(quint64 i, int fate) { return i << 2 | quint64(fate); }
+
+        void release(quint64 h) {
+            Slot & s = slot(h);
+            s.frame = Frame(); // release image & avframe refs now rather than when the slot is next reused
+            // advance head *before* emptying the slot: once it's Empty the producer may refill it at once, and must
+            // not then find head still pointing at it (dropFront would take the brand new frame for frame h)
+            head.store(h+1, std::memory_order_release);
+            s.state.store(Slot::Empty, std::memory_order_release);
+            semFree.release(1);
+        }
+
+        // Producer thread only (DropOldest). Takes the front frame away from the converters (if it is still
+        // Pending) or from the encoder (if it's Ready but the encoder hasn't picked it up yet) and frees its slot.
+        // Fails if a converter or the encoder is busy with it, or if the ring isn't full (anymore) as of head:
+        // then the front frame's slot isn't the one at tail t, and dropping it wouldn't make room for the push.
+        bool dropFront(quint64 t, quint64 & droppedNum) {
+            const quint64 h = head.load(std::memory_order_acquire);
+            if (h + slots.size() != t) return false;
+            Slot & s = slot(h);
+            if (int state = Slot::Pending; !s.state.compare_exchange_strong(state, Slot::Converting, std::memory_order_acq_rel)) {
+                quint64 fate = fateOf(h, Slot::Live);
+                if (state != Slot::Ready || !s.fate.compare_exchange_strong(fate, fateOf(h, Slot::Dropped), std::memory_order_acq_rel))
+                    return false;
             }
-            return ret;
+            // the slot is ours now; the semPending or semReadyForEncode resource that went with it becomes a harmless spurious wake-up
+            droppedNum = s.num.load(std::memory_order_relaxed);
+            release(h);
+            // the encoder may have eaten the wake-up for the next frame while it was stuck behind this one
+            semReadyForEncode.release(1);
+            return true;
         }
+    };
+
+    /// A pool of reusable AVFrame pixel buffers, all for the same width, height and pixel format.
+    /// Buffers come from an AVBufferPool, so once avcodec (and everyone else) drops its reference to a frame's
+    /// buf[0], the memory goes back to the pool instead of being freed. This saves us from allocating and faulting-in
+    /// a fresh ~22MB buffer per 5056x2968 YUV420P frame, on every Conversion thread, for every frame.
+    struct FramePool {
+        const int w, h;
+        const AVPixelFormat fmt;
 
+        std::atomic<quint64> nGets = 0ULL, ///< number of frames handed out
+                             nAllocs = 0ULL; ///< number of times the pool had to actually allocate a new buffer
+
+        FramePool(int w, int h, AVPixelFormat fmt);
+        ~FramePool(); ///< outstanding frames stay valid -- the underlying AVBufferPool is freed when the last one is released
+
+        bool isOk() const { return pool != nullptr; }
+        int bufferSize() const { return bufSize; }
+
+        /// on success, returns a frame referencing a pooled buffer which must be freed with av_frame_free(&frame).
+        /// on error, returns nullptr and sets errMsg
+        AVFrame *get(QString &errMsg);
+
+    private:
+        AVBufferPool *pool = nullptr;
+        int linesize[4] = {0};
+        int bufSize = 0;
+        static AVBufferRef *allocCB(void *opaque, int size);
     };
 
+    FramePool::FramePool(int width, int height, AVPixelFormat pxfmt)
+        : w(width), h(height), fmt(pxfmt)
+    {
+        constexpr int align = 64; // generous enough for any SIMD sws_scale or codec may use on the planes
+        if (w <= 0 || h <= 0 || fmt < 0 || av_image_fill_linesizes(linesize, fmt, FFALIGN(w, align)) < 0)
+            return;
+        for (auto & ls : linesize) ls = FFALIGN(ls, align);
+        // this is how av_frame_get_buffer() sizes things too: compute plane offsets relative to a null base
+        uint8_t *data[4] = {nullptr};
+        const int size = av_image_fill_pointers(data, fmt, FFALIGN(h, 32), nullptr, linesize);
+        if (size < 0) return;
+        bufSize = size + 16 + align - 1;
+        pool = av_buffer_pool_init2(bufSize, this, &FramePool::allocCB, nullptr);
+    }
+
+    FramePool::~FramePool()
+    {
+        if (pool && nGets) {
+            Debug("FramePool %dx%d %s: %llu frames served using %llu buffers (%s)", w, h, av_get_pix_fmt_name(fmt),
+                  quint64(nGets), quint64(nAllocs), Util::prettyFormatBytes(quint64(nAllocs)*quint64(bufSize)).toUtf8().constData());
+        }
+        if (pool) av_buffer_pool_uninit(&pool);
+    }
+
+    /* static */
+    AVBufferRef *FramePool::allocCB(void *opaque, int size)
+    {
+        // NB: only ever called from within av_buffer_pool_get(), which is only called while the FramePool is alive
+        ++static_cast<FramePool *>(opaque)->nAllocs;
+        return av_buffer_alloc(size);
+    }
+
+    AVFrame *FramePool::get(QString &errMsg)
+    {
+        if (!pool) { errMsg = "FramePool is invalid"; return nullptr; }
+        AVFrame *frame = av_frame_alloc();
+        try {
+            if (!frame) throw QString("Could not allocate AVFrame");
+            frame->format = fmt;
+            frame->width = w;
+            frame->height = h;
+            if (!(frame->buf[0] = av_buffer_pool_get(pool)))
+                throw QString("Could not get a buffer from the FramePool");
+            memcpy(frame->linesize, linesize, sizeof(linesize));
+            if (av_image_fill_pointers(frame->data, fmt, h, frame->buf[0]->data, frame->linesize) < 0)
+                throw QString("Could not fill pointers");
+            ++nGets;
+        } catch (const QString & e) {
+            errMsg = e;
+            av_frame_free(&frame); // also unrefs frame->buf[0], if any, putting it back in the pool
+        }
+        return frame;
+    }
+
     /// A simple converter to convert from QImage -> AVFrame.
     /// It can handle converting between pixel formats, but resizing/scaling is not implemented.
     struct Converter {
@@ -131,26 +323,60 @@ namespace {
         AVPixelFormat av_pix_fmt_in; ///< the format of the incoming QImages.. usually RGB0
         AVPixelFormat av_pix_fmt_out;
         SwsContext *ctx = nullptr;
+        bool builtin = false; ///< if true, we use our own RGB2YUV code rather than ctx for this conversion
+        FramePool *pool = nullptr; ///< if set, output frames come from this pool (owned by the ConverterMgr)
 
         /// on success, returns a newly allocated frame which must be freed with av_frame_free(&frame).
         /// on error, returns nullptr and sets errMsg
         AVFrame *convert(const QImage &, QString &errMsg);
 
         /// Returns a newly allocated frame like convert above. There is no "conversion" done and it simply copies
-        /// the pixel data from QImage into a referenced AVFrame, and returns it.
-        static AVFrame *trivial(const QImage &, AVPixelFormat fmt, QString& errMsg);
+        /// the pixel data from QImage into a referenced AVFrame, and returns it. The AVFrame buffer comes from pool
+        /// if pool is not nullptr.
+        static AVFrame *trivial(const QImage &, AVPixelFormat fmt, QString& errMsg, FramePool *pool = nullptr);
+
+        /// Zero-copy version of trivial(): returns a frame whose buf[0] points directly at the QImage's pixel data,
+        /// keeping a (shallow) reference to the QImage alive until avcodec and everyone else is done with the frame.
+        /// Returns nullptr without setting errMsg if img's memory layout isn't suitable for handing to avcodec as-is,
+        /// in which case the caller should fall back to trivial().
+        static AVFrame *wrap(const QImage &, AVPixelFormat fmt, QString& errMsg);
+
+        /// True if the conversion from in to out is done by our own RGB2YUV code rather than swscale.
+        static bool isBuiltin(AVPixelFormat in, AVPixelFormat out) {
+            return (in == AV_PIX_FMT_BGRA || in == AV_PIX_FMT_BGR0) && (out == AV_PIX_FMT_YUV420P || out == AV_PIX_FMT_YUVJ420P);
+        }
 
-        ~Converter();
-        Converter(int w, int h, AVPixelFormat src_fmt, AVPixelFormat dest_fmt);
-    private:
-        /// Just allocates a new AVFrame for the data in img. Only call this if fmt_in == fmt_out
-        AVFrame *trivial(const QImage &, QString &errMsg);
+        /// Allocates a w x h frame of pixel format fmt, from pool if pool is not nullptr, or from the heap otherwise.
+        /// On error, returns nullptr and sets errMsg.
+        static AVFrame *newFrame(int w, int h, AVPixelFormat fmt, FramePool *pool, QString &errMsg);
+
+        /// Converts exactly w x h pixels from the src planes into the dst planes using ctx. Both src and dst should
+        /// already point at the first row to convert, which is what lets a frame be converted in independent bands.
+        bool scale(const uint8_t *const src[], const int srcStride[], uint8_t *const dst[], const int dstStride[], QString &errMsg);
+        /// Builtin conversions only: like scale(), but converts just the first rows of the w x h frame this
+        /// Converter was made for, so that one Converter (and its pool) serves all of a frame's bands. RGB2YUV keeps
+        /// no state, so those bands may be converted at the same time, on different threads.
+        bool scaleRows(const uint8_t *const src[], const int srcStride[], uint8_t *const dst[], const int dstStride[],
+                       int rows, QString &errMsg);
+
+        /// Advances each of data's plane pointers by y rows of a fmt image, honoring chroma subsampling. y should be a
+        /// multiple of the vertical chroma subsampling factor.
+        static void offsetRows(uint8_t *data[4], const int linesize[4], AVPixelFormat fmt, int y);
 
         /// this is a work-alike to AVPicture. AVPicture itself was deprecated. Used internally.
         struct Picture {
             uint8_t *data[AV_NUM_DATA_POINTERS] = {nullptr};    ///< pointers to the image data planes
             int linesize[AV_NUM_DATA_POINTERS]  = {0};          ///< number of bytes per line
         };
+
+        /// Fills pic with pointers into img (shallow -- no copy). Returns false and sets errMsg on failure.
+        static bool fillPicture(Picture &pic, const QImage &img, AVPixelFormat fmt, QString &errMsg);
+
+        ~Converter();
+        Converter(int w, int h, AVPixelFormat src_fmt, AVPixelFormat dest_fmt);
+    private:
+        /// Just allocates a new AVFrame for the data in img. Only call this if fmt_in == fmt_out
+        AVFrame *trivial(const QImage &, QString &errMsg);
     };
 
     Converter::~Converter()
@@ -168,7 +394,12 @@ namespace {
             Error("FFmpegEncoder bad args!");
             return;
         }
-        if (av_pix_fmt_in != av_pix_fmt_out) {
+        if (isBuiltin(av_pix_fmt_in, av_pix_fmt_out)) {
+            // By far the most common case. Our hand-written converter does this a lot faster than swscale.
+            // Note it produces limited range output for YUVJ420P too, same as the "colorspace voodoo" below.
+            Debug() << "Img format != Codec format; using builtin " << RGB2YUV::implName(RGB2YUV::Auto) << " converter";
+            builtin = true;
+        } else if (av_pix_fmt_in != av_pix_fmt_out) {
             Debug() << "Img format != Codec format; using a converter";
 
             //create the conversion context.  you only need to do this once if
@@ -201,28 +432,154 @@ namespace {
 
     /* static */
     AVFrame *
-    Converter::trivial(const QImage &img, AVPixelFormat fmt, QString & errMsg)
+    Converter::trivial(const QImage &img, AVPixelFormat fmt, QString & errMsg, FramePool *pool)
     {
         if (img.isNull()) { errMsg = "Null image passed to converter"; return nullptr; }
 
-        AVFrame *frame = av_frame_alloc(); // allocate frame struct, initializing to default values
+        AVFrame *frame = nullptr;
+        try {
+            if (!(frame = newFrame(img.width(), img.height(), fmt, pool, errMsg)))
+                throw errMsg;
+            Picture inpic;
+            if (!fillPicture(inpic, img, fmt, errMsg))
+                throw errMsg;
+            av_image_copy(frame->data, frame->linesize, const_cast<const uint8_t **>(inpic.data), inpic.linesize, fmt, img.width(), img.height());
+        } catch (const QString & e) {
+            errMsg = e;
+            av_frame_free(&frame);
+        }
+        return frame;
+    }
+    /* static */
+    AVFrame *
+    Converter::newFrame(int width, int height, AVPixelFormat fmt, FramePool *pool, QString &errMsg)
+    {
+        AVFrame *frame = nullptr;
+        try {
+            if (pool) {
+                if (pool->w != width || pool->h != height || pool->fmt != fmt)
+                    throw QString("Requested frame does not match FramePool geometry/format");
+                // recycled buffer, already referenced by frame (av_frame_free returns it to the pool)
+                if (!(frame = pool->get(errMsg)))
+                    throw errMsg;
+            } else {
+                frame = av_frame_alloc(); // allocate frame struct, initializing to default values
+                if (!frame)
+                    throw QString("av_frame_alloc returned NULL!");
+                // req struct fields need to be set for av_frame_get_buffer to work ok
+                frame->width = width;
+                frame->height = height;
+                frame->format = fmt;
+                // allocate buffers and reference frame. (av_frame_free also unreferences frame->buf before deleting frame struct)
+                if (int res = av_frame_get_buffer(frame, 0 /* <-- docs say to pass 0 *//*32*/);
+                        res != 0) {
+                    throw QString("av_frame_get_buffer returned %1").arg(res);
+                }
+            }
+        } catch (const QString & e) {
+            errMsg = e;
+            av_frame_free(&frame); // implicitly sets frame to nullptr. calling av_frame_free with NULL frame is ok.
+        }
+        return frame;
+    }
+
+    /* static */
+    bool
+    Converter::fillPicture(Picture &pic, const QImage &img, AVPixelFormat fmt, QString &errMsg)
+    {
+        // NB: this does a shallow copy -- just fills pointers to image planes...
+        if (int size = av_image_fill_arrays(pic.data,
+                                            pic.linesize,
+                                            img.constBits(),
+                                            fmt, img.width(), img.height(), 32 /* align=32 for QImages, from Qt docs*/);
+                size < 0) {
+            errMsg = QString("av_image_fill_arrays returned %1").arg(size);
+            return false;
+        } else if (size > img.bytesPerLine()*img.height()) {
+            errMsg = "av_image_fill_arrays size is greater than img size in bytes!";
+            return false;
+        }
+        return true;
+    }
+
+    /* static */
+    void
+    Converter::offsetRows(uint8_t *data[4], const int linesize[4], AVPixelFormat fmt, int y)
+    {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+        if (!desc) return;
+        for (int i = 0; i < 4 && data[i]; ++i) {
+            const int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0; // planes 1 & 2 are chroma, if planar
+            data[i] += qint64(y >> shift) * linesize[i];
+        }
+    }
+
+    bool
+    Converter::scale(const uint8_t *const src[], const int srcStride[], uint8_t *const dst[], const int dstStride[], QString &errMsg)
+    {
+        if (builtin) {
+            RGB2YUV::bgraToYUV420(src[0], srcStride[0], dst, dstStride, w, h, false /* limited range, like swscale */);
+            return true;
+        }
+        if (!ctx) {
+            errMsg = "Could not allocate a SwsContext!";
+            return false;
+        }
+        //perform the conversion
+        if (int res = sws_scale(ctx, src, srcStride, 0, h, dst, dstStride); res < 0) {
+            errMsg = QString("sws_scale returned %1").arg(res);
+            return false;
+        }
+        return true;
+    }
+
+    bool
+    Converter::scaleRows(const uint8_t *const src[], const int srcStride[], uint8_t *const dst[], const int dstStride[],
+                         int rows, QString &errMsg)
+    {
+        if (!builtin || rows < 0 || rows > h) {
+            errMsg = QString("Cannot convert %1 of %2 rows with this converter").arg(rows).arg(h);
+            return false;
+        }
+        RGB2YUV::bgraToYUV420(src[0], srcStride[0], dst, dstStride, w, rows, false /* limited range, like swscale */);
+        return true;
+    }
+
+    /* static */
+    AVFrame *
+    Converter::wrap(const QImage &img, AVPixelFormat fmt, QString & errMsg)
+    {
+        if (img.isNull()) { errMsg = "Null image passed to converter"; return nullptr; }
+
+        // QImage formats are all single-plane, but avcodec's SIMD code may want its usual alignment for
+        // the plane pointer and stride, which QImage only guarantees to 4 bytes. Util::alignedImage()s qualify.
+        const auto align = quintptr(av_cpu_max_align());
+        if (av_pix_fmt_count_planes(fmt) != 1 || (quintptr(img.constBits()) % align) || (quintptr(img.bytesPerLine()) % align))
+            return nullptr;
+
+        AVFrame *frame = av_frame_alloc();
+        QImage *ref = nullptr;
         try {
             if (!frame) throw QString("Could not allocate AVFrame");
             frame->format = fmt;
             frame->width = img.width();
             frame->height = img.height();
-            if (av_frame_get_buffer(frame, 0))
-                throw QString("Could not allocate AVFrame buffer");
-            Picture inpic;
-            if (av_image_fill_arrays(inpic.data, inpic.linesize, img.constBits(), fmt, img.width(), img.height(), 32/*QImages use align=32*/) < 0)
-                throw QString("Could not fill arrays");
-            av_image_copy(frame->data, frame->linesize, const_cast<const uint8_t **>(inpic.data), inpic.linesize, fmt, img.width(), img.height());
+            ref = new QImage(img); // shallow copy; keeps pixel data alive (and unmodified) for as long as frame->buf[0] lives
+            frame->buf[0] = av_buffer_create(const_cast<uint8_t *>(ref->constBits()), int(ref->sizeInBytes()),
+                                             [](void *opaque, uint8_t *) { delete static_cast<QImage *>(opaque); },
+                                             ref, AV_BUFFER_FLAG_READONLY);
+            if (!frame->buf[0]) throw QString("Could not create AVBufferRef for QImage");
+            ref = nullptr; // now owned by frame->buf[0]
+            frame->data[0] = frame->buf[0]->data;
+            frame->linesize[0] = img.bytesPerLine();
         } catch (const QString & e) {
             errMsg = e;
+            delete ref;
             av_frame_free(&frame);
         }
         return frame;
     }
+
     AVFrame *
     Converter::trivial(const QImage &img, QString & errMsg)
     {
@@ -230,7 +587,10 @@ namespace {
             errMsg = "Do not call trivial() unless fmt_in == fmt_out!";
             return nullptr;
         }
-        return trivial(img, av_pix_fmt_out, errMsg);
+        errMsg.clear();
+        if (AVFrame *frame = wrap(img, av_pix_fmt_out, errMsg); frame || !errMsg.isEmpty())
+            return frame;
+        return trivial(img, av_pix_fmt_out, errMsg, pool); // img not suitable for zero-copy, so copy it
     }
 
     AVFrame *
@@ -241,8 +601,8 @@ namespace {
             return nullptr;
         }
         if (av_pix_fmt_in == av_pix_fmt_out)
-            return trivial(img, errMsg);
-        if (!ctx) {
+            return trivial(img, errMsg); // zero-copy if at all possible
+        if (!ctx && !builtin) {
             errMsg = "Could not allocate a SwsContext!";
             return nullptr;
         }
@@ -251,46 +611,16 @@ namespace {
             return nullptr;
         }
 
-        AVFrame *frame = av_frame_alloc(); // allocate frame struct
+        AVFrame *frame = nullptr;
 
         try {
-            if (!frame)
-                throw QString("av_frame_alloc returned NULL!");
-            // req struct fields need to be set for av_frame_get_buffer to work ok
-            frame->width = w;
-            frame->height = h;
-            frame->format = av_pix_fmt_out;
-            // allocate buffers and reference frame. (av_frame_free also unreferences frame->buf before deleting frame struct)
-            if (int res = av_frame_get_buffer(frame, 0 /* <-- docs say to pass 0 *//*32*/);
-                    res != 0) {
-                throw QString("av_frame_get_buffer returned %1").arg(res);
-            }
-
+            if (!(frame = newFrame(w, h, av_pix_fmt_out, pool, errMsg)))
+                throw errMsg;
             Picture inpic;
-
-            // NB: this does a shallow copy -- just fills pointers to image planes...
-            if (int size = av_image_fill_arrays(inpic.data,
-                                                inpic.linesize,
-                                                img.constBits(),
-                                                av_pix_fmt_in, w, h, 32 /* align=32 for QImages, from Qt docs*/);
-                    size < 0) {
-                throw QString("av_image_fill_arrays returned %1").arg(size);
-            } else if (size > img.bytesPerLine()*h) {
-                throw QString("av_image_fill_arrays size is greater than img size in bytes!");
-            }
-
-            //perform the conversion
-            if (int res =
-                    sws_scale(ctx,
-                              inpic.data,
-                              inpic.linesize,
-                              0,
-                              h,
-                              frame->data,
-                              frame->linesize);
-                    res < 0) {
-                throw QString("sws_scale returned %1").arg(res);
-            }
+            if (!fillPicture(inpic, img, av_pix_fmt_in, errMsg))
+                throw errMsg;
+            if (!scale(inpic.data, inpic.linesize, frame->data, frame->linesize, errMsg))
+                throw errMsg;
             errMsg = "";
         } catch (const QString &s) {
             errMsg = s;
@@ -301,13 +631,28 @@ namespace {
 
     class ConverterMgr {
         std::list<Converter *> convs;
+        std::list<FramePool> pools; ///< one per output (w, h, pix_fmt), shared by all Converters producing that output
         QMutex mut;
+        FramePool *poolFor(int w, int h, int pix_fmt_out); ///< call with mut held
     public:
         Converter *take(int w, int h, int pix_fmt_in, int pix_fmt_out);
+
         void put(Converter *&); ///< writes nullptr to passed-in arg after it's done putting the converter back in the list.
         ~ConverterMgr();
     };
 
+    FramePool *ConverterMgr::poolFor(int w, int h, int pxout) {
+        for (auto & pool : pools)
+            if (pool.w == w && pool.h == h && pool.fmt == pxout)
+                return pool.isOk() ? &pool : nullptr;
+        pools.emplace_back(w, h, AVPixelFormat(pxout));
+        if (!pools.back().isOk()) {
+            Warning("Could not create a FramePool for %dx%d %s, falling back to per-frame allocation", w, h, av_get_pix_fmt_name(AVPixelFormat(pxout)));
+            return nullptr;
+        }
+        return &pools.back();
+    }
+
     Converter *ConverterMgr::take(int w, int h, int pxin, int pxout) {
         {
             QMutexLocker l(&mut);
@@ -318,14 +663,82 @@ namespace {
                 }
             }
         }
-        return new Converter(w, h, AVPixelFormat(pxin), AVPixelFormat(pxout));
+        auto conv = new Converter(w, h, AVPixelFormat(pxin), AVPixelFormat(pxout));
+        QMutexLocker l(&mut);
+        conv->pool = poolFor(w, h, pxout);
+        return conv;
     }
     void ConverterMgr::put(Converter *&conv) {
         QMutexLocker l(&mut);
         convs.push_front(conv);
         conv = nullptr;
     }
-    ConverterMgr::~ConverterMgr() { for (auto conv : convs) delete conv; }
+    ConverterMgr::~ConverterMgr() { for (auto conv : convs) delete conv; /* pools cleaned up implicitly */ }
+
+    /// Converts img into a new frame of pix_fmt_out, split into nSlices horizontal bands which are converted in
+    /// parallel: band 0 in the calling thread, the rest in pool. Blocks until all bands are done. The bands share the
+    /// one Converter from convs for the whole frame (see Converter::scaleRows()), and so the whole frame's FramePool,
+    /// however unevenly h divides into bands.
+    /// Only for Converter::isBuiltin() conversions: RGB2YUV works on independent 2x2 blocks, so bands starting on even
+    /// rows give the very same output as converting the whole frame at once. swscale filters chroma vertically across
+    /// what would be band edges, so those conversions must not be split like this.
+    /// On error returns nullptr and sets errMsg.
+    AVFrame *convertSliced(ConverterMgr &convs, QThreadPool &pool, const QImage &img, AVPixelFormat pix_fmt_in,
+                           AVPixelFormat pix_fmt_out, int nSlices, QString &errMsg)
+    {
+        const int w = img.width(), h = img.height();
+        // bands must start on an even row (4:2:0 chroma). 16 also keeps each band's rows nicely aligned.
+        constexpr int rowAlign = 16;
+        const int bandH = FFALIGN((h + nSlices - 1) / qMax(nSlices, 1), rowAlign);
+        Converter *conv = convs.take(w, h, pix_fmt_in, pix_fmt_out);
+        AVFrame *frame = Converter::newFrame(w, h, pix_fmt_out, conv->pool, errMsg);
+        Converter::Picture inpic;
+        if (frame && !Converter::fillPicture(inpic, img, pix_fmt_in, errMsg))
+            av_frame_free(&frame);
+        if (!frame) {
+            convs.put(conv);
+            return nullptr;
+        }
+
+        std::vector<QString> errs(size_t(nSlices));
+        auto doBand = [&](int band) {
+            const int y0 = band*bandH, bh = qMin(bandH, h - y0);
+            Converter::Picture src(inpic), dst;
+            std::copy(std::begin(frame->data), std::end(frame->data), std::begin(dst.data));
+            std::copy(std::begin(frame->linesize), std::end(frame->linesize), std::begin(dst.linesize));
+            Converter::offsetRows(src.data, src.linesize, pix_fmt_in, y0);
+            Converter::offsetRows(dst.data, dst.linesize, pix_fmt_out, y0);
+            conv->scaleRows(src.data, src.linesize, dst.data, dst.linesize, bh, errs[size_t(band)]);
+        };
+        // One runnable per band, owned by us (not the pool) so that dispatching a band costs no std::function and
+        // no per-band heap allocation beyond this one array.
+        struct Band : QRunnable {
+            decltype(doBand) *func = nullptr;
+            QSemaphore *done = nullptr;
+            int band = 0;
+            Band() { setAutoDelete(false); }
+            void run() override { (*func)(band); done->release(); }
+        };
+        QSemaphore sem;
+        int nStarted = 0;
+        std::unique_ptr<Band[]> bands(new Band[size_t(nSlices)]);
+        for (int band = 1; band < nSlices && band*bandH < h; ++band, ++nStarted) {
+            Band & b = bands[size_t(band)];
+            b.func = &doBand; b.done = &sem; b.band = band;
+            pool.start(&b);
+        }
+        doBand(0);
+        sem.acquire(nStarted);
+        convs.put(conv);
+
+        for (const auto & e : errs)
+            if (!e.isEmpty()) {
+                errMsg = e;
+                av_frame_free(&frame);
+                break;
+            }
+        return frame;
+    }
 
 } // end anonymous namespace
 
@@ -344,42 +757,73 @@ struct FFmpegEncoder::Priv {
 
     bool wroteHeader = false;
 
-    QThreadPool poolConv, poolEnc;
+    std::vector<QThread *> convThreads; ///< long-lived Conversion threads, each blocking on queue->semPending
+    QThread *encThread = nullptr; ///< the long-lived Encoder thread, blocking on queue->semReadyForEncode
+    QThreadPool poolSlice;
     ConverterMgr converters;
-    std::atomic_bool stopEncFlag = false;
+    std::atomic_int conversionSlices = 0; ///< see FFmpegEncoder::setConversionSlices()
+    std::atomic_bool stopConvFlag = false, stopEncFlag = false;
+    bool closed = false; ///< see FFmpegEncoder::close()
+    std::atomic<quint64> framesWritten = 0ULL; ///< see FFmpegEncoder::framesWritten()
 
     Priv();
     ~Priv();
 };
 
-FFmpegEncoder::FFmpegEncoder(const QString &fn, double fps, qint64 br, int fmt, unsigned n_thr)
-    : outFile(fn), fps(fps), bitrate(br), fmt(fmt), num_threads(int(n_thr))
+FFmpegEncoder::FFmpegEncoder(const QString &fn, double fps, qint64 br, int fmt, unsigned n_thr,
+                             QueuePolicy qpol, qint64 qbudget, qint64 frameBytes)
+    : outFile(fn), fps(fps), bitrate(br), fmt(fmt), num_threads(qMax(int(n_thr), 1)), queuePolicy(qpol)
 {
     p = new Priv;
-    p->queue = new Q; p->queue->name = "Frame Q";
-    p->poolConv.setMaxThreadCount(num_threads);
-    p->poolEnc.setMaxThreadCount(1);
-
-    Util::renameAllPoolThreads(p->poolConv, "Conversion");
-    Util::renameAllPoolThreads(p->poolEnc, "Encoding");
+    qint64 qcap = qint64(ceil(qMax(fps, 1.0) * maxQueueSeconds));
+    if (qbudget > 0 && frameBytes > 0)
+        qcap = qMin(qcap, qbudget / frameBytes);
+    qcap = qMax(qcap, qint64(Q::minFrames));
+    p->queue = new Q(int(qcap)); p->queue->name = "Frame Q";
+    Debug("FFmpegEncoder: queue capacity %d frames (%0.1f MB at %0.1f fps), policy %d", p->queue->capacity(),
+          double(qcap*frameBytes)/1e6, fps, int(queuePolicy));
+    p->poolSlice.setMaxThreadCount(num_threads);
+    Util::renameAllPoolThreads(p->poolSlice, "Conversion Slice");
+
+    // The pipeline threads live as long as we do and sleep on the queue's semaphores when there is nothing to do,
+    // so enqueue() never has to (re)start anything and a wake-up can't be lost to a busy thread pool.
+    for (int i = 0; i < num_threads; ++i) {
+        QThread *thr = QThread::create([this]{ doConversion(); });
+        thr->setObjectName(QString("Conversion %1").arg(i+1));
+        thr->start();
+        p->convThreads.push_back(thr);
+    }
+    p->encThread = QThread::create([this]{ doEncode(); });
+    p->encThread->setObjectName("Encoding");
+    p->encThread->start();
 }
 
 FFmpegEncoder::~FFmpegEncoder()
 {
     disconnect(); // we don't want threads still running to continue to emit signals as we are destructing.
+    close();
+    if (p->queue) { delete p->queue; p->queue = nullptr; }
+    delete p; p = nullptr; // should write trailer for us...
+}
 
-    p->poolConv.waitForDone(); // allow conversion threads to finish
-    p->queue->semReadyForEncode.release(p->queue->size()); // make sure encoder thread runs until it drains all frames
-    p->stopEncFlag = true; // stop flag indicates encoder thread should exit after it drains queue.
-    p->poolEnc.waitForDone(); // allow encoder thread to finish
+void FFmpegEncoder::close()
+{
+    if (p->closed) return;
+    p->closed = true;
+    // Converters finish whatever is still Pending, then each one consumes 1 of these extra wake-ups and exits.
+    p->stopConvFlag = true;
+    p->queue->semPending.release(int(p->convThreads.size()));
+    for (auto thr : p->convThreads) { thr->wait(); delete thr; }
+    p->convThreads.clear();
+    // Everything left in the queue is now Ready. The encoder drains it all, then sees the stop flag and exits.
+    p->stopEncFlag = true;
+    p->queue->semReadyForEncode.release(1);
+    p->encThread->wait(); delete p->encThread; p->encThread = nullptr;
 
     QString error;
     if (!flushEncoder(&error)) {
         Warning("Encoder flush returned error: %s",error.toUtf8().constData());
     }
-
-    if (p->queue) { delete p->queue; p->queue = nullptr; }
-    delete p; p = nullptr; // should write trailer for us...
 }
 
 FFmpegEncoder::Priv::Priv()
@@ -405,88 +849,115 @@ FFmpegEncoder::Priv::~Priv()
 //    Debug("Priv deleted.");
 }
 
-bool FFmpegEncoder::enqueue(const Frame &frame, QString *errMsg)
+bool FFmpegEncoder::enqueue(const Frame &frame, QString *errMsg, bool block)
 {
-    bool ret = p->queue->enqueue(frame, errMsg);
+    std::vector<quint64> dropped;
+    const qint64 t0 = Util::getTimeNS();
+    bool ret = p->queue->enqueue(frame, errMsg, block ? BlockProducer : queuePolicy, &dropped); // wakes a Conversion thread on success
+    LatencyStats::record(LatencyStats::EnqueueWait, Util::getTimeNS() - t0);
+    for (const auto fnum : dropped) emit frameDropped(fnum);
     if (!ret) emit frameDropped(frame.num);
-    doConversionLater();
-    if (!p->framesProcessed)
-        doEncodeLater(); // on first run fire up the encode thread
     return ret;
 }
 
-void FFmpegEncoder::doConversionLater()
+quint64 FFmpegEncoder::framesWritten() const { return p->framesWritten; }
+
+FFmpegEncoder::QueueStats FFmpegEncoder::queueStats()
 {
-    if (!LambdaRunnable::tryStart(p->poolConv, [this]{ doConversion(); })) {
-        // pool busy..
-        //Debug() << "FFmpegEncoder queue->enqueue -- pool busy";
-    }
+    QueueStats ret;
+    ret.depth = p->queue->size();
+    ret.capacity = p->queue->capacity();
+    ret.highWater = p->queue->highWaterMark();
+    ret.recentHighWater = p->queue->takeRecentHighWaterMark();
+    return ret;
 }
-void FFmpegEncoder::doEncodeLater()
+
+void FFmpegEncoder::setConversionSlices(int n) { p->conversionSlices = qMax(n, 0); }
+
+int FFmpegEncoder::conversionSlicesFor(int frameHeight) const
 {
-    if (!LambdaRunnable::tryStart(p->poolEnc, [this]{ doEncode(); })) {
-        // pool busy..
-        //Debug() << "FFmpegEncoder ready frame->enqueue -- pool busy";
+    int n = p->conversionSlices;
+    if (!n) {
+        // auto: spread the threads over however many frames are waiting. At low fps that's usually just the one
+        // frame, so it gets all of them. At high fps the queue fills up and we are back to 1 thread per frame.
+        n = num_threads / qMax(p->queue->size(), 1);
     }
+    return qBound(1, n, qMax(frameHeight / 64, 1)); // don't bother with bands smaller than ~64 rows
 }
 
 void FFmpegEncoder::doConversion()
 {
-    Frame *frame = p->queue->findFirstNeedsAVFrame();
-    if (frame) {
+    int nConverted = 0;
+    for (;;) {
+        p->queue->semPending.acquire(1);
+        Q::Slot *slot = p->queue->claimForConversion();
+        if (!slot) {
+            // every Pending frame has 1 semaphore resource, so an empty claim is one of the d'tor's stop wake-ups
+            // (another converter may have picked up "our" frame in the meantime, and this is the resource for it).
+            if (p->stopConvFlag) break;
+            continue;
+        }
+        Frame *frame = &slot->frame;
         const QImage & img(frame->img);
         const AVPixelFormat img_pix_fmt = qimgfmt2avcodecfmt(img.format());
         const AVPixelFormat codec_pix_fmt = pixelFormatForCodecId(fmt2CodecId(fmt));
-        if (!frame->avframe && int(frame->flag)==1) {
-            auto t0 = Util::getTime();
-            Converter *conv = p->converters.take(img.width(), img.height(), img_pix_fmt, codec_pix_fmt);
+        if (const AVFrame *av = frame->avframe;
+                av && (av->format != codec_pix_fmt || av->width != img.width() || av->height != img.height())) {
+            // the source attached a frame the codec can't take as-is: go from img like for any other frame
+            frame->destroyAVFrame();
+        }
+        if (!frame->avframe) {
+            const qint64 t0 = Util::getTimeNS();
             QString err;
-            frame->avframe = conv->convert(img, err);
-            p->converters.put(conv);
+            if (const int nSlices = conversionSlicesFor(img.height()); nSlices > 1 && Converter::isBuiltin(img_pix_fmt, codec_pix_fmt)) {
+                frame->avframe = convertSliced(p->converters, p->poolSlice, img, img_pix_fmt, codec_pix_fmt, nSlices, err);
+            } else {
+                Converter *conv = p->converters.take(img.width(), img.height(), img_pix_fmt, codec_pix_fmt);
+                frame->avframe = conv->convert(img, err);
+                p->converters.put(conv);
+            }
+            LatencyStats::record(LatencyStats::Convert, Util::getTimeNS() - t0);
             if (!frame->avframe)
                 emit error(err);
-            p->queue->markFrameReadyForEncode(frame); // mark it as "processed"
-            Debug() << "convert " << frame->num << " took: " << (Util::getTime()-t0) << " ms";
-            doConversionLater(); // re-enqueue another conversion thread when we are done. may be noop if all threads are busy.
-        } else {
-            Warning() << "POSSIBLE RACE CONDITION: Two converter threads got given the same frame!";
-        }
-    } else {
-        //Debug() << "doConversion -- got a null frame";
+        } // else the source already delivered it in codec_pix_fmt (e.g. FakeFrameGenerator::YUV420P): nothing to do
+        p->queue->markFrameReadyForEncode(slot); // mark it as "processed" (even on failure, so it doesn't block the queue)
+        ++nConverted;
     }
+    Debug("doConversion exiting after %d frames converted", nConverted);
 }
 
 void FFmpegEncoder::doEncode()
 {
     int iterct_outer = 0;
-    while (!p->stopEncFlag) {
-        int iterct = 0;
-        while (p->queue->semReadyForEncode.tryAcquire(1, 100)) {
+    for (;;) {
+        p->queue->semReadyForEncode.acquire(1);
+        // we drain all ready frames below, so swallow any extra wake-ups that correspond to them
+        p->queue->semReadyForEncode.tryAcquire(p->queue->semReadyForEncode.available());
+        while (Frame *frame = p->queue->peekReadyForEncode()) {
+            if (!frame->avframe) {
+                // conversion failed (and already emitted error) -- skip it.
+                emit frameDropped(frame->num);
+                p->queue->popFront();
+                continue;
+            }
             QString err;
-            Frame frame = p->queue->getFirstIfReadyForEncode();
-            if (!frame.isNull()) {
-                //    if (res) qDebug("dequeue got img frame %llu (%d x %d)", frame.num, frame.img.width(), frame.img.height());
-                if (const int res = encode(frame, &err); res == 0) {
-                    // got EAGAIN from avcodec
-                    Debug() << "Got EAGAIN from avcodec_send_frame, re-enqueing frame...";
-                    p->queue->putBackFrame(std::move(frame));
-                } else if (res < 0) {
-                    emit error(err);
-                } else if (res > 0) {
-                    emit wroteFrame(frame.num);
-                }
-                // note Frame may be invalidated after this line because of putBackFrame() call above.
-            } else {
-                //Debug("Frame was null...");
+            if (const int res = encode(*frame, &err); res == 0) {
+                // got EAGAIN from avcodec. encode() drained the codec's output, so just retry this same frame.
+                Debug() << "Got EAGAIN from avcodec_send_frame, retrying frame...";
+                continue;
+            } else if (res < 0) {
+                emit error(err);
+            } else if (res > 0) {
+                ++p->framesWritten;
+                emit wroteFrame(frame->num);
             }
-            ++iterct;
-        }
-        if (!iterct) {
-            //Debug("Spurious wakeup...");
+            p->queue->popFront(); // note frame is invalidated after this line
         }
         ++iterct_outer;
+        // the d'tor only sets this once all converters are gone, so the drain above got every last frame
+        if (p->stopEncFlag) break;
     }
-    Debug("doEncode exiting after %d semaphore timeouts and %u frames processed", iterct_outer, unsigned(p->framesProcessed));
+    Debug("doEncode exiting after %d iterations and %u frames processed", iterct_outer, unsigned(p->framesProcessed));
 }
 
 quint64 FFmpegEncoder::bytesWritten() const
@@ -714,7 +1185,9 @@ static int write_frame(AVFormatContext *fmt_ctx, const AVRational *time_base, AV
 int FFmpegEncoder::write_video_frame(AVPacket *pkt)
 {
     const quint64 b0 = bytesWritten();
+    const qint64 t0 = Util::getTimeNS();
     const int ret = ::write_frame(p->oc, &p->c->time_base, p->video_st, pkt);
+    LatencyStats::record(LatencyStats::Write, Util::getTimeNS() - t0);
     if (0==ret) emit wroteBytes(qint64(bytesWritten()-b0));
     return ret;
 }
@@ -768,7 +1241,6 @@ bool FFmpegEncoder::flushEncoder(QString *errMsg)
 int FFmpegEncoder::encode(Frame & frame, QString *errMsg)
 {
     const QImage & img(frame.img);
-    qint64 t0 = Util::getTime();
 
     if (!p || !p->codec || !p->c || !p->oc || !p->oc->pb) {
         if (!setupP(img.width(), img.height(), pixelFormatForCodecId(fmt2CodecId(fmt)), errMsg)) {
@@ -791,7 +1263,9 @@ int FFmpegEncoder::encode(Frame & frame, QString *errMsg)
 
         outFrame->pts = fnum;
 
+        qint64 t0 = Util::getTimeNS();
         int res = avcodec_send_frame(p->c, outFrame); // will ref this frame's buf (shallow copy it)
+        LatencyStats::record(LatencyStats::SendFrame, Util::getTimeNS() - t0);
 
         if (AVERROR(EAGAIN) == res) {
             // new API: avcodec_send_frame() may return EAGAIN when its buffers are full.
@@ -804,7 +1278,8 @@ int FFmpegEncoder::encode(Frame & frame, QString *errMsg)
         } else
             p->framesProcessed++;
 
-        while ((res = avcodec_receive_packet(p->c, &p->pkt)) == 0) { // keep looping until we get -EAGAIN or some error
+        for (t0 = Util::getTimeNS(); (res = avcodec_receive_packet(p->c, &p->pkt)) == 0; t0 = Util::getTimeNS()) { // keep looping until we get -EAGAIN or some error
+            LatencyStats::record(LatencyStats::ReceivePacket, Util::getTimeNS() - t0);
             if (write_video_frame(&p->pkt)) { // this automatically unreferences and inits the packet
                 QString error = "Error #11: Could not write frame";
                 if (p->oc && p->oc->pb && p->oc->pb->error)
@@ -823,7 +1298,6 @@ int FFmpegEncoder::encode(Frame & frame, QString *errMsg)
         if (errMsg) *errMsg = e;
     }
 
-    Debug() << "encode " << frame.num << " took: " << (Util::getTime()-t0) << " ms";
     return retVal;
 }
 
@@ -913,3 +1387,98 @@ namespace { // Anonymous
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif
+
+
+// Below is to benchmark the lock-free Q against the mutex + std::deque queue it replaced.
+// Reports enqueue() latency percentiles with 1 producer, N busy converter threads, and 1 encoder thread.
+#if 0
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    /// the old Q, minus the parts that aren't on the hot path
+    struct LegacyQ {
+        std::deque<Frame> frames;
+        const int maxFrames;
+        QMutex mut;
+        explicit LegacyQ(int maxFrames) : maxFrames(maxFrames) {}
+        bool enqueue(const Frame & frame) {
+            QMutexLocker l(&mut);
+            if (int(frames.size()) >= maxFrames) return false;
+            frames.push_back(frame);
+            return true;
+        }
+        bool convertOne() {
+            QMutexLocker l(&mut);
+            for (auto & f : frames)
+                if (f.flag == 0) { f.flag = 2; return true; } // claim + "convert" + mark ready
+            return false;
+        }
+        bool encodeOne() {
+            QMutexLocker l(&mut);
+            if (frames.empty() || frames.front().flag != 2) return false;
+            frames.pop_front();
+            return true;
+        }
+    };
+
+    struct NewQAdapter {
+        Q q;
+        explicit NewQAdapter(int maxFrames) : q(maxFrames) {}
+        bool enqueue(const Frame & frame) { return q.enqueue(frame); }
+        bool convertOne() {
+            if (auto s = q.claimForConversion()) { q.markFrameReadyForEncode(s); return true; }
+            return false;
+        }
+        bool encodeOne() {
+            if (!q.peekReadyForEncode()) return false;
+            q.popFront();
+            return true;
+        }
+    };
+
+    template <typename Queue>
+    void benchQ(const char *name, int nConverters, int nFrames)
+    {
+        using Clock = std::chrono::steady_clock;
+        Queue q(int(Frame::DefaultFPS()));
+        std::atomic_bool done = false;
+        std::vector<std::thread> thrs;
+        for (int i = 0; i < nConverters; ++i)
+            thrs.emplace_back([&]{ while (!done) if (!q.convertOne()) std::this_thread::yield(); });
+        thrs.emplace_back([&]{ while (!done) if (!q.encodeOne()) std::this_thread::yield(); });
+
+        const QImage img(64, 64, QImage::Format_ARGB32);
+        std::vector<qint64> ns;
+        ns.reserve(size_t(nFrames));
+        int dropped = 0;
+        for (int i = 0; i < nFrames; ++i) {
+            const Frame f(img, quint64(i+1));
+            const auto t0 = Clock::now();
+            const bool ok = q.enqueue(f);
+            ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+            if (!ok) ++dropped;
+            std::this_thread::sleep_for(std::chrono::microseconds(20)); // roughly emulate a fast generator
+        }
+        done = true;
+        for (auto & t : thrs) t.join();
+
+        std::sort(ns.begin(), ns.end());
+        auto pct = [&ns](double p) { return ns[std::min(ns.size()-1, size_t(p * double(ns.size())))]; };
+        Log("%s: %d frames, %d converters, %d full -- enqueue ns p50: %lld p90: %lld p99: %lld p99.9: %lld max: %lld",
+            name, nFrames, nConverters, dropped, pct(0.5), pct(0.9), pct(0.99), pct(0.999), ns.back());
+    }
+}
+
+void BENCH_FrameQ()
+{
+    Log() << "Running BENCH_FrameQ";
+    const int nConv = int(qMax(1U, Util::getNVirtualProcessors()-2));
+    for (int i = 0; i < 2; ++i) { // 2 passes so the first one warms things up
+        benchQ<LegacyQ>("mutex+deque Q", nConv, 100000);
+        benchQ<NewQAdapter>("lock-free slot Q", nConv, 100000);
+    }
+}
+#endif
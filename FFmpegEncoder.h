@@ -16,16 +16,52 @@ class FFmpegEncoder : public QObject
 {
     Q_OBJECT
 public:
-    FFmpegEncoder(const QString & outFile, double fps, qint64 bitrate, int fmt, unsigned numFFmpegEncodingThreads);
+    /// What enqueue() does when the frame queue is full (i.e. encoding can't keep up with incoming frames).
+    enum QueuePolicy {
+        DropNewest = 0, ///< drop the frame being enqueued (default)
+        DropOldest, ///< drop the oldest frame not yet being worked on, in favour of the new one
+        BlockProducer ///< block the calling thread until there is room in the queue. Never drops frames.
+    };
+
+    struct QueueStats {
+        int depth = 0, ///< frames currently in the queue
+            capacity = 0, ///< max frames the queue can hold
+            highWater = 0, ///< deepest the queue has been since recording started
+            recentHighWater = 0; ///< deepest the queue has been since the previous call to queueStats()
+    };
+
+    /// The frame queue holds up to maxQueueSeconds worth of frames at fps, but never more than fit in queueMemBudget
+    /// bytes given frameBytes bytes per queued frame (source image + converted frame), and never fewer than 3.
+    /// A queueMemBudget or frameBytes of 0 means "unlimited" (and so the queue holds maxQueueSeconds of frames).
+    FFmpegEncoder(const QString & outFile, double fps, qint64 bitrate, int fmt, unsigned numFFmpegEncodingThreads,
+                  QueuePolicy queuePolicy = DropNewest, qint64 queueMemBudget = 0, qint64 frameBytes = 0);
     ~FFmpegEncoder() override; ///< stop encoding session if running and gracefully close output movie file. May take a while to complete (on the order of milliseconds to seconds).
 
     /// Call this from your data grabbing thread (or main thread) to enqueue a video frame.
-    /// Will kick off the rest of the pipeline in other threads behind the scenes.
+    /// Wakes up the rest of the pipeline in other threads behind the scenes.
     /// (Deleting this instance stops the encoding and writes trailers to the file).
-    bool enqueue(const Frame &, QString *errMsg = nullptr);
+    /// block: wait for room in the queue whatever the QueuePolicy, for frames that mustn't be dropped.
+    bool enqueue(const Frame &, QString *errMsg = nullptr, bool block = false);
+
+    QueueStats queueStats(); ///< Thread-safe. Note this resets QueueStats::recentHighWater.
+
+    /// Thread-safe. Frames handed to avcodec so far: one per wroteFrame(), including those the d'tor or close()
+    /// encode after signals have stopped being of interest.
+    quint64 framesWritten() const;
+
+    /// Encodes everything still queued and flushes the codec. Only call it once nothing more will be enqueued. The
+    /// d'tor does this if it hasn't been done; calling it first lets framesWritten() be read once it's all in.
+    void close();
 
     bool wroteHeader() const; ///< Returns true iff the header has been written to the output file (it's a sign things are going well!).
 
+    /// Split each frame's pixel format conversion into n horizontal bands which are converted in parallel, so that
+    /// per-frame conversion latency scales with core count (and not just throughput). n = 1 disables this.
+    /// n = 0 (the default) picks n automatically based on how many frames are waiting to be converted.
+    /// Only the built-in BGRA -> YUV 4:2:0 conversion is ever split (the output is identical either way); swscale
+    /// conversions always run whole.
+    void setConversionSlices(int n);
+
 signals:
     // Note: The below signals are auto-disconnected right before the cleanup/file trailer code runs in the d'tor
     // However they may still be received in a Queued connection after this instance has died.
@@ -52,11 +88,13 @@ private:
     double fps = 0.0;
     qint64 bitrate=0;
     int fmt=0,num_threads=0;
+    QueuePolicy queuePolicy = DropNewest;
+
+    static constexpr double maxQueueSeconds = 5.0;
 
-    void doConversion(); ///< Short-lived Conversion thread function -- these run in parallel and populate Frame.avframe. Runs once per Frame (but in parallel for all frames in queue).
-    void doConversionLater(); ///< Tell Conversion thread pool to fire up a thread if it has any idle threads waiting.
-    void doEncode(); ///< Encoder Thread's function.  Runs indefinitely until instance destruction. Only one of these is ever extant at once.
-    void doEncodeLater(); ///< This is called to fire up the initial Encoder thread and is a noop once the Encoder thread is running.
+    int conversionSlicesFor(int frameHeight) const; ///< number of bands to split the next frame's conversion into. Called by Conversion threads.
+    void doConversion(); ///< Conversion thread function -- num_threads of these run in parallel for the lifetime of this instance, sleeping until a frame is enqueued, and populate Frame.avframe.
+    void doEncode(); ///< Encoder Thread's function.  Runs until instance destruction, sleeping until a converted frame is ready. Only one of these is ever extant at once.
 };
 
 #endif // FFMPEGENCODER_H
@@ -0,0 +1,28 @@
+# Headless recording benchmark. Builds all of the app's sources (save for main.cpp) plus Bench.cpp into a console
+# program. See the comment at the top of Bench.cpp for usage.
+
+include(FG_Test_App.pro)
+
+TARGET = FG_Bench
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES -= main.cpp
+SOURCES += Bench.cpp
+
+# We share a build directory with FG_Test_App, so keep our intermediate files apart from its.
+OBJECTS_DIR = bench_build/obj
+MOC_DIR = bench_build/moc
+UI_DIR = bench_build/ui
+RCC_DIR = bench_build/rcc
+
+macx {
+    # Not an .app bundle, so don't copy the FFmpeg .dylibs into one -- just point the loader at them.
+    QMAKE_EXTRA_TARGETS -= cpy cpy2
+    POST_TARGETDEPS -= not_a_real_file
+    QMAKE_RPATHDIR += $$fflib.dir
+}
+
+win32 {
+    LIBS += psapi.lib
+}
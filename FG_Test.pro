@@ -1,7 +1,8 @@
 TEMPLATE = subdirs
-SUBDIRS += FG_Test_App QuaZip
+SUBDIRS += FG_Test_App FG_Bench QuaZip
 FG_Test_App.file = FG_Test_App.pro
 FG_Test_App.depends = QuaZip
+FG_Bench.file = FG_Bench.pro
+FG_Bench.depends = QuaZip
 QuaZip.subdir = QuaZip
 
-
@@ -38,7 +38,19 @@ SOURCES += \
     Frame.cpp \
     Recorder.cpp \
     FFmpegEncoder.cpp \
-    FrameGenerator.cpp
+    FrameGenerator.cpp \
+    RGB2YUV.cpp \
+    LatencyStats.cpp \
+    ZipWriter.cpp \
+    RawSequenceWriter.cpp \
+    RecordingReader.cpp \
+    ImageEncoder.cpp \
+    WriteBehindBuffer.cpp \
+    StripeSet.cpp \
+    PreTriggerBuffer.cpp \
+    TileCodec.cpp \
+    FrameMailbox.cpp \
+    BoxFilter.cpp
 
 HEADERS += \
     App.h \
@@ -56,7 +68,19 @@ HEADERS += \
     Frame.h \
     Recorder.h \
     FFmpegEncoder.h \
-    FrameGenerator.h
+    FrameGenerator.h \
+    RGB2YUV.h \
+    LatencyStats.h \
+    ZipWriter.h \
+    RawSequenceWriter.h \
+    RecordingReader.h \
+    ImageEncoder.h \
+    WriteBehindBuffer.h \
+    StripeSet.h \
+    PreTriggerBuffer.h \
+    TileCodec.h \
+    FrameMailbox.h \
+    BoxFilter.h
 
 FORMS += \
     MainWindow.ui \
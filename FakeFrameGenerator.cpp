@@ -1,31 +1,131 @@
 #include "FakeFrameGenerator.h"
 #include "Util.h"
+#include "RGB2YUV.h"
 #include <QTimer>
-#include <cstdlib>
 #include <QtGlobal>
 #include <chrono>
+#include <cstring>
+#include <vector>
+extern "C" {
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+}
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define FFG_SSE2 1
+#endif
+
+namespace {
+    constexpr int maxPooledBuffers = 8; ///< Paced mode: beyond this many outstanding frames, we just allocate
+
+    inline quint64 splitmix64(quint64 x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /// 8 independent xorshift32 generators per row, seeded from (seed, frame, row), so any row can be rendered on its own.
+    /// Pixel x comes from lane x % 8. The SSE2 and scalar paths produce identical output.
+    void noiseRow(quint32 *out, int w, quint32 seed, quint64 frame, int row)
+    {
+        alignas(16) quint32 lane[8];
+        quint64 s = splitmix64((quint64(seed) << 32) ^ splitmix64(frame) ^ quint64(row));
+        for (int i = 0; i < 8; i += 2) {
+            s = splitmix64(s);
+            lane[i] = quint32(s) | 1U; lane[i+1] = quint32(s >> 32) | 1U; // xorshift state must be nonzero
+        }
+        int x = 0;
+#ifdef FFG_SSE2
+        __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(lane)),
+                b = _mm_load_si128(reinterpret_cast<const __m128i *>(lane + 4));
+        const __m128i mask63 = _mm_set1_epi32(63), alpha = _mm_set1_epi32(int(0xff000000)),
+                      c16 = _mm_set1_epi32(16), c8 = _mm_set1_epi32(8);
+        auto step = [](__m128i v) {
+            v = _mm_xor_si128(v, _mm_slli_epi32(v, 13));
+            v = _mm_xor_si128(v, _mm_srli_epi32(v, 17));
+            return _mm_xor_si128(v, _mm_slli_epi32(v, 5));
+        };
+        auto pixels = [&](__m128i v) {
+            __m128i i = _mm_and_si128(_mm_srli_epi32(v, 8), mask63);
+            i = _mm_srli_epi32(_mm_add_epi32(_mm_slli_epi32(i, 1), i), 2); // *3/4 -> 0..47
+            const __m128i g = _mm_subs_epu16(i, c16), bl = _mm_subs_epu16(i, c8); // upper 16 bits are 0, so this saturates at 0 as we want
+            return _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(i, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), bl));
+        };
+        for (; x + 8 <= w; x += 8) {
+            a = step(a); b = step(b);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), pixels(a));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x + 4), pixels(b));
+        }
+        _mm_store_si128(reinterpret_cast<__m128i *>(lane), a);
+        _mm_store_si128(reinterpret_cast<__m128i *>(lane + 4), b);
+#endif
+        for (; x < w; x += 8) {
+            for (int i = 0; i < 8; ++i) {
+                quint32 v = lane[i];
+                v ^= v << 13; v ^= v >> 17; v ^= v << 5;
+                lane[i] = v;
+                if (x + i < w) {
+                    const int in = int(((v >> 8) & 63U) * 3U) >> 2;
+                    out[x + i] = qRgb(in, qMax(in-16, 0), qMax(in-8, 0));
+                }
+            }
+        }
+    }
+
+    /// Reduces one BGRA row to 8 bits: BT.601 luma (RGB2YUV's full range weights), or if bayer, the one channel an
+    /// RGGB sensor would have seen at each pixel.
+    void grayRow(const quint32 *in, uchar *out, int w, bool bayer, int row)
+    {
+        if (!bayer) {
+            for (int x = 0; x < w; ++x) {
+                const quint32 p = in[x];
+                out[x] = uchar((29U*(p & 0xffU) + 150U*((p >> 8) & 0xffU) + 77U*((p >> 16) & 0xffU) + 128U) >> 8);
+            }
+            return;
+        }
+        // even rows are R G R G ..., odd rows G B G B ...
+        const int shiftEven = row & 1 ? 8 : 16, shiftOdd = row & 1 ? 0 : 8;
+        for (int x = 0; x < w; ++x)
+            out[x] = uchar(in[x] >> (x & 1 ? shiftOdd : shiftEven));
+    }
 
-FakeFrameGenerator::FakeFrameGenerator(int w_in, int h_in, double fps, int nuniq)
-    : w(w_in), h(h_in)
+    /// Runs fn(y0, y1) over [0, h) in bands, in parallel on pool if not null. Blocks until done.
+    /// (render() is static and may be called from anywhere, so its StripRunner lives on the stack.)
+    template <typename Func>
+    void forRowBands(int h, QThreadPool *pool, const Func & fn)
+    {
+        if (!pool) { fn(0, h); return; }
+        StripRunner strips(*pool);
+        strips.run(h, strips.stripRows(h), [&fn](int, int y0, int y1) { fn(y0, y1); });
+    }
+}
+
+FakeFrameGenerator::FakeFrameGenerator(int w_in, int h_in, double fps, int nuniq, Mode mode, Pattern pattern, Output output,
+                                       quint32 seed_in)
+    : w(w_in), h(h_in), md(mode), pat(pattern), out(output), seed(seed_in)
 {
     thr.setObjectName("Fake Frame Generator");
     if (fps <= 0.0) fps = 1.0;
-    if (fps > 1000.0) fps = 1000.0;
+    if (fps > 100000.0) fps = 100000.0;
     if (w <= 0) w = 1;
     if (h <= 0) h = 1;
     if (nuniq <= 0) nuniq = 1;
 
-    frames.reserve(nuniq);
-
     reqfps = fps;
+    nUnique = nuniq;
+    buffers.reserve(qMax(maxPooledBuffers, maxInFlight));
+    renderPool.setMaxThreadCount(qMax(QThread::idealThreadCount(), 1));
+    Util::renameAllPoolThreads(renderPool, "Fake Frame Render");
 
     postLambdaSync([this] {
         // run in thread...
         t = new QTimer(this);
-        t->setSingleShot(false);
-        t->setInterval(std::chrono::milliseconds(int(1000.0/reqfps)));
+        t->setSingleShot(true); // re-armed by genFrame() according to mode
+        t->setTimerType(Qt::PreciseTimer);
         connect(t, SIGNAL(timeout()), this, SLOT(genFrame()));
-        t->start();
+        t0NS = Util::getTimeNS();
+        t->start(0);
     });
 }
 
@@ -34,59 +134,159 @@ FakeFrameGenerator::~FakeFrameGenerator()
     postLambdaSync([this]{
         delete t; t = nullptr;
     });
+    for (AVFrame *av : yuvFrames) av_frame_free(&av); // frames still out downstream keep their buffers alive
 }
 
-void FakeFrameGenerator::genFrame()
+int FakeFrameGenerator::freeBuffer()
 {
-    QImage img2Send;
-
-    if (frames.size() < frames.capacity()) {
-        QImage img(w, h, /*QImage::Format_RGB444*/QImage::Format_ARGB32);
-
-        for (int r = 0; r < h; ++r) {
-            if (img.format() == QImage::Format_RGB444) {
-
-                quint16 *line = reinterpret_cast<quint16 *>(img.scanLine(r));
-                for (int c = 0; c < w; ++c) {
-                    //                double r[3];
-                    //                for (int i = 0; i < 3; ++i)
-                    //                    r[i] = double(qrand())/double(RAND_MAX);
-                    //                line[c] = qRgb(int(r[0]*255.0), int(r[1]*255.0), int(r[2]*255.0));
-                    qint8 intensity = qint8((double(qrand())/double(RAND_MAX))*4.0);
-                    line[c] = quint16(
-                                  ( (qMax(intensity-1, 0) & 0xf) << 0) // blue
-                                | ( (qMax(intensity-2, 0) & 0xf) << 4) // green
-                                | ( ( intensity & 0xf )          << 8) // red
-                                );
-                                //| (0xf<<12) ); // unused
-                }
+    for (int i = 0; i < buffers.size(); ++i)
+        if (buffers[i].isDetached()) return i; // only we hold a reference: downstream code is done with it
+    if (buffers.size() < (md == FreeRunning ? maxInFlight : maxPooledBuffers)) {
+        buffers.push_back(newBuffer());
+        return buffers.size()-1;
+    }
+    return -1;
+}
 
-            } else if (img.format() == QImage::Format_ARGB32) {
+QImage FakeFrameGenerator::newBuffer() const
+{
+    // aligned so the encoder can use it without a copy
+    return Util::alignedImage(w, h, out == Gray8 || out == BayerRGGB8 ? QImage::Format_Grayscale8 : QImage::Format_ARGB32);
+}
 
-                QRgb *line = reinterpret_cast<QRgb *>(img.scanLine(r));
-                for (int c = 0; c < w; ++c) {
-                    //                double r[3];
-                    //                for (int i = 0; i < 3; ++i)
-                    //                    r[i] = double(qrand())/double(RAND_MAX);
-                    //                line[c] = qRgb(int(r[0]*255.0), int(r[1]*255.0), int(r[2]*255.0));
-                    int intensity = int((double(qrand())/double(RAND_MAX))*48.0);
-                    line[c] = qRgb(intensity, qMax(intensity-16, 0), qMax(intensity-8, 0));
-                }
+AVFrame *FakeFrameGenerator::yuvFrame()
+{
+    for (AVFrame *av : yuvFrames)
+        if (av_frame_is_writable(av)) return av_frame_clone(av); // only we hold a reference: downstream code is done with it
+    AVFrame *av = av_frame_alloc();
+    if (av) {
+        av->format = AV_PIX_FMT_YUV420P;
+        av->width = w;
+        av->height = h;
+        av->color_range = AVCOL_RANGE_MPEG;
+    }
+    if (!av || av_frame_get_buffer(av, 64) < 0) {
+        av_frame_free(&av);
+        return nullptr;
+    }
+    if (yuvFrames.size() >= (md == FreeRunning ? maxInFlight : maxPooledBuffers))
+        return av; // a one-off, like newBuffer()'s beyond the pool
+    yuvFrames.push_back(av);
+    return av_frame_clone(av);
+}
 
-            }
-        }
-        frames.push_back(img);
-        img2Send = img; // shallow copy
+void FakeFrameGenerator::renderOutput(QImage &img, quint64 num)
+{
+    if (img.depth() == 32) {
+        render(img, pat, num, seed, nUnique, &renderPool);
+        return;
+    }
+    if (scratch.isNull()) scratch = Util::alignedImage(w, h, QImage::Format_ARGB32);
+    render(scratch, pat, num, seed, nUnique, &renderPool);
+    const bool bayer = out == BayerRGGB8;
+    uchar *const bits = img.bits();
+    const qsizetype bpl = img.bytesPerLine();
+    forRowBands(h, &renderPool, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y)
+            grayRow(reinterpret_cast<const quint32 *>(scratch.constScanLine(y)), bits + qsizetype(y) * bpl, w, bayer, y);
+    });
+}
+
+void FakeFrameGenerator::genFrame()
+{
+    QImage img;
+    const quint64 num = frameNum + 1;
+    if (const int i = freeBuffer(); i > -1) {
+        renderOutput(buffers[i], num); // render in-place while it's still unshared...
+        img = buffers[i]; // ...then shallow-copy it out
+    } else if (md == FreeRunning) {
+        t->start(1); // downstream is still busy with all of our frames. try again shortly.
+        return;
     } else {
-        int which = 0;
-        do {
-            which = int(double(qrand())/double(RAND_MAX) * frames.size());
-            which = qMax(which, 0);
-            which = qMin(frames.size()-1, which);
-        } while (which == lastPick);
-        img2Send = frames[lastPick = which];
+        img = newBuffer();
+        renderOutput(img, num);
     }
 
-    emit generatedFrame(Frame(img2Send, ++frameNum));
+    Frame f(img, frameNum = num);
+    if (out == YUV420P) {
+        if (AVFrame *av = yuvFrame(); !av) {
+            Warning() << "FakeFrameGenerator: could not allocate a " << w << "x" << h << " YUV420P frame";
+        } else {
+            // in bands of whole row pairs, so that each band's chroma rows are its own
+            const int pairs = (h + 1) / 2;
+            forRowBands(pairs, &renderPool, [&](int p0, int p1) {
+                uint8_t *const dst[3] = { av->data[0] + qsizetype(p0) * 2 * av->linesize[0],
+                                          av->data[1] + qsizetype(p0) * av->linesize[1],
+                                          av->data[2] + qsizetype(p0) * av->linesize[2] };
+                RGB2YUV::bgraToYUV420(img.constScanLine(p0 * 2), int(img.bytesPerLine()), dst, av->linesize, w,
+                                      qMin(p1 * 2, h) - p0 * 2, false);
+            });
+            f.avframe = av;
+        }
+    }
+    f.tNS = Util::getTimeNS();
+    emit generatedFrame(f);
+
+    if (md == FreeRunning) {
+        t->start(0);
+        return;
+    }
+    // Paced: frame n is due at t0 + n/fps exactly. Rounding each delay up to the next ms costs < 1ms of jitter but
+    // never accumulates, unlike a fixed integer-ms interval.
+    const qint64 now = Util::getTimeNS();
+    qint64 due = t0NS + qint64(double(++nSinceT0) * 1e9 / reqfps);
+    if (now - due > 1000000000LL) {
+        // more than 1 sec behind (system too slow or was suspended) -- don't try to catch up, just start over from now
+        t0NS = due = now;
+        nSinceT0 = 0;
+    }
+    t->start(int(qMax((due - now + 999999LL) / 1000000LL, 0LL)));
 }
 
+/* static */
+void FakeFrameGenerator::render(QImage &img, Pattern pattern, quint64 frame, quint32 seed, int nUniqueFrames, QThreadPool *pool)
+{
+    const int w = img.width(), h = img.height();
+    if (img.isNull() || img.depth() != 32) return;
+    uchar *const bits = img.bits(); // detaches if shared, so do this here and not in the worker threads
+    const qsizetype bpl = img.bytesPerLine();
+    auto line = [&](int y) { return reinterpret_cast<quint32 *>(bits + qsizetype(y) * bpl); };
+    const quint64 phase = frame + (seed & 0xffffU);
+
+    switch (pattern) {
+    case Noise:
+        frame %= quint64(qMax(nUniqueFrames, 1));
+        forRowBands(h, pool, [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y) noiseRow(line(y), w, seed, frame, y);
+        });
+        break;
+    case Gradient: {
+        // red and blue only depend on x, so build that once and just OR in green (which depends on y) per row
+        std::vector<quint32> tmpl(size_t(qMax(w, 0)));
+        for (int x = 0; x < w; ++x)
+            tmpl[size_t(x)] = 0xff000000U | (quint32((quint64(x) + phase*2) & 0xff) << 16) | quint32(((quint64(x) >> 2) + phase) & 0xff);
+        forRowBands(h, pool, [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y) {
+                const quint32 g = quint32((quint64(y) + phase) & 0xff) << 8;
+                quint32 *out = line(y);
+                for (int x = 0; x < w; ++x) out[x] = tmpl[size_t(x)] | g;
+            }
+        });
+        break;
+    }
+    case MovingBars: {
+        // 75% SMPTE-ish colour bars: white, yellow, cyan, green, magenta, red, blue, black
+        static const quint32 colors[8] = { 0xffbfbfbf, 0xffbfbf00, 0xff00bfbf, 0xff00bf00, 0xffbf00bf, 0xffbf0000, 0xff0000bf, 0xff000000 };
+        const int barW = qMax(w / 8, 1), speed = qMax(w / 256, 1);
+        std::vector<quint32> tmpl(size_t(qMax(w, 0)));
+        for (int x = 0; x < w; ++x) {
+            const quint64 pos = quint64(x) + quint64(barW) * 8ULL * 1024ULL - (phase * quint64(speed)) % (quint64(barW) * 8ULL * 1024ULL);
+            tmpl[size_t(x)] = colors[(pos / quint64(barW)) % 8];
+        }
+        forRowBands(h, pool, [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y) std::memcpy(line(y), tmpl.data(), size_t(w) * sizeof(quint32));
+        });
+        break;
+    }
+    }
+}
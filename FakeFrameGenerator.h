@@ -2,22 +2,60 @@
 #define FAKEFRAMEGENERATOR_H
 
 #include <QImage>
+#include <QThreadPool>
 #include <QVector>
 #include "Frame.h"
 #include "FrameGenerator.h"
 
 class QTimer;
 
-/// Currently generates random static.  Used for testing.
+/// Generates test patterns (random static by default).  Used for testing.
+///
+/// All patterns are a pure function of (pattern, frame number, seed), so a given sequence is exactly reproducible
+/// no matter how fast or on how many threads it was generated. Frames are rendered in parallel horizontal bands into
+/// recycled buffers, so generation shouldn't ever be the bottleneck.
 class FakeFrameGenerator : public FrameGenerator
 {
     Q_OBJECT
 public:
+    enum Mode {
+        Paced = 0, ///< emit frames at fps, scheduled against a monotonic clock so that the average rate is exact (e.g. 29.97)
+        FreeRunning ///< ignore fps and emit frames as fast as downstream code is done with them (at most maxInFlight outstanding)
+    };
+
+    enum Pattern {
+        Noise = 0, ///< dim random static. Repeats every nUniqueFrames frames.
+        Gradient, ///< RGB gradient, scrolling
+        MovingBars ///< vertical colour bars, moving right
+    };
+
+    /// What the frames are delivered as. Everything but BGRA is there to exercise the paths a real camera's frames
+    /// would take (GLVideoWidget's plane layouts, encoders fed pre-converted frames).
+    enum Output {
+        BGRA = 0, ///< img is ARGB32
+        Gray8, ///< img is Grayscale8, the pattern's luma
+        BayerRGGB8, ///< img is Grayscale8, an RGGB Bayer mosaic of the pattern (see GLVideoWidget::setBayerPattern)
+        YUV420P ///< img is ARGB32, and avframe is the same picture as limited range YUV420P (made with RGB2YUV)
+    };
+
+    static constexpr int maxInFlight = 4; ///< FreeRunning mode: max frames emitted but not yet released by downstream code
+
     FakeFrameGenerator(int width = Frame::DefaultWidth(), int height = Frame::DefaultHeight(),
-                       double fps = Frame::DefaultFPS(), int nUniqueFrames = 16);
+                       double fps = Frame::DefaultFPS(), int nUniqueFrames = 16,
+                       Mode mode = Paced, Pattern pattern = Noise, Output output = BGRA, quint32 seed = 1);
     ~FakeFrameGenerator() override;
 
     double requestedFPS() const { return reqfps; }
+    QSize frameSize() const { return QSize(w, h); }
+    Mode mode() const { return md; }
+    Pattern pattern() const { return pat; }
+    Output output() const { return out; }
+
+    /// Renders frame frameNum of pattern into img, which must be a 32-bit (ARGB32 or RGB32) image. If pool is not
+    /// null, rows are rendered in parallel on it. The result depends only on the arguments (not on the pool), so this
+    /// can be used to regenerate (or verify) any frame of a sequence.
+    static void render(QImage &img, Pattern pattern, quint64 frameNum, quint32 seed, int nUniqueFrames = 16,
+                       QThreadPool *pool = nullptr);
 
    /* INHERITED signals:
     *     void generatedFrame(const Frame &);
@@ -29,10 +67,24 @@ private slots:
 private:
     int w, h;
     double reqfps;
+    int nUnique;
+    Mode md;
+    Pattern pat;
+    Output out;
+    quint32 seed;
     quint64 frameNum = 0ULL;
     QTimer *t = nullptr;
-    QVector<QImage> frames;
-    int lastPick = -999;
+    QVector<QImage> buffers; ///< recycled once nobody but us references them anymore
+    QVector<AVFrame *> yuvFrames; ///< YUV420P output: likewise, once av_frame_is_writable() says they're ours alone
+    QImage scratch; ///< Gray8 and BayerRGGB8 output: the pattern is rendered here first
+    QThreadPool renderPool;
+    qint64 t0NS = 0; ///< Paced mode: when the current schedule started
+    quint64 nSinceT0 = 0ULL; ///< Paced mode: frames emitted since t0NS
+
+    int freeBuffer(); ///< returns the index of a buffer we may render into, or -1 if none (and we may not allocate another)
+    QImage newBuffer() const; ///< an uninitialized image in the format out calls for
+    AVFrame *yuvFrame(); ///< a new reference to a YUV420P frame we may convert into (free with av_frame_free()), or nullptr
+    void renderOutput(QImage &img, quint64 num); ///< renders frame num into img (from newBuffer()), converting as out calls for
 };
 
 #endif // FAKEFRAMEGENERATOR_H
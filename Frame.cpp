@@ -19,6 +19,7 @@ Frame &Frame::operator=(const Frame &o)
     //qDebug("copy assign");
     img = o.img;
     num = o.num;
+    tNS = o.tNS;
     flag = int(o.flag);
     destroyAVFrame();
     if (o.avframe)
@@ -33,6 +34,7 @@ Frame::operator=(Frame &&o)
     if (this != &o) {
         img = std::move(o.img);
         num = o.num;
+        tNS = o.tNS;
         flag = int(o.flag);
         destroyAVFrame();
         avframe = o.avframe;
@@ -46,6 +48,7 @@ void Frame::destruct()
 {
     img = QImage();
     num = 0;
+    tNS = 0;
     flag = 0;
     destroyAVFrame();
 }
@@ -12,6 +12,7 @@ struct Frame
 {
     QImage img;
     quint64 num = 0ULL;
+    qint64 tNS = 0; ///< Util::getTimeNS() when the frame was captured, or 0 if unknown
     AVFrame *avframe = nullptr; ///< may be null. if non-nullptr, contains referenced AVFrame, suitable for passing to avcodec_send_frame(). (be sure to set avframe->pts before using). Will be freed in d'tor with av_frame_free
     std::atomic<int> flag = 0; ///< flag for internal processing use
 
@@ -0,0 +1,19 @@
+#include "FrameMailbox.h"
+#include <memory>
+
+FrameMailbox::~FrameMailbox()
+{
+    delete slot.exchange(nullptr);
+}
+
+bool FrameMailbox::post(const Frame & f)
+{
+    const std::unique_ptr<Frame> old(slot.exchange(new Frame(f))); // freed here, on the producer's thread
+    return !old;
+}
+
+Frame FrameMailbox::take()
+{
+    std::unique_ptr<Frame> f(slot.exchange(nullptr));
+    return f ? std::move(*f) : Frame();
+}
@@ -0,0 +1,32 @@
+#ifndef FRAMEMAILBOX_H
+#define FRAMEMAILBOX_H
+
+#include "Frame.h"
+#include <atomic>
+
+/// Single-slot, latest-wins hand-off of Frames from a producer thread to a consumer that only wants the newest one
+/// (e.g. the display, which can't show more than 1 frame per screen refresh anyway).
+///
+/// post() swaps the frame in with 1 atomic exchange, and lets go of whatever frame the consumer didn't get to in time.
+/// It returns true only when the box was empty, so the producer wakes the consumer once per frame the consumer
+/// actually takes, not once per frame posted: while the consumer isn't taking (busy, or not showing anything), the
+/// frames just coalesce and nothing is queued anywhere.
+class FrameMailbox
+{
+public:
+    FrameMailbox() = default;
+    ~FrameMailbox();
+
+    /// Thread-safe. Replaces whatever frame is in the box. Returns true if it was empty (the consumer may need waking).
+    bool post(const Frame &);
+    /// Thread-safe. Takes the newest frame out. Returns a null Frame if there's none.
+    Frame take();
+
+private:
+    FrameMailbox(const FrameMailbox &) = delete;
+    FrameMailbox & operator=(const FrameMailbox &) = delete;
+
+    std::atomic<Frame *> slot = nullptr;
+};
+
+#endif // FRAMEMAILBOX_H
@@ -1,136 +1,592 @@
 #include "GLVideoWidget.h"
+#include "BoxFilter.h"
 #include <QPainter>
 #include <QOpenGLPaintDevice>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLTexture>
 #include <QOpenGLFunctions>
-#include <QOpenGLPixelTransferOptions>
 #include <QOpenGLExtraFunctions>
+#include <QOpenGLVertexArrayObject>
+#include <QTimer>
+#include <QMouseEvent>
+#include <QWheelEvent>
+extern "C" {
+#include "libavutil/frame.h"
+#include "libavutil/pixfmt.h"
+}
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 
 #define GLFUNCS   (QOpenGLContext::currentContext()->functions())
 #define GLFUNCS_X (QOpenGLContext::currentContext()->extraFunctions())
 
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+namespace {
+    //TODO: auto-detect these...
+    constexpr GLint TEX_STORAGE = GL_RGB8;
+    constexpr GLenum PIX_FORMAT = GL_BGRA;
+
+    GLenum pixPack(int bpp)
+    {
+        return bpp >= 24 ? GL_UNSIGNED_INT_8_8_8_8_REV
+                         : bpp == 16 ? GL_UNSIGNED_SHORT_4_4_4_4_REV
+                                     : GL_UNSIGNED_BYTE_2_3_3_REV;
+    }
+
+    /// texture coords of red within the 2x2 CFA tile, by GLVideoWidget::Bayer
+    constexpr float BayerRed[][2] = { {0.f, 0.f}, {0.f, 0.f}, {1.f, 0.f}, {0.f, 1.f}, {1.f, 1.f} };
+
+    const char *const VertexShader =
+        "#version 330 core\n"
+        "uniform vec2 uvOffset, uvScale; // the visible part of the frame, in tex0's normalized coords\n"
+        "out vec2 uv;\n"
+        "\n"
+        "void main()\n"
+        "{\n"
+        "    // 1 triangle that covers the viewport: (-1,-1) (3,-1) (-1,3). No vertex data needed.\n"
+        "    vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));\n"
+        "    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+        "    uv = uvOffset + vec2(p.x, 1.0 - p.y) * uvScale; // row 0 (the top of the image) at the top\n"
+        "}\n";
+
+    const char *const FragmentShader =
+        "#version 330 core\n"
+        "uniform sampler2D tex0, tex1, tex2;\n"
+        "uniform int mode; // Layout\n"
+        "uniform bool fullRange;\n"
+        "uniform vec2 bayerRed; // where red is in the 2x2 CFA tile\n"
+        "in vec2 uv;\n"
+        "out vec4 fragColor;\n"
+        "\n"
+        "// BT.601, the inverse of RGB2YUV\n"
+        "vec3 yuv2rgb(float y, float u, float v)\n"
+        "{\n"
+        "    u -= 0.5; v -= 0.5;\n"
+        "    if (!fullRange) {\n"
+        "        y = (y - 16.0/255.0) * (255.0/219.0);\n"
+        "        u *= 255.0/224.0; v *= 255.0/224.0;\n"
+        "    }\n"
+        "    return vec3(y + 1.402*v, y - 0.344136*u - 0.714136*v, y + 1.772*u);\n"
+        "}\n"
+        "\n"
+        "float cfa(ivec2 p, int dx, int dy)\n"
+        "{\n"
+        "    return texelFetch(tex0, clamp(p + ivec2(dx, dy), ivec2(0), textureSize(tex0, 0) - 1), 0).r;\n"
+        "}\n"
+        "\n"
+        "// bilinear demosaic\n"
+        "vec3 demosaic()\n"
+        "{\n"
+        "    ivec2 p = ivec2(floor(uv * vec2(textureSize(tex0, 0))));\n"
+        "    vec2 site = mod(vec2(p) + bayerRed, 2.0);\n"
+        "    float c = cfa(p, 0, 0);\n"
+        "    float h = (cfa(p, -1, 0) + cfa(p, 1, 0)) * 0.5;\n"
+        "    float v = (cfa(p, 0, -1) + cfa(p, 0, 1)) * 0.5;\n"
+        "    float x = (cfa(p, -1, -1) + cfa(p, 1, -1) + cfa(p, -1, 1) + cfa(p, 1, 1)) * 0.25;\n"
+        "    float hv = (h + v) * 0.5;\n"
+        "    if (site.y < 0.5) return site.x < 0.5 ? vec3(c, hv, x) : vec3(h, c, v); // red row: R G\n"
+        "    return site.x < 0.5 ? vec3(v, c, h) : vec3(x, hv, c); // blue row: G B\n"
+        "}\n"
+        "\n"
+        "void main()\n"
+        "{\n"
+        "    vec3 rgb;\n"
+        "    if (mode == 1) // chroma planes are half size, but normalized coords are the same\n"
+        "        rgb = yuv2rgb(texture(tex0, uv).r, texture(tex1, uv).r, texture(tex2, uv).r);\n"
+        "    else if (mode == 2) {\n"
+        "        vec2 c = texture(tex1, uv).rg;\n"
+        "        rgb = yuv2rgb(texture(tex0, uv).r, c.x, c.y);\n"
+        "    } else if (mode == 3)\n"
+        "        rgb = vec3(texture(tex0, uv).r);\n"
+        "    else if (mode == 4)\n"
+        "        rgb = demosaic();\n"
+        "    else\n"
+        "        rgb = texture(tex0, uv).rgb;\n"
+        "    fragColor = vec4(rgb, 1.0);\n"
+        "}\n";
+
+    using BufferStorageFn = void (QOPENGLF_APIENTRYP)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+    constexpr GLbitfield PersistentFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+}
+
 GLVideoWidget::GLVideoWidget(QWidget *parent)
     : QOpenGLWidget(parent), ps(this)
 {
+    QSurfaceFormat fmt = format();
+    fmt.setVersion(3, 3);
+    fmt.setProfile(QSurfaceFormat::CoreProfile);
+    setFormat(fmt);
     connect(&ps, SIGNAL(perSec(double)), this, SIGNAL(fps(double)));
+    // swapBuffers() blocks until vsync (swap interval 1, the default), so this paces pull() to the refresh rate
+    connect(this, &QOpenGLWidget::frameSwapped, this, [this]{
+        awaitingSwap = false;
+        pull();
+    });
+    // leaves at least 1 PBO for the GL to be reading from while the others are filled
+    copyPool.setMaxThreadCount(NPBOS - 1);
 }
 
 GLVideoWidget::~GLVideoWidget()
 {
+    copyPool.waitForDone(); // copies write into mapped PBOs
     makeCurrent();
+    for (Pbo & b : pbos) destroyPbo(b);
     delete pd; pd = nullptr;
-    delete tex; tex = nullptr;
-    if (pbos[0]) GLFUNCS_X->glDeleteBuffers(NPBOS, pbos);
+    for (auto & t : tex) { delete t; t = nullptr; }
+    delete vao; vao = nullptr;
     doneCurrent();
 }
 
+qint64 GLVideoWidget::Planes::bytes() const
+{
+    qint64 ret = 0;
+    for (int k = 0; k < n; ++k) ret += p[k].bytes();
+    return ret;
+}
+
+bool GLVideoWidget::planesOf(const Frame & f, Planes & out) const
+{
+    out = Planes();
+    const auto plane = [&out](const uchar *bits, int stride, int w, int h, int texelBytes, GLint internalFmt, GLenum fmt, GLenum type) {
+        Plane & p = out.p[out.n++];
+        p.bits = bits; p.stride = stride; p.w = w; p.h = h; p.texelBytes = texelBytes;
+        p.internalFmt = internalFmt; p.fmt = fmt; p.type = type;
+    };
+    if (const AVFrame *av = f.avframe; av && av->linesize[0] > 0) {
+        const int w = av->width, h = av->height, cw = (w + 1) / 2, ch = (h + 1) / 2;
+        const auto bayer8 = [&](Bayer b) { out.layout = BayerMosaic; out.bayer = b; plane(av->data[0], av->linesize[0], w, h, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE); };
+        const auto bayer16 = [&](Bayer b) { out.layout = BayerMosaic; out.bayer = b; plane(av->data[0], av->linesize[0], w, h, 2, GL_R16, GL_RED, GL_UNSIGNED_SHORT); };
+        switch (av->format) {
+        case AV_PIX_FMT_YUVJ420P:
+            out.fullRange = true;
+            Q_FALLTHROUGH();
+        case AV_PIX_FMT_YUV420P:
+            if (av->linesize[1] <= 0 || av->linesize[2] <= 0) break;
+            out.layout = YUV420P;
+            out.fullRange = out.fullRange || av->color_range == AVCOL_RANGE_JPEG;
+            plane(av->data[0], av->linesize[0], w, h, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+            plane(av->data[1], av->linesize[1], cw, ch, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+            plane(av->data[2], av->linesize[2], cw, ch, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+            out.p[1].sub = out.p[2].sub = 1;
+            return true;
+        case AV_PIX_FMT_NV12:
+            if (av->linesize[1] <= 0) break;
+            out.layout = NV12;
+            out.fullRange = av->color_range == AVCOL_RANGE_JPEG;
+            plane(av->data[0], av->linesize[0], w, h, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+            plane(av->data[1], av->linesize[1], cw, ch, 2, GL_RG8, GL_RG, GL_UNSIGNED_BYTE);
+            out.p[1].sub = 1;
+            return true;
+        case AV_PIX_FMT_GRAY8:
+            out.layout = Mono;
+            plane(av->data[0], av->linesize[0], w, h, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+            return true;
+        case AV_PIX_FMT_GRAY16:
+            out.layout = Mono;
+            plane(av->data[0], av->linesize[0], w, h, 2, GL_R16, GL_RED, GL_UNSIGNED_SHORT);
+            return true;
+        case AV_PIX_FMT_BAYER_RGGB8: bayer8(RGGB); return true;
+        case AV_PIX_FMT_BAYER_GRBG8: bayer8(GRBG); return true;
+        case AV_PIX_FMT_BAYER_GBRG8: bayer8(GBRG); return true;
+        case AV_PIX_FMT_BAYER_BGGR8: bayer8(BGGR); return true;
+        case AV_PIX_FMT_BAYER_RGGB16: bayer16(RGGB); return true;
+        case AV_PIX_FMT_BAYER_GRBG16: bayer16(GRBG); return true;
+        case AV_PIX_FMT_BAYER_GBRG16: bayer16(GBRG); return true;
+        case AV_PIX_FMT_BAYER_BGGR16: bayer16(BGGR); return true;
+        default: break;
+        }
+        out = Planes(); // not something we can show directly: fall back to img, if there is one
+    }
+    const QImage & img = f.img;
+    if (img.isNull()) return false;
+    const int w = img.width(), h = img.height(), bpl = int(img.bytesPerLine());
+    const bool gray8 = img.format() == QImage::Format_Grayscale8;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+    const bool gray16 = img.format() == QImage::Format_Grayscale16;
+#else
+    const bool gray16 = false;
+#endif
+    if (gray8 || gray16) {
+        out.layout = bayer != NoBayer ? BayerMosaic : Mono;
+        out.bayer = bayer;
+        if (gray8) plane(img.constBits(), bpl, w, h, 1, GL_R8, GL_RED, GL_UNSIGNED_BYTE);
+        else plane(img.constBits(), bpl, w, h, 2, GL_R16, GL_RED, GL_UNSIGNED_SHORT);
+        return true;
+    }
+    const int bpp = img.depth();
+    plane(img.constBits(), bpl, w, h, qMax(bpp / 8, 1), TEX_STORAGE, PIX_FORMAT, pixPack(bpp));
+    return true;
+}
+
+int GLVideoWidget::fitView(Planes & pl, bool scalable) const
+{
+    const QRect all(0, 0, pl.p[0].w, pl.p[0].h);
+    pl.rect = all;
+    if (QRect crop = visibleRect().toAlignedRect() & all; crop != all && !crop.isEmpty()) {
+        // even offsets keep chroma planes and Bayer tiles in step with the crop
+        crop.setLeft(crop.left() & ~1);
+        crop.setTop(crop.top() & ~1);
+        pl.rect = crop;
+        for (int k = 0; k < pl.n; ++k) {
+            Plane & p = pl.p[k];
+            const int round = (1 << p.sub) - 1,
+                      x0 = crop.left() >> p.sub, x1 = qMin(p.w, (crop.left() + crop.width() + round) >> p.sub),
+                      y0 = crop.top() >> p.sub, y1 = qMin(p.h, (crop.top() + crop.height() + round) >> p.sub);
+            p.bits += qint64(y0) * p.stride + qint64(x0) * p.texelBytes;
+            p.w = x1 - x0;
+            p.h = y1 - y0;
+        }
+    }
+    if (!scalable || pl.layout == BayerMosaic || pixWidth < 1 || pixHeight < 1) return 1;
+    int factor = qMin(pl.p[0].w / pixWidth, pl.p[0].h / pixHeight);
+    for (int k = 0; k < pl.n; ++k) {
+        const Plane & p = pl.p[k];
+        if (p.type != GL_UNSIGNED_BYTE && p.type != GL_UNSIGNED_INT_8_8_8_8_REV) return 1; // BoxFilter does 8-bit channels only
+        factor = qMin(factor, qMin(p.w, p.h)); // no plane may end up empty
+    }
+    return qBound(1, factor, BoxFilter::MaxFactor);
+}
+
+/* static */
+GLVideoWidget::Planes GLVideoWidget::downscaled(const Planes & src, int factor)
+{
+    Planes ret = src;
+    for (int k = 0; k < ret.n; ++k) {
+        Plane & p = ret.p[k];
+        p.w /= factor;
+        p.h /= factor;
+        p.stride = p.w * p.texelBytes;
+        p.bits = nullptr;
+    }
+    ret.rect.setSize(QSize(ret.p[0].w, ret.p[0].h) * factor); // the last few rows/columns may have been dropped
+    return ret;
+}
+
+QRectF GLVideoWidget::visibleRect() const
+{
+    const QRectF all(QPointF(), QSizeF(frameSize));
+    if (zm <= 1.0 || frameSize.isEmpty()) return all;
+    QRectF r(QPointF(), all.size() / zm);
+    r.moveCenter(zoomCenter.isNull() ? all.center() : zoomCenter);
+    r.moveLeft(qBound(0.0, r.left(), all.width() - r.width()));
+    r.moveTop(qBound(0.0, r.top(), all.height() - r.height()));
+    return r;
+}
+
+void GLVideoWidget::setZoom(double zoom, QPointF center)
+{
+    zm = qBound(1.0, zoom, 64.0);
+    if (!center.isNull()) zoomCenter = center;
+    // don't let the center wander off past the edges, or panning back would seem stuck for a while
+    zoomCenter = zm > 1.0 && !frameSize.isEmpty() ? visibleRect().center() : QPointF();
+    update(); // pans/zooms what's on screen now; the next frame is cropped to match
+}
+
+void GLVideoWidget::wheelEvent(QWheelEvent *e)
+{
+    if (frameSize.isEmpty() || width() < 1 || height() < 1) { QOpenGLWidget::wheelEvent(e); return; }
+    // keep the frame pixel under the cursor where it is
+    const QRectF vis = visibleRect();
+    const QPointF rel(e->posF().x() / width(), e->posF().y() / height()),
+                  at = vis.topLeft() + QPointF(rel.x() * vis.width(), rel.y() * vis.height());
+    const double newZoom = qBound(1.0, zm * std::pow(1.25, e->angleDelta().y() / 120.0), 64.0);
+    const QSizeF newSize = QSizeF(frameSize) / newZoom;
+    setZoom(newZoom, at - QPointF(rel.x() * newSize.width(), rel.y() * newSize.height())
+                     + QPointF(newSize.width(), newSize.height()) / 2.0);
+    e->accept();
+}
+
+void GLVideoWidget::mousePressEvent(QMouseEvent *e)
+{
+    dragLast = e->pos();
+    QOpenGLWidget::mousePressEvent(e);
+}
+
+void GLVideoWidget::mouseMoveEvent(QMouseEvent *e)
+{
+    if (!(e->buttons() & Qt::LeftButton) || zm <= 1.0 || width() < 1 || height() < 1) { QOpenGLWidget::mouseMoveEvent(e); return; }
+    const QPoint d = e->pos() - dragLast;
+    dragLast = e->pos();
+    const QRectF vis = visibleRect();
+    setZoom(zm, vis.center() - QPointF(d.x() * vis.width() / width(), d.y() * vis.height() / height()));
+}
+
+void GLVideoWidget::mouseDoubleClickEvent(QMouseEvent *e)
+{
+    setZoom(1.0);
+    QOpenGLWidget::mouseDoubleClickEvent(e);
+}
+
+void GLVideoWidget::postFrame(const Frame & f)
+{
+    // only the post that fills an empty box wakes us: the rest coalesce until pull() takes what's there
+    if (mailbox.post(f))
+        QMetaObject::invokeMethod(this, [this]{ pull(); }, Qt::QueuedConnection);
+}
+
+void GLVideoWidget::pull()
+{
+    // if we're not ready, the frame stays in the box and nothing posts more wakeups: frameSwapped() or showEvent()
+    // will call us again
+    if (awaitingSwap || !isVisible() || window()->isMinimized()) return;
+    if (const Frame f = mailbox.take(); !f.isNull() || f.avframe) {
+        awaitingSwap = true;
+        updateFrame(f);
+    }
+}
+
+void GLVideoWidget::showEvent(QShowEvent *e)
+{
+    QOpenGLWidget::showEvent(e);
+    awaitingSwap = false; // whatever we were waiting on may never have been painted while hidden
+    QMetaObject::invokeMethod(this, [this]{ pull(); }, Qt::QueuedConnection);
+}
+
 void GLVideoWidget::updateFrame(const Frame & inframe)
 {
-    frame = inframe;
-    if (tex && prog && !frame.isNull()) {
-        //TODO: auto-detect these...
-        constexpr int TEX_STORAGE = GL_RGB, PIX_FORMAT = GL_BGRA;
-        const int bpp = frame.img.depth();
-        const int PIX_PACK = bpp >= 24 ? GL_UNSIGNED_INT_8_8_8_8_REV
-                                         : bpp == 16 ? GL_UNSIGNED_SHORT_4_4_4_4_REV
-                                                     : GL_UNSIGNED_BYTE_2_3_3_REV;
-        //const auto t0 = Util::getTime(); Q_UNUSED(t0);
+    Planes pl;
+    if (tex[0] && prog && planesOf(inframe, pl)) {
         makeCurrent();
-        if (!tex->isCreated()) tex->create();
-        glBindTexture(GL_TEXTURE_RECTANGLE, tex->textureId());
-        glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        index = (index + 1) % NPBOS;
-        const int nextIndex = (index + 1) % NPBOS;
-        if (pbos[index] && pbos[nextIndex]) {
-            // use PBOs to upload texture data asynchronously...
-            if (const Frame & fi = pboFrames[index]; !fi.isNull()) {
-                // set the "current texture" to be the PBO we just wrote to in the last iteration --
-                // this means we have a 1-frame delay but it's preferable for the performance benefit we get.
-                // note the frame image data is kept persistent (in the pboFrames array) for a short time.
-
-                GLFUNCS_X->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[index]);
-                glTexImage2D(GL_TEXTURE_RECTANGLE, 0, TEX_STORAGE, fi.img.width(), fi.img.height(), 0, PIX_FORMAT, PIX_PACK, nullptr);
-                tex->setSize(fi.img.width(), fi.img.height());
-                glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-            }
-            const Frame & fn = (pboFrames[nextIndex] = frame);
-            // bind PBO to update texture source for next frame (next frame will use THIS frame data. because we are 1 frame behind with PBOs enabled).
-            GLFUNCS_X->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[nextIndex]);
-            // copy data to GPU memory -- this happens asynchronously and the requirement is that the img stays
-            // around until it's done which is why we keep the frames around in the pboFrames[] array.
-            GLFUNCS_X->glBufferData(GL_PIXEL_UNPACK_BUFFER, fn.img.sizeInBytes(), fn.img.constBits(), GL_STREAM_DRAW);
-            GLFUNCS_X->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (usePbos) {
+            pending = inframe; // any older frame still waiting for a PBO is dropped
+            submitPending();
         } else {
-            glTexImage2D(GL_TEXTURE_RECTANGLE, 0, TEX_STORAGE, frame.img.width(), frame.img.height(), 0, PIX_FORMAT, PIX_PACK, frame.img.constBits());
-            tex->setSize(frame.img.width(), frame.img.height());
-            glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+            // cropping is free here (GL_UNPACK_ROW_LENGTH), but downscaling needs the copy thread
+            frameSize = QSize(pl.p[0].w, pl.p[0].h);
+            fitView(pl, false);
+            uploadTex(pl, false);
+            texFrameNum = inframe.num;
+            update();
         }
         doneCurrent();
-        //qDebug("setData took %lld msec",Util::getTime()-t0);
+    } else {
+        frame = inframe; // the QPainter fallback draws from this
+        if (frame.isNull()) texSize = QSize();
+        update();
+    }
+}
+
+void GLVideoWidget::submitPending()
+{
+    Planes src;
+    if (!planesOf(pending, src)) return;
+    frameSize = QSize(src.p[0].w, src.p[0].h);
+    const int factor = fitView(src, downscale);
+    const Planes up = downscaled(src, factor);
+    const int i = acquirePbo(up.bytes());
+    if (i < 0) {
+        if (!usePbos) {
+            // mapping failed and the ring turned itself off: upload the slow way from now on
+            uploadTex(src, false);
+            texFrameNum = pending.num;
+            pending = Frame();
+            update();
+        } else if (!retryPending && std::none_of(std::begin(pbos), std::end(pbos), [](const Pbo & b){ return b.filling; })) {
+            // all waiting on the GL, and no copy will finish and call us again: poll
+            retryPending = true;
+            QTimer::singleShot(1, this, [this]{
+                retryPending = false;
+                makeCurrent();
+                submitPending();
+                doneCurrent();
+            });
+        }
+        return;
+    }
+    pbos[i].filling = true;
+    // the copy (or box filter) into the PBO happens on copyPool; the GUI thread only touches the GL. f keeps src's
+    // pointers valid.
+    copyPool.start(new LambdaRunnable([this, i, f = pending, src, up, factor, dst = pbos[i].ptr, seq = ++nSubmitted] {
+        qint64 off = 0;
+        for (int k = 0; k < up.n; off += up.p[k++].bytes()) {
+            const Plane & s = src.p[k], & u = up.p[k];
+            if (factor == 1 && s.stride == u.stride)
+                std::memcpy(dst + off, s.bits, size_t(u.bytes()));
+            else
+                BoxFilter::downscale(s.bits, s.stride, s.w, s.h, s.texelBytes, factor, dst + off, u.stride);
+        }
+        QMetaObject::invokeMethod(this, [this, i, up, num = f.num, seq] {
+            uploadFromPbo(i, up, num, seq);
+        }, Qt::QueuedConnection);
+    }));
+    pending = Frame();
+}
+
+int GLVideoWidget::acquirePbo(qint64 bytes)
+{
+    auto *f = GLFUNCS_X;
+    for (int n = 0; n < NPBOS; ++n) {
+        const int i = (index + n) % NPBOS;
+        Pbo & b = pbos[i];
+        if (b.filling) continue;
+        if (b.fence) {
+            if (f->glClientWaitSync(b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+                continue; // the GL is still reading from it
+            f->glDeleteSync(b.fence);
+            b.fence = nullptr;
+        }
+        if (persistent) {
+            if (b.capacity < bytes) {
+                // storage is immutable, so growing it means a new buffer
+                destroyPbo(b);
+                f->glGenBuffers(1, &b.id);
+                f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.id);
+                reinterpret_cast<BufferStorageFn>(bufferStorage)(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(bytes), nullptr, PersistentFlags);
+                b.ptr = static_cast<uchar *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(bytes), PersistentFlags));
+                b.capacity = b.ptr ? bytes : 0;
+                f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            }
+        } else {
+            // orphan the old storage so mapping needn't wait for an upload that may still be reading it
+            f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.id);
+            f->glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(bytes), nullptr, GL_STREAM_DRAW);
+            b.capacity = bytes;
+            b.ptr = static_cast<uchar *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(bytes),
+                                                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+            f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        if (!b.ptr) {
+            Warning() << "Failed to map a " << bytes << " byte PBO -- PBOs disabled.";
+            usePbos = false;
+            return -1;
+        }
+        index = (i + 1) % NPBOS;
+        return i;
+    }
+    return -1;
+}
+
+void GLVideoWidget::uploadFromPbo(int i, const Planes & pl, quint64 num, quint64 seq)
+{
+    makeCurrent();
+    auto *f = GLFUNCS_X;
+    Pbo & b = pbos[i];
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.id);
+    if (!persistent) {
+        f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        b.ptr = nullptr;
+    }
+    if (seq > lastUploaded) { // copies may finish out of order: never go back to an older frame
+        lastUploaded = seq;
+        uploadTex(pl, true);
+        b.fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        texFrameNum = num;
+        update();
+    }
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    b.filling = false;
+    submitPending();
+    doneCurrent();
+}
+
+void GLVideoWidget::uploadTex(const Planes & pl, bool fromPbo)
+{
+    // rows are uploaded exactly stride bytes apart, whatever the alignment
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // the demosaic reads exact texels; everything else is interpolated
+    const GLint filter = pl.layout == BayerMosaic ? GL_NEAREST : GL_LINEAR;
+    const bool refilter = pl.layout != shown.layout;
+    qint64 off = 0;
+    for (int k = 0; k < pl.n; off += pl.p[k++].bytes()) {
+        const Plane & p = pl.p[k];
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, p.stride / p.texelBytes);
+        const void *data = fromPbo ? reinterpret_cast<const void *>(quintptr(off)) : p.bits;
+        if (texSizes[k] != QSize(p.w, p.h) || texFmts[k] != p.internalFmt) {
+            // immutable storage can't be respecified, so a new size or format means a new texture. Only then.
+            tex[k]->destroy();
+            tex[k]->create();
+            glBindTexture(GL_TEXTURE_2D, tex[k]->textureId());
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+            if (haveTexStorage) {
+                GLFUNCS_X->glTexStorage2D(GL_TEXTURE_2D, 1, GLenum(p.internalFmt), p.w, p.h);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p.w, p.h, p.fmt, p.type, data);
+            } else
+                glTexImage2D(GL_TEXTURE_2D, 0, p.internalFmt, p.w, p.h, 0, p.fmt, p.type, data);
+            tex[k]->setSize(p.w, p.h);
+            texSizes[k] = QSize(p.w, p.h);
+            texFmts[k] = p.internalFmt;
+        } else {
+            glBindTexture(GL_TEXTURE_2D, tex[k]->textureId());
+            if (refilter) {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, p.w, p.h, p.fmt, p.type, data);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    shown = pl;
+    texSize = texSizes[0];
+}
+
+void GLVideoWidget::destroyPbo(Pbo & b)
+{
+    auto *f = GLFUNCS_X;
+    if (b.fence) f->glDeleteSync(b.fence);
+    if (b.ptr) {
+        f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.id);
+        f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     }
-    update();
+    if (b.id) f->glDeleteBuffers(1, &b.id);
+    b = Pbo();
 }
 
 void GLVideoWidget::initializeGL()
 {
-    QOpenGLVersionProfile profile(format());
-    auto [maj, min] = profile.version();
-    Log("Using OpenGL Version %d.%d",maj,min);
+    auto *ctx = QOpenGLContext::currentContext();
+    const auto ver = ctx->format().version();
+    Log("Using OpenGL Version %d.%d", ver.first, ver.second);
+    if (ver < qMakePair(3, 3) || ctx->isOpenGLES()) {
+        // the QPainter fallback in paintGL() will have to do
+        Warning() << "OpenGL 3.3 core profile unavailable -- video display will be slow.";
+        return;
+    }
 
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_BLEND);
-    glDisable( GL_ALPHA_TEST );
-    glDisable( GL_SCISSOR_TEST );
-    glDisable( GL_LIGHT0 );
-    glDisable( GL_STENCIL_TEST );
-    glDisable( GL_DITHER );
-    glEnable(GL_TEXTURE_RECTANGLE);
-    glShadeModel( GL_FLAT );
-    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
-    GLFUNCS_X->glGenBuffers(NPBOS, pbos);
-    if (!pbos[0])
-        Warning() << "glGenBuffers failed -- PBOs unavailable.";
-    tex = new QOpenGLTexture(QOpenGLTexture::TargetRectangle);
-}
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_DITHER);
 
-void GLVideoWidget::resizeGL(int w, int h)
-{
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    const qreal retinaScale = devicePixelRatio();
-    pixWidth = GLsizei(w * retinaScale); pixHeight = GLsizei(h * retinaScale);
-    glViewport(0, 0, pixWidth, pixHeight);
-    glOrtho( 0., GLdouble(pixWidth), 0, GLdouble(pixHeight), -1., 1.);
-    if (pd) delete pd;
-    pd = new QOpenGLPaintDevice(pixWidth, pixHeight);
-    if (prog) delete prog;
+    // the ring needs fences (3.2) and glMapBufferRange (3.0). persistent mapping needs glBufferStorage (4.4).
+    usePbos = (ver >= qMakePair(3, 2) || ctx->hasExtension("GL_ARB_sync"))
+              && (ver >= qMakePair(3, 0) || ctx->hasExtension("GL_ARB_map_buffer_range"));
+    if (usePbos && (ver >= qMakePair(4, 4) || ctx->hasExtension("GL_ARB_buffer_storage")))
+        bufferStorage = ctx->getProcAddress("glBufferStorage");
+    persistent = bufferStorage != nullptr;
+    for (Pbo & b : pbos)
+        if (usePbos) GLFUNCS_X->glGenBuffers(1, &b.id);
+    if (usePbos && !pbos[0].id) usePbos = false;
+    if (!usePbos)
+        Warning() << "Fence syncs or glMapBufferRange unavailable -- PBOs unavailable.";
+    else
+        Debug() << "Texture uploads via " << NPBOS << (persistent ? " persistently mapped" : " orphaned") << " PBOs";
+    haveTexStorage = ver >= qMakePair(4, 2) || ctx->hasExtension("GL_ARB_texture_storage");
+    for (auto & t : tex) t = new QOpenGLTexture(QOpenGLTexture::Target2D);
+
+    // core profile draws need a VAO bound, even with no vertex data
+    vao = new QOpenGLVertexArrayObject(this);
+    vao->create();
+
+    // compiled once: nothing in it depends on the widget's size
     prog = new QOpenGLShaderProgram(this);
     try {
-        if ( ! prog->addShaderFromSourceCode(QOpenGLShader::Vertex,
-                                             "#version 120\n"
-                                             "varying vec2 texCoord;\n"
-                                             "\n"
-                                             "void main(void)\n"
-                                             "{\n"
-                                             "    gl_Position = ftransform();\n"
-                                             "    texCoord = gl_MultiTexCoord0.st;\n"
-                                             "}\n"
-                                             ) )
+        if ( ! prog->addShaderFromSourceCode(QOpenGLShader::Vertex, VertexShader) )
             throw QString("Vertex shader failed to compile: ") + prog->log();
-        if ( ! prog->addShaderFromSourceCode(QOpenGLShader::Fragment,
-                                             "#version 120\n"
-                                             "#extension GL_ARB_texture_rectangle : enable\n"
-                                             "uniform sampler2DRect tex;\n"
-                                             "varying vec2 texCoord;\n"
-                                             "\n"
-                                             "void main()\n"
-                                             "{\n"
-                                             "    vec4 color = texture2DRect(tex,texCoord);\n"
-                                             "    gl_FragColor = color;\n"
-                                             "}\n"
-                                             ) )
+        if ( ! prog->addShaderFromSourceCode(QOpenGLShader::Fragment, FragmentShader) )
             throw QString("Fragment shader failed to compile: ") + prog->log();
         if ( ! prog->link() )
             throw QString("Error on link: ") + prog->log();
@@ -138,55 +594,52 @@ void GLVideoWidget::resizeGL(int w, int h)
         // failed.. will use QPainter method in paintGL()
         delete prog; prog = nullptr;
         Error() << "OpenGL Shader program failure: " << e;
+        return;
     }
+    prog->bind();
+    static const char *const texNames[MaxPlanes] = { "tex0", "tex1", "tex2" };
+    for (int texUnit = 0; texUnit < MaxPlanes; ++texUnit)
+        prog->setUniformValue(texNames[texUnit], texUnit);
+    prog->release();
+}
+
+void GLVideoWidget::resizeGL(int w, int h)
+{
+    const qreal retinaScale = devicePixelRatio();
+    pixWidth = GLsizei(w * retinaScale); pixHeight = GLsizei(h * retinaScale);
+    glViewport(0, 0, pixWidth, pixHeight);
+    if (pd) delete pd;
+    pd = new QOpenGLPaintDevice(pixWidth, pixHeight);
 }
 
 void GLVideoWidget::paintGL()
 {
-    if (frame.isNull()) {
-        glClearColor(0.0,0.0,0.0,1.0);
-        glClear(GL_COLOR_BUFFER_BIT);
-    } else if (tex && prog) {
+    if (tex[0] && prog && texSize.isValid() && !shown.rect.isEmpty()) {
         //const auto t0 = Util::getTime(); Q_UNUSED(t0);
         prog->bind();
-        constexpr int texUnit = 0;
-        prog->setUniformValue("tex", texUnit);
-        GLFUNCS->glActiveTexture(GL_TEXTURE0+texUnit);
-        glBindTexture(GL_TEXTURE_RECTANGLE, tex->textureId());
-
-        glEnableClientState(GL_VERTEX_ARRAY);
-        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-        glColor4f(1.f,1.f,1.f,1.f);
-        const GLint w = pixWidth, h = pixHeight;
-        const GLint tw = tex->width(), th = tex->height();
-        const GLint
-        v[] = {
-            0,0, w,0, w,h, 0,h
-        },/*
-        t[] = {
-            // don't flip image vertically
-            0,0, tw,0, tw,th, 0,th
-        };*/
-        t[] = {
-            // flip image vertically
-            0,th, tw,th, tw,0, 0,0
-        };
-
-        glVertexPointer(2, GL_INT, 0, v);
-        glTexCoordPointer(2, GL_INT, 0, t);
-        glDrawArrays(GL_QUADS, 0, 4);
-        glDisableClientState(GL_VERTEX_ARRAY);
-        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-
+        prog->setUniformValue("mode", int(shown.layout));
+        prog->setUniformValue("fullRange", int(shown.fullRange));
+        prog->setUniformValue("bayerRed", BayerRed[shown.bayer][0], BayerRed[shown.bayer][1]);
+        // the textures hold shown.rect of the frame; show visibleRect() of it. These differ only until the next
+        // frame after a zoom or pan.
+        const QRectF vis = visibleRect(), r = shown.rect;
+        prog->setUniformValue("uvOffset", float((vis.left() - r.left()) / r.width()), float((vis.top() - r.top()) / r.height()));
+        prog->setUniformValue("uvScale", float(vis.width() / r.width()), float(vis.height() / r.height()));
+        for (int texUnit = 0; texUnit < shown.n; ++texUnit) {
+            GLFUNCS->glActiveTexture(GL_TEXTURE0+texUnit);
+            glBindTexture(GL_TEXTURE_2D, tex[texUnit]->textureId());
+        }
         GLFUNCS->glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+        vao->bind();
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        vao->release();
         prog->release();
 
         //qDebug("render using tex took: %lld msec",Util::getTime()-t0);
-        emit displayedFrame(frame.num);
-    } else if (pd) {
+        emit displayedFrame(texFrameNum);
+    } else if (pd && !frame.isNull()) {
         //const auto t0 = Util::getTime(); Q_UNUSED(t0);
-        // NB: uncomment code that creates the pd in resizeGL() if you uncomment this...
         const QRect r(QPoint(), pd->size());
         QPainter p(pd);
         p.setRenderHint(QPainter::SmoothPixmapTransform, /*set to false for now.. true*/false);
@@ -194,6 +647,9 @@ void GLVideoWidget::paintGL()
 
         //qDebug("render using QPainter took: %lld msec",Util::getTime()-t0);
         emit displayedFrame(frame.num);
+    } else {
+        glClearColor(0.0,0.0,0.0,1.0);
+        glClear(GL_COLOR_BUFFER_BIT);
     }
     ps.mark();
 }
@@ -2,13 +2,24 @@
 #define GLVIDEOWIDGET_H
 
 #include <QOpenGLWidget>
+#include <QThreadPool>
 #include "Frame.h"
+#include "FrameMailbox.h"
 #include "Util.h"
 
 class QOpenGLPaintDevice;
 class QOpenGLShaderProgram;
 class QOpenGLTexture;
+class QOpenGLVertexArrayObject;
 
+/// Displays Frames. Besides packed BGRA QImages, it takes 8/16 bit grayscale QImages (mono, or a Bayer mosaic -- see
+/// setBayerPattern()) and Frames whose avframe is YUV420P/YUVJ420P, NV12, GRAY8/16 or BAYER_*8/16. Those are uploaded
+/// as 1 R8/R16/RG8 texture per plane and converted to RGB in the fragment shader, so they needn't be converted to
+/// 32-bit RGB on the CPU first.
+///
+/// Needs an OpenGL 3.3 core profile context, which it asks for. Each frame is 1 draw of a fullscreen triangle, with
+/// zoom/pan as uniforms, from textures with immutable storage that are only reallocated when the frame size or
+/// format changes. Without 3.3, frames are drawn with QPainter, which is a lot slower.
 class GLVideoWidget : public QOpenGLWidget
 {
     Q_OBJECT
@@ -16,6 +27,28 @@ public:
     explicit GLVideoWidget(QWidget *parent = nullptr);
     ~GLVideoWidget() override;
 
+    /// How grayscale QImages are shown: as they are (NoBayer, the default), or demosaiced with this CFA pattern.
+    /// (Bayer AVFrames carry their own pattern.)
+    enum Bayer { NoBayer = 0, RGGB, GRBG, GBRG, BGGR };
+    void setBayerPattern(Bayer b) { bayer = b; }
+    Bayer bayerPattern() const { return bayer; }
+
+    /// Thread-safe: connect generators to this with Qt::DirectConnection. Frames wait in a latest-wins mailbox until
+    /// the last one shown has been swapped to the screen, so there's at most 1 upload per refresh (with vsync) no
+    /// matter how fast frames come in, and no work at all while the widget isn't visible.
+    void postFrame(const Frame &);
+
+    /// Frames bigger than the widget are box-filtered down to about its pixel size (see BoxFilter) on the copy thread,
+    /// before upload. Needs the PBO ring, and 8 bits per channel; Bayer mosaics are never downscaled. On by default.
+    void setDownscale(bool on) { downscale = on; }
+    bool isDownscaling() const { return downscale; }
+    /// Magnification, >= 1 (1 = the whole frame, the default). Zoomed in, only the visible part of each frame is
+    /// uploaded, at full resolution (or downscaled, if that's still bigger than the widget). center is in frame pixels;
+    /// a null one keeps the current center. What's on screen is zoomed right away, and the next frame is cropped to
+    /// match. The mouse wheel zooms about the cursor, dragging pans and double-clicking zooms back out.
+    void setZoom(double zoom, QPointF center = QPointF());
+    double zoom() const { return zm; }
+
 signals:
     void fps(double);
     void displayedFrame(quint64 num);
@@ -27,20 +60,92 @@ protected:
     void initializeGL() override;
     void resizeGL(int w, int h) override;
     void paintGL() override;
+    void showEvent(QShowEvent *) override;
+    void wheelEvent(QWheelEvent *) override;
+    void mousePressEvent(QMouseEvent *) override;
+    void mouseMoveEvent(QMouseEvent *) override;
+    void mouseDoubleClickEvent(QMouseEvent *) override;
 
 private:
     Frame frame;
     PerSec ps;
+    FrameMailbox mailbox;
+    bool awaitingSwap = false; ///< a frame was taken from mailbox and frameSwapped() hasn't been emitted since
+    void pull(); ///< shows the newest frame in mailbox, if the display is ready for one
     QOpenGLPaintDevice *pd = nullptr; // fallback to QPainter-based painting -- this will go away if we transition away from QImage for pixel data
     QOpenGLShaderProgram *prog = nullptr;
-    QOpenGLTexture *tex = nullptr;
     GLsizei pixWidth=0, pixHeight=0;
+    Bayer bayer = NoBayer;
+    bool downscale = true;
+    double zm = 1.0;
+    QPointF zoomCenter; ///< in frame pixels. null = the middle of the frame.
+    QSize frameSize; ///< of the last frame submitted, for mapping mouse positions to frame pixels
+    QPoint dragLast;
+    QRectF visibleRect() const; ///< the part of a frameSize frame that's shown, given zm and zoomCenter
 
-    // PBO-related stuff. Note we only use these fields if PBOs are available, otherwise the fallback is a slower pixel transfer method.
-    static constexpr int NPBOS = 2;
-    GLuint pbos[NPBOS] = {0};
+    /// How a frame's pixels are laid out, i.e. which path the fragment shader takes ("mode" uniform)
+    enum Layout { BGRA = 0, YUV420P, NV12, Mono, BayerMosaic };
+    static constexpr int MaxPlanes = 3;
+    struct Plane {
+        const uchar *bits = nullptr;
+        int stride = 0, w = 0, h = 0, texelBytes = 4;
+        int sub = 0; ///< log2 of the plane's subsampling (1 for the chroma of 4:2:0)
+        GLint internalFmt = 0;
+        GLenum fmt = 0, type = 0;
+        qint64 bytes() const { return qint64(stride) * h; }
+    };
+    struct Planes {
+        Layout layout = BGRA;
+        bool fullRange = false; ///< YUV only
+        Bayer bayer = NoBayer; ///< BayerMosaic only
+        int n = 0;
+        Plane p[MaxPlanes];
+        QRect rect; ///< the part of the frame these planes hold, in frame pixels
+        qint64 bytes() const;
+    };
+    /// Where f's pixels are and how to upload them: from f.avframe if it's in a format we can show, else from f.img.
+    /// Returns false if there's nothing to show.
+    bool planesOf(const Frame & f, Planes & out) const;
+    /// Crops pl to visibleRect(), and returns the factor to box-filter the result by to get it down to about the
+    /// widget's size: 1 if it's small enough already, or if !scalable.
+    int fitView(Planes & pl, bool scalable) const;
+    /// The planes uploaded when src is box-filtered by factor: packed (stride = w * texelBytes), bits unset.
+    static Planes downscaled(const Planes & src, int factor);
+
+    QOpenGLVertexArrayObject *vao = nullptr;
+    QOpenGLTexture *tex[MaxPlanes] = {};
+    bool haveTexStorage = false; ///< glTexStorage2D (GL 4.2 or ARB_texture_storage)
+    QSize texSizes[MaxPlanes]; ///< invalid until the first upload
+    GLint texFmts[MaxPlanes] = {};
+    Planes shown; ///< layout of what's currently in tex[]. Its pointers are stale.
+    QSize texSize; ///< of what's currently in tex[0], i.e. the frame size. Invalid until the first upload.
+    quint64 texFrameNum = 0; ///< frame number of what's currently in tex[]
+
+    // PBO ring. Note we only use these fields if PBOs are available, otherwise the fallback is a slower pixel transfer
+    // method. Each frame is memcpy'd into a mapped PBO on copyPool, then uploaded from it on the GUI thread, with a
+    // fence so the PBO isn't written again until the GL is done reading it.
+    struct Pbo {
+        GLuint id = 0;
+        qint64 capacity = 0;
+        uchar *ptr = nullptr; ///< mapped while filling (always, if persistent)
+        GLsync fence = nullptr; ///< of the last upload from this PBO, or null
+        bool filling = false; ///< a copyPool job owns ptr
+    };
+    static constexpr int NPBOS = 3;
+    Pbo pbos[NPBOS];
+    bool usePbos = false, persistent = false; ///< persistent: glBufferStorage + persistently mapped, otherwise orphan + map unsynchronized each frame
+    QFunctionPointer bufferStorage = nullptr; ///< glBufferStorage, which QOpenGLExtraFunctions lacks
     int index = 0;
-    Frame pboFrames[NPBOS]; // we buffer the pbo data in memory so pixel transfers can happen to the GPU in the background
+    quint64 nSubmitted = 0, lastUploaded = 0;
+    Frame pending; ///< newest frame that couldn't get a PBO yet. Older ones are dropped.
+    bool retryPending = false;
+    QThreadPool copyPool;
+
+    void submitPending(); ///< call with the context current
+    int acquirePbo(qint64 bytes); ///< a free PBO with room for bytes, mapped. -1 if they're all busy.
+    void uploadFromPbo(int i, const Planes &, quint64 num, quint64 seq);
+    void uploadTex(const Planes &, bool fromPbo); ///< fromPbo: from the bound PBO, planes packed back to back from offset 0
+    void destroyPbo(Pbo &);
 };
 
 #endif // GLVIDEOWIDGET_H
@@ -0,0 +1,324 @@
+#include "ImageEncoder.h"
+#include "RGB2YUV.h"
+#include "Util.h"
+#include "quazip/quacrc32fast.h"
+#include <QThread>
+#include <QtEndian>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <zlib.h>
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+}
+
+namespace {
+    void appendBE32(QByteArray & b, quint32 v) { char tmp[4]; qToBigEndian(v, tmp); b.append(tmp, 4); }
+
+    void appendChunk(QByteArray & out, const char type[4], const char *data, int len)
+    {
+        appendBE32(out, quint32(len));
+        out.append(type, 4);
+        out.append(data, len);
+        unsigned long crc = quazip_crc32(0L, reinterpret_cast<const unsigned char *>(type), 4);
+        if (len) crc = quazip_crc32(crc, reinterpret_cast<const unsigned char *>(data), size_t(len)); // (a null buffer resets the CRC, zlib-style)
+        appendBE32(out, quint32(crc));
+    }
+
+    /// PNG "Sub" filter of one BGRA row into RGB: each byte minus the same channel of the pixel to its left.
+    /// (Or no filter, with level 0, where it wouldn't buy anything.)
+    void filterRow(const uchar *src, uchar *dst, int w, bool sub)
+    {
+        *dst++ = sub ? 1 : 0;
+        uchar pr = 0, pg = 0, pb = 0;
+        for (int x = 0; x < w; ++x, src += 4, dst += 3) {
+            const uchar r = src[2], g = src[1], b = src[0];
+            if (sub) {
+                dst[0] = uchar(r - pr); dst[1] = uchar(g - pg); dst[2] = uchar(b - pb);
+                pr = r; pg = g; pb = b;
+            } else {
+                dst[0] = r; dst[1] = g; dst[2] = b;
+            }
+        }
+    }
+
+    /// libjpeg's quality -> scale factor (percent of the standard tables), then onto MJPEG's qscale (1-31).
+    int jpgQScale(int quality)
+    {
+        quality = qBound(1, quality, 100);
+        const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+        return qBound(1, qRound(scale / 5.0), 31);
+    }
+}
+
+struct ImageEncoder::JpgCtx
+{
+    AVCodecContext *c = nullptr;
+    AVFrame *frame = nullptr;
+    AVPacket *pkt = nullptr;
+    SwsContext *sws = nullptr; ///< only for 4:2:2/4:4:4
+    int w = 0, h = 0, nThreads = 0;
+    int64_t pts = 0;
+
+    ~JpgCtx() {
+        if (sws) sws_freeContext(sws);
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+        avcodec_free_context(&c);
+    }
+};
+
+ImageEncoder::ImageEncoder(Settings::Fmt fmt_in, const Params & params_in)
+    : fmt(fmt_in), params(params_in)
+{
+    const int n = params.nStripThreads > 0 ? params.nStripThreads : QThread::idealThreadCount();
+    stripPool.setMaxThreadCount(qMax(n, 1));
+    if (fmt != Settings::Fmt_PNG && fmt != Settings::Fmt_JPG)
+        Error() << "ImageEncoder: unsupported format " << Settings::fmt2String(fmt);
+}
+
+ImageEncoder::~ImageEncoder()
+{
+    stripPool.waitForDone();
+    for (auto *ctx : freeJpgCtxs) delete ctx;
+    freeJpgCtxs.clear();
+}
+
+bool ImageEncoder::encode(const QImage & img_in, QByteArray & out, QString *errMsg)
+{
+    out.clear();
+    if (img_in.isNull()) {
+        if (errMsg) *errMsg = "Null image";
+        return false;
+    }
+    // both encoders read BGRA bytes. That's what the frame generators produce, so this normally costs nothing.
+    const QImage img = img_in.format() == QImage::Format_RGB32 || img_in.format() == QImage::Format_ARGB32
+            ? img_in : img_in.convertToFormat(QImage::Format_RGB32);
+    bool ok = false;
+    if (fmt == Settings::Fmt_PNG) ok = encodePng(img, out, errMsg);
+    else if (fmt == Settings::Fmt_JPG) ok = encodeJpg(img, out, errMsg);
+    else if (errMsg) *errMsg = "ImageEncoder: unsupported format";
+    if (!ok) out.clear();
+    return ok;
+}
+
+bool ImageEncoder::encodePng(const QImage & img, QByteArray & out, QString *errMsg)
+{
+    const int w = img.width(), h = img.height();
+    const int level = qBound(0, params.pngLevel, 9);
+    const qint64 rowBytes = 1 + 3LL * w;
+    StripRunner runner(stripPool); // on the stack: frames may be encoded on several threads at once
+    const int stripH = runner.stripRows(h);
+    const int nStrips = (h + stripH - 1) / stripH;
+
+    struct Strip {
+        QByteArray z; ///< raw deflate data
+        uLong adler = 1;
+        qint64 inBytes = 0;
+        bool ok = false;
+    };
+    std::vector<Strip> strips(static_cast<size_t>(nStrips));
+
+    // zlib header: 32K window, deflate; FLEVEL is informational. FCHECK makes it a multiple of 31.
+    const int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    const uchar cmf = 0x78;
+    uchar flg = uchar(flevel << 6);
+    flg = uchar(flg + (31 - (cmf * 256 + flg) % 31) % 31);
+
+    runner.run(h, stripH, [&](int i, int y0, int y1) {
+        Strip & s = strips[size_t(i)];
+        const bool last = y1 == h;
+        z_stream zs{};
+        if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, level >= 1 && level <= 3 ? Z_RLE : Z_DEFAULT_STRATEGY) != Z_OK)
+            return;
+        s.inBytes = rowBytes * (y1 - y0);
+        // room for the zlib header (first strip), the sync flush's empty stored block and the Adler-32 (last strip)
+        const int pre = i == 0 ? 2 : 0;
+        const uLong bound = deflateBound(&zs, uLong(s.inBytes)) + 16;
+        if (bound > uLong(INT_MAX - pre)) { deflateEnd(&zs); return; }
+        s.z = QByteArray(int(bound) + pre, Qt::Uninitialized);
+        if (pre) s.z[0] = char(cmf), s.z[1] = char(flg);
+        zs.next_out = reinterpret_cast<Bytef *>(s.z.data() + pre);
+        zs.avail_out = uInt(bound);
+        // filter a batch of rows at a time, so deflate() and adler32() get reasonably large buffers
+        const int batchRows = int(qBound(qint64(1), (qint64(64) * 1024) / rowBytes, qint64(y1 - y0)));
+        std::vector<uchar> buf(size_t(rowBytes * batchRows));
+        bool ok = true;
+        for (int y = y0; ok && y < y1; y += batchRows) {
+            const int n = qMin(batchRows, y1 - y);
+            for (int r = 0; r < n; ++r)
+                filterRow(img.constScanLine(y + r), buf.data() + r * rowBytes, w, level > 0);
+            const uInt len = uInt(rowBytes * n);
+            s.adler = adler32(s.adler, buf.data(), len);
+            zs.next_in = buf.data();
+            zs.avail_in = len;
+            const bool end = y + n >= y1;
+            const int res = deflate(&zs, !end ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH));
+            // output buffer is deflateBound() sized, so all of the input is always consumed
+            ok = zs.avail_in == 0 && (res == Z_OK || (res == Z_STREAM_END && end && last));
+        }
+        s.z.resize(pre + int(zs.total_out));
+        deflateEnd(&zs);
+        s.ok = ok;
+    });
+
+    uLong adler = 1;
+    qint64 total = 0;
+    for (const auto & s : strips) {
+        if (!s.ok) {
+            if (errMsg) *errMsg = "PNG: deflate error";
+            return false;
+        }
+        adler = adler32_combine(adler, s.adler, z_off_t(s.inBytes));
+        total += s.z.size();
+    }
+
+    if (total + qint64(strips.size()) * 12 + 64 > qint64(INT_MAX)) {
+        if (errMsg) *errMsg = "PNG: image too large";
+        return false;
+    }
+    out.reserve(int(total + qint64(strips.size()) * 12 + 64));
+    static const char sig[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    out.append(sig, 8);
+    {
+        QByteArray ihdr;
+        appendBE32(ihdr, quint32(w));
+        appendBE32(ihdr, quint32(h));
+        ihdr.append(char(8)); // bit depth
+        ihdr.append(char(2)); // color type: RGB
+        ihdr.append(3, '\0'); // compression, filter, interlace: default, adaptive, none
+        appendChunk(out, "IHDR", ihdr.constData(), ihdr.size());
+    }
+    for (size_t i = 0; i < strips.size(); ++i) {
+        QByteArray & z = strips[i].z;
+        if (i + 1 == strips.size()) appendBE32(z, quint32(adler));
+        appendChunk(out, "IDAT", z.constData(), z.size());
+        z.clear();
+    }
+    appendChunk(out, "IEND", nullptr, 0);
+    return true;
+}
+
+ImageEncoder::JpgCtx *ImageEncoder::takeJpgCtx(int w, int h, QString *errMsg)
+{
+    int nThreads = 1;
+    {
+        QMutexLocker ml(&mut);
+        while (!freeJpgCtxs.empty()) {
+            JpgCtx *ctx = freeJpgCtxs.back();
+            freeJpgCtxs.pop_back();
+            if (ctx->w == w && ctx->h == h) return ctx;
+            jpgThreads -= ctx->nThreads;
+            delete ctx; // frame size changed
+        }
+        // A context's slice threads live as long as it does, and there's one context per frame being encoded at once,
+        // so they would multiply. Instead the first context gets all it can use of stripPool's thread count, and the
+        // rest what's left, but at least 1 each: only so many frames are encoded at once, 1 per calling thread.
+        const int wanted = qBound(1, stripPool.maxThreadCount(), qMax(h / StripRunner::MinRows, 1));
+        nThreads = qBound(1, stripPool.maxThreadCount() - jpgThreads, wanted);
+        jpgThreads += nThreads;
+    }
+    JpgCtx *ctx = openJpgCtx(w, h, nThreads, errMsg);
+    if (!ctx) {
+        QMutexLocker ml(&mut);
+        jpgThreads -= nThreads;
+    }
+    return ctx;
+}
+
+ImageEncoder::JpgCtx *ImageEncoder::openJpgCtx(int w, int h, int nThreads, QString *errMsg) const
+{
+    std::unique_ptr<JpgCtx> ctx(new JpgCtx);
+    ctx->w = w; ctx->h = h; ctx->nThreads = nThreads;
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec || !(ctx->c = avcodec_alloc_context3(codec)) || !(ctx->frame = av_frame_alloc()) || !(ctx->pkt = av_packet_alloc())) {
+        if (errMsg) *errMsg = "JPG: could not allocate the MJPEG encoder";
+        return nullptr;
+    }
+    static const AVPixelFormat pixFmts[] = { AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_YUVJ422P, AV_PIX_FMT_YUVJ444P };
+    const AVPixelFormat pixFmt = pixFmts[qBound(0, int(params.subsampling), 2)];
+    AVCodecContext *c = ctx->c;
+    c->width = w; c->height = h;
+    c->pix_fmt = pixFmt;
+    c->color_range = AVCOL_RANGE_JPEG;
+    c->time_base = AVRational{1, 25}; // meaningless for stills, but required
+    c->gop_size = 1; c->max_b_frames = 0;
+    const int q = jpgQScale(params.jpgQuality);
+    c->flags |= AV_CODEC_FLAG_QSCALE;
+    c->global_quality = FF_QP2LAMBDA * q;
+    c->qmin = c->qmax = q;
+    // strips: one slice per thread, each on its own thread
+    c->thread_type = FF_THREAD_SLICE;
+    c->thread_count = nThreads;
+    av_opt_set(c->priv_data, "huffman", "default", 0); // "optimal" costs a second pass over every frame
+    if (avcodec_open2(c, codec, nullptr) < 0) {
+        if (errMsg) *errMsg = "JPG: could not open the MJPEG encoder";
+        return nullptr;
+    }
+    AVFrame *f = ctx->frame;
+    f->format = pixFmt; f->width = w; f->height = h;
+    f->color_range = AVCOL_RANGE_JPEG;
+    if (av_frame_get_buffer(f, 64) < 0) {
+        if (errMsg) *errMsg = "JPG: could not allocate frame";
+        return nullptr;
+    }
+    if (pixFmt != AV_PIX_FMT_YUVJ420P) {
+        ctx->sws = sws_getContext(w, h, AV_PIX_FMT_BGRA, w, h, pixFmt, SWS_POINT, nullptr, nullptr, nullptr);
+        if (!ctx->sws) {
+            if (errMsg) *errMsg = "JPG: could not create the color converter";
+            return nullptr;
+        }
+    }
+    return ctx.release();
+}
+
+void ImageEncoder::giveJpgCtx(JpgCtx *ctx)
+{
+    QMutexLocker ml(&mut);
+    freeJpgCtxs.push_back(ctx);
+}
+
+void ImageEncoder::dropJpgCtx(JpgCtx *ctx)
+{
+    {
+        QMutexLocker ml(&mut);
+        jpgThreads -= ctx->nThreads;
+    }
+    delete ctx;
+}
+
+bool ImageEncoder::encodeJpg(const QImage & img, QByteArray & out, QString *errMsg)
+{
+    const int w = img.width(), h = img.height();
+    JpgCtx *ctx = takeJpgCtx(w, h, errMsg);
+    if (!ctx) return false;
+    bool ok = false;
+    do {
+        AVFrame *f = ctx->frame;
+        if (av_frame_make_writable(f) < 0) { if (errMsg) *errMsg = "JPG: frame not writable"; break; }
+        const uint8_t *src[1] = { img.constBits() };
+        const int srcStride[1] = { img.bytesPerLine() };
+        if (!ctx->sws)
+            RGB2YUV::bgraToYUV420(src[0], srcStride[0], f->data, f->linesize, w, h, true /* full range, as JFIF wants */);
+        else if (sws_scale(ctx->sws, src, srcStride, 0, h, f->data, f->linesize) < 0) {
+            if (errMsg) *errMsg = "JPG: color conversion failed";
+            break;
+        }
+        f->pts = ctx->pts++;
+        f->quality = ctx->c->global_quality;
+        if (avcodec_send_frame(ctx->c, f) < 0 || avcodec_receive_packet(ctx->c, ctx->pkt) < 0) {
+            if (errMsg) *errMsg = "JPG: encode error";
+            break;
+        }
+        out = QByteArray(reinterpret_cast<const char *>(ctx->pkt->data), ctx->pkt->size);
+        av_packet_unref(ctx->pkt);
+        ok = true;
+    } while (false);
+    if (ok) giveJpgCtx(ctx);
+    else dropJpgCtx(ctx); // its state is unknown after an error; don't reuse it
+    return ok;
+}
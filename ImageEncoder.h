@@ -0,0 +1,61 @@
+#ifndef IMAGEENCODER_H
+#define IMAGEENCODER_H
+
+#include "Settings.h"
+#include <QByteArray>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+#include <vector>
+
+/// Encodes frames to PNG or JPEG for the 1-file-per-frame formats. Much faster than QImage::save(), with control
+/// over quality, and each frame is split into horizontal strips that are encoded in parallel.
+///
+/// PNG is written directly with zlib. Rows are Sub-filtered, alpha is dropped (8-bit RGB), and each strip is deflated
+/// on its own, ending with a sync flush, as pigz does. Their Adler-32s are combined, so the file holds one ordinary
+/// zlib stream, split over one IDAT chunk per strip.
+///
+/// JPEG goes through libavcodec's MJPEG encoder (whose packets are complete JFIF images) with slice threading: each
+/// strip is encoded on its own thread, separated by restart markers. Each frame being encoded at once needs an encoder
+/// of its own, and all of them together get nStripThreads slice threads (but at least 1 each). The BGRA -> YUV
+/// conversion uses RGB2YUV for 4:2:0 and swscale for 4:2:2/4:4:4.
+class ImageEncoder
+{
+public:
+    enum Subsampling { Sub420 = 0, Sub422, Sub444 };
+
+    struct Params {
+        int jpgQuality = 90; ///< 1-100, roughly as libjpeg's quality (mapped onto the MJPEG encoder's qscale)
+        Subsampling subsampling = Sub420;
+        int pngLevel = 1; ///< zlib level 0-9. 1-3 use Z_RLE, which is several times faster and nearly as small on camera images
+        int nStripThreads = 0; ///< PNG: threads per frame. JPG: slice threads in all. 0 = QThread::idealThreadCount()
+    };
+
+    ImageEncoder(Settings::Fmt fmt, const Params & params); ///< fmt must be Fmt_PNG or Fmt_JPG
+    ~ImageEncoder();
+
+    /// Thread-safe. Any number of frames may be encoded at once. Returns false on error, with out left empty.
+    bool encode(const QImage & img, QByteArray & out, QString *errMsg = nullptr);
+
+    Settings::Fmt format() const { return fmt; }
+
+private:
+    bool encodePng(const QImage & img, QByteArray & out, QString *errMsg);
+    bool encodeJpg(const QImage & img, QByteArray & out, QString *errMsg);
+
+    struct JpgCtx; ///< an opened MJPEG encoder + scratch frame. Not thread-safe, so each in-flight frame takes its own.
+    JpgCtx *takeJpgCtx(int w, int h, QString *errMsg);
+    JpgCtx *openJpgCtx(int w, int h, int nThreads, QString *errMsg) const;
+    void giveJpgCtx(JpgCtx *ctx);
+    void dropJpgCtx(JpgCtx *ctx); ///< deletes it, giving its slice threads back
+
+    const Settings::Fmt fmt;
+    const Params params;
+    QThreadPool stripPool; ///< PNG strips
+    QMutex mut; ///< guards freeJpgCtxs and jpgThreads
+    std::vector<JpgCtx *> freeJpgCtxs;
+    int jpgThreads = 0; ///< slice threads of all the JpgCtxs there are, in use or not. See takeJpgCtx().
+};
+
+#endif // IMAGEENCODER_H
@@ -0,0 +1,178 @@
+#include "LatencyStats.h"
+#include "Util.h"
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    // returns the index of the highest set bit of v, which must be nonzero
+    inline int msb(quint64 v) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(v);
+#else
+        int r = 0;
+        while (v >>= 1) ++r;
+        return r;
+#endif
+    }
+
+    int shardForThisThread() {
+        static std::atomic_int next = 0;
+        thread_local const int shard = next++ % LatencyHistogram::NShards;
+        return shard;
+    }
+}
+
+LatencyHistogram::LatencyHistogram() : shards(NShards) { reset(); }
+
+/* static */ int LatencyHistogram::bucketFor(quint64 ns)
+{
+    if (ns < quint64(SubBuckets)) return int(ns);
+    const int e = qMin(msb(ns), MaxBits-1) - SubBucketBits; // >= 0
+    const quint64 m = qMin(ns >> e, quint64(2*SubBuckets - 1)); // in [SubBuckets, 2*SubBuckets)
+    return e*SubBuckets + int(m);
+}
+
+/* static */ quint64 LatencyHistogram::bucketLowNS(int b)
+{
+    if (b < SubBuckets) return quint64(b);
+    const int e = b / SubBuckets - 1;
+    return quint64(b - e*SubBuckets) << e;
+}
+
+/* static */ quint64 LatencyHistogram::bucketHighNS(int b)
+{
+    if (b < SubBuckets) return quint64(b);
+    const int e = b / SubBuckets - 1;
+    return bucketLowNS(b) + (quint64(1) << e) - 1;
+}
+
+void LatencyHistogram::record(qint64 ns)
+{
+    const quint64 v = ns > 0 ? quint64(ns) : 0;
+    Shard & s = shards[size_t(shardForThisThread())];
+    s.buckets[bucketFor(v)].fetch_add(1, std::memory_order_relaxed);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+    s.sumNS.fetch_add(v, std::memory_order_relaxed);
+    for (quint64 m = s.maxNS.load(std::memory_order_relaxed);
+         v > m && !s.maxNS.compare_exchange_weak(m, v, std::memory_order_relaxed); ) {}
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    Snapshot ret;
+    ret.buckets.resize(NBuckets, 0);
+    for (const auto & s : shards) {
+        ret.count += s.count.load(std::memory_order_relaxed);
+        ret.sumNS += s.sumNS.load(std::memory_order_relaxed);
+        ret.maxNS = qMax(ret.maxNS, s.maxNS.load(std::memory_order_relaxed));
+        for (int i = 0; i < NBuckets; ++i)
+            ret.buckets[size_t(i)] += s.buckets[i].load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto & s : shards) {
+        s.count = 0; s.sumNS = 0; s.maxNS = 0;
+        for (auto & b : s.buckets) b = 0;
+    }
+}
+
+quint64 LatencyHistogram::Snapshot::percentile(double pct) const
+{
+    quint64 total = 0;
+    for (const auto c : buckets) total += c; // don't trust count: it may have been read at a slightly different time
+    if (!total) return 0;
+    const quint64 rank = qMax(quint64(1), quint64(std::ceil(qBound(0.0, pct, 100.0) / 100.0 * double(total))));
+    quint64 seen = 0;
+    for (int i = 0; i < int(buckets.size()); ++i) {
+        if ((seen += buckets[size_t(i)]) >= rank)
+            return qMin(bucketHighNS(i), maxNS ? maxNS : bucketHighNS(i));
+    }
+    return maxNS;
+}
+
+namespace LatencyStats {
+
+    const char *stageName(Stage s)
+    {
+        switch (s) {
+        case EnqueueWait: return "enqueue wait";
+        case QueueResidency: return "queue residency";
+        case Convert: return "convert";
+        case SendFrame: return "send_frame";
+        case ReceivePacket: return "receive_packet";
+        case Write: return "write";
+        default: break;
+        }
+        return "???";
+    }
+
+    LatencyHistogram & histogram(Stage s)
+    {
+        static LatencyHistogram hists[NStages];
+        return hists[qBound(0, int(s), int(NStages)-1)];
+    }
+
+    void resetAll()
+    {
+        for (int i = 0; i < NStages; ++i) histogram(Stage(i)).reset();
+    }
+
+    QString report()
+    {
+        QString ret;
+        QTextStream ts(&ret, QIODevice::WriteOnly);
+        ts << qSetFieldWidth(16) << left << "stage" << qSetFieldWidth(10) << right
+           << "count" << "mean" << "p50" << "p99" << "max" << qSetFieldWidth(0) << "\n";
+        ts.setRealNumberNotation(QTextStream::FixedNotation);
+        ts.setRealNumberPrecision(2);
+        for (int i = 0; i < NStages; ++i) {
+            const auto snap = histogram(Stage(i)).snapshot();
+            ts << qSetFieldWidth(16) << left << stageName(Stage(i)) << qSetFieldWidth(10) << right
+               << snap.count << snap.meanNS()/1e6 << double(snap.percentile(50.0))/1e6
+               << double(snap.percentile(99.0))/1e6 << double(snap.maxNS)/1e6 << qSetFieldWidth(0) << "\n";
+        }
+        ts.flush();
+        return ret;
+    }
+
+    bool dumpToFile(const QString & fileName, QString *errMsg)
+    {
+        QFile f(fileName);
+        if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text)) {
+            if (errMsg) *errMsg = f.errorString();
+            return false;
+        }
+        QTextStream ts(&f);
+        ts << "stage,count,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n";
+        std::vector<LatencyHistogram::Snapshot> snaps;
+        for (int i = 0; i < NStages; ++i) {
+            snaps.push_back(histogram(Stage(i)).snapshot());
+            const auto & s = snaps.back();
+            ts << stageName(Stage(i)) << "," << s.count << "," << quint64(s.meanNS()) << "," << s.percentile(50.0) << ","
+               << s.percentile(90.0) << "," << s.percentile(99.0) << "," << s.percentile(99.9) << "," << s.maxNS << "\n";
+        }
+        ts << "\nstage,bucket_low_ns,bucket_high_ns,count\n";
+        for (int i = 0; i < NStages; ++i) {
+            const auto & s = snaps[size_t(i)];
+            for (int b = 0; b < int(s.buckets.size()); ++b)
+                if (const auto c = s.buckets[size_t(b)])
+                    ts << stageName(Stage(i)) << "," << LatencyHistogram::bucketLowNS(b) << ","
+                       << LatencyHistogram::bucketHighNS(b) << "," << c << "\n";
+        }
+        ts.flush();
+        if (f.error() != QFile::NoError) {
+            if (errMsg) *errMsg = f.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    ScopedTimer::ScopedTimer(Stage s) : stage(s), t0(Util::getTimeNS()) {}
+    ScopedTimer::~ScopedTimer() { record(stage, Util::getTimeNS() - t0); }
+
+} // end namespace LatencyStats
@@ -0,0 +1,84 @@
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+#include <QString>
+#include <atomic>
+#include <vector>
+
+/// A lock-free latency histogram, cheap enough to record into from every pipeline thread for every frame.
+///
+/// Values (nanoseconds) are counted in log-linear ("HDR"-style) buckets: values below SubBuckets are exact, above
+/// that each power of two is split into SubBuckets linear buckets, so any value is reported to within 1/SubBuckets
+/// (~3%) of what was recorded. Recording is a couple of relaxed atomic adds into the calling thread's shard; the
+/// shards only get summed up when someone asks for a snapshot().
+class LatencyHistogram
+{
+public:
+    static constexpr int SubBucketBits = 5, SubBuckets = 1 << SubBucketBits;
+    static constexpr int MaxBits = 40; ///< values >= 2^40 ns (~18 minutes) are clamped into the last bucket
+    static constexpr int NBuckets = (MaxBits - SubBucketBits + 1) * SubBuckets;
+    static constexpr int NShards = 8; ///< threads are assigned shards round-robin, so more threads than this share
+
+    struct Snapshot {
+        quint64 count = 0, sumNS = 0, maxNS = 0;
+        std::vector<quint64> buckets; ///< NBuckets counts
+
+        quint64 percentile(double pct) const; ///< in ns. pct is in the range [0, 100]
+        double meanNS() const { return count ? double(sumNS) / double(count) : 0.0; }
+    };
+
+    LatencyHistogram();
+
+    void record(qint64 ns); ///< thread-safe, lock-free, wait-free (well, save for the max update)
+    Snapshot snapshot() const; ///< thread-safe. Recording may continue concurrently, in which case it may or may not be included.
+    void reset(); ///< thread-safe, but values recorded concurrently with a reset may be lost
+
+    static int bucketFor(quint64 ns);
+    static quint64 bucketLowNS(int bucket); ///< the smallest value that lands in bucket
+    static quint64 bucketHighNS(int bucket); ///< the largest value that lands in bucket
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<quint64> count, sumNS, maxNS;
+        std::atomic<quint64> buckets[NBuckets];
+    };
+    std::vector<Shard> shards; ///< on the heap since these are ~9KB each
+};
+
+/// The process-wide set of histograms for the recording pipeline:
+/// capture (Recorder) -> enqueue -> convert -> avcodec_send_frame -> avcodec_receive_packet -> av_interleaved_write_frame
+namespace LatencyStats {
+
+    enum Stage {
+        EnqueueWait = 0, ///< time the producer spent in FFmpegEncoder::enqueue (non-trivial with the BlockProducer queue policy)
+        QueueResidency, ///< time from a frame being enqueued until the Encoder thread picks it up (includes conversion)
+        Convert, ///< pixel format conversion of 1 frame
+        SendFrame, ///< avcodec_send_frame
+        ReceivePacket, ///< avcodec_receive_packet, for each packet received
+        Write, ///< av_interleaved_write_frame, for each packet written
+        NStages
+    };
+
+    const char *stageName(Stage);
+    LatencyHistogram & histogram(Stage);
+
+    inline void record(Stage s, qint64 ns) { histogram(s).record(ns); }
+    void resetAll();
+
+    /// Returns a fixed-width table with count, mean, p50, p99, max (in ms) for each stage.
+    QString report();
+
+    /// Writes all non-empty buckets of all stages, plus the summary, to fileName as CSV.
+    bool dumpToFile(const QString & fileName, QString *errMsg = nullptr);
+
+    /// Records the time between its construction and destruction into stage.
+    struct ScopedTimer {
+        const Stage stage;
+        const qint64 t0;
+        explicit ScopedTimer(Stage s);
+        ~ScopedTimer();
+    };
+
+} // end namespace LatencyStats
+
+#endif // LATENCYSTATS_H
@@ -12,7 +12,6 @@
 #include <QGridLayout>
 #include <QTimer>
 #include <QIcon>
-#include <chrono>
 #include <vector>
 
 namespace {
@@ -61,17 +60,10 @@ MainWindow::MainWindow(QWidget *parent) :
 
     setupToolBar();
 
-    // testing...
-    fgen = new FakeFrameGenerator();
-    Connect(fgen, SIGNAL(generatedFrame(const Frame &)), ui->videoWidget, SLOT(updateFrame(const Frame &)));
     connect(ui->videoWidget, &GLVideoWidget::fps, this, [this](double fps) {
         statusStrings[FPS1] = QString("%1 FPS (display)").arg(fps, 7, 'g', 3);
         updateStatusMessageThrottled();
     });
-    connect(fgen, &FakeFrameGenerator::fps, this, [this](double fps) {
-        statusStrings[FPS2] = QString("%1 FPS (generate)").arg(fps, 7, 'g', 3);
-        updateStatusMessageThrottled();
-    });
     connect(ui->videoWidget, &GLVideoWidget::displayedFrame, this, [this](quint64 frameNum) {
         statusStrings[FrameNum] = QString("Frame %1").arg(frameNum);
         updateStatusMessageThrottled();
@@ -94,8 +86,12 @@ MainWindow::MainWindow(QWidget *parent) :
         statusStrings[FrameNumRec] = "";
         statusStrings[Dropped] = "";
         statusStrings[MBPerSec] = "";
+        statusStrings[QueueDepth] = "";
+        statusStrings[BufferFill] = "";
         statusStrings[FPS3] = "";
         tbActs["record"]->setChecked(false);
+        applyGenerator(); // in case the settings changed while recording
+        applyPreTrigger();
         Log() << "Recording stopped.";
         updateToolBar();
         updateStatusMessageThrottled();
@@ -104,6 +100,7 @@ MainWindow::MainWindow(QWidget *parent) :
         kill_dlg();
         blinkenTimer->start();
         statusStrings[Recording] = QString("Saving to '%1'...").arg(fname);
+        statusStrings[PreTrigger] = "";
         tbActs["record"]->setChecked(true);
         Log() << "Recording started, saving to: " << fname;
         updateToolBar();
@@ -126,7 +123,38 @@ MainWindow::MainWindow(QWidget *parent) :
         statusStrings[MBPerSec] = QString("%1 MB/s").arg(rate, 0, 'f', 1);
         updateStatusMessageThrottled();
     });
-    connect(fgen, &FakeFrameGenerator::generatedFrame, rec, &Recorder::saveFrame);
+    connect(rec, &Recorder::queueDepth, this, [this](int depth, int recentMax, int max, int capacity){
+        if (!rec->isRecording()) return;
+        statusStrings[QueueDepth] = QString("Q %1/%2 (peak %3, max %4)").arg(depth).arg(capacity).arg(recentMax).arg(max);
+        updateStatusMessageThrottled();
+    });
+    connect(rec, &Recorder::bufferFill, this, [this](qint64 bytes, qint64 recentMax, qint64 budget, qint64 spilled){
+        if (!rec->isRecording() || budget <= 0) return;
+        QString s = QString("Buf %1% (peak %2%)").arg(qRound(100.0 * bytes / budget)).arg(qRound(100.0 * recentMax / budget));
+        if (spilled > 0) s += QString(", %1 MB spilled").arg(spilled / (1024*1024));
+        statusStrings[BufferFill] = s;
+        updateStatusMessageThrottled();
+    });
+    connect(rec, &Recorder::preTriggerFill, this, [this](int frames, double secs, qint64 bytes, qint64 capacity){
+        if (rec->isRecording()) return;
+        statusStrings[PreTrigger] = QString("Pre-trigger %1 s, %2 fr. (%3/%4 MB)").arg(secs, 0, 'f', 1).arg(frames)
+                                    .arg(bytes / (1024*1024)).arg(capacity / (1024*1024));
+        updateStatusMessageThrottled();
+    });
+    connect(rec, &Recorder::finalizeProgress, this, [this](QString location, int framesLeft){
+        finalizing[location] = framesLeft;
+        updateFinalizingStatus();
+    });
+    connect(rec, &Recorder::finalized, this, [this](QString location){
+        finalizing.remove(location);
+        Log() << "Recording finished: " << location;
+        updateFinalizingStatus();
+    });
+    // testing...
+    applyGenerator();
+    connect(app(), &App::settingsChanged, this, &MainWindow::applyGenerator);
+    connect(app(), &App::settingsChanged, this, &MainWindow::applyPreTrigger);
+    applyPreTrigger();
 
     connect(blinkenTimer=new QTimer(this), &QTimer::timeout, this, [this]{
         if (auto a = tbActs["record"]; a && rec && rec->isRecording()) {
@@ -139,6 +167,50 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->statusBar->setFont(QFont("Fixed"));
 }
 
+void MainWindow::updateFinalizingStatus()
+{
+    int frames = 0;
+    for (const int n : finalizing) frames += n;
+    if (finalizing.isEmpty()) statusStrings[Finalizing] = "";
+    else if (frames) statusStrings[Finalizing] = QString("Finishing %1 recording(s), %2 fr. left").arg(finalizing.size()).arg(frames);
+    else statusStrings[Finalizing] = QString("Finishing %1 recording(s), closing").arg(finalizing.size());
+    updateStatusMessageThrottled();
+}
+
+void MainWindow::applyGenerator()
+{
+    const Settings & settings = Util::settings();
+    const auto pattern = FakeFrameGenerator::Pattern(settings.genPattern); // same order
+    const auto output = FakeFrameGenerator::Output(settings.genOutput); // same order
+    const auto mode = settings.genFreeRunning ? FakeFrameGenerator::FreeRunning : FakeFrameGenerator::Paced;
+    // a new generator starts over at frame 1, which a recording mustn't see: it waits for the recording to stop
+    if (fgen && (rec->isRecording() || (fgen->pattern() == pattern && fgen->output() == output && fgen->mode() == mode)))
+        return;
+    delete fgen;
+    fgen = new FakeFrameGenerator(Frame::DefaultWidth(), Frame::DefaultHeight(), Frame::DefaultFPS(), 16, mode, pattern, output);
+    // Bayer mosaics arrive as plain grayscale images, so the widget has to be told
+    ui->videoWidget->setBayerPattern(output == FakeFrameGenerator::BayerRGGB8 ? GLVideoWidget::RGGB : GLVideoWidget::NoBayer);
+    // direct: the widget's mailbox keeps only the newest frame, so frames the display can't keep up with never
+    // reach the GUI thread's event queue
+    connect(fgen, &FrameGenerator::generatedFrame, ui->videoWidget, &GLVideoWidget::postFrame, Qt::DirectConnection);
+    connect(fgen, &FakeFrameGenerator::fps, this, [this](double fps) {
+        statusStrings[FPS2] = QString("%1 FPS (generate)").arg(fps, 7, 'g', 3);
+        updateStatusMessageThrottled();
+    });
+    connect(fgen, &FakeFrameGenerator::generatedFrame, rec, &Recorder::saveFrame);
+}
+
+void MainWindow::applyPreTrigger()
+{
+    Settings settings = Util::settings();
+    settings.fps = fgen->requestedFPS();
+    rec->setPreTrigger(settings);
+    if (settings.preTriggerSecs <= 0.) {
+        statusStrings[PreTrigger] = "";
+        updateStatusMessageThrottled();
+    }
+}
+
 void MainWindow::updateStatusMessage()
 {
     static const QString sep("  -  ");
@@ -155,6 +227,11 @@ MainWindow::~MainWindow()
 
 void MainWindow::closeEvent(QCloseEvent *e) {
     if (!rec || !rec->isRecording() || QMessageBox::question(this,"Confirm Quit", QString("A recording is running.\nAre you sure you wish to quit %1?").arg(qApp->applicationName())) == QMessageBox::Yes) {
+        if (rec && (rec->isRecording() || rec->isFinalizing())) {
+            // quitting waits for the recordings to be finished (in ~Recorder), so say why it's taking a moment
+            show_dlg("Finishing recording...");
+            qApp->processEvents();
+        }
         QMainWindow::closeEvent(e);
         e->accept();
         qApp->quit();
@@ -191,16 +268,13 @@ void MainWindow::setupToolBar()
         if (b && !rec->isRecording()) {
             show_dlg("Recording Starting...");
             Util::settings().fps = fgen->requestedFPS();
-            QString err = rec->start(Util::settings());
+            QString err = rec->start(Util::settings(), fgen->frameSize());
             if (!err.isEmpty()) {
                 kill_dlg();
                 emit rec->error(err);
             }
         } else if (!b && rec->isRecording()) {
-            show_dlg("Please Wait...");
-            // this makes sure the dialog appears.. on Windows it doesn't show up in time. So we call stop in 10ms giving the dialog time to appear.
-            using namespace std::chrono;
-            QTimer::singleShot(10ms, this, [this]{ rec->stop(); });
+            rec->stop(); // returns quickly: the files are finished in the background (see Recorder::finalized)
         }
         updateToolBar();
     });
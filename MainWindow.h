@@ -32,13 +32,17 @@ private:
     void setupToolBar();
     void updateToolBar();
     void updateStatusMessage();
+    void applyPreTrigger(); ///< (re)configures rec's pre-trigger buffer from the settings, at the generator's fps
+    void applyGenerator(); ///< (re)creates fgen if the settings ask for a different test source. Not while recording.
     QMap<QString, QAction *> tbActs;
     Throttler updateStatusMessageThrottled;
     Ui::MainWindow *ui;
     FakeFrameGenerator *fgen = nullptr;
 
-    enum StatusString { FPS1 = 0, FPS2, FPS3, FrameNum, Dropped, FrameNumRec, MBPerSec, Recording, NStatus };
+    enum StatusString { FPS1 = 0, FPS2, FPS3, FrameNum, Dropped, FrameNumRec, MBPerSec, QueueDepth, BufferFill, PreTrigger, Recording, Finalizing, NStatus };
     QVector<QString> statusStrings = QVector<QString>(NStatus);
+    QMap<QString, int> finalizing; ///< stopped recordings still being written out -> frames left
+    void updateFinalizingStatus();
 
     Recorder *rec = nullptr;
 
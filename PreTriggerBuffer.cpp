@@ -0,0 +1,395 @@
+#include "PreTriggerBuffer.h"
+#include "Util.h"
+#include <QMutexLocker>
+#include <QThread>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <zlib.h>
+
+struct PreTriggerBuffer::Buffer
+{
+    enum State : quint8 { Free = 0, Busy, Stored, Out }; ///< Busy: being filled by the store thread, or inflated into by take()
+    PreTriggerBuffer *owner = nullptr;
+    uchar *data = nullptr;
+    State state = Free;
+};
+
+struct PreTriggerBuffer::Strip
+{
+    z_stream def{}, inf{}; ///< zlib keeps pointers back to these, so a Strip must never move once they're initialized
+    bool defOk = false, infOk = false;
+    std::vector<uchar> scratch; ///< deflateBound() of a whole strip
+};
+
+PreTriggerBuffer::PreTriggerBuffer(const Config & config, const DropFunc & onDrop_in)
+    : cfg(config), onDrop(onDrop_in), storeStrips(pool), takeStrips(pool), inbox(size_t(InboxSize))
+{
+    pool.setMaxThreadCount(qMax(cfg.nThreads > 0 ? cfg.nThreads : QThread::idealThreadCount(), 1));
+    Util::renameAllPoolThreads(pool, "PreTrigger Strip");
+    storeThr = QThread::create([this]{ storeLoop(); });
+    storeThr->setObjectName("PreTrigger Store");
+    storeThr->start();
+}
+
+PreTriggerBuffer::~PreTriggerBuffer()
+{
+    {
+        QMutexLocker ml(&mut);
+        stopping = true;
+        cond.wakeAll();
+    }
+    storeThr->wait();
+    delete storeThr; storeThr = nullptr;
+    pool.waitForDone();
+    QMutexLocker ml(&mut);
+    while (nOut > 0) cond.wait(&mut); // their images' cleanup functions point at us
+    freeAll();
+}
+
+void PreTriggerBuffer::push(const Frame & f)
+{
+    if (f.isNull()) return;
+    QMutexLocker ml(&mut);
+    if (md != Capturing) return;
+    if (inCount == InboxSize) {
+        ++skipped;
+        return;
+    }
+    Frame & slot = inbox[size_t((inHead + inCount++) % InboxSize)];
+    slot = f;
+    if (!slot.tNS) slot.tNS = Util::getTimeNS();
+    cond.wakeAll();
+}
+
+bool PreTriggerBuffer::pushIfFlushing(const Frame & f)
+{
+    QMutexLocker ml(&mut);
+    if (md != Flushing) return false;
+    if (f.isNull()) return true;
+    if (inCount == InboxSize) {
+        ml.unlock();
+        if (onDrop) onDrop(f.num);
+        return true;
+    }
+    Frame & slot = inbox[size_t((inHead + inCount++) % InboxSize)];
+    slot = f;
+    if (!slot.tNS) slot.tNS = Util::getTimeNS();
+    cond.wakeAll();
+    return true;
+}
+
+bool PreTriggerBuffer::beginFlush()
+{
+    QMutexLocker ml(&mut);
+    if (md != Capturing) return false;
+    md = count || inCount || storing ? Flushing : Idle;
+    cond.wakeAll();
+    return md == Flushing;
+}
+
+void PreTriggerBuffer::restart()
+{
+    QMutexLocker ml(&mut);
+    md = Capturing;
+    for (int i = 0; i < count; ++i) {
+        const Entry & e = ring[size_t((front + i) % int(ring.size()))];
+        if (e.slot > -1) buffers[size_t(e.slot)].state = Buffer::Free;
+    }
+    front = count = 0;
+    arenaHead = arenaUsed = 0;
+    for (auto & f : inbox) f = Frame();
+    inHead = inCount = 0;
+    skipped = 0;
+    cond.wakeAll();
+}
+
+PreTriggerBuffer::Mode PreTriggerBuffer::mode() const
+{
+    QMutexLocker ml(&mut);
+    return md;
+}
+
+qint64 PreTriggerBuffer::heldBytes() const { return arena ? arenaUsed : qint64(count) * frameBytes; }
+
+PreTriggerBuffer::Stats PreTriggerBuffer::stats() const
+{
+    QMutexLocker ml(&mut);
+    Stats ret;
+    ret.frames = count;
+    if (count > 1)
+        ret.seconds = double(ring[size_t((front + count - 1) % int(ring.size()))].tNS - ring[size_t(front)].tNS) / 1e9;
+    ret.bytes = heldBytes();
+    ret.capacityBytes = qint64(buffers.size()) * frameBytes + arenaSize;
+    ret.skipped = skipped;
+    return ret;
+}
+
+void PreTriggerBuffer::freeAll()
+{
+    for (auto & s : strips) {
+        if (s.defOk) deflateEnd(&s.def);
+        if (s.infOk) inflateEnd(&s.inf);
+    }
+    strips.clear();
+    for (auto & b : buffers) qFreeAligned(b.data);
+    buffers.clear();
+    qFreeAligned(arena); arena = nullptr;
+    arenaSize = arenaHead = arenaUsed = 0;
+    ring.clear();
+    front = count = 0;
+    w = h = bpl = 0;
+    fmt = QImage::Format_Invalid;
+    frameBytes = 0;
+}
+
+bool PreTriggerBuffer::setupFor(const QImage & img)
+{
+    if (!buffers.empty() && img.width() == w && img.height() == h && img.bytesPerLine() == bpl && img.format() == fmt)
+        return true;
+    // a different frame size (or the very first frame): start over, once nobody is using the old buffers, and once
+    // any old frames still due out of take() are out
+    while ((nOut > 0 || (md == Flushing && count)) && !stopping) cond.wait(&mut);
+    if (stopping) return false;
+    freeAll();
+    w = img.width(); h = img.height(); bpl = img.bytesPerLine(); fmt = img.format();
+    frameBytes = qint64(bpl) * h;
+    if (frameBytes <= 0) return false;
+
+    const int nFrames = qMax(int(std::ceil(cfg.seconds * cfg.fps)), 1);
+    const int headroom = qMax(int(std::ceil(cfg.fps)), 1); // a second's worth more, for frames that come in while Flushing
+    const int nStrips = qBound(1, pool.maxThreadCount(), qMin(MaxStrips, qMax(h / StripRunner::MinRows, 1)));
+    stripH = (h + nStrips - 1) / nStrips;
+    int nBuffers = NInflateBuffers;
+    if (cfg.compressLevel <= 0) {
+        nBuffers = int(qBound(qint64(1), cfg.maxBytes / frameBytes, qint64(nFrames + headroom)));
+        maxFrames = qMin(nFrames, nBuffers);
+        ring.assign(size_t(nBuffers), Entry());
+    } else {
+        maxFrames = nFrames;
+        ring.assign(size_t(nFrames + headroom), Entry());
+        strips = std::vector<Strip>(size_t((h + stripH - 1) / stripH)); // constructed in place, never moved
+        qint64 scratchBytes = 0;
+        for (auto & s : strips) {
+            s.defOk = deflateInit2(&s.def, qBound(1, cfg.compressLevel, 9), Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            s.infOk = inflateInit2(&s.inf, -15) == Z_OK;
+            if (!s.defOk || !s.infOk) { freeAll(); return false; }
+            s.scratch.resize(size_t(deflateBound(&s.def, uLong(qint64(stripH) * bpl))));
+            scratchBytes += qint64(s.scratch.size());
+        }
+        // the budget covers everything: the arena gets what the inflate buffers and scratch space leave over
+        arenaSize = qMax(cfg.maxBytes - NInflateBuffers * frameBytes - scratchBytes, frameBytes);
+        if (!(arena = static_cast<uchar *>(qMallocAligned(size_t(arenaSize), 64)))) { freeAll(); return false; }
+    }
+    buffers = std::vector<Buffer>(size_t(nBuffers));
+    for (auto & b : buffers) {
+        b.owner = this;
+        if (!(b.data = static_cast<uchar *>(qMallocAligned(size_t(frameBytes), 64)))) { freeAll(); return false; }
+    }
+    Debug() << "PreTriggerBuffer: " << w << "x" << h << ", up to " << maxFrames << " frames, "
+            << (qint64(buffers.size()) * frameBytes + arenaSize) / (1024*1024) << " MB"
+            << (arena ? QString(" (compressed, %1 strips)").arg(strips.size()) : QString());
+    return true;
+}
+
+void PreTriggerBuffer::storeLoop()
+{
+    QMutexLocker ml(&mut);
+    for (;;) {
+        while (!inCount && !stopping) cond.wait(&mut);
+        if (stopping) return;
+        Frame f = std::move(inbox[size_t(inHead)]);
+        inHead = (inHead + 1) % InboxSize;
+        --inCount;
+        storing = true;
+
+        bool stored = false;
+        auto evictFront = [this] {
+            const Entry & e = ring[size_t(front)];
+            if (e.slot > -1) buffers[size_t(e.slot)].state = Buffer::Free;
+            arenaUsed -= arena ? e.len : 0;
+            front = (front + 1) % int(ring.size());
+            --count;
+        };
+        // Capturing: anything too old goes, and there's always room for the newest frame
+        auto evictOld = [&] {
+            const qint64 maxAgeNS = qint64(cfg.seconds * 1e9);
+            while (count && (count >= maxFrames || f.tNS - ring[size_t(front)].tNS > maxAgeNS)) evictFront();
+        };
+        Entry e;
+        e.num = f.num;
+        e.tNS = f.tNS;
+        if (!setupFor(f.img)) {
+            if (!stopping) Error() << "PreTriggerBuffer: out of memory for " << f.img.width() << "x" << f.img.height() << " frames";
+        } else if (!arena) {
+            // raw: copy it into a free slot
+            for (;;) {
+                if (md == Capturing) evictOld();
+                for (size_t i = 0; i < buffers.size() && e.slot < 0; ++i)
+                    if (buffers[i].state == Buffer::Free) e.slot = int(i);
+                if (e.slot > -1 || stopping) break;
+                if (md == Capturing && count) evictFront();
+                // Flushing: nothing may be evicted, but take() frees one soon. (Meanwhile the inbox fills up, and
+                // after that pushIfFlushing() drops frames.) Capturing: all of them are still out of take().
+                else cond.wait(&mut);
+            }
+            if (e.slot > -1) {
+                Buffer & b = buffers[size_t(e.slot)];
+                b.state = Buffer::Busy;
+                ml.unlock();
+                const uchar *src = f.img.constBits();
+                storeStrips.run(h, stripH, [&](int, int y0, int y1) {
+                    std::memcpy(b.data + qint64(y0) * bpl, src + qint64(y0) * bpl, size_t(qint64(y1 - y0) * bpl));
+                });
+                ml.relock();
+                b.state = Buffer::Stored;
+                stored = true;
+            }
+        } else {
+            // compressed: deflate each strip into its scratch space, in parallel...
+            ml.unlock();
+            const uchar *src = f.img.constBits();
+            storeStrips.run(h, stripH, [&](int i, int y0, int y1) {
+                Strip & s = strips[size_t(i)];
+                deflateReset(&s.def);
+                s.def.next_in = const_cast<Bytef *>(src + qint64(y0) * bpl);
+                s.def.avail_in = uInt(qint64(y1 - y0) * bpl);
+                s.def.next_out = s.scratch.data();
+                s.def.avail_out = uInt(s.scratch.size());
+                e.stripLen[i] = deflate(&s.def, Z_FINISH) == Z_STREAM_END ? quint32(s.def.total_out) : 0;
+            });
+            bool ok = true;
+            for (size_t i = 0; i < strips.size(); ++i) {
+                ok = ok && e.stripLen[i];
+                e.len += e.stripLen[i];
+            }
+            ml.relock();
+            // ...then find it a spot in the arena, right after the newest frame, or back at the start
+            while (ok && e.len <= arenaSize && !stopping) {
+                if (md == Capturing) evictOld();
+                bool fits = !count;
+                e.off = 0;
+                if (count && count < int(ring.size())) {
+                    const Entry & oldest = ring[size_t(front)];
+                    if (oldest.off < arenaHead) {
+                        // free: from the newest frame to the end, and from the start to the oldest
+                        if (arenaSize - arenaHead >= e.len) e.off = arenaHead, fits = true;
+                        else fits = e.len <= oldest.off;
+                    } else if (oldest.off - arenaHead >= e.len) {
+                        // wrapped around: free from the newest frame to the oldest
+                        e.off = arenaHead, fits = true;
+                    }
+                }
+                if (fits) {
+                    arenaHead = e.off + e.len;
+                    ml.unlock();
+                    qint64 off = e.off;
+                    for (size_t i = 0; i < strips.size(); ++i) {
+                        std::memcpy(arena + off, strips[i].scratch.data(), e.stripLen[i]);
+                        off += e.stripLen[i];
+                    }
+                    ml.relock();
+                    arenaUsed += e.len;
+                    stored = true;
+                    break;
+                }
+                if (md == Capturing) evictFront(); // (count > 0, or it would have fit)
+                else cond.wait(&mut); // Flushing: wait for take() to make room
+            }
+        }
+        if (stored) {
+            ring[size_t((front + count) % int(ring.size()))] = e;
+            ++count;
+        }
+        const bool dropped = !stored && md == Flushing;
+        if (!stored && md == Capturing) ++skipped;
+        f = Frame(); // let go of the caller's image
+        storing = false;
+        cond.wakeAll();
+        if (dropped && onDrop) {
+            ml.unlock();
+            onDrop(e.num);
+            ml.relock();
+        }
+    }
+}
+
+Frame PreTriggerBuffer::take()
+{
+    QMutexLocker ml(&mut);
+    for (;;) {
+        while (!count) {
+            if (md != Flushing || stopping) return Frame();
+            if (!inCount && !storing) {
+                md = Idle; // atomically with finding it empty, so pushIfFlushing() can't slip a frame in after this
+                cond.wakeAll();
+                return Frame();
+            }
+            cond.wait(&mut);
+        }
+        const Entry e = ring[size_t(front)];
+        int bi = e.slot;
+        bool ok = true;
+        if (arena) {
+            // inflate it, strips in parallel, into one of our buffers. It stays in the ring until then, so the
+            // store thread leaves its bytes alone.
+            for (bi = -1; bi < 0 && !stopping; ) {
+                for (size_t i = 0; i < buffers.size() && bi < 0; ++i)
+                    if (buffers[i].state == Buffer::Free) bi = int(i);
+                if (bi < 0) cond.wait(&mut);
+            }
+            if (stopping) return Frame();
+            Buffer & b = buffers[size_t(bi)];
+            b.state = Buffer::Busy;
+            ++nOut; // (so a frame size change waits for us)
+            ml.unlock();
+            std::array<qint64, MaxStrips> offs{};
+            for (size_t i = 1; i < strips.size(); ++i) offs[i] = offs[i-1] + e.stripLen[i-1];
+            std::atomic_bool allOk{true};
+            takeStrips.run(h, stripH, [&](int i, int y0, int y1) {
+                Strip & s = strips[size_t(i)];
+                inflateReset(&s.inf);
+                s.inf.next_in = const_cast<Bytef *>(arena + e.off + offs[size_t(i)]);
+                s.inf.avail_in = uInt(e.stripLen[i]);
+                s.inf.next_out = b.data + qint64(y0) * bpl;
+                s.inf.avail_out = uInt(qint64(y1 - y0) * bpl);
+                if (inflate(&s.inf, Z_FINISH) != Z_STREAM_END || s.inf.avail_out) allOk = false;
+            });
+            ok = allOk;
+            ml.relock();
+            --nOut;
+            b.state = ok ? Buffer::Busy : Buffer::Free;
+            arenaUsed -= e.len;
+        }
+        front = (front + 1) % int(ring.size());
+        --count;
+        cond.wakeAll();
+        if (!ok) {
+            Error() << "PreTriggerBuffer: frame " << e.num << " would not inflate, dropping it";
+            ml.unlock();
+            if (onDrop) onDrop(e.num);
+            ml.relock();
+            continue;
+        }
+        Buffer & b = buffers[size_t(bi)];
+        b.state = Buffer::Out;
+        ++nOut;
+        ml.unlock();
+        // read-only: writing to it would detach (copy) it rather than scribble over our buffer
+        Frame ret(QImage(const_cast<const uchar *>(b.data), w, h, bpl, fmt, releaseBuffer, &b), e.num);
+        ret.tNS = e.tNS;
+        return ret;
+    }
+}
+
+/* static */
+void PreTriggerBuffer::releaseBuffer(void *info)
+{
+    Buffer *b = static_cast<Buffer *>(info);
+    PreTriggerBuffer *self = b->owner;
+    QMutexLocker ml(&self->mut);
+    b->state = Buffer::Free;
+    --self->nOut;
+    self->cond.wakeAll();
+}
@@ -0,0 +1,125 @@
+#ifndef PRETRIGGERBUFFER_H
+#define PRETRIGGERBUFFER_H
+
+#include "Frame.h"
+#include "Util.h"
+#include <QMutex>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <functional>
+#include <vector>
+
+class QThread;
+
+/// Holds on to the last few seconds of frames while nothing is being recorded ("pre-trigger"), so that a recording
+/// can start with what happened just before somebody decided to record it.
+///
+/// All memory is allocated up front, when the first frame shows what size frames are, and is then reused for as long
+/// as that stays the same, so this can run indefinitely without allocating (but for the QImage header of each frame
+/// take() hands out). Frames are kept either raw, in a ring of frame-sized slots, or (compressLevel > 0) deflated and
+/// packed back to back into one ring-shaped arena, which fits more seconds into the same memory. Compression splits
+/// each frame into strips that are deflated in parallel on the buffer's own pool. Copying or compressing happens on
+/// the buffer's store thread: push() just queues the frame and returns, and the caller's image is let go of as soon
+/// as it's been copied.
+///
+/// Capturing: the oldest frames make room for new ones, and frames older than Config::seconds go anyway.
+/// beginFlush() switches to Flushing: take() hands out what's stored, oldest first, and frames pushed meanwhile (with
+/// pushIfFlushing()) queue up behind them, so a recording gets everything in order. Nothing is evicted any more:
+/// they wait for take() to make room, and if the inbox fills up meanwhile, they're dropped (see DropFunc). Once it's
+/// all been taken, take() returns a null Frame and the buffer goes Idle until restart().
+class PreTriggerBuffer
+{
+public:
+    enum Mode { Idle = 0, Capturing, Flushing };
+
+    struct Config {
+        double seconds = 5.0;
+        double fps = Frame::DefaultFPS(); ///< with seconds, decides how many frames are kept
+        qint64 maxBytes = 2048LL * 1024LL * 1024LL; ///< all allocated when the first frame arrives
+        int compressLevel = 0; ///< 0 = keep frames raw, 1-9 = zlib level
+        int nThreads = 0; ///< for compressing and inflating strips. 0 = QThread::idealThreadCount()
+    };
+
+    struct Stats {
+        int frames = 0;
+        double seconds = 0.0; ///< from the oldest frame held to the newest
+        qint64 bytes = 0, capacityBytes = 0; ///< memory holding frames now, and allocated in all
+        quint64 skipped = 0; ///< frames that came in while Capturing faster than the store thread could keep them
+    };
+
+    using DropFunc = std::function<void(quint64 frameNum)>; ///< for frames dropped while Flushing. Called on any thread.
+
+    explicit PreTriggerBuffer(const Config & config, const DropFunc & onDrop = DropFunc());
+    ~PreTriggerBuffer(); ///< waits for the images of frames handed out by take() to be released
+
+    /// Thread-safe, returns at once. Ignored unless Capturing.
+    void push(const Frame & f);
+    /// Thread-safe, returns at once. If Flushing, f is queued behind the frames still stored (to come out of take()
+    /// after them), and this returns true. Otherwise returns false and f is none of our business.
+    bool pushIfFlushing(const Frame & f);
+
+    /// Capturing -> Flushing. Returns false, and goes straight to Idle, if there is nothing stored.
+    bool beginFlush();
+    /// Flushing only, 1 thread at a time. Blocks until the oldest frame stored is ready, and returns it, with the
+    /// frame number and time it came in with. Its image is read-only and refers to our memory (a slot, or a buffer
+    /// it was inflated into), which is reused only once the image is released. Returns a null Frame when there's
+    /// nothing left, switching to Idle in the same breath, so a frame pushed afterwards sees pushIfFlushing() fail.
+    Frame take();
+    /// -> Capturing, forgetting anything still stored.
+    void restart();
+
+    Mode mode() const;
+    const Config & config() const { return cfg; }
+    Stats stats() const;
+
+    static constexpr int InboxSize = 4; ///< frames waiting for the store thread. Beyond that, Capturing skips them.
+    static constexpr int MaxStrips = 16;
+    static constexpr int NInflateBuffers = 3; ///< compressed mode: frames that can be out of take() at once
+
+private:
+    struct Entry {
+        quint64 num = 0;
+        qint64 tNS = 0;
+        int slot = -1; ///< raw mode
+        qint64 off = 0, len = 0; ///< compressed mode: where in the arena
+        quint32 stripLen[MaxStrips] = {};
+    };
+    struct Buffer; ///< a frame-sized buffer: a raw slot, or a buffer take() inflates into
+    struct Strip; ///< a z_stream pair and scratch space
+
+    void storeLoop(); ///< runs on storeThr
+    bool setupFor(const QImage & img); ///< (re)allocates everything for frames like img, with mut held. false if out of memory
+    void freeAll(); ///< with mut held, nothing in flight
+    static void releaseBuffer(void *info); ///< QImage cleanup for frames out of take()
+    qint64 heldBytes() const;
+
+    const Config cfg;
+    const DropFunc onDrop;
+    QThreadPool pool; ///< strips
+    StripRunner storeStrips, takeStrips; ///< for the store thread, and for take(), which may run at the same time
+
+    mutable QMutex mut; ///< guards everything below
+    QWaitCondition cond; ///< any state change: a frame queued, stored, taken or released, a mode change
+    Mode md = Capturing;
+    bool stopping = false, storing = false; ///< storing: the store thread has a frame out of the inbox
+    std::vector<Frame> inbox; ///< InboxSize slots, circular
+    int inHead = 0, inCount = 0;
+    quint64 skipped = 0;
+
+    int w = 0, h = 0, bpl = 0;
+    QImage::Format fmt = QImage::Format_Invalid;
+    qint64 frameBytes = 0;
+    int maxFrames = 0; ///< kept while Capturing. Raw mode has a little headroom beyond that, for Flushing.
+    std::vector<Buffer> buffers; ///< raw: the slots. compressed: NInflateBuffers to inflate into.
+    int nOut = 0; ///< buffers whose images are out of take()
+    std::vector<Entry> ring; ///< stored frames, oldest at front, in the order they came in
+    int front = 0, count = 0;
+    uchar *arena = nullptr; ///< compressed mode
+    qint64 arenaSize = 0, arenaHead = 0, arenaUsed = 0;
+    std::vector<Strip> strips; ///< compressed mode
+    int stripH = 0;
+
+    QThread *storeThr = nullptr;
+};
+
+#endif // PRETRIGGERBUFFER_H
@@ -44,9 +44,24 @@ Prefs::Prefs(Settings &settings_in, QWidget *parent)
         if (settings.format == fmt) ui->formatCB->setCurrentIndex(ui->formatCB->count()-1);
     }
     ui->zipChk->setChecked(settings.zipEmbed);
+    ui->zipLevelSB->setValue(settings.zipLevel);
+    ui->rawContainerChk->setChecked(settings.rawContainer);
+    ui->rawIOCB->setCurrentIndex(int(settings.rawIO)); // combo box items are in Settings::RawIO order
+    ui->rawCompressSB->setValue(settings.rawCompressLevel);
+    ui->jpgQualitySB->setValue(settings.jpgQuality);
+    ui->jpgSubsamplingCB->setCurrentIndex(int(settings.jpgSubsampling)); // combo box items are in Settings::JpgSubsampling order
+    ui->pngLevelSB->setValue(settings.pngLevel);
     auto enableDisableZipChk = [this]() -> Settings::Fmt {
         auto fmt = Settings::Fmt(ui->formatCB->currentData().toInt());
-        ui->zipChk->setEnabled(Settings::ZipableFormats.count(fmt));
+        const bool rawSeq = fmt == Settings::Fmt_RAW && settings.rawContainer;
+        ui->zipChk->setEnabled(Settings::ZipableFormats.count(fmt) && !rawSeq);
+        ui->zipLevelSB->setEnabled(fmt == Settings::Fmt_RAW && settings.zipEmbed && !rawSeq);
+        ui->rawContainerChk->setEnabled(fmt == Settings::Fmt_RAW);
+        ui->rawIOCB->setEnabled(rawSeq);
+        ui->rawCompressSB->setEnabled(rawSeq);
+        ui->jpgQualitySB->setEnabled(fmt == Settings::Fmt_JPG);
+        ui->jpgSubsamplingCB->setEnabled(fmt == Settings::Fmt_JPG);
+        ui->pngLevelSB->setEnabled(fmt == Settings::Fmt_PNG);
         return fmt;
     };
 
@@ -58,6 +73,101 @@ Prefs::Prefs(Settings &settings_in, QWidget *parent)
     });
     connect(ui->zipChk, &QCheckBox::clicked, this, [=](bool b){
         settings.zipEmbed = b;
+        enableDisableZipChk();
+    });
+    connect(ui->zipLevelSB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int lvl){
+        settings.zipLevel = lvl;
+    });
+    connect(ui->rawContainerChk, &QCheckBox::clicked, this, [=](bool b){
+        settings.rawContainer = b;
+        enableDisableZipChk();
+    });
+    connect(ui->rawIOCB, QOverload<int>::of(&QComboBox::activated), this, [this](int idx){
+        settings.rawIO = Settings::RawIO(idx);
+    });
+    connect(ui->rawCompressSB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int lvl){
+        settings.rawCompressLevel = lvl;
+    });
+    connect(ui->jpgQualitySB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int q){
+        settings.jpgQuality = q;
+    });
+    connect(ui->jpgSubsamplingCB, QOverload<int>::of(&QComboBox::activated), this, [this](int idx){
+        settings.jpgSubsampling = Settings::JpgSubsampling(idx);
+    });
+    connect(ui->pngLevelSB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int lvl){
+        settings.pngLevel = lvl;
+    });
+
+    ui->queuePolicyCB->setCurrentIndex(int(settings.queuePolicy)); // combo box items are in Settings::QueuePolicy order, minus Queue_Block
+    connect(ui->queuePolicyCB, QOverload<int>::of(&QComboBox::activated), this, [this](int idx){
+        settings.queuePolicy = Settings::QueuePolicy(idx);
+    });
+    ui->genPatternCB->setCurrentIndex(int(settings.genPattern)); // combo box items are in Settings::GenPattern order
+    connect(ui->genPatternCB, QOverload<int>::of(&QComboBox::activated), this, [this](int idx){
+        settings.genPattern = Settings::GenPattern(idx);
+    });
+    ui->genOutputCB->setCurrentIndex(int(settings.genOutput)); // combo box items are in Settings::GenOutput order
+    connect(ui->genOutputCB, QOverload<int>::of(&QComboBox::activated), this, [this](int idx){
+        settings.genOutput = Settings::GenOutput(idx);
+    });
+    ui->genFreeRunChk->setChecked(settings.genFreeRunning);
+    connect(ui->genFreeRunChk, &QCheckBox::clicked, this, [this](bool b){
+        settings.genFreeRunning = b;
+    });
+    ui->spillChk->setChecked(settings.spillEnabled);
+    ui->spillDirLE->setText(settings.spillDir);
+    ui->spillDirLE->setEnabled(settings.spillEnabled);
+    ui->spillDirBut->setEnabled(settings.spillEnabled);
+    connect(ui->spillChk, &QCheckBox::clicked, this, [this](bool b){
+        settings.spillEnabled = b;
+        ui->spillDirLE->setEnabled(b);
+        ui->spillDirBut->setEnabled(b);
+    });
+    connect(ui->spillDirBut, &QPushButton::clicked, this, [this] {
+        const QString dir = QFileDialog::getExistingDirectory(this, "Specify Spill Directory", settings.spillDir);
+        if (QFileInfo fi(dir); fi.exists() && fi.isDir()) {
+            ui->spillDirLE->setText(dir);
+            settings.spillDir = dir;
+        } else if (!dir.isEmpty()) {
+            QMessageBox::critical(this, "Invalid Directory Specified", "The specified directory does not exist.");
+        }
+    });
+    ui->stripeDirsLE->setText(settings.stripeDirs.join(";"));
+    connect(ui->stripeDirsLE, &QLineEdit::editingFinished, this, [this]{
+        QStringList dirs;
+        for (const auto & dir : ui->stripeDirsLE->text().split(';', QString::SkipEmptyParts))
+            if (const QString d = dir.trimmed(); !d.isEmpty()) dirs.append(d);
+        settings.stripeDirs = dirs;
+        ui->stripeDirsLE->setText(dirs.join(";"));
+    });
+    connect(ui->stripeDirBut, &QPushButton::clicked, this, [this] {
+        const QString dir = QFileDialog::getExistingDirectory(this, "Add Stripe Directory", settings.stripeDirs.value(settings.stripeDirs.size()-1, settings.saveDir));
+        if (QFileInfo fi(dir); fi.exists() && fi.isDir()) {
+            if (!settings.stripeDirs.contains(dir)) settings.stripeDirs.append(dir);
+            ui->stripeDirsLE->setText(settings.stripeDirs.join(";"));
+        } else if (!dir.isEmpty()) {
+            QMessageBox::critical(this, "Invalid Directory Specified", "The specified directory does not exist.");
+        }
+    });
+    ui->queueMemSB->setValue(settings.queueMemMB);
+    connect(ui->queueMemSB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int mb){
+        settings.queueMemMB = mb;
+    });
+    ui->preTriggerSB->setValue(settings.preTriggerSecs);
+    ui->preTriggerMemSB->setValue(settings.preTriggerMemMB);
+    ui->preTriggerCompressChk->setChecked(settings.preTriggerCompress);
+    ui->preTriggerMemSB->setEnabled(settings.preTriggerSecs > 0.);
+    ui->preTriggerCompressChk->setEnabled(settings.preTriggerSecs > 0.);
+    connect(ui->preTriggerSB, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, [this](double secs){
+        settings.preTriggerSecs = secs;
+        ui->preTriggerMemSB->setEnabled(secs > 0.);
+        ui->preTriggerCompressChk->setEnabled(secs > 0.);
+    });
+    connect(ui->preTriggerMemSB, QOverload<int>::of(&QSpinBox::valueChanged), this, [this](int mb){
+        settings.preTriggerMemMB = mb;
+    });
+    connect(ui->preTriggerCompressChk, &QCheckBox::clicked, this, [this](bool b){
+        settings.preTriggerCompress = b;
     });
 }
 
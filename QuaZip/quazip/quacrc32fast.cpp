@@ -0,0 +1,294 @@
+/*
+This file is part of QuaZIP.
+
+QuaZIP is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 2.1 of the License, or
+(at your option) any later version.
+
+QuaZIP is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with QuaZIP.  If not, see <http://www.gnu.org/licenses/>.
+
+See COPYING file for the full LGPL text.
+*/
+
+#include "quacrc32fast.h"
+
+#include "zlib.h"
+
+#include <QtEndian>
+#include <QtGlobal>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define QUACRC32_X86 1
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    define QUACRC32_TARGET /* MSVC lets us use any intrinsic anywhere */
+#  else
+#    include <cpuid.h>
+#    define QUACRC32_TARGET __attribute__((target("pclmul,sse4.1")))
+#  endif
+#else
+#  define QUACRC32_X86 0
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#  define QUACRC32_ARM 1
+#  include <arm_acle.h>
+#else
+#  define QUACRC32_ARM 0
+#endif
+
+/* All the implementations below work on the raw CRC register, i.e. with
+ * the initial/final inversion done by the caller. */
+
+namespace {
+
+	const quint32 Poly = 0xedb88320u; /* reflected 0x04c11db7 */
+
+	struct Tables {
+		quint32 t[16][256];
+		Tables()
+		{
+			for (quint32 i = 0; i < 256; ++i) {
+				quint32 c = i;
+				for (int k = 0; k < 8; ++k)
+					c = (c >> 1) ^ (Poly & (0u - (c & 1u)));
+				t[0][i] = c;
+			}
+			for (int i = 0; i < 256; ++i)
+				for (int k = 1; k < 16; ++k)
+					t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+		}
+	};
+
+	const Tables &tables()
+	{
+		static const Tables tabs; // thread-safe initialization
+		return tabs;
+	}
+
+	inline quint32 load32(const unsigned char *p)
+	{
+		quint32 v;
+		std::memcpy(&v, p, 4);
+		return qFromLittleEndian(v);
+	}
+
+	quint32 crcSlice16(quint32 c, const unsigned char *p, size_t len)
+	{
+		const quint32 (*t)[256] = tables().t;
+		while (len >= 16) {
+			const quint32 a = load32(p) ^ c, b = load32(p + 4), d = load32(p + 8), e = load32(p + 12);
+			c = t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24]
+			  ^ t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[9][(b >> 16) & 0xff] ^ t[8][b >> 24]
+			  ^ t[7][d & 0xff] ^ t[6][(d >> 8) & 0xff] ^ t[5][(d >> 16) & 0xff] ^ t[4][d >> 24]
+			  ^ t[3][e & 0xff] ^ t[2][(e >> 8) & 0xff] ^ t[1][(e >> 16) & 0xff] ^ t[0][e >> 24];
+			p += 16;
+			len -= 16;
+		}
+		while (len--)
+			c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+		return c;
+	}
+
+	quint32 crcZlib(quint32 c, const unsigned char *p, size_t len)
+	{
+		uLong crc = ~c & 0xffffffffu;
+		while (len) {
+			const uInt n = uInt(qMin(len, size_t(1) << 30));
+			crc = crc32(crc, p, n);
+			p += n;
+			len -= n;
+		}
+		return ~quint32(crc);
+	}
+
+#if QUACRC32_X86
+	QUACRC32_TARGET inline __m128i ld(const unsigned char *q)
+	{
+		return _mm_loadu_si128(reinterpret_cast<const __m128i *>(q));
+	}
+
+	/* x * k (the two 64-bit halves with the matching halves of k), plus next */
+	QUACRC32_TARGET inline __m128i fold(__m128i x, __m128i k, __m128i next)
+	{
+		return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+	}
+
+	/* Folds 4 x 128 bits at a time with carry-less multiplies, then reduces
+	 * to 32 bits with a Barrett reduction. See Intel's "Fast CRC Computation
+	 * for Generic Polynomials Using PCLMULQDQ Instruction" (Gopal et al.,
+	 * 2009); the constants are the bit-reflected ones given there for the
+	 * gzip/zip polynomial. Needs len >= 64; does the multiple of 16 prefix
+	 * and leaves the rest to the caller. */
+	QUACRC32_TARGET
+	quint32 crcPclmul(quint32 c, const unsigned char *&p, size_t &len)
+	{
+		const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL),
+		              k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL),
+		              k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL),
+		              poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL),
+		              mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+
+		__m128i x1 = _mm_xor_si128(ld(p), _mm_cvtsi32_si128(int(c))), x2 = ld(p + 16), x3 = ld(p + 32), x4 = ld(p + 48);
+		p += 64;
+		len -= 64;
+		while (len >= 64) {
+			x1 = fold(x1, k1k2, ld(p));
+			x2 = fold(x2, k1k2, ld(p + 16));
+			x3 = fold(x3, k1k2, ld(p + 32));
+			x4 = fold(x4, k1k2, ld(p + 48));
+			p += 64;
+			len -= 64;
+		}
+		// 4 x 128 -> 128
+		x1 = fold(x1, k3k4, x2);
+		x1 = fold(x1, k3k4, x3);
+		x1 = fold(x1, k3k4, x4);
+		while (len >= 16) {
+			x1 = fold(x1, k3k4, ld(p));
+			p += 16;
+			len -= 16;
+		}
+		// 128 -> 64
+		x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+		x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), x2);
+		// Barrett reduction 64 -> 32
+		x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+		x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		return quint32(_mm_extract_epi32(x1, 1));
+	}
+
+	quint32 crcPclmulAll(quint32 c, const unsigned char *p, size_t len)
+	{
+		if (len >= 64)
+			c = crcPclmul(c, p, len);
+		return crcSlice16(c, p, len);
+	}
+
+	bool cpuHasPclmul()
+	{
+#  ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 1);
+		const unsigned ecx = unsigned(regs[2]);
+#  else
+		unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			return false;
+#  endif
+		return (ecx & (1u << 1)) && (ecx & (1u << 19)); // PCLMULQDQ, SSE4.1
+	}
+#endif // QUACRC32_X86
+
+#if QUACRC32_ARM
+	quint32 crcArmv8(quint32 c, const unsigned char *p, size_t len)
+	{
+		for (; len && (quintptr(p) & 7); --len)
+			c = __crc32b(c, *p++);
+		for (; len >= 32; len -= 32, p += 32) {
+			quint64 v[4];
+			std::memcpy(v, p, sizeof(v));
+			c = __crc32d(c, qFromLittleEndian(v[0]));
+			c = __crc32d(c, qFromLittleEndian(v[1]));
+			c = __crc32d(c, qFromLittleEndian(v[2]));
+			c = __crc32d(c, qFromLittleEndian(v[3]));
+		}
+		for (; len >= 8; len -= 8, p += 8) {
+			quint64 v;
+			std::memcpy(&v, p, 8);
+			c = __crc32d(c, qFromLittleEndian(v));
+		}
+		while (len--)
+			c = __crc32b(c, *p++);
+		return c;
+	}
+#endif // QUACRC32_ARM
+
+	typedef quint32 (*CrcFunc)(quint32, const unsigned char *, size_t);
+
+	CrcFunc funcFor(int impl)
+	{
+		switch (impl) {
+		case QUACRC32_ZLIB: return crcZlib;
+#if QUACRC32_X86
+		case QUACRC32_PCLMUL: return cpuHasPclmul() ? crcPclmulAll : nullptr;
+#endif
+#if QUACRC32_ARM
+		case QUACRC32_ARMV8: return crcArmv8;
+#endif
+		case QUACRC32_SLICE16: return crcSlice16;
+		default: return nullptr;
+		}
+	}
+
+	int selectImpl()
+	{
+		const int prefs[] = { QUACRC32_PCLMUL, QUACRC32_ARMV8 };
+		for (int impl : prefs)
+			if (funcFor(impl))
+				return impl;
+		return QUACRC32_SLICE16;
+	}
+
+	int selected()
+	{
+		static const int impl = selectImpl(); // thread-safe initialization, runs once
+		return impl;
+	}
+
+} // namespace
+
+extern "C" {
+
+unsigned long quazip_crc32(unsigned long crc, const unsigned char *buf, size_t len)
+{
+	return quazip_crc32_using(QUACRC32_AUTO, crc, buf, len);
+}
+
+unsigned long quazip_crc32_using(int impl, unsigned long crc, const unsigned char *buf, size_t len)
+{
+	if (!buf)
+		return 0;
+	static const CrcFunc autoFunc = funcFor(selected());
+	CrcFunc f = impl == QUACRC32_AUTO ? autoFunc : funcFor(impl);
+	if (!f)
+		f = crcSlice16;
+	return ~f(~quint32(crc), buf, len);
+}
+
+int quazip_crc32_available(int impl)
+{
+	return impl == QUACRC32_AUTO || funcFor(impl) != nullptr;
+}
+
+int quazip_crc32_selected(void)
+{
+	return selected();
+}
+
+const char *quazip_crc32_name(int impl)
+{
+	switch (impl) {
+	case QUACRC32_AUTO: return "auto";
+	case QUACRC32_ZLIB: return "zlib";
+	case QUACRC32_SLICE16: return "slice-by-16";
+	case QUACRC32_PCLMUL: return "pclmul";
+	case QUACRC32_ARMV8: return "armv8";
+	default: return "unknown";
+	}
+}
+
+} // extern "C"
@@ -0,0 +1,70 @@
+#ifndef QUACRC32FAST_H
+#define QUACRC32FAST_H
+
+/*
+This file is part of QuaZIP.
+
+QuaZIP is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 2.1 of the License, or
+(at your option) any later version.
+
+QuaZIP is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with QuaZIP.  If not, see <http://www.gnu.org/licenses/>.
+
+See COPYING file for the full LGPL text.
+*/
+
+/* Drop-in replacement for zlib's crc32() (same polynomial, same pre/post
+ * conditioning, so results can be mixed freely with zlib's), picking the
+ * fastest implementation the CPU supports the first time it is called:
+ *
+ *  - x86/x86_64 with PCLMULQDQ + SSE4.1: carry-less multiply folding
+ *  - ARMv8 built with the CRC extension: the crc32 instructions
+ *  - anything else: slice-by-16 tables (about as fast as a recent zlib,
+ *    and much faster than older ones' byte-at-a-time or slice-by-4 loops)
+ *
+ * Plain C linkage so zip.c and unzip.c can use it as well. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	QUACRC32_AUTO = 0, /* whatever quazip_crc32() dispatches to */
+	QUACRC32_ZLIB,     /* zlib's crc32(), for reference */
+	QUACRC32_SLICE16,
+	QUACRC32_PCLMUL,
+	QUACRC32_ARMV8,
+	QUACRC32_N_IMPLS
+};
+
+/* Same semantics as zlib's crc32(crc, buf, len). buf may be NULL, in
+ * which case the initial value (0) is returned. Thread-safe. */
+unsigned long quazip_crc32(unsigned long crc, const unsigned char *buf, size_t len);
+
+/* For tests and benchmarks: run a specific implementation. Falls back to
+ * slice-by-16 if impl isn't available on this CPU/build. */
+unsigned long quazip_crc32_using(int impl, unsigned long crc, const unsigned char *buf, size_t len);
+
+/* Nonzero iff impl can run on this CPU/build. QUACRC32_AUTO, _ZLIB and
+ * _SLICE16 are always available. */
+int quazip_crc32_available(int impl);
+
+/* The implementation quazip_crc32() dispatches to (never QUACRC32_AUTO). */
+int quazip_crc32_selected(void);
+
+const char *quazip_crc32_name(int impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QUACRC32FAST_H */
@@ -7,6 +7,7 @@ HEADERS += \
         $$PWD/quaadler32.h \
         $$PWD/quachecksum32.h \
         $$PWD/quacrc32.h \
+        $$PWD/quacrc32fast.h \
         $$PWD/quagzipfile.h \
         $$PWD/quaziodevice.h \
         $$PWD/quazipdir.h \
@@ -22,6 +23,7 @@ SOURCES += $$PWD/qioapi.cpp \
            $$PWD/JlCompress.cpp \
            $$PWD/quaadler32.cpp \
            $$PWD/quacrc32.cpp \
+           $$PWD/quacrc32fast.cpp \
            $$PWD/quagzipfile.cpp \
            $$PWD/quaziodevice.cpp \
            $$PWD/quazip.cpp \
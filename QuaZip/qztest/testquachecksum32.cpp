@@ -26,6 +26,9 @@ see quazip/(un)zip.h files for details. Basically it's the zlib license.
 
 #include <quazip/quaadler32.h>
 #include <quazip/quacrc32.h>
+#include <quazip/quacrc32fast.h>
+
+#include "zlib.h"
 
 #include <QtTest/QtTest>
 
@@ -48,3 +51,57 @@ void TestQuaChecksum32::update()
     adler32.update("pedia");
     QCOMPARE(adler32.value(), 0x11E60398u);
 }
+
+void TestQuaChecksum32::crc32Impls_data()
+{
+    QTest::addColumn<int>("impl");
+    for (int impl = 0; impl < QUACRC32_N_IMPLS; ++impl) {
+        if (quazip_crc32_available(impl))
+            QTest::newRow(quazip_crc32_name(impl)) << impl;
+    }
+}
+
+void TestQuaChecksum32::crc32Impls()
+{
+    QFETCH(int, impl);
+    QByteArray data(1 << 16, Qt::Uninitialized);
+    quint32 x = 2463534242u;
+    for (int i = 0; i < data.size(); ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        data[i] = static_cast<char>(x);
+    }
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.constData());
+    QCOMPARE(quazip_crc32_using(impl, 0, reinterpret_cast<const unsigned char *>("Wikipedia"), 9), 0xADAAC02Eul);
+    QCOMPARE(quazip_crc32_using(impl, 12345, NULL, 0), 0ul);
+    // every length around the SIMD block sizes, at every alignment, continuing from a nonzero crc
+    for (int len = 0; len <= 300; ++len) {
+        for (int off = 0; off < 16; ++off) {
+            const uLong init = uLong(len) * 2654435761ul & 0xffffffffu;
+            QCOMPARE(quazip_crc32_using(impl, init, p + off, len), crc32(init, p + off, uInt(len)));
+        }
+    }
+    // split updates must match a single pass
+    const unsigned long whole = crc32(0L, p, uInt(data.size()));
+    QCOMPARE(quazip_crc32_using(impl, 0, p, size_t(data.size())), whole);
+    QCOMPARE(quazip_crc32_using(impl, quazip_crc32_using(impl, 0, p, 1001), p + 1001, size_t(data.size() - 1001)), whole);
+}
+
+void TestQuaChecksum32::crc32Bench_data()
+{
+    crc32Impls_data();
+}
+
+void TestQuaChecksum32::crc32Bench()
+{
+    QFETCH(int, impl);
+    // 1 MB, so that plain qztest runs stay cheap. Set QZTEST_BENCH_FRAME to time one raw 5056x2968 ARGB frame instead,
+    // the size the recorder's zip writer checksums.
+    const int size = qEnvironmentVariableIsSet("QZTEST_BENCH_FRAME") ? 5056 * 2968 * 4 : 1 << 20;
+    const QByteArray data(size, '\x5a');
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.constData());
+    unsigned long crc = 0;
+    QBENCHMARK {
+        crc = quazip_crc32_using(impl, 0, p, size_t(data.size()));
+    }
+    QCOMPARE(crc, crc32(0L, p, uInt(data.size())));
+}
@@ -32,6 +32,10 @@ class TestQuaChecksum32: public QObject {
 private slots:
     void calculate();
     void update();
+    void crc32Impls_data();
+    void crc32Impls();
+    void crc32Bench_data();
+    void crc32Bench();
 };
 
 #endif // QUAZIP_TEST_QUACHECKSUM32_H
@@ -0,0 +1,351 @@
+#include "RGB2YUV.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#  define RGB2YUV_X86 1
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    define TARGET(x) /* MSVC lets us use any intrinsic anywhere */
+#  else
+#    define TARGET(x) __attribute__((target(x)))
+#  endif
+#else
+#  define RGB2YUV_X86 0
+#endif
+
+namespace RGB2YUV {
+
+namespace {
+
+    /// BT.601 coefficients, scaled by 256. Byte order of the incoming pixels is B, G, R, A.
+    struct Coeffs {
+        int yB, yG, yR, yOff;
+        int uB, uG, uR;
+        int vB, vG, vR;
+    };
+
+    // Limited range is what swscale produces for both YUV420P and (with the "colorspace voodoo" in FFmpegEncoder's
+    // Converter) YUVJ420P output. Full range is true JPEG-style output.
+    constexpr Coeffs limitedRange = { 25, 129, 66, 16,   112, -74, -38,   -18, -94, 112 };
+    constexpr Coeffs fullRange    = { 29, 150, 77,  0,   128, -85, -43,   -21, -107, 128 };
+
+    inline uint8_t clamp8(int v) { return uint8_t(std::min(std::max(v, 0), 255)); }
+
+    inline uint8_t luma(const uint8_t *p, const Coeffs &c) {
+        return clamp8(((c.yB*p[0] + c.yG*p[1] + c.yR*p[2] + 128) >> 8) + c.yOff);
+    }
+
+    /// Processes the 2 rows r0 & r1 from column x0 to w, 2 columns at a time. y1 may be nullptr (odd last row, in
+    /// which case r1 == r0).
+    void rowPairScalar(const uint8_t *r0, const uint8_t *r1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                       int x0, int w, const Coeffs &c)
+    {
+        for (int x = x0; x < w; x += 2) {
+            const int xn = std::min(x+1, w-1); // replicate the last column for odd widths
+            const uint8_t *p[4] = { r0 + 4*x, r0 + 4*xn, r1 + 4*x, r1 + 4*xn };
+            y0[x] = luma(p[0], c);
+            if (xn != x) y0[xn] = luma(p[1], c);
+            if (y1) {
+                y1[x] = luma(p[2], c);
+                if (xn != x) y1[xn] = luma(p[3], c);
+            }
+            const int b = p[0][0] + p[1][0] + p[2][0] + p[3][0],
+                      g = p[0][1] + p[1][1] + p[2][1] + p[3][1],
+                      r = p[0][2] + p[1][2] + p[2][2] + p[3][2];
+            u[x/2] = clamp8(((c.uB*b + c.uG*g + c.uR*r + 512) >> 10) + 128);
+            v[x/2] = clamp8(((c.vB*b + c.vG*g + c.vR*r + 512) >> 10) + 128);
+        }
+    }
+
+#if RGB2YUV_X86
+    // Both SIMD versions below work the same way: pixels get widened to 16 bits ([B G R A] per pixel), then
+    // pmaddwd against [cB cG cR 0] yields [B*cB+G*cG, R*cR] per pixel, and phaddd sums those to one int32 per pixel.
+    // For chroma, the 2 rows are summed first, and a 2nd phaddd sums horizontal neighbours.
+
+    struct SSECoeffs {
+        __m128i y, u, v, yOff;
+    };
+
+    /// 4 pixels in, 4 int32 lumas out
+    TARGET("sse4.1")
+    inline __m128i lumasSSE41(__m128i px, const SSECoeffs &k)
+    {
+        const __m128i zero = _mm_setzero_si128(),
+                      lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero),
+                      s = _mm_hadd_epi32(_mm_madd_epi16(lo, k.y), _mm_madd_epi16(hi, k.y));
+        return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(s, _mm_set1_epi32(128)), 8), k.yOff);
+    }
+
+    TARGET("sse4.1")
+    inline void store8SSE41(uint8_t *dst, __m128i a, __m128i b)
+    {
+        const __m128i w16 = _mm_packs_epi32(a, b);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(w16, w16));
+    }
+
+    /// s0..s3 are 8 vertically-summed pixels widened to 16 bits, 2 per register. Writes 4 chroma samples to dst.
+    TARGET("sse4.1")
+    inline void chromasSSE41(__m128i s0, __m128i s1, __m128i s2, __m128i s3, __m128i coef, uint8_t *dst)
+    {
+        const __m128i p03 = _mm_hadd_epi32(_mm_madd_epi16(s0, coef), _mm_madd_epi16(s1, coef)),
+                      p47 = _mm_hadd_epi32(_mm_madd_epi16(s2, coef), _mm_madd_epi16(s3, coef)),
+                      sum = _mm_hadd_epi32(p03, p47), // 4 chroma samples, each the sum of a 2x2 block
+                      c32 = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(512)), 10), _mm_set1_epi32(128)),
+                      c16 = _mm_packs_epi32(c32, c32);
+        const int c8 = _mm_cvtsi128_si32(_mm_packus_epi16(c16, c16));
+        std::copy_n(reinterpret_cast<const uint8_t *>(&c8), 4, dst);
+    }
+
+    /// Returns the number of columns processed (a multiple of 8).
+    TARGET("sse4.1")
+    int rowPairSSE41(const uint8_t *r0, const uint8_t *r1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                     int w, const Coeffs &c)
+    {
+        const SSECoeffs k = {
+            _mm_setr_epi16(short(c.yB), short(c.yG), short(c.yR), 0, short(c.yB), short(c.yG), short(c.yR), 0),
+            _mm_setr_epi16(short(c.uB), short(c.uG), short(c.uR), 0, short(c.uB), short(c.uG), short(c.uR), 0),
+            _mm_setr_epi16(short(c.vB), short(c.vG), short(c.vR), 0, short(c.vB), short(c.vG), short(c.vR), 0),
+            _mm_set1_epi32(c.yOff)
+        };
+        const __m128i zero = _mm_setzero_si128();
+        const int n = w & ~7;
+        for (int x = 0; x < n; x += 8) {
+            const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + 4*x)),
+                          a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r0 + 4*x + 16)),
+                          b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + 4*x)),
+                          b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r1 + 4*x + 16));
+            store8SSE41(y0 + x, lumasSSE41(a0, k), lumasSSE41(a1, k));
+            if (y1) store8SSE41(y1 + x, lumasSSE41(b0, k), lumasSSE41(b1, k));
+
+            // vertical sums, 16 bits per component, 2 pixels per register
+            const __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero)),
+                          s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero)),
+                          s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero)),
+                          s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+            chromasSSE41(s0, s1, s2, s3, k.u, u + x/2);
+            chromasSSE41(s0, s1, s2, s3, k.v, v + x/2);
+        }
+        return n;
+    }
+
+    struct AVXCoeffs {
+        __m256i y, u, v, yOff;
+    };
+
+    /// 8 pixels in, 8 int32 lumas out (in pixel order -- unpack & hadd both work within 128-bit lanes)
+    TARGET("avx2")
+    inline __m256i lumasAVX2(__m256i px, const AVXCoeffs &k)
+    {
+        const __m256i zero = _mm256_setzero_si256(),
+                      lo = _mm256_unpacklo_epi8(px, zero), hi = _mm256_unpackhi_epi8(px, zero),
+                      s = _mm256_hadd_epi32(_mm256_madd_epi16(lo, k.y), _mm256_madd_epi16(hi, k.y));
+        return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(s, _mm256_set1_epi32(128)), 8), k.yOff);
+    }
+
+    TARGET("avx2")
+    inline void store16AVX2(uint8_t *dst, __m256i a, __m256i b)
+    {
+        // packs interleaves the 128-bit lanes of a & b, so undo that, then pack again and gather the 2 useful quads
+        const __m256i w16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0)),
+                      w8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(w16, w16), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(w8));
+    }
+
+    /// s0..s3 are 16 vertically-summed pixels widened to 16 bits, 4 per register. Writes 8 chroma samples to dst.
+    TARGET("avx2")
+    inline void chromasAVX2(__m256i s0, __m256i s1, __m256i s2, __m256i s3, __m256i coef, uint8_t *dst)
+    {
+        const __m256i p07 = _mm256_hadd_epi32(_mm256_madd_epi16(s0, coef), _mm256_madd_epi16(s1, coef)),
+                      p8f = _mm256_hadd_epi32(_mm256_madd_epi16(s2, coef), _mm256_madd_epi16(s3, coef)),
+                      // 8 chroma samples, each the sum of a 2x2 block, in the order 0 1 4 5 | 2 3 6 7
+                      sum = _mm256_hadd_epi32(p07, p8f),
+                      c32 = _mm256_permutevar8x32_epi32(
+                                _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(512)), 10), _mm256_set1_epi32(128)),
+                                _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7)),
+                      c16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(c32, c32), _MM_SHUFFLE(3, 1, 2, 0)),
+                      c8 = _mm256_packus_epi16(c16, c16);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(c8));
+    }
+
+    /// Returns the number of columns processed (a multiple of 16).
+    TARGET("avx2")
+    int rowPairAVX2(const uint8_t *r0, const uint8_t *r1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                    int w, const Coeffs &c)
+    {
+        const AVXCoeffs k = {
+            _mm256_setr_epi16(short(c.yB), short(c.yG), short(c.yR), 0, short(c.yB), short(c.yG), short(c.yR), 0,
+                              short(c.yB), short(c.yG), short(c.yR), 0, short(c.yB), short(c.yG), short(c.yR), 0),
+            _mm256_setr_epi16(short(c.uB), short(c.uG), short(c.uR), 0, short(c.uB), short(c.uG), short(c.uR), 0,
+                              short(c.uB), short(c.uG), short(c.uR), 0, short(c.uB), short(c.uG), short(c.uR), 0),
+            _mm256_setr_epi16(short(c.vB), short(c.vG), short(c.vR), 0, short(c.vB), short(c.vG), short(c.vR), 0,
+                              short(c.vB), short(c.vG), short(c.vR), 0, short(c.vB), short(c.vG), short(c.vR), 0),
+            _mm256_set1_epi32(c.yOff)
+        };
+        const __m256i zero = _mm256_setzero_si256();
+        const int n = w & ~15;
+        for (int x = 0; x < n; x += 16) {
+            const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r0 + 4*x)),
+                          a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r0 + 4*x + 32)),
+                          b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r1 + 4*x)),
+                          b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r1 + 4*x + 32));
+            store16AVX2(y0 + x, lumasAVX2(a0, k), lumasAVX2(a1, k));
+            if (y1) store16AVX2(y1 + x, lumasAVX2(b0, k), lumasAVX2(b1, k));
+
+            const __m256i s0 = _mm256_add_epi16(_mm256_unpacklo_epi8(a0, zero), _mm256_unpacklo_epi8(b0, zero)),
+                          s1 = _mm256_add_epi16(_mm256_unpackhi_epi8(a0, zero), _mm256_unpackhi_epi8(b0, zero)),
+                          s2 = _mm256_add_epi16(_mm256_unpacklo_epi8(a1, zero), _mm256_unpacklo_epi8(b1, zero)),
+                          s3 = _mm256_add_epi16(_mm256_unpackhi_epi8(a1, zero), _mm256_unpackhi_epi8(b1, zero));
+            chromasAVX2(s0, s1, s2, s3, k.u, u + x/2);
+            chromasAVX2(s0, s1, s2, s3, k.v, v + x/2);
+        }
+        return n;
+    }
+
+    bool cpuHas(Impl impl)
+    {
+#  ifdef _MSC_VER
+        int regs[4];
+        __cpuid(regs, 1);
+        const bool sse41 = regs[2] & (1 << 19), osxsave = regs[2] & (1 << 27), avx = regs[2] & (1 << 28);
+        bool avx2 = false;
+        if (osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) { // OS saves the ymm registers
+            __cpuidex(regs, 7, 0);
+            avx2 = regs[1] & (1 << 5);
+        }
+#  else
+        const bool sse41 = __builtin_cpu_supports("sse4.1"), avx2 = __builtin_cpu_supports("avx2");
+#  endif
+        switch (impl) {
+        case SSE41: return sse41;
+        case AVX2: return avx2;
+        default: return true;
+        }
+    }
+#endif // RGB2YUV_X86
+
+} // end anonymous namespace
+
+bool isSupported(Impl impl)
+{
+    switch (impl) {
+    case Auto:
+    case Scalar: return true;
+#if RGB2YUV_X86
+    case SSE41:
+    case AVX2: {
+        static const bool has[] = { false, true, cpuHas(SSE41), cpuHas(AVX2) };
+        return has[impl];
+    }
+#endif
+    default: return false;
+    }
+}
+
+Impl bestImpl()
+{
+    static const Impl best = isSupported(AVX2) ? AVX2 : isSupported(SSE41) ? SSE41 : Scalar;
+    return best;
+}
+
+const char *implName(Impl impl)
+{
+    switch (impl) {
+    case Auto: return implName(bestImpl());
+    case Scalar: return "Scalar";
+    case SSE41: return "SSE4.1";
+    case AVX2: return "AVX2";
+    }
+    return "Unknown";
+}
+
+void bgraToYUV420(const uint8_t *src, int srcStride, uint8_t *const dst[3], const int dstStride[3],
+                  int w, int h, bool full, Impl impl)
+{
+    if (impl == Auto || !isSupported(impl)) impl = bestImpl();
+    const Coeffs & c = full ? fullRange : limitedRange;
+    for (int y = 0; y < h; y += 2) {
+        const bool havePair = y+1 < h; // odd last row gets paired with itself (and only its own Y row written)
+        const uint8_t *r0 = src + ptrdiff_t(y)*srcStride, *r1 = havePair ? r0 + srcStride : r0;
+        uint8_t *y0 = dst[0] + ptrdiff_t(y)*dstStride[0], *y1 = havePair ? y0 + dstStride[0] : nullptr,
+                *u = dst[1] + ptrdiff_t(y/2)*dstStride[1], *v = dst[2] + ptrdiff_t(y/2)*dstStride[2];
+        int x = 0;
+#if RGB2YUV_X86
+        if (impl == AVX2) x = rowPairAVX2(r0, r1, y0, y1, u, v, w, c);
+        else if (impl == SSE41) x = rowPairSSE41(r0, r1, y0, y1, u, v, w, c);
+#endif
+        rowPairScalar(r0, r1, y0, y1, u, v, x, w, c);
+    }
+}
+
+} // end namespace RGB2YUV
+
+
+// Below is to test & benchmark the above against swscale (as configured by FFmpegEncoder's Converter).
+// Checks all implementations are bit-exact with each other, and with themselves when run in bands the way
+// FFmpegEncoder's sliced conversion does, and reports PSNR vs. swscale for each plane.
+#if 0
+#include "Util.h"
+#include <QImage>
+#include <vector>
+#include <cmath>
+extern "C" {
+#include "libswscale/swscale.h"
+#include "libavutil/imgutils.h"
+}
+
+void TEST_RGB2YUV()
+{
+    using namespace RGB2YUV;
+    const int w = 5056, h = 2968, n = 20;
+    QImage img(w, h, QImage::Format_ARGB32);
+    for (int r = 0; r < h; ++r) {
+        QRgb *line = reinterpret_cast<QRgb *>(img.scanLine(r));
+        for (int c = 0; c < w; ++c)
+            line[c] = qRgb((c*255)/w, (r*255)/h, qrand() & 0xff); // gradients + noise
+    }
+    for (const bool full : { false, true }) {
+        const AVPixelFormat outFmt = full ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+        struct Planes {
+            std::vector<uint8_t> buf; uint8_t *data[3]; int linesize[3];
+            Planes(int w, int h) : buf(size_t(w*h + 2*((w+1)/2)*((h+1)/2))) {
+                linesize[0] = w; linesize[1] = linesize[2] = (w+1)/2;
+                data[0] = buf.data(); data[1] = data[0] + w*h; data[2] = data[1] + linesize[1]*((h+1)/2);
+            }
+        };
+        Planes ref(w, h);
+        SwsContext *ctx = sws_getContext(w, h, AV_PIX_FMT_BGRA, w, h, outFmt, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+        const uint8_t *srcData[1] = { img.constBits() }; const int srcStride[1] = { img.bytesPerLine() };
+        auto t0 = Util::getTime();
+        for (int i = 0; i < n; ++i) sws_scale(ctx, srcData, srcStride, 0, h, ref.data, ref.linesize);
+        Log("swscale -> %s: %.2f ms/frame", av_get_pix_fmt_name(outFmt), double(Util::getTime()-t0)/n);
+        sws_freeContext(ctx);
+
+        Planes scalar(w, h);
+        for (const Impl impl : { Scalar, SSE41, AVX2 }) {
+            if (!isSupported(impl)) { Log("%s: unsupported on this CPU", implName(impl)); continue; }
+            Planes out(w, h);
+            t0 = Util::getTime();
+            for (int i = 0; i < n; ++i) bgraToYUV420(img.constBits(), img.bytesPerLine(), out.data, out.linesize, w, h, full, impl);
+            const double ms = double(Util::getTime()-t0)/n;
+            if (impl == Scalar) scalar.buf = out.buf;
+            Planes banded(w, h);
+            for (int y0 = 0, bandH = 16*23; y0 < h; y0 += bandH) { // any even band height will do
+                uint8_t *const dst[3] = { banded.data[0] + y0*banded.linesize[0], banded.data[1] + (y0/2)*banded.linesize[1],
+                                          banded.data[2] + (y0/2)*banded.linesize[2] };
+                bgraToYUV420(img.constBits() + y0*img.bytesPerLine(), img.bytesPerLine(), dst, banded.linesize, w, qMin(bandH, h - y0), full, impl);
+            }
+            const bool exact = out.buf == scalar.buf && banded.buf == out.buf;
+            double psnr[3];
+            for (int p = 0; p < 3; ++p) {
+                const int pw = p ? (w+1)/2 : w, ph = p ? (h+1)/2 : h;
+                double se = 0.;
+                for (int i = 0; i < pw*ph; ++i) { const double d = double(out.data[p][i]) - double(ref.data[p][i]); se += d*d; }
+                psnr[p] = 10.0 * std::log10(255.0*255.0 / qMax(se / double(pw*ph), 1e-10));
+            }
+            Log("%s (%s range): %.2f ms/frame, bit-exact vs scalar and banded: %s, PSNR vs swscale Y: %.1f dB U: %.1f dB V: %.1f dB",
+                implName(impl), full ? "full" : "limited", ms, exact ? "yes" : "NO!", psnr[0], psnr[1], psnr[2]);
+        }
+    }
+}
+#endif
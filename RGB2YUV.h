@@ -0,0 +1,34 @@
+#ifndef RGB2YUV_H
+#define RGB2YUV_H
+
+#include <cstdint>
+
+/// Hand-written BGRA/BGR0 -> planar YUV 4:2:0 (8 bit) converter. This is the conversion nearly every recording does
+/// (QImage::Format_ARGB32 -> YUV420P or YUVJ420P), so we special-case it rather than go through swscale.
+///
+/// Uses BT.601 coefficients with 8.8 fixed-point math. Chroma is the average of each 2x2 block (the last column/row is
+/// replicated for odd sizes). All implementations use the exact same integer math and so are bit-identical to each other.
+namespace RGB2YUV {
+
+    enum Impl {
+        Auto = 0, ///< pick the fastest one this CPU supports, at runtime
+        Scalar,
+        SSE41,
+        AVX2
+    };
+
+    /// Returns the fastest implementation the current CPU supports.
+    Impl bestImpl();
+    /// Returns true iff this CPU (and build) can run impl.
+    bool isSupported(Impl impl);
+    const char *implName(Impl impl);
+
+    /// Converts a w x h BGRA (alpha ignored) image at src into the 3 planes of dst (Y, U, V).
+    /// If fullRange is false, output is limited ("MPEG", 16-235/240) range, otherwise it is full ("JPEG", 0-255) range.
+    /// The src and dst pointers need no particular alignment.
+    void bgraToYUV420(const uint8_t *src, int srcStride, uint8_t *const dst[3], const int dstStride[3],
+                      int w, int h, bool fullRange, Impl impl = Auto);
+
+} // end namespace RGB2YUV
+
+#endif // RGB2YUV_H
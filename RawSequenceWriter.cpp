@@ -0,0 +1,439 @@
+#include "RawSequenceWriter.h"
+#include "Util.h"
+#include <QDateTime>
+#include <QMutexLocker>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifndef Q_OS_WIN
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+static_assert(Q_BYTE_ORDER == Q_LITTLE_ENDIAN, "the .fgraw header and index are written as in-memory structs");
+static_assert(sizeof(RawSequenceWriter::Header) <= RawSequenceWriter::Alignment, "header must fit in 1 block");
+static_assert(sizeof(RawSequenceWriter::Header) == 96 && sizeof(RawSequenceWriter::IndexEntry) == 24,
+              "on-disk layout changed");
+
+namespace {
+    constexpr qint64 minPreallocBytes = 1LL << 30; ///< grow the file at least this much at a time
+    constexpr int minPreallocFrames = 16;
+
+    inline qint64 roundUp(qint64 v, qint64 a) { return (v + a - 1) / a * a; }
+
+#ifndef Q_OS_WIN
+    QString errnoString(const char *what) { return QString("%1: %2").arg(what).arg(std::strerror(errno)); }
+#endif
+}
+
+constexpr char RawSequenceWriter::Magic[8];
+
+RawSequenceWriter::RawSequenceWriter(const QString & fn, double fps_in, IOMode m)
+    : fileName(fn), fps(fps_in), mode(m)
+#ifdef Q_OS_WIN
+    , f(fn)
+#endif
+{
+#ifdef Q_OS_WIN
+    mode = Buffered;
+#endif
+}
+
+RawSequenceWriter::~RawSequenceWriter()
+{
+    if (isOpen()) close();
+    for (char *b : freeBuffers) qFreeAligned(b);
+}
+
+bool RawSequenceWriter::isOpen() const
+{
+    QMutexLocker ml(&mut);
+#ifdef Q_OS_WIN
+    return f.isOpen();
+#else
+    return fd > -1;
+#endif
+}
+
+quint64 RawSequenceWriter::frameCount() const
+{
+    QMutexLocker ml(&mut);
+    return quint64(index.size());
+}
+
+bool RawSequenceWriter::open(QString *errMsg)
+{
+    QMutexLocker ml(&mut);
+#ifdef Q_OS_WIN
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        if (errMsg) *errMsg = f.errorString();
+        return false;
+    }
+#else
+    const QByteArray path = fileName.toLocal8Bit();
+    const int flags = O_WRONLY|O_CREAT|O_TRUNC;
+#  ifdef O_DIRECT
+    if (mode == Direct) {
+        fd = ::open(path.constData(), flags|O_DIRECT, 0666);
+        if (fd < 0 && errno == EINVAL) {
+            Warning() << "O_DIRECT not supported for " << fileName << ", falling back to dropping written data from the cache";
+            mode = DropCache;
+        }
+    }
+#  endif
+    if (fd < 0) fd = ::open(path.constData(), flags, 0666);
+    if (fd < 0) {
+        if (errMsg) *errMsg = errnoString("open");
+        return false;
+    }
+#  ifdef F_NOCACHE
+    if (mode != Buffered) ::fcntl(fd, F_NOCACHE, 1);
+#  endif
+#endif
+    haveFirst = failed = false;
+    allocatedTo = dataEnd = 0;
+    index.clear();
+    return true;
+}
+
+void RawSequenceWriter::setCompression(const TileCodec::Params & params)
+{
+    QMutexLocker ml(&mut);
+    if (haveFirst) {
+        Warning() << "RawSequenceWriter: can't change compression after the first frame";
+        return;
+    }
+    codec.reset(params.level > 0 ? new TileCodec(params) : nullptr);
+}
+
+bool RawSequenceWriter::checkOpen(QString *errMsg) const
+{
+    if (failed || !(
+#ifdef Q_OS_WIN
+            f.isOpen()
+#else
+            fd > -1
+#endif
+            )) {
+        if (errMsg) *errMsg = "Raw sequence file is not open";
+        return false;
+    }
+    return true;
+}
+
+bool RawSequenceWriter::setupFirstFrame(int width, int height, int bpl, QImage::Format fmt, qint64 tNS, QString *errMsg)
+{
+    std::memcpy(hdr.magic, Magic, sizeof(hdr.magic));
+    hdr.version = codec ? Version : 1;
+    hdr.headerBytes = Alignment;
+    hdr.width = quint32(width);
+    hdr.height = quint32(height);
+    hdr.bytesPerLine = quint32(bpl);
+    hdr.qimageFormat = quint32(fmt);
+    hdr.frameBytes = quint64(bpl) * quint64(height);
+    hdr.frameStride = codec ? 0 : quint64(roundUp(qint64(hdr.frameBytes), Alignment));
+    hdr.dataOffset = dataEnd = Alignment;
+    hdr.codec = codec ? TileCodec::Deflate : 0;
+    hdr.reserved = 0;
+    hdr.nFrames = hdr.indexOffset = 0;
+    hdr.fps = fps;
+    // (a frame from before recording started, e.g. pre-trigger, dates the recording back to when it was captured)
+    const qint64 now = Util::getTimeNS();
+    t0NS = tNS ? tNS : now;
+    hdr.startTimeMSecs = QDateTime::currentMSecsSinceEpoch() - (now - t0NS) / 1000000LL;
+    // write a provisional header now, so a crashed recording can at least be identified (indexOffset == 0)
+    char *buf = static_cast<char *>(qMallocAligned(Alignment, Alignment));
+    if (!buf) {
+        if (errMsg) *errMsg = "Out of memory";
+        return false;
+    }
+    std::memset(buf, 0, Alignment);
+    std::memcpy(buf, &hdr, sizeof(hdr));
+    const bool ok = writeAt(buf, Alignment, 0, errMsg);
+    qFreeAligned(buf);
+    haveFirst = ok;
+    return ok;
+}
+
+void RawSequenceWriter::growTo(qint64 end, qint64 unitBytes)
+{
+    if (end > allocatedTo) {
+        const qint64 chunk = roundUp(qMax(minPreallocBytes, minPreallocFrames * unitBytes), Alignment);
+        preallocate(allocatedTo, end - allocatedTo + chunk);
+        allocatedTo = end + chunk;
+    }
+}
+
+bool RawSequenceWriter::write(const QImage & img, quint64 frameNum, QString *errMsg, qint64 captureTimeNS)
+{
+    if (isCompressed()) {
+        const Chunk c = compress(img, frameNum, errMsg, captureTimeNS);
+        return !c.isNull() && write(c, errMsg);
+    }
+    quint64 slot = 0;
+    {
+        QMutexLocker ml(&mut);
+        if (!checkOpen(errMsg)) return false;
+        if (!haveFirst && !setupFirstFrame(img.width(), img.height(), img.bytesPerLine(), img.format(), captureTimeNS, errMsg)) {
+            failed = true;
+            return false;
+        }
+        if (quint32(img.width()) != hdr.width || quint32(img.height()) != hdr.height
+                || quint32(img.bytesPerLine()) != hdr.bytesPerLine || quint32(img.format()) != hdr.qimageFormat) {
+            if (errMsg) *errMsg = "Frame size or format changed during recording";
+            return false;
+        }
+        slot = quint64(index.size());
+        index.push_back({frameNum, slot, (captureTimeNS ? captureTimeNS : Util::getTimeNS()) - t0NS});
+        growTo(qint64(hdr.dataOffset + (slot + 1) * hdr.frameStride), qint64(hdr.frameStride));
+    }
+
+    const qint64 off = qint64(hdr.dataOffset + slot * hdr.frameStride);
+    const char *src = reinterpret_cast<const char *>(img.constBits());
+    bool ok;
+    if (mode == Direct && !(quintptr(src) % Alignment) && !(hdr.frameBytes % Alignment)) {
+        ok = writeAt(src, qint64(hdr.frameBytes), off, errMsg); // already aligned: no copy
+    } else if (mode == Direct) {
+        // O_DIRECT needs an aligned source, so bounce through one of our buffers. The copy is cheap next to the I/O.
+        char *buf = takeBuffer(qint64(hdr.frameStride));
+        if (!buf) {
+            if (errMsg) *errMsg = "Out of memory";
+            return false;
+        }
+        std::memcpy(buf, src, size_t(hdr.frameBytes));
+        std::memset(buf + hdr.frameBytes, 0, size_t(hdr.frameStride - hdr.frameBytes));
+        ok = writeAt(buf, qint64(hdr.frameStride), off, errMsg);
+        giveBuffer(buf, qint64(hdr.frameStride));
+    } else {
+        ok = writeAt(src, qint64(hdr.frameBytes), off, errMsg);
+        if (ok && mode == DropCache) dropCache(off, qint64(hdr.frameBytes));
+    }
+    if (!ok) {
+        QMutexLocker ml(&mut);
+        failed = true;
+    }
+    return ok;
+}
+
+RawSequenceWriter::Chunk RawSequenceWriter::compress(const QImage & img, quint64 frameNum, QString *errMsg,
+                                                     qint64 captureTimeNS)
+{
+    Chunk c;
+    if (!codec) {
+        if (errMsg) *errMsg = "Compression is off";
+        return c;
+    }
+    if (img.isNull()) {
+        if (errMsg) *errMsg = "Null frame";
+        return c;
+    }
+    const qint64 bufBytes = roundUp(TileCodec::maxChunkBytes(img.height(), img.bytesPerLine()), Alignment);
+    char *buf = takeBuffer(bufBytes);
+    if (!buf) {
+        if (errMsg) *errMsg = "Out of memory";
+        return c;
+    }
+    c.data.reset(buf, [this, bufBytes](char *b) { giveBuffer(b, bufBytes); });
+    c.bytes = codec->encode(img.constBits(), img.height(), img.bytesPerLine(), qMax(img.depth() / 8, 1), frameNum,
+                            reinterpret_cast<uchar *>(buf), errMsg);
+    if (c.bytes < 0) return Chunk();
+    c.paddedBytes = roundUp(c.bytes, Alignment);
+    std::memset(buf + c.bytes, 0, size_t(c.paddedBytes - c.bytes));
+    c.frameNum = frameNum;
+    c.captureTimeNS = captureTimeNS;
+    c.width = img.width();
+    c.height = img.height();
+    c.bytesPerLine = img.bytesPerLine();
+    c.format = img.format();
+    return c;
+}
+
+bool RawSequenceWriter::write(const Chunk & c, QString *errMsg)
+{
+    if (c.isNull()) {
+        if (errMsg) *errMsg = "Null chunk";
+        return false;
+    }
+    qint64 off = 0;
+    {
+        QMutexLocker ml(&mut);
+        if (!checkOpen(errMsg)) return false;
+        if (!haveFirst && !setupFirstFrame(c.width, c.height, c.bytesPerLine, c.format, c.captureTimeNS, errMsg)) {
+            failed = true;
+            return false;
+        }
+        if (quint32(c.width) != hdr.width || quint32(c.height) != hdr.height
+                || quint32(c.bytesPerLine) != hdr.bytesPerLine || quint32(c.format) != hdr.qimageFormat) {
+            if (errMsg) *errMsg = "Frame size or format changed during recording";
+            return false;
+        }
+        // chunks are variable-sized, so claim the space for this one now and write it outside the lock
+        off = dataEnd;
+        dataEnd += c.paddedBytes;
+        index.push_back({c.frameNum, quint64(off), (c.captureTimeNS ? c.captureTimeNS : Util::getTimeNS()) - t0NS});
+        growTo(dataEnd, c.paddedBytes);
+    }
+    // the buffer is aligned and padded, so this is fine for O_DIRECT as is
+    const bool ok = writeAt(c.data.get(), c.paddedBytes, off, errMsg);
+    if (ok && mode == DropCache) dropCache(off, c.paddedBytes);
+    if (!ok) {
+        QMutexLocker ml(&mut);
+        failed = true;
+    }
+    return ok;
+}
+
+bool RawSequenceWriter::close(QString *errMsg)
+{
+    QMutexLocker ml(&mut);
+#ifdef Q_OS_WIN
+    if (!f.isOpen()) return true;
+#else
+    if (fd < 0) return true;
+#endif
+    bool ok = !failed;
+    if (!ok && errMsg) *errMsg = "An earlier write failed; the recording is incomplete";
+    qint64 fileEnd = 0;
+    if (ok && haveFirst) {
+        std::sort(index.begin(), index.end(), [](const IndexEntry &a, const IndexEntry &b) { return a.frameNum < b.frameNum; });
+        hdr.nFrames = quint64(index.size());
+        hdr.indexOffset = codec ? quint64(dataEnd) : hdr.dataOffset + hdr.nFrames * hdr.frameStride;
+        const qint64 idxBytes = qint64(index.size() * sizeof(IndexEntry));
+        fileEnd = qint64(hdr.indexOffset) + idxBytes;
+        // index and header go through aligned buffers too, since the fd may be O_DIRECT
+        const qint64 bufBytes = roundUp(qMax(idxBytes, qint64(Alignment)), Alignment);
+        char *buf = static_cast<char *>(qMallocAligned(size_t(bufBytes), Alignment));
+        if (!buf) {
+            if (errMsg) *errMsg = "Out of memory";
+            ok = false;
+        } else {
+            std::memset(buf, 0, size_t(bufBytes));
+            std::memcpy(buf, index.data(), size_t(idxBytes));
+            ok = writeAt(buf, roundUp(idxBytes, Alignment), qint64(hdr.indexOffset), errMsg);
+            if (ok) {
+                std::memset(buf, 0, Alignment);
+                std::memcpy(buf, &hdr, sizeof(hdr));
+                ok = writeAt(buf, Alignment, 0, errMsg);
+            }
+            qFreeAligned(buf);
+        }
+    }
+#ifdef Q_OS_WIN
+    if (ok) ok = f.resize(fileEnd);
+    if (!ok && errMsg && errMsg->isEmpty()) *errMsg = f.errorString();
+    f.close();
+#else
+    if (ok && ::ftruncate(fd, off_t(fileEnd)) != 0) { // drop the index padding
+        if (errMsg) *errMsg = errnoString("ftruncate");
+        ok = false;
+    }
+#  if defined(Q_OS_LINUX)
+    // Give back what was preallocated past the end but never written (also when the recording failed). Only a
+    // truncate that actually shrinks the file is sure to free KEEP_SIZE blocks on every filesystem (a hole punched
+    // past EOF isn't), so grow it by a byte first. Best effort.
+    if (const off_t eof = ::lseek(fd, 0, SEEK_END); eof >= 0 && allocatedTo > qint64(eof)
+            && (::ftruncate(fd, eof + 1) != 0 || ::ftruncate(fd, eof) != 0))
+        Debug() << "ftruncate (releasing preallocated space): " << std::strerror(errno);
+#  endif
+    if (::close(fd) != 0 && ok) {
+        if (errMsg) *errMsg = errnoString("close");
+        ok = false;
+    }
+    fd = -1;
+#endif
+    index.clear();
+    index.shrink_to_fit();
+    return ok;
+}
+
+bool RawSequenceWriter::writeAt(const char *data, qint64 len, qint64 offset, QString *errMsg)
+{
+#ifdef Q_OS_WIN
+    QMutexLocker ml(&fileMut);
+    if (!f.seek(offset) || f.write(data, len) != len) {
+        if (errMsg) *errMsg = f.errorString();
+        return false;
+    }
+    return true;
+#else
+    while (len > 0) {
+        const ssize_t n = ::pwrite(fd, data, size_t(qMin(len, qint64(1) << 30)), off_t(offset));
+        if (n < 0 && errno == EINTR) continue;
+#  ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && (::fcntl(fd, F_GETFL) & O_DIRECT)) {
+            // some filesystems accept O_DIRECT at open() but reject the writes. Switch it off and carry on.
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT);
+            if (IOMode expected = Direct; mode.compare_exchange_strong(expected, DropCache))
+                Warning() << "O_DIRECT write rejected for " << fileName << ", falling back to dropping written data from the cache";
+            continue;
+        }
+#  endif
+        if (n <= 0) {
+            if (errMsg) *errMsg = n < 0 ? errnoString("write") : QString("Short write");
+            return false;
+        }
+        data += n; len -= n; offset += n;
+    }
+    return true;
+#endif
+}
+
+void RawSequenceWriter::preallocate(qint64 offset, qint64 len)
+{
+#if defined(Q_OS_LINUX)
+    // best effort: fallocate() is cheap where supported (ext4, xfs, btrfs). Don't use posix_fallocate(), which would
+    // fall back to writing zeros. KEEP_SIZE: the file only gets as long as what's actually been written, so if the
+    // recording is interrupted, a reader recovering it doesn't mistake the preallocated space for zero-filled frames.
+    if (::fallocate(fd, FALLOC_FL_KEEP_SIZE, off_t(offset), off_t(len)) != 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+        Debug() << "fallocate: " << std::strerror(errno);
+#elif defined(Q_OS_DARWIN)
+    fstore_t fst{};
+    fst.fst_flags = F_ALLOCATECONTIG|F_ALLOCATEALL;
+    fst.fst_posmode = F_PEOFPOSMODE;
+    fst.fst_length = off_t(len);
+    if (::fcntl(fd, F_PREALLOCATE, &fst) != 0) {
+        fst.fst_flags = F_ALLOCATEALL; // contiguous failed, try any
+        ::fcntl(fd, F_PREALLOCATE, &fst);
+    }
+    (void)offset;
+#else
+    (void)offset; (void)len; // Windows: the file just grows as written
+#endif
+}
+
+void RawSequenceWriter::dropCache(qint64 offset, qint64 len)
+{
+#if defined(Q_OS_LINUX)
+    // DONTNEED only evicts clean pages, so write them out first
+    ::sync_file_range(fd, off_t(offset), off_t(len), SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+    ::posix_fadvise(fd, off_t(offset), off_t(len), POSIX_FADV_DONTNEED);
+#else
+    (void)offset; (void)len; // macOS: F_NOCACHE already keeps it out of the cache
+#endif
+}
+
+char *RawSequenceWriter::takeBuffer(qint64 bytes)
+{
+    {
+        QMutexLocker ml(&mut);
+        if (bytes != freeBufferBytes) {
+            // only happens with a frame of the wrong size, which write() will reject anyway
+            for (char *b : freeBuffers) qFreeAligned(b);
+            freeBuffers.clear();
+            freeBufferBytes = bytes;
+        } else if (!freeBuffers.empty()) {
+            char *b = freeBuffers.back();
+            freeBuffers.pop_back();
+            return b;
+        }
+    }
+    return static_cast<char *>(qMallocAligned(size_t(bytes), Alignment));
+}
+
+void RawSequenceWriter::giveBuffer(char *buf, qint64 bytes)
+{
+    QMutexLocker ml(&mut);
+    if (bytes == freeBufferBytes) freeBuffers.push_back(buf);
+    else qFreeAligned(buf);
+}
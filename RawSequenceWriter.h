@@ -0,0 +1,136 @@
+#ifndef RAWSEQUENCEWRITER_H
+#define RAWSEQUENCEWRITER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QString>
+#include <QtGlobal>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "TileCodec.h"
+#ifdef Q_OS_WIN
+#include <QFile>
+#endif
+
+/// Writes Fmt_RAW recordings as a single .fgraw file instead of one file per frame.
+///
+/// File layout (all integers little-endian):
+///
+///     [Header, padded to Alignment bytes]
+///     [frame slot 0][frame slot 1]...   each slot is frameStride bytes (frameBytes rounded up to Alignment)
+///     [IndexEntry x nFrames]            sorted by frameNum, written by close()
+///
+/// Frames go into slots in the order they arrive, which with several writer threads need not be frame number order.
+/// The index maps each frame number to its slot. A file whose header has indexOffset == 0 was not closed properly.
+/// Its slots are still intact, but which frame is in which slot is lost.
+///
+/// With setCompression(), frames are stored losslessly compressed instead (version 2, codec != 0): each is a
+/// TileCodec chunk, starting at an Alignment boundary, padded to the next one. There are no fixed-size slots
+/// (frameStride is 0) and an IndexEntry's slot is the chunk's file offset. A chunk header carries its frame number
+/// and size, so an unclosed file can be recovered completely by walking the chunks.
+///
+/// The file is preallocated in large chunks as it grows (without changing its size, which only ever covers what has
+/// been written), so the filesystem can lay it out contiguously. Every slot is aligned, so (on Linux) frames can be
+/// written with O_DIRECT from aligned buffers, bypassing the page cache.
+/// DropCache mode writes through the page cache, but flushes each frame to disk and then evicts it
+/// (sync_file_range + posix_fadvise(DONTNEED)). Buffered is plain pwrite. On macOS, both Direct and DropCache
+/// map to F_NOCACHE. On Windows everything is Buffered.
+class RawSequenceWriter
+{
+public:
+    enum IOMode { Direct = 0, DropCache, Buffered };
+
+    static constexpr quint32 Alignment = 4096; ///< header size and slot alignment; fine for O_DIRECT on any device
+    static constexpr char Magic[8] = {'F','G','R','A','W','S','E','Q'};
+    static constexpr quint32 Version = 2; ///< uncompressed files are still written as version 1, which has the same layout (codec reads as 0)
+
+    struct Header {
+        char magic[8];
+        quint32 version, headerBytes;
+        quint32 width, height, bytesPerLine, qimageFormat; ///< qimageFormat is a QImage::Format
+        quint64 frameBytes, frameStride, dataOffset;
+        quint64 nFrames, indexOffset; ///< filled in by close()
+        double fps;
+        qint64 startTimeMSecs; ///< since the epoch, UTC
+        quint32 codec, reserved; ///< codec: 0 = uncompressed, else a TileCodec::Codec
+    };
+
+    struct IndexEntry {
+        quint64 frameNum, slot; ///< the frame's data is at dataOffset + slot * frameStride (compressed: at offset slot)
+        qint64 timeNS; ///< when it was captured (or else written), relative to the first frame written. May be < 0.
+    };
+
+    RawSequenceWriter(const QString & fileName, double fps, IOMode mode = Direct);
+    ~RawSequenceWriter(); ///< calls close() if still open
+
+    bool open(QString *errMsg = nullptr); ///< creates (truncates) the file. The header is written with the first frame.
+    bool isOpen() const;
+
+    /// Store frames compressed (see TileCodec). params.level 0 = uncompressed, the default. Call before the first
+    /// frame is written.
+    void setCompression(const TileCodec::Params & params);
+    bool isCompressed() const { return bool(codec); }
+
+    /// A compressed frame, ready to be written. Holds one of the writer's buffers, so must not outlive it.
+    struct Chunk {
+        std::shared_ptr<char> data; ///< aligned, zero-padded to paddedBytes
+        qint64 bytes = 0, paddedBytes = 0; ///< paddedBytes is a multiple of Alignment
+        quint64 frameNum = 0;
+        qint64 captureTimeNS = 0;
+        int width = 0, height = 0, bytesPerLine = 0;
+        QImage::Format format = QImage::Format_Invalid;
+        bool isNull() const { return !data; }
+    };
+
+    /// Thread-safe, and doesn't touch the file, so many frames can be compressed at once while write(Chunk) is
+    /// serialized (if need be) by the caller. Only when compressed. Returns a null Chunk on error.
+    Chunk compress(const QImage & img, quint64 frameNum, QString *errMsg = nullptr, qint64 captureTimeNS = 0);
+    /// Thread-safe. Writes a chunk made by compress().
+    bool write(const Chunk & chunk, QString *errMsg = nullptr);
+
+    /// Thread-safe. All frames must have the same size and format as the first. Frames may be written in any order.
+    /// captureTimeNS is the Util::getTimeNS() the frame was captured at, if known (see Frame::tNS); else 0, and the
+    /// time it's written is indexed instead. If compressed, this is compress() + write(Chunk).
+    bool write(const QImage & img, quint64 frameNum, QString *errMsg = nullptr, qint64 captureTimeNS = 0);
+
+    /// Writes the index and final header and trims the preallocated tail. Not thread-safe with respect to write().
+    bool close(QString *errMsg = nullptr);
+
+    /// The mode actually in use. Direct falls back to DropCache if the filesystem doesn't support it (e.g. tmpfs).
+    IOMode ioMode() const { return mode.load(); }
+    quint64 frameCount() const;
+
+private:
+    bool writeAt(const char *data, qint64 len, qint64 offset, QString *errMsg); ///< positional, thread-safe
+    void preallocate(qint64 offset, qint64 len);
+    void dropCache(qint64 offset, qint64 len);
+    bool checkOpen(QString *errMsg) const; ///< called with mut held
+    /// called with mut held. Sets up hdr for frames of this geometry and writes a provisional header.
+    bool setupFirstFrame(int width, int height, int bpl, QImage::Format fmt, qint64 tNS, QString *errMsg);
+    void growTo(qint64 end, qint64 unitBytes); ///< called with mut held. Preallocates ahead if end is past allocatedTo.
+    char *takeBuffer(qint64 bytes); ///< an aligned buffer of at least bytes
+    void giveBuffer(char *buf, qint64 bytes);
+
+    const QString fileName;
+    const double fps;
+    std::atomic<IOMode> mode;
+#ifdef Q_OS_WIN
+    QFile f;
+    QMutex fileMut; ///< QFile has a single file position, so writes are serialized
+#else
+    int fd = -1;
+#endif
+    mutable QMutex mut; ///< guards everything below, and opening/closing the file
+    bool haveFirst = false, failed = false;
+    Header hdr{};
+    qint64 allocatedTo = 0; ///< file offset up to which we've preallocated
+    qint64 dataEnd = 0; ///< compressed: where the next chunk goes
+    qint64 t0NS = 0;
+    std::vector<IndexEntry> index;
+    std::vector<char *> freeBuffers;
+    qint64 freeBufferBytes = 0; ///< the size of everything in freeBuffers
+    std::unique_ptr<TileCodec> codec; ///< only if compressed
+};
+
+#endif // RAWSEQUENCEWRITER_H
@@ -1,46 +1,142 @@
 #include "Recorder.h"
 #include "Settings.h"
 #include "Util.h"
-#include "quazip/quazip.h"
-#include "quazip/quazipfile.h"
+#include "ZipWriter.h"
+#include "RawSequenceWriter.h"
+#include "ImageEncoder.h"
+#include "WriteBehindBuffer.h"
+#include "StripeSet.h"
+#include "PreTriggerBuffer.h"
 #include "FFmpegEncoder.h"
+#include "LatencyStats.h"
 #include <QDir>
 #include <QDateTime>
-#include <QThreadPool>
-#include <QByteArray>
-#include <QBuffer>
+#include <QFile>
+#include <QFileInfo>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QThread>
+#include <QThreadPool>
+#include <QByteArray>
 #include <QTimer>
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
+#include <vector>
+#ifndef Q_OS_WIN
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+namespace {
+    /// Asks the OS to put what's been written to path (a file or a directory of them) on disk, and waits for it.
+    /// Best effort. On Linux it's 1 syncfs() for the whole filesystem, rather than an fsync() per file.
+    void syncToDisk(const QString & path)
+    {
+#if defined(Q_OS_LINUX)
+        if (const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY); fd > -1) {
+            if (::syncfs(fd) != 0) Debug() << "syncfs " << path << ": " << std::strerror(errno);
+            ::close(fd);
+        }
+#elif !defined(Q_OS_WIN)
+        if (QFileInfo(path).isDir()) {
+            ::sync(); // no syncfs(): 1 sync() beats an fsync() per frame file
+        } else if (const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY); fd > -1) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#else
+        Q_UNUSED(path) // closing handed it all to the OS, which is as far as Windows goes without a write handle
+#endif
+    }
+
+    PreTriggerBuffer *newPreTrigger(Recorder *rec, const PreTriggerBuffer::Config &cfg)
+    {
+        // the drop callback runs on the buffer's store thread, so the signal is queued to wherever it's connected
+        return new PreTriggerBuffer(cfg, [rec](quint64 num){ emit rec->frameDropped(num); });
+    }
+}
 
 struct Recorder::Pvt
 {
-    Pvt(const QString &o, Settings::Fmt f, double fps) : dest(o), format(f) {
+    /// o is what's reported as the recording's location: the manifest if striping, else the only target's path.
+    Pvt(quint64 serial_in, const QString &o, const QStringList &targetPaths, const Settings &settings,
+        const QSize &frameSize, const StripeSet::ErrorFunc &onStripeError)
+        : serial(serial_in), dest(o), format(settings.format), zipLevel(qBound(0, settings.zipLevel, 9)) {
         using namespace std::chrono;
         auto pollBytesTimer = 333ms;
+        const double fps = settings.fps;
         if (Settings::FFmpegFormats.count(format)) {
-            unsigned n = Util::getNPhysicalProcessors();
+            unsigned n = settings.transient.nThreads > 0 ? unsigned(settings.transient.nThreads) : Util::getNPhysicalProcessors();
             if (n < 1) n = 1;
             pool.setMaxThreadCount(1); // only 1 processing thread. multiple threads happen in the encoder itself.
             isZip = false;
-            ff = new FFmpegEncoder(dest, fps, qint64(1e6*60)/*qint64(Frame::DefaultWidth())*qint64(Frame::DefaultHeight())*2LL*8LL*qint64(fps)*/, format, n);
+            FFmpegEncoder::QueuePolicy qpol = FFmpegEncoder::DropNewest;
+            switch (settings.queuePolicy) {
+            case Settings::Queue_DropOldest: qpol = FFmpegEncoder::DropOldest; break;
+            case Settings::Queue_Block: qpol = FFmpegEncoder::BlockProducer; break;
+            default: break;
+            }
+            // each queued frame holds on to its (at most 32-bit) source image plus the converted frame, which is at
+            // most as big
+            const qint64 frameBytes = qint64(qMax(frameSize.width(), 1))*qint64(qMax(frameSize.height(), 1))*4LL*2LL;
+            ff = new FFmpegEncoder(dest, fps, qint64(1e6*60)/*qint64(Frame::DefaultWidth())*qint64(Frame::DefaultHeight())*2LL*8LL*qint64(fps)*/, format, n,
+                                   qpol, qint64(settings.queueMemMB)*1024LL*1024LL, frameBytes);
+            ff->setConversionSlices(settings.transient.convSlices);
             pollBytesTimer = 1s;
         } else {
-            int n = QThread::idealThreadCount()-1;
+            int n = settings.transient.nThreads > 0 ? settings.transient.nThreads : QThread::idealThreadCount()-1;
             if (n < 1) n = 1;
             pool.setMaxThreadCount(n);
-            if (dest.endsWith(".zip")) {
-                isZip = true;
-                zip = new QuaZip(dest);
-                if (!zip->open(QuaZip::mdCreate)) {
-                    Error() << "Error opening zip";
-                    delete zip; zip = nullptr;
-                    return;
+            if (format == Settings::Fmt_PNG || format == Settings::Fmt_JPG) {
+                ImageEncoder::Params ip;
+                ip.jpgQuality = settings.jpgQuality;
+                ip.subsampling = ImageEncoder::Subsampling(settings.jpgSubsampling); // same order
+                ip.pngLevel = settings.pngLevel;
+                ip.nStripThreads = n;
+                imgEnc = new ImageEncoder(format, ip);
+            }
+            isRawSeq = targetPaths.value(0).endsWith(".fgraw");
+            isZip = targetPaths.value(0).endsWith(".zip");
+            for (const auto & path : targetPaths) {
+                targets.emplace_back();
+                Target & t = targets.back();
+                t.dest = path;
+                if (isRawSeq) {
+                    RawSequenceWriter::IOMode mode = RawSequenceWriter::Direct;
+                    switch (settings.rawIO) {
+                    case Settings::RawIO_DropCache: mode = RawSequenceWriter::DropCache; break;
+                    case Settings::RawIO_Buffered: mode = RawSequenceWriter::Buffered; break;
+                    default: break;
+                    }
+                    t.rawSeq = new RawSequenceWriter(path, fps, mode);
+                    if (settings.rawCompressLevel > 0) {
+                        TileCodec::Params tp;
+                        tp.level = settings.rawCompressLevel;
+                        tp.predictor = settings.rawPredictor;
+                        tp.nThreads = n;
+                        t.rawSeq->setCompression(tp);
+                    }
+                    if (QString err; !t.rawSeq->open(&err)) {
+                        Error() << "Error opening raw sequence file " << path << ": " << err;
+                        delete t.rawSeq; t.rawSeq = nullptr;
+                    }
+                } else if (isZip) {
+                    t.zip = new ZipWriter(path);
+                    if (QString err; !t.zip->open(&err)) {
+                        Error() << "Error opening zip " << path << ": " << err;
+                        delete t.zip; t.zip = nullptr;
+                    }
+                }
+            }
+            if (targets.size() > 1) {
+                stripes = new StripeSet(dest, targetPaths, onStripeError);
+                if (QString err; !stripes->open(&err)) {
+                    Error() << "Error creating stripe manifest: " << err;
+                    delete stripes; stripes = nullptr;
                 }
-                zip->setZip64Enabled(true);
-                zipFile = new QuaZipFile(zip);
             }
         }
         QTimer *t = new QTimer(&perSecMB);
@@ -50,75 +146,290 @@ struct Recorder::Pvt
         });
         t->start(pollBytesTimer);
     }
-    ~Pvt() {
-        if (zipFile) { if (zipFile->isOpen()) zipFile->close(); delete zipFile; zipFile = nullptr; }
-        if (zip) { if (zip->isOpen()) zip->close(); delete zip; zip = nullptr; }
-        if (ff) { delete ff; ff = nullptr; }
+    ~Pvt() { finish(); }
+
+    /// Writes out everything still queued and closes the files. Slow (seconds, for a big queue or zip directory),
+    /// so stop() has the finalizer thread do it. Leaves only the cheap stuff for the destructor.
+    void finish() {
+        if (finished) return;
+        finished = true;
+        if (preFlush) { // the pre-trigger frames (and the live ones behind them) still go in ahead of the drain
+            preFlush->wait();
+            delete preFlush; preFlush = nullptr;
+        }
+        if (wbb) wbb->drain(); // everything buffered still gets written
+        pool.waitForDone();
+        if (stripes) { // waits for the stripes' writer threads. Before wbb goes: their queued jobs hold some of its budget.
+            if (QString err; !stripes->close(&err)) Error() << "Error finishing stripe manifest: " << err;
+            delete stripes; stripes = nullptr;
+        }
+        delete take(wbb);
+        for (auto & t : targets) {
+            if (t.zip) {
+                if (QString err; !t.zip->close(&err)) Error() << "Error finishing zip: " << err;
+                delete t.zip; t.zip = nullptr;
+            }
+            if (t.rawSeq) {
+                if (QString err; !t.rawSeq->close(&err)) Error() << "Error finishing raw sequence file: " << err;
+                delete t.rawSeq; t.rawSeq = nullptr;
+            }
+        }
+        if (ff) {
+            ff->close(); // flushes the encoder
+            nWritten = ff->framesWritten();
+        }
+        delete take(ff); // writes the trailer
+        if (imgEnc) { delete imgEnc; imgEnc = nullptr; }
+        delete take(preBuf); // only now: it waits for the images it handed out to be let go of
+        for (const auto & t : targets) syncToDisk(t.dest);
+        if (targets.size() > 1) syncToDisk(dest); // the manifest
+    }
+
+    /// frames still to be written, for finalizeProgress(). Thread-safe with respect to finish().
+    int framesLeft() {
+        QMutexLocker ml(&finishMut);
+        const int pre = preBuf ? preBuf->stats().frames : 0;
+        if (ff) return pre + ff->queueStats().depth;
+        return pre + (wbb ? wbb->stats().frames : 0) + pool.activeThreadCount();
     }
+    /// nulls ptr, under finishMut, so framesLeft() doesn't look at it while it's deleted
+    template <typename T> T *take(T *& ptr) { QMutexLocker ml(&finishMut); T *ret = ptr; ptr = nullptr; return ret; }
+
+    const quint64 serial; ///< tells recordings apart (see stopLater())
     QThreadPool pool;
     QString dest;
     const Settings::Fmt format;
-    bool isZip = false;
-    QuaZip *zip = nullptr;
-    QuaZipFile *zipFile = nullptr;
-    QMutex mut;
+    const int zipLevel; ///< 0 = store, 1-9 = deflate. Only applied to RAW frames; PNG/JPG are already compressed.
+    /// Where frames go: a directory, .zip or .fgraw. Just 1, unless striping over several drives.
+    struct Target {
+        QString dest;
+        ZipWriter *zip = nullptr;
+        RawSequenceWriter *rawSeq = nullptr; ///< if not null, RAW frames all go to this 1 file
+    };
+    std::vector<Target> targets;
+    bool isZip = false, isRawSeq = false;
+    StripeSet *stripes = nullptr; ///< if striping: round-robins the targets' writes, 1 writer thread each
+    ImageEncoder *imgEnc = nullptr; ///< for PNG/JPG
+    WriteBehindBuffer *wbb = nullptr; ///< frames waiting for pool (non-FFmpeg formats only)
     PerSec perSecMB, perSecFrames;
     std::atomic<qint64> wroteBytes;
+    QThread *preFlush = nullptr; ///< feeds the pre-trigger buffer's frames in ahead of the live ones
+    PreTriggerBuffer *preBuf = nullptr; ///< the buffer preFlush was still taking from when stop() handed it over to us
+    QThread *finalizer = nullptr; ///< runs finish() once stopped
+    std::atomic_bool stopped{false}; ///< from stop() on: frames still being written are no longer reported
+    std::atomic<quint64> nWritten{0}; ///< frames written, reported or not. Complete once finish() is done.
+    bool finished = false;
+    QMutex finishMut; ///< guards wbb, ff and preBuf while finish() deletes them
 
     FFmpegEncoder *ff = nullptr;
 };
 
 Recorder::Recorder(QObject *parent) : QObject(parent)
 {
-    // this is so our ThreadPool thread can stop recording by posting this signal to the main thread.
-    connect(this, SIGNAL(stopLater()), this, SLOT(stop()));
+    // this is so our ThreadPool thread can stop recording by posting this signal to the main thread. By then it may
+    // have been stopped, and even another one started, which must be left alone.
+    connect(this, &Recorder::stopLater, this, [this](quint64 serial){ if (p && p->serial == serial) stop(); },
+            Qt::QueuedConnection);
     connect(this, SIGNAL(wroteFrame(quint64)), this, SLOT(didWriteFrame()));
 }
 
 Recorder::~Recorder()
 {
-    if (isRecording()) stop(); // implicitly deletes p, if non-null
+    if (isRecording()) stop();
+    waitForFinalized();
+    delete pre; pre = nullptr;
 }
 
 void Recorder::stop()
 {
-    if (p) {
-        if (p->pool.activeThreadCount()) p->pool.waitForDone();
-        delete p; p = nullptr;
-        emit stopped();
+    if (!p) return;
+    Pvt * const pv = p;
+    if (pv->preFlush && pv->preFlush->isFinished()) {
+        delete pv->preFlush; pv->preFlush = nullptr;
+    } else if (pv->preFlush) {
+        // The pre-trigger frames still get recorded, and so do the live ones queued behind them, which can take a
+        // while if the disk is behind. So the recording takes the buffer along, the finalizer waits for the flush
+        // rather than us, and the next recording gets a buffer of its own.
+        pv->preBuf = pre;
+        pre = newPreTrigger(this, pv->preBuf->config());
+    }
+    p = nullptr;
+    pv->stopped = true;
+    // Its timers would report on whatever p is now. Only finalizeProgress() is of interest from here on.
+    for (QTimer *t : pv->perSecMB.findChildren<QTimer *>()) t->stop();
+    QTimer *t = new QTimer(&pv->perSecMB); // dies with pv
+    connect(t, &QTimer::timeout, this, [this, pv]{ emit finalizeProgress(pv->dest, pv->framesLeft()); });
+    t->start(250);
+
+    // Writing out the queue, the zip's central directory, the video trailer etc. can take seconds, so it's done on
+    // a thread of its own. The next recording may start meanwhile, with its own Pvt and files.
+    pv->finalizer = QThread::create([pv]{ pv->finish(); });
+    pv->finalizer->setObjectName("Recording Finalizer");
+    if (pv->ff) {
+        disconnect(pv->ff, nullptr, this, nullptr); // its drops and writes from here on aren't the next recording's
+        connect(pv->ff, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
+        pv->ff->moveToThread(pv->finalizer); // it gets deleted there
+    }
+    connect(pv->finalizer, &QThread::finished, this, [this, serial = pv->serial]{ finalizeDone(serial); });
+    finalizing.push_back(pv);
+    pv->finalizer->start();
+
+    if (pre) pre->restart(); // and fill it up for the next recording
+    emit stopped();
+    emit finalizeProgress(pv->dest, pv->framesLeft());
+}
+
+void Recorder::finalizeDone(quint64 serial)
+{
+    const auto it = std::find_if(finalizing.begin(), finalizing.end(), [serial](Pvt *pv){ return pv->serial == serial; });
+    if (it == finalizing.end()) return; // waitForFinalized() got to it first
+    Pvt * const pv = *it;
+    finalizing.erase(it);
+    pv->finalizer->wait();
+    delete pv->finalizer; pv->finalizer = nullptr;
+    const QString location = pv->dest;
+    const quint64 nWritten = pv->nWritten;
+    delete pv;
+    emit finalized(location, nWritten);
+}
+
+void Recorder::waitForFinalized()
+{
+    while (!finalizing.empty()) {
+        finalizing.front()->finalizer->wait();
+        finalizeDone(finalizing.front()->serial);
     }
 }
 
 bool Recorder::isRecording() const { return !!p; }
 
-QString Recorder::start(const Settings &settings, QString *saveLocation)
+void Recorder::setPreTrigger(const Settings &settings)
+{
+    if (isRecording()) return;
+    PreTriggerBuffer::Config cfg;
+    cfg.seconds = settings.preTriggerSecs;
+    cfg.fps = settings.fps > 0. ? settings.fps : Frame::DefaultFPS();
+    cfg.maxBytes = qint64(qMax(settings.preTriggerMemMB, 1)) * 1024LL * 1024LL;
+    cfg.compressLevel = settings.preTriggerCompress ? 1 : 0; // fastest: it has to keep up with the camera
+    cfg.nThreads = settings.transient.nThreads;
+    if (pre) {
+        const auto & c = pre->config();
+        if (cfg.seconds > 0. && c.seconds == cfg.seconds && c.fps == cfg.fps && c.maxBytes == cfg.maxBytes
+                && c.compressLevel == cfg.compressLevel && c.nThreads == cfg.nThreads)
+            return;
+        delete pre; pre = nullptr;
+    }
+    if (cfg.seconds <= 0.) {
+        if (preTimer) preTimer->stop();
+        return;
+    }
+    pre = newPreTrigger(this, cfg);
+    if (!preTimer) {
+        preTimer = new QTimer(this);
+        connect(preTimer, &QTimer::timeout, this, [this]{
+            if (!pre || isRecording()) return;
+            const auto st = pre->stats();
+            emit preTriggerFill(st.frames, st.seconds, st.bytes, st.capacityBytes);
+        });
+    }
+    preTimer->start(1000);
+}
+
+QString Recorder::start(const Settings &settings, const QSize &frameSize, QString *saveLocation)
 {
     if (isRecording()) return "Recording already running!";
     QDir d(settings.saveDir);
     if (!d.exists()) return "Save directory invalid.";
 
-    QString dest = QString("%1%2")
+    // Image formats may be striped: saveDir gets the manifest and the first stripe, each of stripeDirs one more.
+    QStringList dirs(settings.saveDir);
+    if (!Settings::FFmpegFormats.count(settings.format)) {
+        for (const auto & sd : settings.stripeDirs) {
+            if (!QDir(sd).exists()) return QString("Stripe directory %1 invalid.").arg(sd);
+            dirs.append(sd);
+        }
+    }
+
+    const QString baseName = QString("%1%2")
             .arg(settings.savePrefix.isEmpty() ? "" : QString("%1_").arg(settings.savePrefix))
             .arg(QDateTime::currentDateTime().toString("yyMMdd_HHmmss"));
-    if (Settings::FFmpegFormats.count(settings.format)) dest += ".avi";
-    else if (settings.zipEmbed) dest += ".zip";
-    else {
-        if (!d.mkdir(QString(dest)))
+    QString ext;
+    if (Settings::FFmpegFormats.count(settings.format)) ext = ".avi";
+    else if (settings.format == Settings::Fmt_RAW && settings.rawContainer) ext = ".fgraw";
+    else if (settings.zipEmbed) ext = ".zip";
+    // a recording started within a second of the previous one (which may well still be being finalized) mustn't
+    // land on top of it
+    QString name = baseName;
+    for (int n = 2; ; ++n) {
+        bool taken = dirs.size() > 1 && QFileInfo::exists(settings.saveDir + QDir::separator() + name + StripeSet::ManifestSuffix);
+        for (const auto & dir : dirs) taken = taken || QFileInfo::exists(dir + QDir::separator() + name + ext);
+        if (!taken) break;
+        name = QString("%1_%2").arg(baseName).arg(n);
+    }
+    QStringList targets;
+    for (const auto & dir : dirs) {
+        if (ext.isEmpty() && !QDir(dir).mkdir(name))
             return "Error creating output directory.";
+        targets.append(dir + QDir::separator() + name + ext);
     }
-    dest = settings.saveDir + QDir::separator() + dest;
-    p = new Pvt(dest, settings.format, settings.fps);
+    const QString dest = targets.size() > 1 ? settings.saveDir + QDir::separator() + name + StripeSet::ManifestSuffix
+                                            : targets.front();
+    LatencyStats::resetAll(); // so the DebugWindow shows stats for this recording only
+    // the stripes' writer threads report errors from there, so stop() has to be posted back to this thread
+    const quint64 serial = ++nStarted;
+    p = new Pvt(serial, dest, targets, settings, frameSize, [this, serial](const QString &err){ emit error(err); emit stopLater(serial); });
     if (saveLocation) *saveLocation = dest;
     connect(&p->perSecMB, SIGNAL(perSec(double)), this, SIGNAL(dataRate(double)));
     connect(&p->perSecFrames, SIGNAL(perSec(double)), this, SIGNAL(fps(double)));
     if (p->ff) {
         connect(p->ff, SIGNAL(error(QString)), this, SIGNAL(error(QString)));
-        connect(p->ff, SIGNAL(error(QString)), this, SLOT(stop()));
+        connect(p->ff, &FFmpegEncoder::error, this, [this, serial]{ emit stopLater(serial); });
         connect(p->ff, SIGNAL(frameDropped(quint64)), this, SIGNAL(frameDropped(quint64)));
         connect(p->ff, SIGNAL(wroteFrame(quint64)), this, SIGNAL(wroteFrame(quint64)));
         connect(p->ff, &FFmpegEncoder::wroteBytes, this, [this](qint64 nb){
             if (p) p->wroteBytes += nb;
         });
+        QTimer *t = new QTimer(&p->perSecMB); // dies with p
+        connect(t, &QTimer::timeout, this, [this]{
+            if (!p || !p->ff) return;
+            const auto qs = p->ff->queueStats();
+            emit queueDepth(qs.depth, qs.recentHighWater, qs.highWater, qs.capacity);
+        });
+        t->start(1000);
+    } else {
+        WriteBehindBuffer::Config cfg;
+        cfg.budgetBytes = qMax(qint64(settings.queueMemMB), qint64(1)) * 1024LL * 1024LL;
+        cfg.highWaterPct = settings.bufHighPct;
+        cfg.lowWaterPct = settings.bufLowPct;
+        if (settings.spillEnabled) cfg.spillDir = settings.spillDir;
+        switch (settings.queuePolicy) {
+        case Settings::Queue_DropOldest: cfg.policy = WriteBehindBuffer::DropOldest; break;
+        case Settings::Queue_Block: cfg.policy = WriteBehindBuffer::Block; break;
+        default: break;
+        }
+        // the drop callback may run on a pool thread, so the signal is queued to wherever it's connected
+        p->wbb = new WriteBehindBuffer(cfg, p->pool, [this, pv = p](const Frame &f){ saveFrame_InAThread(pv, f); },
+                                       [this, pv = p](quint64 num){ if (!pv->stopped) emit frameDropped(num); });
+        QTimer *t = new QTimer(&p->perSecMB); // dies with p
+        connect(t, &QTimer::timeout, this, [this]{
+            if (!p || !p->wbb) return;
+            const auto st = p->wbb->stats();
+            emit bufferFill(st.memBytes, st.memHighWater, st.budgetBytes, st.spilledBytes);
+        });
+        t->start(1000);
+    }
+    if (pre) {
+        const auto st = pre->stats();
+        emit preTriggerFill(st.frames, st.seconds, st.bytes, st.capacityBytes);
+        // From here on saveFrame() queues live frames behind the buffered ones, until preFlush has taken them all.
+        // Nothing may be dropped on the way: they're all that's left of those seconds.
+        if (pre->beginFlush()) {
+            p->preFlush = QThread::create([this, pv = p, buf = pre]{
+                for (Frame f; !(f = buf->take()).isNull(); ) enqueue(pv, f, true);
+            });
+            p->preFlush->setObjectName("PreTrigger Flush");
+            p->preFlush->start();
+        }
     }
     emit started(dest);
     return QString();
@@ -126,90 +437,137 @@ QString Recorder::start(const Settings &settings, QString *saveLocation)
 
 void Recorder::saveFrame(const Frame &f_in)
 {
-    if (!isRecording()) return;
-    if (!p->ff) {
-        // no FFmpegEncoder, use "img save"
-        Frame f(f_in);
-        if (!LambdaRunnable::tryStart(p->pool, [this, f] { saveFrame_InAThread(f); })) {
-            Warning() << "Frame " << f.num << " dropped";
-            emit frameDropped(f.num);
+    if (!isRecording()) {
+        if (pre) pre->push(f_in);
+        return;
+    }
+    if (pre && pre->pushIfFlushing(f_in)) return; // it goes in behind the pre-trigger frames still being flushed
+    enqueue(p, f_in, false);
+}
+
+void Recorder::enqueue(Pvt * const pv, const Frame &f_in, bool block)
+{
+    if (!pv->ff) {
+        // no FFmpegEncoder, use "img save". The frame waits in the write-behind buffer for a pool thread.
+        if (!pv->wbb->push(f_in, block)) {
+            Warning() << "Frame " << f_in.num << " dropped (write-behind buffer full)";
+            if (!pv->stopped) emit frameDropped(f_in.num);
         }
     } else {
         // use FFmpegEncoder
-        if (QString err; ! p->ff->enqueue(f_in, &err) )
+        if (QString err; ! pv->ff->enqueue(f_in, &err, block) )
             Warning() << err;
     }
 }
 
-void Recorder::saveFrame_InAThread(const Frame &f)
+void Recorder::saveFrame_InAThread(Pvt * const pv, const Frame &f)
 {
-    if (!p) {
+    if (!pv) {
         // defensive programming.  this check is not going to ever be true (unless we change this class around and forget to update this code).
-        QString err("INTERNAL ERROR: 'p' ptr is null but we are still saving in saveFrame_InAThread_NoZip!");
+        QString err("INTERNAL ERROR: 'pv' ptr is null but we are still saving in saveFrame_InAThread!");
         Error() << err; emit error(err); return;
     }
 
     struct Err { QString err; };
 
     try {
-        if (p->isZip && (!p->zip || !p->zipFile))
-            throw Err{"Zip File could not be opened. Check the destination directory."};
-        QString ext = Settings::fmt2String(p->format).toLower();
-
-        QIODevice *out = nullptr;
-        QByteArray outbytes;
-        QBuffer outbuf(&outbytes);
-        const QString fname = QString("Frame_%1.%2").arg(f.num,6,10,QChar('0')).arg(ext);
-        QFile outf(p->dest + QDir::separator() + fname);
-        qint64 wroteBytes = 0LL;
-        if (p->isZip)
-            out = &outbuf;
-        else
-            out = &outf;
-        if (!out->open(QFile::WriteOnly|QFile::NewOnly))
-            throw Err{out->errorString()};
-        if (p->format == Settings::Fmt_RAW) {
-            // not zip file, write to file
-            const qint64 len = f.img.bytesPerLine()*f.img.height();
-            if (p->isZip) {
-                // zip file.. skip writing to buffer.. instear "point" buffer at img data. This usage ensures no extra copying
-                outbytes = QByteArray::fromRawData(reinterpret_cast<const char *>(f.img.constBits()), int(len));
+        if (pv->targets.size() > 1 && !pv->stripes)
+            throw Err{"Stripe manifest could not be created. Check the save directory."};
+        const int stripe = pv->stripes ? pv->stripes->next() : 0;
+        Pvt::Target & t = pv->targets[size_t(stripe)];
+        // Everything up to the write itself (encoding, compressing, checksumming) happens right here, concurrently on
+        // all of the pool's threads. The write is the job: run right away, or when striping, on the stripe's writer thread.
+        StripeSet::Job job;
+        qint64 jobBytes = 0; // what job holds on to: the frame, and/or what it was encoded or compressed into
+        if (pv->isRawSeq) {
+            if (!t.rawSeq)
+                throw Err{"Raw sequence file could not be opened. Check the destination directory."};
+            if (t.rawSeq->isCompressed()) {
+                // like a zip entry: compressed here, concurrently, and only the write is the job
+                QString err;
+                const auto chunk = t.rawSeq->compress(f.img, f.num, &err, f.tNS);
+                if (chunk.isNull())
+                    throw Err{QString("Error compressing frame %1: %2").arg(f.num).arg(err)};
+                jobBytes = chunk.paddedBytes;
+                job = [this, pv, &t, chunk](QString *err) {
+                    if (!t.rawSeq->write(chunk, err)) return false;
+                    pv->wroteBytes += chunk.paddedBytes;
+                    ++pv->nWritten;
+                    if (!pv->stopped) emit wroteFrame(chunk.frameNum); // (once stopped, it's finalizeProgress())
+                    return true;
+                };
             } else {
-                // not a zip file. write to output file.
-                if (const qint64 res = out->write(reinterpret_cast<const char *>(f.img.constBits()), len); res < 0LL)
-                    throw Err{out->errorString()};
-                else if (res != len)
-                    throw Err{"Short write"};
-            }
-        } else if (p->format == Settings::Fmt_PNG || p->format == Settings::Fmt_JPG) {
-            // JPG/PNG needs conversion so this usage does the conversion. In the zip file case we are writing to outbytes.
-            // In the non zip file case we are writing to a disk file here.
-            if (!f.img.save(out, ext.toUpper().toUtf8().constData()))
-                throw Err{QString("Error writing %1 image").arg(ext.toUpper())};
-        } else
-            throw Err{"Invalid format"};
-        if (p->isZip) {
-            QuaZipNewInfo inf(fname);
-            inf.setPermissions(QFile::Permissions(0x6666));
-            QMutexLocker ml(&p->mut); // only 1 thread at a time can modify the QuaZipFile object...
-            if (!p->zipFile->open(QuaZipFile::WriteOnly|QuaZipFile::NewOnly, inf, nullptr, 0, Z_DEFLATED, Z_NO_COMPRESSION)) {
-                throw Err{p->zipFile->errorString()};
+                jobBytes = f.img.sizeInBytes();
+                job = [this, pv, &t, f](QString *err) {
+                    if (!t.rawSeq->write(f.img, f.num, err, f.tNS)) return false;
+                    pv->wroteBytes += qint64(f.img.bytesPerLine()) * f.img.height();
+                    ++pv->nWritten;
+                    if (!pv->stopped) emit wroteFrame(f.num);
+                    return true;
+                };
             }
-            if (qint64 len = p->zipFile->write(outbytes); len != outbytes.length()) {
-                throw Err{p->zipFile->errorString()};
+        } else {
+            if (pv->isZip && !t.zip)
+                throw Err{"Zip File could not be opened. Check the destination directory."};
+            const QString ext = Settings::fmt2String(pv->format).toLower();
+            const QString fname = QString("Frame_%1.%2").arg(f.num,6,10,QChar('0')).arg(ext);
+            QByteArray outbytes;
+            if (pv->format == Settings::Fmt_RAW) {
+                // zip: no copy, "point" outbytes at the img data (the job holds on to f, and so to the data).
+                // Otherwise the job writes straight from the image.
+                const qint64 len = qint64(f.img.bytesPerLine())*f.img.height();
+                if (pv->isZip) outbytes = QByteArray::fromRawData(reinterpret_cast<const char *>(f.img.constBits()), int(len));
+            } else if (pv->format == Settings::Fmt_PNG || pv->format == Settings::Fmt_JPG) {
+                // JPG/PNG needs encoding, which ImageEncoder spreads over several threads.
+                if (QString err; !pv->imgEnc->encode(f.img, outbytes, &err))
+                    throw Err{QString("Error writing %1 image: %2").arg(ext.toUpper()).arg(err)};
             } else
-                wroteBytes = len;
-            p->zipFile->close();
-            if (p->zipFile->getZipError() != Z_OK) {
-                throw Err{"Error on close within zip file"};
+                throw Err{"Invalid format"};
+            jobBytes = f.img.sizeInBytes() + (pv->format == Settings::Fmt_RAW ? 0 : outbytes.size()); // RAW: outbytes is f's data
+            if (pv->isZip) {
+                // Only ZipWriter::append() (which is just the write() calls) is serialized.
+                const auto entry = ZipWriter::prepare(fname, outbytes, pv->format == Settings::Fmt_RAW ? pv->zipLevel : 0);
+                job = [this, pv, &t, f, entry](QString *err) {
+                    if (!t.zip->append(entry, err)) return false;
+                    pv->wroteBytes += entry.data.size();
+                    ++pv->nWritten;
+                    if (!pv->stopped) emit wroteFrame(f.num);
+                    return true;
+                };
+            } else {
+                job = [this, pv, path = t.dest + QDir::separator() + fname, f, outbytes](QString *err) {
+                    QFile outf(path);
+                    if (!outf.open(QFile::WriteOnly|QFile::NewOnly)) {
+                        if (err) *err = outf.errorString();
+                        return false;
+                    }
+                    const char *data = outbytes.constData();
+                    qint64 len = outbytes.size();
+                    if (pv->format == Settings::Fmt_RAW) {
+                        data = reinterpret_cast<const char *>(f.img.constBits());
+                        len = qint64(f.img.bytesPerLine())*f.img.height();
+                    }
+                    if (const qint64 res = outf.write(data, len); res != len) {
+                        if (err) *err = res < 0LL ? outf.errorString() : QString("Short write");
+                        return false;
+                    }
+                    pv->wroteBytes += len;
+                    ++pv->nWritten;
+                    if (!pv->stopped) emit wroteFrame(f.num);
+                    return true;
+                };
             }
-        } else
-            wroteBytes = out->pos();
-        p->wroteBytes += wroteBytes;
-        emit wroteFrame(f.num);
+        }
+        if (pv->stripes) {
+            // The job waits in the stripe's queue after we return, and the write-behind buffer stops counting the frame
+            // then, so the job counts against the budget itself until it's done (or dropped).
+            pv->stripes->submit(stripe, f.num, [job, held = pv->wbb->hold(jobBytes)](QString *err) { return job(err); });
+            // errors are reported from the writer thread, via onStripeError
+        } else if (QString err; !job(&err))
+            throw Err{err};
     } catch (const Err & e) {
         emit error(e.err);
-        emit stopLater();
+        emit stopLater(pv->serial);
         return;
     }
 }
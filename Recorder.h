@@ -2,8 +2,12 @@
 #define RECORDER_H
 
 #include <QObject>
+#include <QSize>
+#include <vector>
 #include "Frame.h"
 struct Settings;
+class PreTriggerBuffer;
+class QTimer;
 
 // TODO: much optimization
 class Recorder : public QObject
@@ -13,18 +17,45 @@ public:
     explicit Recorder(QObject *parent = nullptr);
     ~Recorder() override;
 
-    QString start(const Settings &, QString *saveLocation = nullptr); ///< on success, returns an empty QString. on failure returns an error message.
+    /// frameSize: what saveFrame() will be given, which sizes the encoder's frame queue. On success, returns an empty
+    /// QString. On failure returns an error message.
+    QString start(const Settings &, const QSize &frameSize, QString *saveLocation = nullptr);
     bool isRecording() const;
+    /// True while recordings stop() has ended are still being finished in the background (see finalized()).
+    bool isFinalizing() const { return !finalizing.empty(); }
+    /// Blocks until every recording stop() has ended is completely on disk, emitting finalized() for each.
+    void waitForFinalized();
+    /// Keeps the last settings.preTriggerSecs of frames given to saveFrame() while not recording, to record first
+    /// thing when recording starts. 0 seconds turns that off. Ignored while recording. Settings that don't change
+    /// anything keep what's already buffered.
+    void setPreTrigger(const Settings &);
 
 signals:
     void started(QString location);
+    /// Recording has stopped: no more frames are taken, and start() may be called again right away. What was
+    /// still queued is written out, and the files finished, in the background; finalized() follows once that's done.
     void stopped();
+    /// emitted periodically while location, a recording that has stopped, is being finished: framesLeft frames are
+    /// still waiting to be written. 0 means they all have been, and the files are being closed and synced.
+    void finalizeProgress(QString location, int framesLeft);
+    /// location is completely written, closed, and (as far as the OS will say) on disk. framesWritten counts every
+    /// frame in it, including those written after stop(), which wroteFrame() doesn't report.
+    void finalized(QString location, quint64 framesWritten);
     void error(QString); ///< emitted during recording iff error occurs.
     void wroteFrame(quint64 frameNum);
     void frameDropped(quint64);
-    void stopLater();
+    void stopLater(quint64 serial); ///< stop() the recording with this Pvt::serial, if it's still the current one
     void dataRate(double mbPerSec); ///< emitted periodically to inform calling code about the MB/sec data rate written to disk
     void fps(double);
+    /// emitted once a second while recording to a video format. recentMax is the deepest the encoder's frame queue got
+    /// in the last second, max is the deepest it got since recording started.
+    void queueDepth(int depth, int recentMax, int max, int capacity);
+    /// emitted once a second while recording to an image format (RAW/PNG/JPG): how much of the write-behind
+    /// buffer's memory budget is in use now and at most in the last second, and how much has spilled to disk.
+    void bufferFill(qint64 bytes, qint64 recentMaxBytes, qint64 budgetBytes, qint64 spilledBytes);
+    /// emitted once a second while the pre-trigger buffer is on and not recording, and once more by start() with
+    /// what's about to be recorded from it: frames (and seconds of them) held in bytes of capacityBytes.
+    void preTriggerFill(int frames, double seconds, qint64 bytes, qint64 capacityBytes);
 
 public slots:
     void stop();
@@ -34,10 +65,16 @@ private slots:
     void didWriteFrame();
 
 private:
-    void saveFrame_InAThread(const Frame &);
-
     struct Pvt;
+    void saveFrame_InAThread(Pvt *, const Frame &); ///< pv, not p: it may be a recording that's being finalized
+    void finalizeDone(quint64 serial); ///< on this thread, once that recording's finalizer thread is done
+    void enqueue(Pvt *, const Frame &, bool block); ///< to pv's encoder or write-behind buffer. block: never drop it.
+
     Pvt *p = nullptr;
+    std::vector<Pvt *> finalizing; ///< stopped recordings whose finalizer threads haven't been reaped yet
+    quint64 nStarted = 0; ///< for Pvt::serial
+    PreTriggerBuffer *pre = nullptr; ///< outlives each recording: it's filled in between them (see stop() for the exception)
+    QTimer *preTimer = nullptr;
 };
 
 #endif // RECORDER_H
@@ -0,0 +1,534 @@
+#include "RecordingReader.h"
+#include "RawSequenceWriter.h"
+#include "StripeSet.h"
+#include "TileCodec.h"
+#include "Util.h"
+#include "quazip/quazip.h"
+#include "quazip/quazipfile.h"
+#include "quazip/quazipfileinfo.h"
+#include "quazip/unzip.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRegularExpression>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+#ifndef Q_OS_WIN
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+namespace {
+    /// A read-only mapping of a whole file. Shared by the reader and every QImage that points into it.
+    struct Mapping {
+        QFile file;
+        uchar *base = nullptr;
+        qint64 size = 0;
+
+        explicit Mapping(const QString & path) : file(path) {}
+        ~Mapping() { if (base) file.unmap(base); }
+
+        bool map(QString *errMsg) {
+            if (!file.open(QIODevice::ReadOnly)) {
+                if (errMsg) *errMsg = file.errorString();
+                return false;
+            }
+            size = file.size();
+            if (size > 0 && !(base = file.map(0, size))) {
+                if (errMsg) *errMsg = QString("Could not map %1: %2").arg(file.fileName()).arg(file.errorString());
+                return false;
+            }
+            return true;
+        }
+    };
+    using MappingPtr = std::shared_ptr<Mapping>;
+
+    void releaseMapping(void *info) { delete static_cast<MappingPtr *>(info); }
+    void releaseByteArray(void *info) { delete static_cast<QByteArray *>(info); }
+
+    /// Wraps bits in a QImage without copying. The image keeps keepAlive alive. Qt wants 32-bit aligned scanlines,
+    /// so if bits isn't (e.g. a zip entry that wasn't written by our ZipWriter) we have to make a copy.
+    QImage wrap(const uchar *bits, const QSize & sz, int bpl, QImage::Format fmt, const MappingPtr & keepAlive)
+    {
+        if (quintptr(bits) % 4 || bpl % 4) {
+            QImage ret(sz, fmt);
+            if (ret.isNull()) return ret;
+            const int rowBytes = qMin(bpl, ret.bytesPerLine());
+            for (int y = 0; y < sz.height(); ++y)
+                std::memcpy(ret.scanLine(y), bits + qint64(y) * bpl, size_t(rowBytes));
+            return ret;
+        }
+        return QImage(bits, sz.width(), sz.height(), bpl, fmt, releaseMapping, new MappingPtr(keepAlive));
+    }
+
+#ifndef Q_OS_WIN
+    void adviseRange(const Mapping & m, qint64 off, qint64 len, int advice)
+    {
+        static const qint64 pageSize = qMax(qint64(::sysconf(_SC_PAGESIZE)), qint64(1));
+        if (!m.base || off >= m.size || len <= 0) return;
+        len = qMin(len, m.size - off);
+        const qint64 start = off / pageSize * pageSize;
+        ::posix_madvise(m.base + start, size_t(len + (off - start)), advice);
+    }
+#endif
+}
+
+struct RecordingReader::Pvt
+{
+    struct Entry {
+        enum Type : quint8 { Raw, Encoded, Chunk }; ///< Encoded = PNG/JPG. Chunk = a compressed .fgraw frame (TileCodec).
+        quint64 num = 0;
+        qint64 offset = 0, size = 0; ///< within the mapping (.fgraw and .zip). For Striped, offset is the index in the stripe.
+        qint64 tNS = 0; ///< from the .fgraw's index: when it was captured, relative to the first frame. 0 if unknown.
+        Type type = Raw;
+        bool deflated = false; ///< a compressed zip entry: has to be read through QuaZip, not the mapping
+        int stripe = -1; ///< Striped only: which of stripes has it
+        QString name; ///< file path (Directory) or entry name (deflated)
+    };
+
+    const QString path;
+    QSize size;
+    QImage::Format format;
+    int bpl = 0;
+    double fps = 0.0;
+    qint64 startMSecs = 0; ///< .fgraw: Header::startTimeMSecs, which Striped rebases its stripes' frame times with
+    Kind kind = Invalid;
+    MappingPtr map; ///< .fgraw and .zip only
+    std::vector<Entry> entries; ///< sorted by frame number
+    QHash<quint64, qint64> byNum;
+    std::atomic_int readahead{0};
+    QuaZip *zip = nullptr; ///< for deflated entries, which need to go through zlib
+    QMutex zipMut;
+    std::vector<std::unique_ptr<RecordingReader>> stripes; ///< Striped only: 1 reader per stripe
+    bool recovered = false; ///< RawSequence only: there was no index, so the frame numbers are guesses
+    bool timed = false; ///< RawSequence only: there was an index, so entries have their tNS
+    std::unique_ptr<TileCodec> codec; ///< compressed .fgraw only
+
+    Pvt(const QString & p, const QSize & sz, QImage::Format fmt) : path(p), size(sz), format(fmt) {
+        bpl = sz.width() * (QImage(1, 1, fmt).depth() / 8);
+    }
+    ~Pvt() { delete zip; zip = nullptr; }
+
+    bool openRawSequence(QString *errMsg);
+    bool openChunks(const RawSequenceWriter::Header & h); ///< the rest of openRawSequence(), for a compressed file
+    bool openZip(QString *errMsg);
+    bool openDirectory(QString *errMsg);
+    bool openStriped(QString *errMsg);
+    void buildIndex(); ///< sorts entries and fills in byNum
+
+    qint64 rawFrameBytes() const { return qint64(bpl) * size.height(); }
+    static bool parseName(const QString & name, quint64 & num, Entry::Type & type);
+};
+
+/* static */
+bool RecordingReader::Pvt::parseName(const QString & name, quint64 & num, Entry::Type & type)
+{
+    static const QRegularExpression re("^Frame_(\\d+)\\.(raw|png|jpg)$", QRegularExpression::CaseInsensitiveOption);
+    const auto m = re.match(QFileInfo(name).fileName());
+    if (!m.hasMatch()) return false;
+    num = m.captured(1).toULongLong();
+    type = m.captured(2).compare("raw", Qt::CaseInsensitive) == 0 ? Entry::Raw : Entry::Encoded;
+    return true;
+}
+
+bool RecordingReader::Pvt::openRawSequence(QString *errMsg)
+{
+    map = std::make_shared<Mapping>(path);
+    if (!map->map(errMsg)) return false;
+    RawSequenceWriter::Header h;
+    if (map->size < qint64(RawSequenceWriter::Alignment)) {
+        if (errMsg) *errMsg = "File too short to be a raw sequence";
+        return false;
+    }
+    std::memcpy(&h, map->base, sizeof(h));
+    // version 1 is the same layout, never compressed
+    const bool chunked = h.version >= 2 && h.codec != 0;
+    if (std::memcmp(h.magic, RawSequenceWriter::Magic, sizeof(h.magic)) != 0 || !h.version || h.version > RawSequenceWriter::Version
+            || (chunked ? h.codec != TileCodec::Deflate : (!h.frameStride || h.frameBytes > h.frameStride))
+            || h.bytesPerLine * quint64(h.height) > h.frameBytes || h.dataOffset < sizeof(h)) {
+        if (errMsg) *errMsg = "Not a raw sequence file, or unsupported version";
+        return false;
+    }
+    size = QSize(int(h.width), int(h.height));
+    format = QImage::Format(h.qimageFormat);
+    bpl = int(h.bytesPerLine);
+    fps = h.fps;
+    startMSecs = h.startTimeMSecs;
+    if (chunked) return openChunks(h);
+
+    const quint64 nSlots = map->size > qint64(h.dataOffset) ? (quint64(map->size) - h.dataOffset) / h.frameStride : 0;
+    auto addSlot = [&](quint64 num, quint64 slot, qint64 tNS) {
+        Entry e;
+        e.num = num;
+        e.tNS = tNS;
+        e.offset = qint64(h.dataOffset + slot * h.frameStride);
+        e.size = qint64(h.frameBytes);
+        entries.push_back(e);
+    };
+    if (h.indexOffset && h.indexOffset + h.nFrames * sizeof(RawSequenceWriter::IndexEntry) <= quint64(map->size)) {
+        entries.reserve(size_t(h.nFrames));
+        timed = true;
+        const uchar *idx = map->base + h.indexOffset;
+        for (quint64 i = 0; i < h.nFrames; ++i) {
+            RawSequenceWriter::IndexEntry ie;
+            std::memcpy(&ie, idx + i * sizeof(ie), sizeof(ie));
+            if (ie.slot < nSlots) addSlot(ie.frameNum, ie.slot, ie.timeNS);
+        }
+    } else {
+        // not closed properly (crash, power loss...): the slots are all there, but not which frame is in which.
+        // Present them in slot order, which is very nearly frame order. The file ends with the last slot written
+        // (the writer preallocates without growing it), so this is no more slots than were written, give or take
+        // a frame or two whose write was cut short.
+        Warning() << path << " has no index (recording was interrupted?), recovering " << nSlots << " frames in write order";
+        entries.reserve(size_t(nSlots));
+        for (quint64 s = 0; s < nSlots; ++s) addSlot(s + 1, s, 0);
+        recovered = true;
+    }
+    return true;
+}
+
+bool RecordingReader::Pvt::openChunks(const RawSequenceWriter::Header & h)
+{
+    codec = std::make_unique<TileCodec>(TileCodec::Params());
+    auto addChunk = [&](quint64 offset, qint64 tNS) -> bool {
+        TileCodec::ChunkHeader ch;
+        qint64 bytes = 0;
+        if (offset < h.dataOffset || offset >= quint64(map->size)
+                || !TileCodec::readHeader(map->base + offset, map->size - qint64(offset), ch, &bytes))
+            return false;
+        Entry e;
+        e.num = ch.frameNum;
+        e.offset = qint64(offset);
+        e.size = bytes;
+        e.type = Entry::Chunk;
+        e.tNS = tNS;
+        entries.push_back(e);
+        return true;
+    };
+    if (h.indexOffset && h.indexOffset + h.nFrames * sizeof(RawSequenceWriter::IndexEntry) <= quint64(map->size)) {
+        entries.reserve(size_t(h.nFrames));
+        timed = true;
+        const uchar *idx = map->base + h.indexOffset;
+        for (quint64 i = 0; i < h.nFrames; ++i) {
+            RawSequenceWriter::IndexEntry ie;
+            std::memcpy(&ie, idx + i * sizeof(ie), sizeof(ie));
+            if (!addChunk(ie.slot, ie.timeNS)) Warning() << path << ": bad chunk for frame " << ie.frameNum << ", skipped";
+        }
+    } else {
+        // not closed properly: walk the chunks. Each starts on an Alignment boundary and says which frame it is, so
+        // nothing is lost but frames whose write never completed. Several writers may have left holes, so a gap is
+        // skipped a block at a time rather than ending the walk.
+        quint64 off = h.dataOffset;
+        while (off + sizeof(TileCodec::ChunkHeader) <= quint64(map->size)) {
+            if (addChunk(off, 0))
+                off += quint64(entries.back().size + RawSequenceWriter::Alignment - 1) / RawSequenceWriter::Alignment
+                       * RawSequenceWriter::Alignment;
+            else
+                off += RawSequenceWriter::Alignment;
+        }
+        Warning() << path << " has no index (recording was interrupted?), recovered " << entries.size() << " compressed frames";
+    }
+    return true;
+}
+
+bool RecordingReader::Pvt::openZip(QString *errMsg)
+{
+    map = std::make_shared<Mapping>(path);
+    if (!map->map(errMsg)) return false;
+    zip = new QuaZip(path);
+    if (!zip->open(QuaZip::mdUnzip)) {
+        if (errMsg) *errMsg = QString("Could not open zip file (error %1)").arg(zip->getZipError());
+        return false;
+    }
+    for (bool more = zip->goToFirstFile(); more; more = zip->goToNextFile()) {
+        QuaZipFileInfo64 info;
+        Entry e;
+        if (!zip->getCurrentFileInfo(&info) || !parseName(info.name, e.num, e.type)) continue;
+        if (info.flags & 1) continue; // encrypted
+        if (info.method == 0) {
+            // stored: find where the data actually starts (after the local header, whose extra field may differ
+            // from the central directory's), so it can be used in place
+            unzFile uf = zip->getUnzFile();
+            if (unzOpenCurrentFile(uf) != UNZ_OK) continue;
+            e.offset = qint64(unzGetCurrentFileZStreamPos64(uf));
+            unzCloseCurrentFile(uf);
+            e.size = qint64(info.uncompressedSize);
+            if (e.offset + e.size > map->size) continue;
+        } else if (info.method == Z_DEFLATED) {
+            e.name = info.name;
+            e.size = qint64(info.uncompressedSize);
+            e.deflated = true;
+        } else
+            continue;
+        entries.push_back(e);
+    }
+    return true;
+}
+
+bool RecordingReader::Pvt::openDirectory(QString *errMsg)
+{
+    const QDir dir(path);
+    const QFileInfoList files = dir.entryInfoList({"Frame_*"}, QDir::Files);
+    for (const auto & fi : files) {
+        Entry e;
+        if (!parseName(fi.fileName(), e.num, e.type)) continue;
+        e.name = fi.absoluteFilePath();
+        e.size = fi.size();
+        entries.push_back(e);
+    }
+    if (entries.empty()) {
+        if (errMsg) *errMsg = "No Frame_NNNNNN.raw/png/jpg files found";
+        return false;
+    }
+    return true;
+}
+
+bool RecordingReader::Pvt::openStriped(QString *errMsg)
+{
+    StripeSet::Manifest m;
+    if (!StripeSet::readManifest(path, m, errMsg)) return false;
+    if (!m.complete) Warning() << path << " has no end line (recording was interrupted?)";
+    // what each stripe wrote, in the order it wrote it
+    std::vector<std::vector<quint64>> written(size_t(m.stripes.size()));
+    for (const auto & [num, stripe] : m.frames) written[size_t(stripe)].push_back(num);
+
+    for (int s = 0; s < m.stripes.size(); ++s) {
+        auto r = std::make_unique<RecordingReader>(m.stripes[s], size, format);
+        if (QString err; !r->open(&err)) {
+            if (errMsg) *errMsg = QString("Stripe %1 (%2): %3").arg(s).arg(m.stripes[s]).arg(err);
+            return false;
+        }
+        Pvt & sp = *r->p;
+        if (sp.recovered) {
+            // Its own index never got written, but the manifest knows: a stripe has 1 writer, so the frames it
+            // wrote are in its slots in manifest order. Slots past those are preallocated space, or frames whose
+            // write never completed.
+            const auto & nums = written[size_t(s)];
+            sp.entries.resize(qMin(sp.entries.size(), nums.size()));
+            for (size_t i = 0; i < sp.entries.size(); ++i) sp.entries[i].num = nums[i];
+            sp.buildIndex();
+            Debug() << "Stripe " << s << ": recovered " << sp.entries.size() << " frames using the manifest";
+        }
+        if (s == 0) {
+            size = sp.size;
+            format = sp.format;
+            bpl = sp.bpl;
+            fps = sp.fps;
+            startMSecs = sp.startMSecs;
+        }
+        // each stripe's times are relative to its own first frame: make them relative to stripe 0's (to the ms the
+        // headers record their starts to)
+        const qint64 rebaseNS = (sp.startMSecs - startMSecs) * 1000000LL;
+        for (size_t i = 0; i < sp.entries.size(); ++i) {
+            Entry e;
+            e.num = sp.entries[i].num;
+            e.offset = qint64(i);
+            e.size = sp.entries[i].size;
+            e.type = sp.entries[i].type;
+            e.deflated = sp.entries[i].deflated;
+            e.stripe = s;
+            e.tNS = sp.timed ? sp.entries[i].tNS + rebaseNS : 0;
+            entries.push_back(e);
+        }
+        stripes.push_back(std::move(r));
+    }
+    return true;
+}
+
+void RecordingReader::Pvt::buildIndex()
+{
+    std::sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) { return a.num < b.num; });
+    byNum.clear();
+    byNum.reserve(int(entries.size()));
+    for (size_t i = 0; i < entries.size(); ++i)
+        byNum.insert(entries[i].num, qint64(i));
+}
+
+RecordingReader::RecordingReader(const QString & path, const QSize & rawSize, QImage::Format rawFormat)
+    : p(new Pvt(path, rawSize, rawFormat))
+{}
+
+RecordingReader::~RecordingReader() {}
+
+bool RecordingReader::open(QString *errMsg)
+{
+    if (p->kind != Invalid) return true;
+    const QFileInfo fi(p->path);
+    bool ok = false;
+    Kind k = Invalid;
+    if (fi.isDir()) ok = p->openDirectory(errMsg), k = Directory;
+    else if (!fi.exists()) { if (errMsg) *errMsg = "No such file or directory"; }
+    else if (p->path.endsWith(".zip", Qt::CaseInsensitive)) ok = p->openZip(errMsg), k = Zip;
+    else if (p->path.endsWith(StripeSet::ManifestSuffix, Qt::CaseInsensitive)) ok = p->openStriped(errMsg), k = Striped;
+    else ok = p->openRawSequence(errMsg), k = RawSequence;
+    if (!ok) {
+        p->entries.clear();
+        p->map.reset();
+        delete p->zip; p->zip = nullptr;
+        p->stripes.clear();
+        return false;
+    }
+    p->buildIndex();
+    p->kind = k;
+    return true;
+}
+
+bool RecordingReader::isOpen() const { return p->kind != Invalid; }
+RecordingReader::Kind RecordingReader::kind() const { return p->kind; }
+qint64 RecordingReader::frameCount() const { return qint64(p->entries.size()); }
+double RecordingReader::fps() const { return p->fps; }
+QSize RecordingReader::frameSize() const { return p->size; }
+
+quint64 RecordingReader::frameNumAt(qint64 index) const
+{
+    return index >= 0 && index < frameCount() ? p->entries[size_t(index)].num : 0;
+}
+
+qint64 RecordingReader::indexOf(quint64 frameNum) const
+{
+    return p->byNum.value(frameNum, -1);
+}
+
+bool RecordingReader::isZeroCopy(qint64 index) const
+{
+    if (index < 0 || index >= frameCount()) return false;
+    const auto & e = p->entries[size_t(index)];
+    if (e.stripe > -1) return p->stripes[size_t(e.stripe)]->isZeroCopy(e.offset);
+    if (e.type != Pvt::Entry::Raw || e.deflated) return false; // (Chunk: decompressed)
+    return p->kind == Directory || !(quintptr(p->map->base + e.offset) % 4);
+}
+
+Frame RecordingReader::frameAt(qint64 index, QString *errMsg) const
+{
+    if (index < 0 || index >= frameCount()) {
+        if (errMsg) *errMsg = "No such frame";
+        return Frame();
+    }
+    const auto & e = p->entries[size_t(index)];
+    if (const int ra = p->readahead.load(std::memory_order_relaxed); ra > 0)
+        willNeed(index + 1, ra);
+    if (e.stripe > -1) {
+        Frame ret = p->stripes[size_t(e.stripe)]->frameAt(e.offset, errMsg);
+        if (!ret.isNull()) ret.tNS = e.tNS;
+        return ret;
+    }
+
+    QImage img;
+    if (e.deflated) {
+        QByteArray *bytes = new QByteArray;
+        {
+            QMutexLocker ml(&p->zipMut);
+            if (p->zip->setCurrentFile(e.name)) {
+                QuaZipFile zf(p->zip);
+                if (zf.open(QIODevice::ReadOnly)) *bytes = zf.readAll();
+            }
+        }
+        if (e.type == Pvt::Entry::Encoded)
+            img = QImage::fromData(*bytes);
+        else if (bytes->size() >= p->rawFrameBytes()) {
+            // inflated RAW: the image just takes over the buffer
+            img = QImage(reinterpret_cast<const uchar *>(bytes->constData()), p->size.width(), p->size.height(), p->bpl,
+                         p->format, releaseByteArray, bytes);
+            bytes = nullptr;
+        }
+        delete bytes;
+    } else if (e.type == Pvt::Entry::Chunk) {
+        QByteArray *bytes = new QByteArray(int(p->rawFrameBytes()), Qt::Uninitialized);
+        if (p->codec->decode(p->map->base + e.offset, e.size, reinterpret_cast<uchar *>(bytes->data()),
+                             p->size.height(), p->bpl, qMax(QImage(1, 1, p->format).depth() / 8, 1), errMsg)) {
+            img = QImage(reinterpret_cast<const uchar *>(bytes->constData()), p->size.width(), p->size.height(), p->bpl,
+                         p->format, releaseByteArray, bytes);
+            bytes = nullptr;
+        }
+        delete bytes;
+    } else if (e.type == Pvt::Entry::Raw) {
+        MappingPtr m = p->map;
+        qint64 off = e.offset;
+        if (p->kind == Directory) {
+            m = std::make_shared<Mapping>(e.name);
+            if (!m->map(errMsg)) return Frame();
+            off = 0;
+        }
+        if (off + p->rawFrameBytes() > m->size) {
+            if (errMsg) *errMsg = QString("Frame %1 is truncated").arg(e.num);
+            return Frame();
+        }
+        img = wrap(m->base + off, p->size, p->bpl, p->format, m);
+    } else if (p->kind == Directory) {
+        img = QImage(e.name);
+    } else {
+        img = QImage::fromData(p->map->base + e.offset, int(e.size));
+    }
+    if (img.isNull()) {
+        if (errMsg) *errMsg = QString("Could not read frame %1").arg(e.num);
+        return Frame();
+    }
+    Frame ret(img, e.num);
+    ret.tNS = e.tNS;
+    return ret;
+}
+
+void RecordingReader::setReadahead(int nFrames)
+{
+    p->readahead = qMax(nFrames, 0);
+}
+
+void RecordingReader::setSequential(bool seq)
+{
+#ifndef Q_OS_WIN
+    if (p->map) adviseRange(*p->map, 0, p->map->size, seq ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_NORMAL);
+    for (auto & r : p->stripes) r->setSequential(seq);
+#else
+    Q_UNUSED(seq)
+#endif
+}
+
+void RecordingReader::willNeed(qint64 index, int count) const
+{
+#ifndef Q_OS_WIN
+    const qint64 end = qMin(index + qint64(qMax(count, 0)), frameCount());
+    for (qint64 i = qMax(index, qint64(0)); i < end; ++i) {
+        const auto & e = p->entries[size_t(i)];
+        if (e.stripe > -1) {
+            p->stripes[size_t(e.stripe)]->willNeed(e.offset);
+        } else if (p->map && !e.deflated) {
+            adviseRange(*p->map, e.offset, e.size, POSIX_MADV_WILLNEED);
+        }
+#  ifdef Q_OS_LINUX
+        else if (p->kind == Directory) {
+            // not mapped until it's read, so ask for the file itself
+            if (const int fd = ::open(QFile::encodeName(e.name).constData(), O_RDONLY); fd > -1) {
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                ::close(fd);
+            }
+        }
+#  endif
+    }
+#else
+    // Windows: PrefetchVirtualMemory() would do it, but needs Windows 8 headers. The OS's own readahead has to do.
+    Q_UNUSED(index) Q_UNUSED(count)
+#endif
+}
+
+void RecordingReader::dontNeed(qint64 index, int count) const
+{
+#ifndef Q_OS_WIN
+    if (!p->map && p->stripes.empty()) return;
+    const qint64 end = qMin(index + qint64(qMax(count, 0)), frameCount());
+    for (qint64 i = qMax(index, qint64(0)); i < end; ++i) {
+        const auto & e = p->entries[size_t(i)];
+        if (e.stripe > -1)
+            p->stripes[size_t(e.stripe)]->dontNeed(e.offset);
+        else if (!e.deflated)
+            adviseRange(*p->map, e.offset, e.size, POSIX_MADV_DONTNEED); // read-only file mapping: pages just get re-read if touched
+    }
+#else
+    Q_UNUSED(index) Q_UNUSED(count)
+#endif
+}
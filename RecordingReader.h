@@ -0,0 +1,68 @@
+#ifndef RECORDINGREADER_H
+#define RECORDINGREADER_H
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <memory>
+#include "Frame.h"
+
+/// Random-access reader for recordings made by Recorder in the 1-file-per-frame formats: a .fgraw raw sequence
+/// (see RawSequenceWriter), a .zip, or a directory of Frame_NNNNNN.ext files. Or a .fgstripe manifest (see StripeSet)
+/// of several of those, striped over different drives, which then read as 1 recording.
+///
+/// Files are memory-mapped, and RAW frames (in an .fgraw, stored in a .zip, or in a directory) come back as Frames
+/// whose QImage points straight into the mapping: no read(), no copy. The image is read-only; the mapping stays
+/// alive for as long as any such image does, even after the reader is gone. PNG/JPG frames are decoded from the
+/// mapping. Deflated zip entries are inflated through QuaZip, and compressed .fgraw frames by TileCodec. All of
+/// those obviously involve a copy.
+///
+/// Seeking is O(1): frameAt() by position, frame() by frame number (via a hash built when opening). Reading is
+/// thread-safe. Readahead hints (madvise) let the OS fetch the next frames while the current one is being used.
+/// That matters for captures much bigger than RAM, where playback should be limited by I/O, not by copying.
+class RecordingReader
+{
+public:
+    enum Kind { Invalid = 0, RawSequence, Zip, Directory, Striped };
+
+    /// rawSize/rawFormat describe RAW frames in a .zip or directory, which (unlike .fgraw) don't record their
+    /// geometry. The defaults are what the app records.
+    explicit RecordingReader(const QString & path,
+                             const QSize & rawSize = QSize(Frame::DefaultWidth(), Frame::DefaultHeight()),
+                             QImage::Format rawFormat = QImage::Format_ARGB32);
+    ~RecordingReader();
+
+    bool open(QString *errMsg = nullptr);
+    bool isOpen() const;
+    Kind kind() const;
+
+    qint64 frameCount() const;
+    quint64 frameNumAt(qint64 index) const; ///< frame numbers, ascending. 0 if index is out of range.
+    qint64 indexOf(quint64 frameNum) const; ///< -1 if there's no such frame
+    double fps() const; ///< as recorded, for .fgraw. 0 if unknown.
+    QSize frameSize() const; ///< RAW frame size, or rawSize for encoded frames
+
+    /// Returns a null Frame on error (bad index, truncated file, corrupt image...). Frames from an .fgraw (or a
+    /// striped set of them) that was closed properly have tNS set to when they were captured, relative to the first
+    /// frame written rather than to Util::getTimeNS(). Everything else has tNS 0: unknown.
+    Frame frameAt(qint64 index, QString *errMsg = nullptr) const;
+    Frame frame(quint64 frameNum, QString *errMsg = nullptr) const { return frameAt(indexOf(frameNum), errMsg); }
+
+    /// Whether frameAt(index) returns a view of the mapping (true) or a decoded/inflated copy (false).
+    bool isZeroCopy(qint64 index) const;
+
+    /// After frameAt(i), hint that frames i+1..i+n will be needed soon. 0 (the default) turns this off.
+    void setReadahead(int nFrames);
+    /// Tell the OS the frames will be read in order (larger readahead, pages dropped sooner behind the reader).
+    void setSequential(bool sequential);
+    /// Hint that frames [index, index+count) will be needed soon. Returns immediately.
+    void willNeed(qint64 index, int count = 1) const;
+    /// Hint that frames [index, index+count) won't be needed again, so their pages may be reclaimed first.
+    void dontNeed(qint64 index, int count = 1) const;
+
+private:
+    struct Pvt;
+    std::unique_ptr<Pvt> p;
+};
+
+#endif // RECORDINGREADER_H
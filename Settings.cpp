@@ -62,9 +62,35 @@ void Settings::load(int scope)
         format = string2Fmt(s.value("format",fmt2String(Fmt_MJPEG)).toString());
         if (!EnabledFormats.count(format)) format = defaultFormat;
         zipEmbed = s.value("zipEmbed", true).toBool();
+        zipLevel = qBound(0, s.value("zipLevel", 0).toInt(), 9);
+        rawContainer = s.value("rawContainer", false).toBool();
+        rawIO = RawIO(s.value("rawIO", RawIO_Direct).toInt());
+        if (rawIO < 0 || rawIO >= RawIO_N) rawIO = RawIO_Direct;
+        rawCompressLevel = qBound(0, s.value("rawCompressLevel", 0).toInt(), 9);
+        rawPredictor = s.value("rawPredictor", true).toBool();
+        jpgQuality = qBound(1, s.value("jpgQuality", 90).toInt(), 100);
+        jpgSubsampling = JpgSubsampling(s.value("jpgSubsampling", Jpg_420).toInt());
+        if (jpgSubsampling < 0 || jpgSubsampling >= Jpg_N) jpgSubsampling = Jpg_420;
+        pngLevel = qBound(0, s.value("pngLevel", 1).toInt(), 9);
         saveDir = s.value("saveDir", QStandardPaths::writableLocation(QStandardPaths::MoviesLocation)).toString();
         savePrefix = s.value("savePrefix", "Recording").toString();
+        stripeDirs = s.value("stripeDirs", QStringList()).toStringList();
         fps = s.value("fps", Frame::DefaultFPS()).toDouble();
+        queuePolicy = QueuePolicy(s.value("queuePolicy", Queue_DropNewest).toInt());
+        if (queuePolicy < 0 || queuePolicy >= Queue_N || queuePolicy == Queue_Block) queuePolicy = Queue_DropNewest; // Block: FG_Bench only
+        queueMemMB = s.value("queueMemMB", 1024).toInt();
+        bufHighPct = qBound(1, s.value("bufHighPct", 80).toInt(), 100);
+        bufLowPct = qBound(0, s.value("bufLowPct", 50).toInt(), bufHighPct);
+        spillEnabled = s.value("spillEnabled", false).toBool();
+        spillDir = s.value("spillDir", QStandardPaths::writableLocation(QStandardPaths::TempLocation)).toString();
+        preTriggerSecs = qMax(s.value("preTriggerSecs", 0.0).toDouble(), 0.0);
+        preTriggerMemMB = qMax(s.value("preTriggerMemMB", 2048).toInt(), 1);
+        preTriggerCompress = s.value("preTriggerCompress", false).toBool();
+        genPattern = GenPattern(s.value("genPattern", Gen_Noise).toInt());
+        if (genPattern < 0 || genPattern >= Gen_N) genPattern = Gen_Noise;
+        genOutput = GenOutput(s.value("genOutput", GenOut_BGRA).toInt());
+        if (genOutput < 0 || genOutput >= GenOut_N) genOutput = GenOut_BGRA;
+        genFreeRunning = s.value("genFreeRunning", false).toBool();
     }
     if (scope & UART) {
         // uart related
@@ -89,8 +115,29 @@ void Settings::save(int scope)
         s.setValue("format", fmt2String(format));
         s.setValue("saveDir", saveDir);
         s.setValue("savePrefix", savePrefix);
+        s.setValue("stripeDirs", stripeDirs);
         s.setValue("zipEmbed", zipEmbed);
+        s.setValue("zipLevel", zipLevel);
+        s.setValue("rawContainer", rawContainer);
+        s.setValue("rawIO", int(rawIO));
+        s.setValue("rawCompressLevel", rawCompressLevel);
+        s.setValue("rawPredictor", rawPredictor);
+        s.setValue("jpgQuality", jpgQuality);
+        s.setValue("jpgSubsampling", int(jpgSubsampling));
+        s.setValue("pngLevel", pngLevel);
         s.setValue("fps", fps);
+        s.setValue("queuePolicy", int(queuePolicy));
+        s.setValue("queueMemMB", queueMemMB);
+        s.setValue("bufHighPct", bufHighPct);
+        s.setValue("bufLowPct", bufLowPct);
+        s.setValue("spillEnabled", spillEnabled);
+        s.setValue("spillDir", spillDir);
+        s.setValue("preTriggerSecs", preTriggerSecs);
+        s.setValue("preTriggerMemMB", preTriggerMemMB);
+        s.setValue("preTriggerCompress", preTriggerCompress);
+        s.setValue("genPattern", int(genPattern));
+        s.setValue("genOutput", int(genOutput));
+        s.setValue("genFreeRunning", genFreeRunning);
     }
     if (scope & UART) {
         s.setValue("uart_portName", uart.portName);
@@ -113,7 +160,29 @@ QString Settings::toPrettyString() const
         QTextStream ts(&ret,QIODevice::WriteOnly);
         ts << "saveDir = " << saveDir << "\n";
         ts << "savePrefix = " << savePrefix << "\n";
+        ts << "stripeDirs = " << stripeDirs.join(";") << "\n";
         ts << "format = " << fmt2String(format, false) << "\n";
+        ts << "zipEmbed = " << zipEmbed << "\n";
+        ts << "zipLevel = " << zipLevel << "\n";
+        ts << "rawContainer = " << rawContainer << "\n";
+        ts << "rawIO = " << int(rawIO) << "\n";
+        ts << "rawCompressLevel = " << rawCompressLevel << "\n";
+        ts << "rawPredictor = " << rawPredictor << "\n";
+        ts << "jpgQuality = " << jpgQuality << "\n";
+        ts << "jpgSubsampling = " << int(jpgSubsampling) << "\n";
+        ts << "pngLevel = " << pngLevel << "\n";
+        ts << "queuePolicy = " << int(queuePolicy) << "\n";
+        ts << "queueMemMB = " << queueMemMB << "\n";
+        ts << "bufHighPct = " << bufHighPct << "\n";
+        ts << "bufLowPct = " << bufLowPct << "\n";
+        ts << "spillEnabled = " << spillEnabled << "\n";
+        ts << "spillDir = " << spillDir << "\n";
+        ts << "preTriggerSecs = " << preTriggerSecs << "\n";
+        ts << "preTriggerMemMB = " << preTriggerMemMB << "\n";
+        ts << "preTriggerCompress = " << preTriggerCompress << "\n";
+        ts << "genPattern = " << int(genPattern) << "\n";
+        ts << "genOutput = " << int(genOutput) << "\n";
+        ts << "genFreeRunning = " << genFreeRunning << "\n";
         ts << "verbosity = " << other.verbosity << "\n";
         ts << "useDarkStyle = " << appearance.useDarkStyle << "\n";
         ts.flush();
@@ -2,6 +2,7 @@
 #define SETTINGS_H
 
 #include <QString>
+#include <QStringList>
 #include <set>
 
 /// The settigs related to a Record/Screencapture session
@@ -28,10 +29,73 @@ struct Settings
                                ZipableFormats, ///< 1 file-per-frame formats. foramt in this set may be "zipped" into a single file.
                                FFmpegFormats;  ///< formats utilizing the FFmpegEncoder class to write to disk.
 
+    /// What to do when frames come in faster than the encoder can write them. See FFmpegEncoder::QueuePolicy.
+    enum QueuePolicy {
+        Queue_DropNewest = 0,
+        Queue_DropOldest,
+        Queue_Block, ///< never drops, but stalls whoever hands Recorder the frames: in the app that's the GUI thread, so only FG_Bench offers it
+        Queue_N
+    };
+
+    /// How Fmt_RAW frames are written when rawContainer is set. See RawSequenceWriter::IOMode.
+    enum RawIO {
+        RawIO_Direct = 0, ///< O_DIRECT from aligned buffers, bypassing the page cache
+        RawIO_DropCache, ///< buffered, but each frame is flushed and evicted from the page cache once written
+        RawIO_Buffered,
+        RawIO_N
+    };
+
+    /// Chroma subsampling for Fmt_JPG frames. See ImageEncoder::Subsampling.
+    enum JpgSubsampling {
+        Jpg_420 = 0,
+        Jpg_422,
+        Jpg_444,
+        Jpg_N
+    };
+
+    /// What the built-in test source renders. See FakeFrameGenerator::Pattern (same order).
+    enum GenPattern {
+        Gen_Noise = 0,
+        Gen_Gradient,
+        Gen_MovingBars,
+        Gen_N
+    };
+
+    /// What the built-in test source delivers its frames as. See FakeFrameGenerator::Output (same order).
+    enum GenOutput {
+        GenOut_BGRA = 0,
+        GenOut_Gray8,
+        GenOut_BayerRGGB8,
+        GenOut_YUV420P,
+        GenOut_N
+    };
+
     QString saveDir, savePrefix;
+    /// If not empty, RAW/PNG/JPG recordings are striped: frames are spread round-robin over saveDir and each of
+    /// these (ideally all on different drives), with a manifest in saveDir. See StripeSet.
+    QStringList stripeDirs;
     bool zipEmbed;
+    int zipLevel; ///< 0 = store, 1-9 = deflate level for RAW frames embedded in a .zip
+    bool rawContainer; ///< if true, Fmt_RAW recordings go to a single preallocated .fgraw file (takes precedence over zipEmbed)
+    RawIO rawIO;
+    int rawCompressLevel; ///< 0 = off, 1-9 = zlib level for lossless compression of .fgraw frames. See TileCodec.
+    bool rawPredictor; ///< with rawCompressLevel: filter rows before compressing them, which usually helps a lot
+    int jpgQuality; ///< 1-100, for Fmt_JPG
+    JpgSubsampling jpgSubsampling;
+    int pngLevel; ///< zlib level 0-9, for Fmt_PNG
     Fmt format;
     double fps;
+    QueuePolicy queuePolicy;
+    int queueMemMB; ///< memory budget for frames waiting to be encoded/written, in MB. The video queue is sized from this and fps.
+    int bufHighPct, bufLowPct; ///< write-behind buffer watermarks (RAW/PNG/JPG), as % of queueMemMB. See WriteBehindBuffer.
+    bool spillEnabled; ///< if true, RAW/PNG/JPG frames that don't fit under the high watermark spill to a file in spillDir
+    QString spillDir; ///< ideally a different disk than saveDir
+    double preTriggerSecs; ///< if > 0, the last this many seconds before recording starts are kept in memory and recorded too. See PreTriggerBuffer.
+    int preTriggerMemMB; ///< memory the pre-trigger buffer may use, in MB. It's all allocated up front.
+    bool preTriggerCompress; ///< keep pre-trigger frames deflated (fast zlib level), to fit more of them in preTriggerMemMB
+    GenPattern genPattern; ///< the test source's pattern
+    GenOutput genOutput; ///< the test source's pixel format
+    bool genFreeRunning; ///< if true, the test source ignores fps and emits frames as fast as they're consumed. See FakeFrameGenerator::FreeRunning.
     static const Fmt defaultFormat = Fmt_RAW;
 
     struct UART {
@@ -45,6 +109,8 @@ struct Settings
 
     struct TransientNeverSavedAlwaysFromUI
     {
+        int nThreads = 0; ///< if > 0, overrides the number of threads the Recorder uses to encode/save (0 = pick automatically)
+        int convSlices = 0; ///< FFmpeg formats: see FFmpegEncoder::setConversionSlices() (0 = pick automatically)
         void reset() { *this = TransientNeverSavedAlwaysFromUI(); }
     } transient;
 
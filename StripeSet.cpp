@@ -0,0 +1,164 @@
+#include "StripeSet.h"
+#include "Util.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QThread>
+
+const QString StripeSet::ManifestSuffix(".fgstripe");
+
+StripeSet::StripeSet(const QString & mp, const QStringList & paths, const ErrorFunc & onErr)
+    : manifestPath(mp), onError(onErr), manifest(mp)
+{
+    for (const auto & path : paths) {
+        auto s = std::make_unique<Stripe>();
+        s->path = QFileInfo(path).absoluteFilePath();
+        stripes.push_back(std::move(s));
+    }
+}
+
+StripeSet::~StripeSet()
+{
+    if (isOpen()) close();
+}
+
+bool StripeSet::open(QString *errMsg)
+{
+    if (stripes.empty()) {
+        if (errMsg) *errMsg = "No stripes";
+        return false;
+    }
+    if (!manifest.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text)) {
+        if (errMsg) *errMsg = QString("Cannot create %1: %2").arg(manifestPath).arg(manifest.errorString());
+        return false;
+    }
+    QByteArray hdr = QByteArray("FGSTRIPE ") + QByteArray::number(Version) + "\n";
+    for (size_t i = 0; i < stripes.size(); ++i)
+        hdr += "stripe\t" + QByteArray::number(qulonglong(i)) + "\t" + QDir::toNativeSeparators(stripes[i]->path).toUtf8() + "\n";
+    if (manifest.write(hdr) != hdr.size() || !manifest.flush()) {
+        if (errMsg) *errMsg = QString("Cannot write %1: %2").arg(manifestPath).arg(manifest.errorString());
+        manifest.close();
+        return false;
+    }
+    nFrames = 0;
+    manifestFailed = stopping = false;
+    for (size_t i = 0; i < stripes.size(); ++i) {
+        Stripe *s = stripes[i].get();
+        s->thr = QThread::create([this, s, i]{ writerLoop(*s, int(i)); });
+        s->thr->setObjectName(QString("Stripe %1 Writer").arg(i));
+        s->thr->start();
+    }
+    Debug() << "StripeSet: " << stripes.size() << " stripes, manifest " << manifestPath;
+    return true;
+}
+
+bool StripeSet::close(QString *errMsg)
+{
+    if (!isOpen()) return true;
+    {
+        QMutexLocker ml(&mut);
+        stopping = true;
+        cond.wakeAll();
+    }
+    for (auto & s : stripes) {
+        if (!s->thr) continue;
+        s->thr->wait(); // writerLoop empties its queue before it returns
+        delete s->thr; s->thr = nullptr;
+    }
+    QMutexLocker ml(&manifestMut);
+    const QByteArray end = "end\t" + QByteArray::number(nFrames) + "\n";
+    const bool ok = !manifestFailed && manifest.write(end) == end.size() && manifest.flush();
+    if (!ok && errMsg) *errMsg = QString("Error writing %1: %2").arg(manifestPath).arg(manifest.errorString());
+    manifest.close();
+    return ok;
+}
+
+void StripeSet::submit(int stripe, quint64 frameNum, const Job & job)
+{
+    Stripe & s = *stripes[size_t(stripe)];
+    QMutexLocker ml(&mut);
+    while (int(s.q.size()) >= MaxQueued && !stopping) cond.wait(&mut);
+    s.q.emplace_back(frameNum, job);
+    cond.wakeAll();
+}
+
+void StripeSet::writerLoop(Stripe & s, int index)
+{
+    QMutexLocker ml(&mut);
+    for (;;) {
+        while (s.q.empty() && !stopping) cond.wait(&mut);
+        if (s.q.empty()) return; // stopping, and nothing left to write
+        auto [frameNum, job] = std::move(s.q.front());
+        s.q.pop_front();
+        cond.wakeAll(); // room in the queue for a waiting submit()
+        ml.unlock();
+
+        if (QString err; job(&err))
+            addToManifest("frame\t" + QByteArray::number(frameNum) + "\t" + QByteArray::number(index) + "\n");
+        else if (onError)
+            onError(err);
+
+        ml.relock();
+    }
+}
+
+void StripeSet::addToManifest(const QByteArray & line)
+{
+    QMutexLocker ml(&manifestMut);
+    ++nFrames;
+    if (manifestFailed) return;
+    // flushed every time, so an interrupted recording still knows where its frames went
+    if (manifest.write(line) != line.size() || !manifest.flush()) {
+        Warning() << "Error writing " << manifestPath << ": " << manifest.errorString() << " -- the manifest will be incomplete";
+        manifestFailed = true;
+    }
+}
+
+/* static */
+bool StripeSet::readManifest(const QString & path, Manifest & out, QString *errMsg)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly|QIODevice::Text)) {
+        if (errMsg) *errMsg = f.errorString();
+        return false;
+    }
+    out = Manifest();
+    const QByteArray first = f.readLine().trimmed();
+    if (first != QByteArray("FGSTRIPE ") + QByteArray::number(Version)) {
+        if (errMsg) *errMsg = "Not a stripe manifest, or unsupported version";
+        return false;
+    }
+    int lineNo = 1;
+    while (!f.atEnd()) {
+        const QByteArray line = f.readLine();
+        ++lineNo;
+        if (!line.endsWith('\n')) break; // cut short mid-line by a crash: everything before it is still good
+        const QList<QByteArray> fields = line.chopped(1).split('\t');
+        bool ok1 = false, ok2 = true;
+        if (fields.size() == 3 && fields[0] == "stripe") {
+            const int i = fields[1].toInt(&ok1);
+            if (ok1 && i == out.stripes.size()) {
+                out.stripes.append(QDir::fromNativeSeparators(QString::fromUtf8(fields[2])));
+                continue;
+            }
+        } else if (fields.size() == 3 && fields[0] == "frame") {
+            const quint64 num = fields[1].toULongLong(&ok1);
+            const int stripe = fields[2].toInt(&ok2);
+            if (ok1 && ok2 && stripe >= 0 && stripe < out.stripes.size()) {
+                out.frames.emplace_back(num, stripe);
+                continue;
+            }
+        } else if (fields.size() == 2 && fields[0] == "end") {
+            out.complete = true;
+            continue;
+        } else if (fields.size() == 1 && fields[0].isEmpty())
+            continue;
+        if (errMsg) *errMsg = QString("Bad manifest line %1").arg(lineNo);
+        return false;
+    }
+    if (out.stripes.isEmpty()) {
+        if (errMsg) *errMsg = "Manifest lists no stripes";
+        return false;
+    }
+    return true;
+}
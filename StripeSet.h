@@ -0,0 +1,99 @@
+#ifndef STRIPESET_H
+#define STRIPESET_H
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+class QThread;
+
+/// Spreads a recording over several output locations (stripes), ideally each on its own drive, so that sustained
+/// write throughput adds up across drives instead of being capped by one.
+///
+/// Every stripe has its own writer thread and a short queue. The caller (Recorder, on its pool threads) picks a
+/// stripe with next(), which is plain round-robin, prepares the frame (encodes, compresses) and submit()s the part
+/// that touches the disk. That runs on the stripe's thread, in submission order, while the caller moves on to the
+/// next frame. submit() blocks while the stripe's queue is full, so a slow drive pushes back on the caller instead
+/// of using up memory.
+///
+/// Each stripe is an ordinary recording (a directory, .zip or .fgraw), readable on its own. The manifest is a
+/// small text file that ties them together, with tab-separated fields:
+///
+///     FGSTRIPE 1
+///     stripe <index> <absolute path>     one line per stripe, before any frame
+///     frame <frameNum> <stripe>          appended as each frame is written, in the order each stripe wrote them
+///     end <nFrames>                      written by close(). Missing if the recording was interrupted.
+///
+/// Since a stripe has just one writer, its frame lines are in the same order as its .fgraw slots. That is enough to
+/// recover which frame is where, even from a stripe whose own index never got written. RecordingReader opens a
+/// manifest and reads all the stripes as one recording.
+class StripeSet
+{
+public:
+    using Job = std::function<bool(QString *errMsg)>;
+    using ErrorFunc = std::function<void(const QString &)>;
+
+    static constexpr int MaxQueued = 4; ///< jobs waiting per stripe, not counting the one being written
+    static constexpr int Version = 1;
+    static const QString ManifestSuffix; ///< ".fgstripe"
+
+    struct Manifest {
+        QStringList stripes;
+        std::vector<std::pair<quint64, int>> frames; ///< (frameNum, stripe), in manifest order
+        bool complete = false; ///< has the end line
+    };
+
+    /// onError is called (on a writer thread) with the message of any job that fails.
+    StripeSet(const QString & manifestPath, const QStringList & stripePaths, const ErrorFunc & onError = ErrorFunc());
+    ~StripeSet(); ///< calls close() if still open
+
+    bool open(QString *errMsg = nullptr); ///< creates the manifest and starts the writer threads
+    /// Waits for every submitted job, stops the writer threads and finishes the manifest. Not thread-safe with
+    /// respect to submit().
+    bool close(QString *errMsg = nullptr);
+    bool isOpen() const { return manifest.isOpen(); }
+
+    int count() const { return int(stripes.size()); }
+    QString path(int stripe) const { return stripes[size_t(stripe)]->path; }
+    int next() { return int(rr.fetch_add(1u, std::memory_order_relaxed) % unsigned(stripes.size())); } ///< thread-safe
+
+    /// Thread-safe. Queues job for stripe's writer thread, first waiting if that stripe already has MaxQueued jobs
+    /// queued. Once the job succeeds, frameNum is added to the manifest.
+    void submit(int stripe, quint64 frameNum, const Job & job);
+
+    static bool readManifest(const QString & path, Manifest & out, QString *errMsg = nullptr);
+
+private:
+    struct Stripe {
+        QString path;
+        QThread *thr = nullptr;
+        std::deque<std::pair<quint64, Job>> q;
+    };
+
+    void writerLoop(Stripe & s, int index); ///< runs on s.thr
+    void addToManifest(const QByteArray & line);
+
+    const QString manifestPath;
+    const ErrorFunc onError;
+    std::vector<std::unique_ptr<Stripe>> stripes;
+    std::atomic_uint rr{0u};
+
+    QMutex mut; ///< guards the stripes' queues and stopping
+    QWaitCondition cond; ///< a job was queued or taken, or stopping
+    bool stopping = false;
+
+    QMutex manifestMut; ///< guards everything below
+    QFile manifest;
+    quint64 nFrames = 0;
+    bool manifestFailed = false;
+};
+
+#endif // STRIPESET_H
@@ -0,0 +1,176 @@
+#include "TileCodec.h"
+#include "Util.h"
+#include <QThread>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+static_assert(Q_BYTE_ORDER == Q_LITTLE_ENDIAN, "chunk headers and tile sizes are written as in-memory structs");
+static_assert(sizeof(TileCodec::ChunkHeader) == 32, "on-disk layout changed");
+
+namespace {
+    constexpr qint64 BatchBytes = 64 * 1024; ///< rows are filtered this much at a time, so deflate() gets decent-sized buffers
+
+    /// deflateBound() for the settings encode() uses, rounded up generously so it needn't have a z_stream to ask
+    inline qint64 tileBound(qint64 len) { return len + (len >> 11) + 64; }
+
+    /// PNG's Sub filter: each byte minus the same byte of the pixel to its left
+    void subFilter(const uchar *src, uchar *dst, int bpl, int bpp)
+    {
+        std::memcpy(dst, src, size_t(qMin(bpp, bpl)));
+        for (int x = bpp; x < bpl; ++x) dst[x] = uchar(src[x] - src[x - bpp]);
+    }
+
+    void unSubFilter(uchar *row, int bpl, int bpp)
+    {
+        for (int x = bpp; x < bpl; ++x) row[x] = uchar(row[x] + row[x - bpp]);
+    }
+}
+
+constexpr char TileCodec::ChunkMagic[4];
+
+TileCodec::TileCodec(const Params & params_in)
+    : params(params_in)
+{
+    const int n = params.nThreads > 0 ? params.nThreads : QThread::idealThreadCount();
+    tilePool.setMaxThreadCount(qBound(1, n, MaxTiles));
+}
+
+TileCodec::~TileCodec()
+{
+    tilePool.waitForDone();
+}
+
+/* static */
+qint64 TileCodec::maxChunkBytes(int h, int bpl)
+{
+    const qint64 frameBytes = qint64(h) * bpl;
+    return qint64(sizeof(ChunkHeader)) + MaxTiles * qint64(sizeof(quint32)) + tileBound(frameBytes) + MaxTiles * 64;
+}
+
+qint64 TileCodec::encode(const uchar *bits, int h, int bpl, int bpp, quint64 frameNum, uchar *out, QString *errMsg)
+{
+    if (h < 1 || bpl < 1 || bpp < 1) {
+        if (errMsg) *errMsg = "Empty frame";
+        return -1;
+    }
+    StripRunner strips(tilePool); // on the stack: frames may be encoded on several threads at once
+    const int tileRows = strips.stripRows(h);
+    const int nTiles = (h + tileRows - 1) / tileRows;
+    const int level = qBound(1, params.level, 9);
+
+    ChunkHeader hdr;
+    std::memcpy(hdr.magic, ChunkMagic, sizeof(hdr.magic));
+    hdr.codec = Deflate;
+    hdr.predictor = params.predictor ? Sub : NoPredictor;
+    hdr.nTiles = quint32(nTiles);
+    hdr.tileRows = quint32(tileRows);
+    hdr.frameNum = frameNum;
+    quint32 *sizes = reinterpret_cast<quint32 *>(out + sizeof(hdr));
+    uchar *const data = out + sizeof(hdr) + size_t(nTiles) * sizeof(quint32);
+
+    // each tile gets deflated into its own bounded region, then they're packed together below
+    std::vector<qint64> regions(size_t(nTiles), 0);
+    for (int i = 1; i < nTiles; ++i) regions[size_t(i)] = regions[size_t(i-1)] + tileBound(qint64(tileRows) * bpl);
+    std::vector<char> ok(size_t(nTiles), 0);
+
+    strips.run(h, tileRows, [&](int i, int y0, int y1) {
+        z_stream zs{};
+        if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, level <= 3 ? Z_RLE : Z_DEFAULT_STRATEGY) != Z_OK)
+            return;
+        const qint64 inBytes = qint64(y1 - y0) * bpl;
+        zs.next_out = data + regions[size_t(i)];
+        zs.avail_out = uInt(tileBound(inBytes));
+        const uchar *src = bits + qint64(y0) * bpl;
+        int res = Z_OK;
+        if (!params.predictor) {
+            zs.next_in = const_cast<Bytef *>(src);
+            zs.avail_in = uInt(inBytes);
+            res = deflate(&zs, Z_FINISH);
+        } else {
+            const int batchRows = int(qBound(qint64(1), BatchBytes / bpl, qint64(y1 - y0)));
+            std::vector<uchar> buf(size_t(qint64(batchRows) * bpl));
+            for (int y = y0; res == Z_OK && y < y1; y += batchRows) {
+                const int n = qMin(batchRows, y1 - y);
+                for (int r = 0; r < n; ++r)
+                    subFilter(bits + qint64(y + r) * bpl, buf.data() + qint64(r) * bpl, bpl, bpp);
+                zs.next_in = buf.data();
+                zs.avail_in = uInt(qint64(n) * bpl);
+                res = deflate(&zs, y + n < y1 ? Z_NO_FLUSH : Z_FINISH);
+            }
+        }
+        // output room is at least deflateBound(), so it always finishes in one go
+        if (res == Z_STREAM_END) {
+            sizes[i] = quint32(zs.total_out);
+            ok[size_t(i)] = 1;
+        }
+        deflateEnd(&zs);
+    });
+
+    qint64 payload = 0;
+    for (int i = 0; i < nTiles; ++i) {
+        if (!ok[size_t(i)]) {
+            if (errMsg) *errMsg = "Tile compression failed";
+            return -1;
+        }
+        if (payload != regions[size_t(i)]) std::memmove(data + payload, data + regions[size_t(i)], sizes[i]);
+        payload += sizes[i];
+    }
+    hdr.payloadBytes = quint64(nTiles) * sizeof(quint32) + quint64(payload);
+    std::memcpy(out, &hdr, sizeof(hdr));
+    return qint64(sizeof(hdr) + hdr.payloadBytes);
+}
+
+/* static */
+bool TileCodec::readHeader(const uchar *p, qint64 avail, ChunkHeader & h, qint64 *chunkBytes)
+{
+    if (avail < qint64(sizeof(h))) return false;
+    std::memcpy(&h, p, sizeof(h));
+    if (std::memcmp(h.magic, ChunkMagic, sizeof(h.magic)) != 0 || h.codec != Deflate || h.predictor > Sub
+            || !h.nTiles || h.nTiles > quint32(MaxTiles) || !h.tileRows
+            || h.payloadBytes < h.nTiles * sizeof(quint32) || h.payloadBytes > quint64(avail) - sizeof(h))
+        return false;
+    const quint32 *sizes = reinterpret_cast<const quint32 *>(p + sizeof(h));
+    quint64 total = h.nTiles * sizeof(quint32);
+    for (quint32 i = 0; i < h.nTiles; ++i) total += sizes[i];
+    if (total != h.payloadBytes) return false;
+    if (chunkBytes) *chunkBytes = qint64(sizeof(h) + h.payloadBytes);
+    return true;
+}
+
+bool TileCodec::decode(const uchar *chunk, qint64 len, uchar *dst, int h, int bpl, int bpp, QString *errMsg)
+{
+    ChunkHeader hdr;
+    if (!readHeader(chunk, len, hdr) || qint64(hdr.nTiles - 1) * hdr.tileRows >= h || qint64(hdr.nTiles) * hdr.tileRows < h) {
+        if (errMsg) *errMsg = "Bad or truncated chunk";
+        return false;
+    }
+    const quint32 *sizes = reinterpret_cast<const quint32 *>(chunk + sizeof(hdr));
+    std::vector<qint64> offs(size_t(hdr.nTiles));
+    offs[0] = qint64(sizeof(hdr) + hdr.nTiles * sizeof(quint32));
+    for (quint32 i = 1; i < hdr.nTiles; ++i) offs[i] = offs[i-1] + sizes[i-1];
+    std::vector<char> ok(size_t(hdr.nTiles), 0);
+
+    StripRunner(tilePool).run(h, int(hdr.tileRows), [&](int i, int y0, int y1) {
+        z_stream zs{};
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return;
+        zs.next_in = const_cast<Bytef *>(chunk + offs[size_t(i)]);
+        zs.avail_in = sizes[i];
+        uchar *rows = dst + qint64(y0) * bpl;
+        zs.next_out = rows;
+        zs.avail_out = uInt(qint64(y1 - y0) * bpl);
+        const bool done = inflate(&zs, Z_FINISH) == Z_STREAM_END && !zs.avail_out;
+        inflateEnd(&zs);
+        if (!done) return;
+        if (hdr.predictor == Sub)
+            for (int y = y0; y < y1; ++y, rows += bpl) unSubFilter(rows, bpl, bpp);
+        ok[size_t(i)] = 1;
+    });
+    for (const char o : ok) {
+        if (!o) {
+            if (errMsg) *errMsg = "Corrupt tile";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef TILECODEC_H
+#define TILECODEC_H
+
+#include <QString>
+#include <QThreadPool>
+#include <QtGlobal>
+
+/// Fast lossless compression of RAW frames, for compressed .fgraw files (see RawSequenceWriter).
+///
+/// A frame is split into tiles (bands of whole rows) which are compressed, and decompressed, in parallel on the
+/// codec's own pool. Before compressing, rows can go through a cheap predictor: each byte minus the same byte of the
+/// pixel to its left (PNG's Sub filter), which turns smooth sensor data into mostly small numbers. Tiles are raw
+/// deflate, with Z_RLE at the low levels, as for PNG (see ImageEncoder::Params::pngLevel).
+///
+/// A compressed frame is a chunk: ChunkHeader, then nTiles little-endian quint32 tile sizes, then the tiles back
+/// to back. The codec field leaves room for others (e.g. LZ4) later.
+class TileCodec
+{
+public:
+    enum Codec : quint16 { Deflate = 1 };
+    enum Predictor : quint16 { NoPredictor = 0, Sub };
+
+    struct Params {
+        int level = 1; ///< zlib level 1-9. 1-3 use Z_RLE.
+        bool predictor = true;
+        int nThreads = 0; ///< tiles per frame, and threads to compress them on. 0 = QThread::idealThreadCount()
+    };
+
+    struct ChunkHeader {
+        char magic[4]; ///< ChunkMagic
+        quint16 codec, predictor;
+        quint32 nTiles, tileRows; ///< every tile but the last has tileRows rows
+        quint64 frameNum;
+        quint64 payloadBytes; ///< the tile sizes and tiles that follow this header
+    };
+
+    static constexpr char ChunkMagic[4] = {'F','G','C','K'};
+    static constexpr int MaxTiles = 64;
+
+    explicit TileCodec(const Params & params);
+    ~TileCodec();
+
+    /// The most encode() can produce for a frame of h rows of bpl bytes.
+    static qint64 maxChunkBytes(int h, int bpl);
+
+    /// Thread-safe. Compresses h rows of bpl bytes, with bytesPerPixel-byte pixels, into a chunk at out, which must
+    /// have room for maxChunkBytes(h, bpl). Returns the chunk's size, or -1 on error.
+    qint64 encode(const uchar *bits, int h, int bpl, int bytesPerPixel, quint64 frameNum, uchar *out,
+                  QString *errMsg = nullptr);
+
+    /// Thread-safe. Decompresses the chunk at chunk (len bytes available there) into dst, h rows of bpl bytes.
+    bool decode(const uchar *chunk, qint64 len, uchar *dst, int h, int bpl, int bytesPerPixel,
+                QString *errMsg = nullptr);
+
+    /// Reads and sanity-checks the header of the chunk at p (avail bytes available there). On success, chunkBytes
+    /// (if not null) gets the size of the whole chunk.
+    static bool readHeader(const uchar *p, qint64 avail, ChunkHeader & out, qint64 *chunkBytes = nullptr);
+
+private:
+    const Params params;
+    QThreadPool tilePool;
+};
+
+#endif // TILECODEC_H
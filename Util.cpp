@@ -25,6 +25,7 @@
 #  include <thread>
 #endif
 #include <cstdlib>
+#include <limits>
 #include <iostream>
 #include <utility>
 #include <math.h>
@@ -155,7 +156,8 @@ namespace Util
     }
 
     qint64 getTimeNS() {
-        return getTime() * 1000000LL;
+        // monotonic, and with actual nanosecond (or close) resolution -- LatencyStats relies on this
+        return qint64(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
     }
 
     double getTimeSecs() {
@@ -319,6 +321,17 @@ namespace Util
         return pm;
     }
 
+    QImage alignedImage(int w, int h, QImage::Format fmt, int align)
+    {
+        const int bits = QImage::toPixelFormat(fmt).bitsPerPixel();
+        if (w <= 0 || h <= 0 || bits <= 0 || align < 4 || (align & (align-1))) return QImage();
+        const qint64 bpl = ((qint64(w) * bits + 7) / 8 + align - 1) / align * align;
+        if (bpl > std::numeric_limits<int>::max()) return QImage();
+        void *data = qMallocAligned(size_t(bpl * h), size_t(align));
+        if (!data) return QImage();
+        return QImage(static_cast<uchar *>(data), w, h, int(bpl), fmt, [](void *p){ qFreeAligned(p); }, data);
+    }
+
     static QMap<int, QString> KeyMap{
       { 9 , "Tab" }, { 25, "Untab"}, {  27, "Esc" }, { 13, "Ent"}, { 127, "Del" }, { 32, "Space"},
       { 63232, "↑" }, { 63233, "↓"}, { 63234, "←" }, { 63235, "→" },
@@ -9,6 +9,8 @@
 #include <QPixmap>
 #include <functional>
 #include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
 
 struct Settings;
 class App;
@@ -18,7 +20,7 @@ class QThreadPool;
 namespace Util {
 
     qint64 getTime(); ///< returns a timestamp in milliseconds
-    qint64 getTimeNS(); ///< returns a timestamp in nanoseconds (on OSX is basically mach_abs_time)
+    qint64 getTimeNS(); ///< returns a monotonic timestamp in nanoseconds (on OSX is basically mach_abs_time). Only useful for measuring intervals.
     double getTimeSecs(); ///< returns a timestamp in seconds (on OSX it's mach_abs_time / 1e9 )
 
     /// safely connect objects using enqueued messages, printing errors and aborting app if connection fails
@@ -60,6 +62,11 @@ namespace Util {
     // returns pm with its alpha channel multiplied by alpha
     QPixmap multAlpha(const QPixmap &pm, float alpha);
 
+    /// Returns a w x h image whose pixel data and bytesPerLine are both multiples of align bytes. A plain QImage only
+    /// promises 4 (its malloc'd buffers are 16-byte aligned in practice), which isn't enough for FFmpegEncoder to hand
+    /// the data to avcodec as-is, without copying it. Returns a null image if out of memory.
+    QImage alignedImage(int w, int h, QImage::Format fmt, int align = 64);
+
     // used by functions that convert a key to a string (such as Settings::keyEvent2String)
     ushort KeyForName(const QString &nameCaseInsensitive);
     QString NameForKey(ushort key);
@@ -258,6 +265,62 @@ private:
     VoidFunc func;
 };
 
+/// Runs a function over the horizontal strips of a frame in parallel: strip 0 in the calling thread, the rest on a
+/// QThreadPool. Unlike pool.start(new LambdaRunnable(...)) per strip, this allocates nothing: the runnables are part
+/// of the object, made once. So an owner that does one frame at a time keeps one as a member, and code that does
+/// several frames at once (on several threads) makes one per call, on the stack.
+class StripRunner
+{
+public:
+    /// Strips are no shorter than this (but for the last). Any less, and handing a strip to another thread, plus
+    /// whatever per-strip setup the caller does (a z_stream, a sync flush...), isn't worth it.
+    static constexpr int MinRows = 64;
+    static constexpr int MaxRunners = 64; ///< more strips than this are shared out among this many runnables
+
+    explicit StripRunner(QThreadPool & pool) : pool(pool) {}
+    StripRunner(const StripRunner &) = delete;
+    StripRunner & operator=(const StripRunner &) = delete;
+
+    /// Rows per strip for an h row frame: one strip per pool thread, but none shorter than MinRows.
+    int stripRows(int h) const {
+        const int n = qBound(1, pool.maxThreadCount(), qMax(h / MinRows, 1));
+        return qMax((h + n - 1) / n, 1);
+    }
+
+    /// Runs fn(i, y0, y1) for each stripH row strip i of [0, h), concurrently. Blocks until all are done. Not
+    /// reentrant: one run() at a time per StripRunner.
+    template <typename Func>
+    void run(int h, int stripH, const Func & fn) {
+        stripH = qMax(stripH, 1);
+        const int nStrips = h > 0 ? (h + stripH - 1) / stripH : 0, nRunners = qBound(1, nStrips, int(MaxRunners));
+        for (int r = 0; r < nRunners; ++r) {
+            Runner & rr = runners[r];
+            rr.call = [](const void *f, int i, int y0, int y1) { (*static_cast<const Func *>(f))(i, y0, y1); };
+            rr.fn = &fn; rr.first = r; rr.step = nRunners; rr.nStrips = nStrips; rr.h = h; rr.stripH = stripH;
+            rr.done = &done;
+            if (r) pool.start(&rr);
+        }
+        runners[0].run();
+        done.acquire(nRunners);
+    }
+
+private:
+    struct Runner : QRunnable {
+        void (*call)(const void *fn, int i, int y0, int y1) = nullptr;
+        const void *fn = nullptr;
+        int first = 0, step = 1, nStrips = 0, h = 0, stripH = 1;
+        QSemaphore *done = nullptr;
+        Runner() { setAutoDelete(false); }
+        void run() override {
+            for (int i = first; i < nStrips; i += step) call(fn, i, i * stripH, qMin((i + 1) * stripH, h));
+            done->release();
+        }
+    };
+    QThreadPool & pool;
+    QSemaphore done;
+    Runner runners[MaxRunners];
+};
+
 class SpinLock {
     std::atomic_flag locked = ATOMIC_FLAG_INIT;
 public:
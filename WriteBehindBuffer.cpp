@@ -0,0 +1,276 @@
+#include "WriteBehindBuffer.h"
+#include "Util.h"
+#include <QDir>
+#include <QMutexLocker>
+#include <QThread>
+#include <algorithm>
+#include <cstring>
+
+struct WriteBehindBuffer::Entry
+{
+    Frame f; ///< null once spilled
+    quint64 num = 0;
+    qint64 tNS = 0;
+    int flag = 0; ///< num, tNS and flag: for bringing the frame back just as it was, once spilled
+    qint64 bytes = 0;
+    qint64 spillOffset = -1; ///< where it is in the spill file, once spilled
+    int w = 0, h = 0, bpl = 0;
+    QImage::Format fmt = QImage::Format_Invalid;
+    bool taken = false; ///< a drainer has it, or it was dropped: either way, not the spiller's business anymore
+    bool spillWriting = false; ///< spillLoop is writing it out right now
+};
+
+WriteBehindBuffer::WriteBehindBuffer(const Config & config, QThreadPool & pool_in, const Sink & sink_in, const DropFunc & onDrop_in)
+    : cfg(config), pool(pool_in), sink(sink_in), onDrop(onDrop_in)
+{
+    if (!cfg.spillDir.isEmpty()) {
+        spillOut.setFileTemplate(cfg.spillDir + QDir::separator() + "FG_spill_XXXXXX.tmp");
+        if (!spillOut.open()) {
+            Warning() << "Cannot create spill file in " << cfg.spillDir << ": " << spillOut.errorString() << " -- spilling disabled";
+        } else {
+            spillIn.setFileName(spillOut.fileName());
+            if (!spillIn.open(QIODevice::ReadOnly|QIODevice::Unbuffered)) { // unbuffered: the file is overwritten as it is reused
+                Warning() << "Cannot open spill file for reading: " << spillIn.errorString() << " -- spilling disabled";
+                spillOut.close();
+            } else {
+                spillThr = QThread::create([this]{ spillLoop(); });
+                spillThr->setObjectName("Spill Writer");
+                spillThr->start();
+                Debug() << "WriteBehindBuffer: spilling to " << spillOut.fileName();
+            }
+        }
+    }
+}
+
+WriteBehindBuffer::~WriteBehindBuffer()
+{
+    drain();
+    if (spillThr) {
+        {
+            QMutexLocker ml(&mut);
+            stopSpill = true;
+            cond.wakeAll();
+        }
+        spillThr->wait();
+        delete spillThr; spillThr = nullptr;
+    }
+    spillIn.close();
+    spillOut.close(); // QTemporaryFile deletes it
+}
+
+void WriteBehindBuffer::updateWatermarks()
+{
+    if (!filling && memBytes * 100 >= cfg.budgetBytes * cfg.highWaterPct) {
+        filling = true;
+        Debug() << "WriteBehindBuffer: above high watermark (" << memBytes / (1024*1024) << " MB)";
+    } else if (filling && memBytes * 100 <= cfg.budgetBytes * cfg.lowWaterPct) {
+        filling = false;
+        Debug() << "WriteBehindBuffer: back below low watermark (" << memBytes / (1024*1024) << " MB)";
+    }
+}
+
+bool WriteBehindBuffer::push(const Frame & f, bool block)
+{
+    auto e = std::make_shared<Entry>();
+    e->f = f;
+    e->num = f.num;
+    e->tNS = f.tNS;
+    e->flag = f.flag;
+    e->bytes = qMax(f.img.sizeInBytes(), qint64(1));
+    e->w = f.img.width(); e->h = f.img.height(); e->bpl = f.img.bytesPerLine(); e->fmt = f.img.format();
+
+    std::vector<quint64> dropped;
+    {
+        QMutexLocker ml(&mut);
+        // make room. (memBytes > 0: a single frame bigger than the whole budget still gets through, on its own.)
+        while (memBytes > 0 && memBytes + e->bytes > cfg.budgetBytes) {
+            if (cfg.policy == Block || block) {
+                cond.wait(&mut);
+                continue;
+            }
+            if (cfg.policy == DropOldest) {
+                // oldest frame that's still just sitting in memory
+                auto it = std::find_if(q.begin(), q.end(), [](const EntryPtr & x) { return !x->spillWriting && !x->f.isNull(); });
+                if (it != q.end()) {
+                    EntryPtr old = *it;
+                    q.erase(it);
+                    old->taken = true;
+                    old->f = Frame();
+                    memBytes -= old->bytes;
+                    dropped.push_back(old->num);
+                    continue;
+                }
+            }
+            ml.unlock();
+            for (const auto num : dropped) if (onDrop) onDrop(num);
+            return false; // DropNewest, or nothing older left to drop
+        }
+        memBytes += e->bytes;
+        memHighWater = qMax(memHighWater, memBytes);
+        updateWatermarks();
+        q.push_back(e);
+        if (filling && spillThr && !spillFailed && (cfg.spillMaxBytes <= 0 || spillEnd + e->bytes <= cfg.spillMaxBytes)) {
+            spillQ.push_back(e); // newest first out of memory: they're the last ones the drainers will get to
+            cond.wakeAll();
+        }
+        if (nDrainers < qMax(pool.maxThreadCount(), 1)) {
+            ++nDrainers;
+            pool.start(new LambdaRunnable([this]{ drainLoop(); }));
+        }
+    }
+    for (const auto num : dropped) if (onDrop) onDrop(num);
+    return true;
+}
+
+void WriteBehindBuffer::drainLoop()
+{
+    for (;;) {
+        EntryPtr e;
+        Frame f;
+        {
+            QMutexLocker ml(&mut);
+            if (q.empty()) {
+                // the decrement happens under the same lock push() checks nDrainers with, so no frame is ever stranded
+                --nDrainers;
+                cond.wakeAll();
+                return;
+            }
+            e = q.front();
+            q.pop_front();
+            e->taken = true;
+            f = e->f;
+        }
+        const bool fromMem = !f.isNull();
+        if (!fromMem) {
+            QString err;
+            f = readSpilled(*e, &err);
+            if (f.isNull()) {
+                Error() << "Frame " << e->num << " lost: could not read it back from the spill file: " << err;
+                if (onDrop) onDrop(e->num);
+            }
+        }
+        if (!f.isNull()) sink(f);
+        f = Frame();
+        QMutexLocker ml(&mut);
+        if (fromMem) {
+            e->f = Frame();
+            memBytes -= e->bytes;
+            updateWatermarks();
+        } else {
+            spilledBytes -= e->bytes;
+            --nSpilled;
+        }
+        cond.wakeAll();
+    }
+}
+
+void WriteBehindBuffer::spillLoop()
+{
+    QMutexLocker ml(&mut);
+    for (;;) {
+        while (spillQ.empty() && !stopSpill) cond.wait(&mut);
+        if (stopSpill) return;
+        EntryPtr e = spillQ.front();
+        spillQ.pop_front();
+        if (e->taken || e->f.isNull()) continue;
+        if (!filling) { spillQ.clear(); continue; } // dropped back below the low watermark: no need anymore
+        if (nSpilled == 0) spillEnd = 0; // nothing left in the file, and nobody reading it: start over
+        const qint64 off = spillEnd;
+        e->spillWriting = true;
+        const Frame f = e->f;
+        ml.unlock();
+
+        bool ok = spillOut.seek(off);
+        const uchar *bits = f.img.constBits();
+        const qint64 len = qint64(e->bpl) * e->h;
+        for (qint64 done = 0; ok && done < len; ) {
+            const qint64 n = spillOut.write(reinterpret_cast<const char *>(bits) + done, len - done);
+            ok = n > 0;
+            done += qMax(n, qint64(0));
+        }
+        ok = ok && spillOut.flush();
+
+        ml.relock();
+        e->spillWriting = false;
+        if (!ok) {
+            Warning() << "Spill file write failed (" << spillOut.errorString() << "), spilling disabled for the rest of this recording";
+            spillFailed = true;
+            spillQ.clear();
+        } else if (!e->taken) {
+            e->spillOffset = off;
+            e->f = Frame();
+            memBytes -= e->bytes;
+            spilledBytes += e->bytes;
+            ++nSpilled;
+            spillEnd = off + len;
+            updateWatermarks();
+            cond.wakeAll(); // room for a Block'ed producer
+        }
+        // else a drainer got to it while we were writing it: it was used from memory, so the write just goes unused
+    }
+}
+
+Frame WriteBehindBuffer::readSpilled(const Entry & e, QString *errMsg)
+{
+    QImage img = Util::alignedImage(e.w, e.h, e.fmt); // aligned like the frame it was (O_DIRECT, avcodec)
+    if (img.isNull()) {
+        if (errMsg) *errMsg = "Out of memory";
+        return Frame();
+    }
+    QMutexLocker ml(&spillInMut);
+    if (!spillIn.seek(e.spillOffset)) {
+        if (errMsg) *errMsg = spillIn.errorString();
+        return Frame();
+    }
+    const int rowBytes = qMin(e.bpl, img.bytesPerLine());
+    const bool contiguous = e.bpl == img.bytesPerLine();
+    for (int y = 0; y < (contiguous ? 1 : e.h); ++y) {
+        const qint64 len = contiguous ? qint64(e.bpl) * e.h : qint64(rowBytes);
+        if (!contiguous) spillIn.seek(e.spillOffset + qint64(y) * e.bpl);
+        if (spillIn.read(reinterpret_cast<char *>(img.scanLine(y)), len) != len) {
+            if (errMsg) *errMsg = spillIn.errorString().isEmpty() ? QString("Short read") : spillIn.errorString();
+            return Frame();
+        }
+    }
+    Frame ret(img, e.num);
+    ret.tNS = e.tNS;
+    ret.flag = e.flag;
+    return ret;
+}
+
+void WriteBehindBuffer::drain()
+{
+    QMutexLocker ml(&mut);
+    while (!q.empty() || nDrainers > 0) cond.wait(&mut);
+}
+
+std::shared_ptr<void> WriteBehindBuffer::hold(qint64 bytes)
+{
+    {
+        QMutexLocker ml(&mut);
+        memBytes += bytes;
+        memHighWater = qMax(memHighWater, memBytes);
+        updateWatermarks();
+    }
+    return std::shared_ptr<void>(nullptr, [this, bytes](void *) {
+        QMutexLocker ml(&mut);
+        memBytes -= bytes;
+        updateWatermarks();
+        cond.wakeAll(); // room for a Block'ed producer
+    });
+}
+
+WriteBehindBuffer::Stats WriteBehindBuffer::stats()
+{
+    QMutexLocker ml(&mut);
+    Stats ret;
+    ret.memBytes = memBytes;
+    ret.budgetBytes = cfg.budgetBytes;
+    ret.memHighWater = memHighWater;
+    memHighWater = memBytes;
+    ret.spilledBytes = spilledBytes;
+    ret.frames = int(q.size());
+    ret.spilledFrames = nSpilled;
+    ret.filling = filling;
+    return ret;
+}
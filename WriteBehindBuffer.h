@@ -0,0 +1,101 @@
+#ifndef WRITEBEHINDBUFFER_H
+#define WRITEBEHINDBUFFER_H
+
+#include "Frame.h"
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QTemporaryFile>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class QThread;
+
+/// A bounded, in-memory write-behind queue of frames in front of a slow sink (the disk).
+///
+/// push() returns at once. The frame waits in memory and the sink gets it on one of pool's threads, oldest first,
+/// with up to pool.maxThreadCount() frames in the sink at once. That way a transient stall (disk hiccup, another
+/// process doing I/O) is absorbed by RAM, not turned into dropped frames.
+///
+/// The queue is limited by a byte budget, not a frame count. Frames only get dropped (or the producer blocked, per
+/// Policy) when the budget is truly exhausted. Two watermarks, as percentages of the budget, add hysteresis: above
+/// the high one the buffer counts as "filling". If a spill directory is given (ideally on a different disk from the
+/// recording), the newest frames are then also written to a spill file there by a background thread, and dropped
+/// from memory once written. That keeps going until memory use falls below the low watermark. Spilled frames are
+/// read back when their turn comes. The spill file is reused from the start whenever it empties, and deleted at the end.
+class WriteBehindBuffer
+{
+public:
+    enum Policy { DropNewest = 0, DropOldest, Block };
+
+    struct Config {
+        qint64 budgetBytes = 1024LL * 1024LL * 1024LL;
+        int highWaterPct = 80, lowWaterPct = 50;
+        QString spillDir; ///< empty = don't spill
+        qint64 spillMaxBytes = 0; ///< 0 = as much as the disk holds
+        Policy policy = DropNewest;
+    };
+
+    struct Stats {
+        qint64 memBytes = 0, ///< frames buffered in memory, including those in the sink right now, and hold()s
+               budgetBytes = 0,
+               memHighWater = 0, ///< most memBytes has been since the previous call to stats()
+               spilledBytes = 0; ///< frames waiting in the spill file
+        int frames = 0, ///< waiting (in memory or spilled), not counting those in the sink
+            spilledFrames = 0;
+        bool filling = false; ///< between crossing the high watermark and falling back below the low one
+    };
+
+    using Sink = std::function<void(const Frame &)>; ///< called on pool's threads, concurrently
+    using DropFunc = std::function<void(quint64 frameNum)>; ///< called for frames dropped from the queue or lost on spill read-back
+
+    WriteBehindBuffer(const Config & config, QThreadPool & pool, const Sink & sink, const DropFunc & onDrop = DropFunc());
+    ~WriteBehindBuffer(); ///< calls drain()
+
+    /// Thread-safe. Returns false if f itself was dropped. Frames dropped to make room for f (DropOldest) go to onDrop.
+    /// block: wait for room whatever the policy, for frames that mustn't be dropped (e.g. catching up on a backlog).
+    bool push(const Frame & f, bool block = false);
+
+    /// Blocks until every frame pushed so far has been through the sink.
+    void drain();
+
+    /// Thread-safe. For a sink that hands (some of) a frame on, e.g. to another thread's queue, rather than being done
+    /// with it when it returns: bytes count against the budget, like a buffered frame, until the token returned is let
+    /// go of. Tokens must all be gone before the buffer is destroyed.
+    std::shared_ptr<void> hold(qint64 bytes);
+
+    Stats stats(); ///< Thread-safe. Resets Stats::memHighWater.
+    bool isSpilling() const { return spillThr != nullptr; }
+
+private:
+    struct Entry;
+    using EntryPtr = std::shared_ptr<Entry>;
+
+    void drainLoop(); ///< runs on pool, as many at once as pool allows
+    void spillLoop(); ///< runs on spillThr
+    Frame readSpilled(const Entry & e, QString *errMsg);
+    void updateWatermarks(); ///< call with mut held
+
+    const Config cfg;
+    QThreadPool & pool;
+    const Sink sink;
+    const DropFunc onDrop;
+
+    QMutex mut; ///< guards everything below except the spill files
+    QWaitCondition cond; ///< memory freed, queue drained, or spill work available
+    std::deque<EntryPtr> q, spillQ;
+    qint64 memBytes = 0, memHighWater = 0, spilledBytes = 0, spillEnd = 0;
+    int nSpilled = 0, nDrainers = 0;
+    bool filling = false, spillFailed = false, stopSpill = false;
+
+    QThread *spillThr = nullptr;
+    QTemporaryFile spillOut; ///< written only by spillThr
+    QFile spillIn; ///< the same file, for reading back
+    QMutex spillInMut;
+};
+
+#endif // WRITEBEHINDBUFFER_H
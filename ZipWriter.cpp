@@ -0,0 +1,197 @@
+#include "ZipWriter.h"
+#include "quazip/quacrc32fast.h"
+#include <QDateTime>
+#include <QMutexLocker>
+#include <QtEndian>
+#include <climits>
+#include <zlib.h>
+
+namespace {
+    constexpr quint32 Max32 = 0xffffffffU;
+    constexpr quint16 MadeBy = (3 << 8) | 45; ///< Unix (so external attributes are a mode), spec version 4.5 (zip64)
+    constexpr quint16 FlagUTF8 = 0x0800;
+    constexpr quint32 ExternalAttrs = 0100666U << 16; ///< regular file, rw-rw-rw-
+
+    struct LE {
+        QByteArray & b;
+        void u16(quint16 v) { char tmp[2]; qToLittleEndian(v, tmp); b.append(tmp, 2); }
+        void u32(quint32 v) { char tmp[4]; qToLittleEndian(v, tmp); b.append(tmp, 4); }
+        void u64(quint64 v) { char tmp[8]; qToLittleEndian(v, tmp); b.append(tmp, 8); }
+    };
+
+    bool writeAll(QFile & f, const QByteArray & b, QString *errMsg)
+    {
+        if (f.write(b) != qint64(b.size())) {
+            if (errMsg) *errMsg = f.errorString().isEmpty() ? QString("Short write") : f.errorString();
+            return false;
+        }
+        return true;
+    }
+}
+
+ZipWriter::ZipWriter(const QString & fileName) : f(fileName) {}
+
+ZipWriter::~ZipWriter()
+{
+    if (f.isOpen()) close();
+}
+
+bool ZipWriter::open(QString *errMsg)
+{
+    QMutexLocker ml(&mut);
+    if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+        if (errMsg) *errMsg = f.errorString();
+        return false;
+    }
+    centralDir.clear();
+    nEntries = 0;
+    offset = 0;
+    failed = false;
+    return true;
+}
+
+/* static */
+ZipWriter::Entry ZipWriter::prepare(const QString & name, const QByteArray & data, int level)
+{
+    Entry e;
+    e.name = name.toUtf8();
+    e.uncompressedSize = quint64(data.size());
+    e.crc = quint32(quazip_crc32(0L, reinterpret_cast<const unsigned char *>(data.constData()), size_t(data.size())));
+    const QDateTime now = QDateTime::currentDateTime();
+    const QDate d = now.date(); const QTime t = now.time();
+    e.dosTime = quint16((t.hour() << 11) | (t.minute() << 5) | (t.second() / 2));
+    e.dosDate = quint16((qMax(d.year() - 1980, 0) << 9) | (d.month() << 5) | d.day());
+
+    if (level > 0 && !data.isEmpty()) {
+        z_stream zs{};
+        if (deflateInit2(&zs, qMin(level, 9), Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            const uLong bound = deflateBound(&zs, uLong(data.size()));
+            if (bound <= uLong(INT_MAX)) {
+                QByteArray out(int(bound), Qt::Uninitialized);
+                zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+                zs.avail_in = uInt(data.size());
+                zs.next_out = reinterpret_cast<Bytef *>(out.data());
+                zs.avail_out = uInt(out.size());
+                // output buffer is deflateBound() sized, so a single Z_FINISH call always completes
+                if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < uLong(data.size())) {
+                    out.resize(int(zs.total_out));
+                    e.data = out;
+                    e.method = Z_DEFLATED;
+                }
+            }
+            deflateEnd(&zs);
+        }
+    }
+    if (e.method != Z_DEFLATED) {
+        e.data = data; // implicitly shared (or still pointing at the caller's raw data), no copy
+        e.method = 0;
+    }
+    return e;
+}
+
+bool ZipWriter::append(const Entry & e, QString *errMsg)
+{
+    const quint64 csize = quint64(e.data.size()), usize = e.uncompressedSize;
+    const bool zip64 = usize >= Max32 || csize >= Max32;
+
+    QByteArray hdr;
+    hdr.reserve(30 + e.name.size() + 20);
+    LE h{hdr};
+    h.u32(0x04034b50);
+    h.u16(zip64 ? 45 : 20);
+    h.u16(FlagUTF8);
+    h.u16(e.method);
+    h.u16(e.dosTime); h.u16(e.dosDate);
+    h.u32(e.crc);
+    h.u32(zip64 ? Max32 : quint32(csize));
+    h.u32(zip64 ? Max32 : quint32(usize));
+    h.u16(quint16(e.name.size()));
+    h.u16(zip64 ? 20 : 0);
+    hdr.append(e.name);
+    if (zip64) { h.u16(0x0001); h.u16(16); h.u64(usize); h.u64(csize); }
+
+    QMutexLocker ml(&mut);
+    if (!f.isOpen() || failed) {
+        if (errMsg) *errMsg = "Zip file is not open";
+        return false;
+    }
+    const quint64 localOffset = offset;
+    if (e.method == 0) {
+        // pad stored data to StoredAlignment (zipalign's extra field), so a reader that maps the file can use it in place
+        const quint64 pad = (StoredAlignment - (localOffset + quint64(hdr.size()) + 6) % StoredAlignment) % StoredAlignment;
+        h.u16(0xD935); h.u16(quint16(2 + pad)); h.u16(StoredAlignment);
+        hdr.append(int(pad), '\0');
+        qToLittleEndian(quint16((zip64 ? 20 : 0) + 6 + pad), hdr.data() + 28);
+    }
+    if (!writeAll(f, hdr, errMsg) || !writeAll(f, e.data, errMsg)) {
+        failed = true;
+        return false;
+    }
+    offset += quint64(hdr.size()) + csize;
+
+    // central directory record. The zip64 extra field holds only the values that didn't fit, in this order.
+    const bool bigOffset = localOffset >= Max32;
+    const quint16 extraLen = quint16((zip64 ? 16 : 0) + (bigOffset ? 8 : 0));
+    LE c{centralDir};
+    c.u32(0x02014b50);
+    c.u16(MadeBy);
+    c.u16(zip64 || bigOffset ? 45 : 20);
+    c.u16(FlagUTF8);
+    c.u16(e.method);
+    c.u16(e.dosTime); c.u16(e.dosDate);
+    c.u32(e.crc);
+    c.u32(zip64 ? Max32 : quint32(csize));
+    c.u32(zip64 ? Max32 : quint32(usize));
+    c.u16(quint16(e.name.size()));
+    c.u16(extraLen ? extraLen + 4 : 0);
+    c.u16(0); // comment length
+    c.u16(0); // disk number start
+    c.u16(0); // internal attributes
+    c.u32(ExternalAttrs);
+    c.u32(bigOffset ? Max32 : quint32(localOffset));
+    centralDir.append(e.name);
+    if (extraLen) {
+        c.u16(0x0001); c.u16(extraLen);
+        if (zip64) { c.u64(usize); c.u64(csize); }
+        if (bigOffset) c.u64(localOffset);
+    }
+    ++nEntries;
+    return true;
+}
+
+bool ZipWriter::close(QString *errMsg)
+{
+    QMutexLocker ml(&mut);
+    if (!f.isOpen()) return true;
+    bool ok = !failed;
+    if (!ok && errMsg) *errMsg = "An earlier write failed; zip file is incomplete";
+    if (ok) {
+        const quint64 cdOffset = offset, cdSize = quint64(centralDir.size()), n = quint64(nEntries);
+        QByteArray tail;
+        LE t{tail};
+        if (n >= 0xffff || cdOffset >= Max32 || cdSize >= Max32) {
+            const quint64 eocd64Offset = cdOffset + cdSize;
+            t.u32(0x06064b50); // zip64 end of central directory record
+            t.u64(44); // size of the rest of this record
+            t.u16(MadeBy); t.u16(45);
+            t.u32(0); t.u32(0); // this disk, disk with central dir
+            t.u64(n); t.u64(n);
+            t.u64(cdSize); t.u64(cdOffset);
+            t.u32(0x07064b50); // zip64 end of central directory locator
+            t.u32(0); t.u64(eocd64Offset); t.u32(1);
+        }
+        t.u32(0x06054b50); // end of central directory record
+        t.u16(0); t.u16(0);
+        t.u16(quint16(qMin(n, quint64(0xffff)))); t.u16(quint16(qMin(n, quint64(0xffff))));
+        t.u32(quint32(qMin(cdSize, quint64(Max32)))); t.u32(quint32(qMin(cdOffset, quint64(Max32))));
+        t.u16(0); // comment length
+        ok = writeAll(f, centralDir, errMsg) && writeAll(f, tail, errMsg);
+    }
+    f.close();
+    if (ok && f.error() != QFile::NoError) {
+        if (errMsg) *errMsg = f.errorString();
+        ok = false;
+    }
+    centralDir.clear();
+    return ok;
+}
@@ -0,0 +1,60 @@
+#ifndef ZIPWRITER_H
+#define ZIPWRITER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+/// A minimal, append-only .zip writer built for many threads adding entries at once.
+///
+/// The expensive part of adding an entry -- deflating it and computing its CRC32 -- is done by the static prepare(),
+/// which touches no shared state and can run concurrently on any number of threads. append() then writes the
+/// finished local header + data and records the central directory entry; it is the only part that is serialized.
+/// Entries end up in the archive in the order they were append()ed. Zip64 extensions are used automatically for
+/// large entries, offsets past 4GB, and more than 65535 entries. The data of stored entries is aligned to
+/// StoredAlignment bytes within the file (like Android's zipalign does), so it can be memory-mapped and used in place.
+class ZipWriter
+{
+public:
+    static constexpr quint16 StoredAlignment = 64;
+
+    /// An entry, compressed and ready to be written. Produced by prepare(), consumed by append().
+    struct Entry {
+        QByteArray name; ///< UTF-8
+        QByteArray data; ///< the (possibly compressed) bytes to write
+        quint64 uncompressedSize = 0;
+        quint32 crc = 0;
+        quint16 method = 0; ///< 0 = stored, 8 = deflated
+        quint16 dosTime = 0, dosDate = 0;
+    };
+
+    explicit ZipWriter(const QString & fileName);
+    ~ZipWriter(); ///< calls close() if the archive is still open
+
+    bool open(QString *errMsg = nullptr); ///< creates (truncates) the file
+    bool isOpen() const { return f.isOpen(); }
+
+    /// Thread-safe, reentrant. Compresses data at level (0 = store, 1-9 = zlib deflate level). If deflating
+    /// doesn't make it any smaller, the entry is stored instead. With level 0 data is not copied, so it may be
+    /// a QByteArray::fromRawData() wrapper, as long as it stays valid until append() returns.
+    static Entry prepare(const QString & name, const QByteArray & data, int level);
+
+    /// Thread-safe. Writes e to the archive. On error, returns false and the archive should be considered broken.
+    bool append(const Entry & e, QString *errMsg = nullptr);
+
+    /// Writes the central directory and closes the file. Not thread-safe with respect to append().
+    bool close(QString *errMsg = nullptr);
+
+    qint64 entryCount() const { return nEntries; }
+
+private:
+    QFile f;
+    QMutex mut; ///< guards everything below, as well as writes to f
+    QByteArray centralDir; ///< accumulated central directory records, written out by close()
+    qint64 nEntries = 0;
+    quint64 offset = 0; ///< where the next local header goes
+    bool failed = false;
+};
+
+#endif // ZIPWRITER_H